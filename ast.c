@@ -8,11 +8,16 @@
  * @copyright Copyright (c) 2019
  * 
  */
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "ast.h"
+#include "backend.h"
 #include "y.tab.h"
+#include "runtime.h"
 #include "utils.h"
+#include "profile.h"
 
 
 /**
@@ -37,7 +42,8 @@ const char *type_name(enum value_type t) {
  * @return struct expr* 
  */
 struct expr* bool_lit(int v) {
-  struct expr* r = malloc(sizeof(struct expr));
+  struct expr* r = arena_alloc(&compilation->arena, sizeof(struct expr));
+  r->value_type = UNTYPED;
   r->type = BOOL_LIT;
   r->value = v;
   return r;
@@ -50,7 +56,8 @@ struct expr* bool_lit(int v) {
  * @return struct expr* is an expression.
  */
 struct expr* literal(int v) {
-  struct expr* r = malloc(sizeof(struct expr));
+  struct expr* r = arena_alloc(&compilation->arena, sizeof(struct expr));
+  r->value_type = UNTYPED;
   r->type = LITERAL;
   r->value = v;
   return r;
@@ -63,7 +70,8 @@ struct expr* literal(int v) {
  * @return struct expr* is an expression.
  */
 struct expr* variable(size_t id) {
-  struct expr* r = malloc(sizeof(struct expr));
+  struct expr* r = arena_alloc(&compilation->arena, sizeof(struct expr));
+  r->value_type = UNTYPED;
   r->type = VARIABLE;
   r->id = id;
   return r;
@@ -78,7 +86,8 @@ struct expr* variable(size_t id) {
  * @return struct expr*  is an expression.
  */
 struct expr* binop(struct expr *lhs, int op, struct expr *rhs) {
-  struct expr* r = malloc(sizeof(struct expr));
+  struct expr* r = arena_alloc(&compilation->arena, sizeof(struct expr));
+  r->value_type = UNTYPED;
   r->type = BIN_OP;
   r->binop.lhs = lhs;
   r->binop.op = op;
@@ -88,7 +97,8 @@ struct expr* binop(struct expr *lhs, int op, struct expr *rhs) {
 
 // TODO:
 struct expr *ternary(struct expr *lhs, struct expr *mhs, struct expr *rhs ){
-  struct expr* r = malloc(sizeof(struct expr));
+  struct expr* r = arena_alloc(&compilation->arena, sizeof(struct expr));
+  r->value_type = UNTYPED;
   r->type = TERNARY_OP;
   r->ternary.lhs = lhs;
   r->ternary.mhs = mhs;
@@ -103,7 +113,8 @@ struct expr *ternary(struct expr *lhs, struct expr *mhs, struct expr *rhs ){
  * @return struct expr* is an expression
  */
 struct expr* pre_increment(struct expr *e){
-  struct expr* expr = malloc(sizeof(struct expr));
+  struct expr* expr = arena_alloc(&compilation->arena, sizeof(struct expr));
+  expr->value_type = UNTYPED;
   expr->type = PRE_INCREMENT_OP;
   expr->expr = e;
   return expr;
@@ -116,7 +127,8 @@ struct expr* pre_increment(struct expr *e){
  * @return struct expr* is an expression.
  */
 struct expr* post_increment(struct expr *e){
-  struct expr* expr = malloc(sizeof(struct expr));
+  struct expr* expr = arena_alloc(&compilation->arena, sizeof(struct expr));
+  expr->value_type = UNTYPED;
   expr->type = POST_INCREMENT_OP;
   expr->expr = e;
   return expr;
@@ -129,7 +141,8 @@ struct expr* post_increment(struct expr *e){
  * @return struct expr* is an expression.
  */
 struct expr* pre_decrement(struct expr *e){
-  struct expr* expr = malloc(sizeof(struct expr));
+  struct expr* expr = arena_alloc(&compilation->arena, sizeof(struct expr));
+  expr->value_type = UNTYPED;
   expr->type = PRE_DECREMENT_OP;
   expr->expr = e;
   return expr;
@@ -142,12 +155,80 @@ struct expr* pre_decrement(struct expr *e){
  * @return struct expr* is an expression.
  */
 struct expr* post_decrement(struct expr *e){
-  struct expr* expr = malloc(sizeof(struct expr));
+  struct expr* expr = arena_alloc(&compilation->arena, sizeof(struct expr));
+  expr->value_type = UNTYPED;
   expr->type = POST_DECREMENT_OP;
   expr->expr = e;
   return expr;
 }
 
+/**
+ * @brief 
+ * It takes an array and an index to create an element of the array.
+ * @param id is the array.
+ * @param index is an expression.
+ * @return struct expr* is an expression.
+ */
+struct expr* element(size_t id, struct expr *index) {
+  struct expr* r = arena_alloc(&compilation->arena, sizeof(struct expr));
+  r->value_type = UNTYPED;
+  r->type = ELEMENT;
+  r->element.id = id;
+  r->element.index = index;
+  return r;
+}
+
+/**
+ * @brief 
+ * It takes the arguments of a call so far and appends the next one.
+ * @param args is a call without a function yet, NULL before the first argument.
+ * @param arg is an expression.
+ * @return struct expr* is the call.
+ */
+struct expr* add_arg(struct expr *args, struct expr *arg) {
+  if (!args) {
+    args = arena_alloc(&compilation->arena, sizeof(struct expr));
+    args->value_type = UNTYPED;
+    args->type = CALL;
+    args->call.id = 0;
+    args->call.args = NULL;
+    args->call.n_args = 0;
+    args->call.capacity = 0;
+  }
+  if (args->call.n_args == args->call.capacity) {
+    size_t capacity = args->call.capacity ? 2 * args->call.capacity : 4;
+    struct expr **list = arena_alloc(&compilation->arena, capacity * sizeof(list[0]));
+    for (size_t i = 0; i < args->call.n_args; i++) {
+      list[i] = args->call.args[i];
+    }
+    args->call.args = list;
+    args->call.capacity = capacity;
+  }
+  args->call.args[args->call.n_args++] = arg;
+  return args;
+}
+
+/**
+ * @brief 
+ * It takes a function and its arguments to create a call.
+ * @param id is the function.
+ * @param args is the call built by add_arg, NULL for no argument.
+ * @return struct expr* is an expression.
+ */
+struct expr* call(size_t id, struct expr *args) {
+  struct expr* r = args;
+  if (!r) {
+    r = arena_alloc(&compilation->arena, sizeof(struct expr));
+    r->value_type = UNTYPED;
+    r->type = CALL;
+    r->call.args = NULL;
+    r->call.n_args = 0;
+    r->call.capacity = 0;
+  }
+  r->call.id = id;
+  return r;
+}
+
 
 /**
  * @brief 
@@ -165,7 +246,7 @@ void print_expr(struct expr *expr) {
       break;
 
     case VARIABLE:
-      printf("%s", string_int_rev(&global_ids, expr->id));
+      printf("%s", string_int_rev(&compilation->ids, expr->id));
       break;
     case PRE_INCREMENT_OP:
     case POST_INCREMENT_OP:
@@ -199,6 +280,21 @@ void print_expr(struct expr *expr) {
       printf(" : ");
       print_expr(expr->ternary.rhs);
       break;
+    case ELEMENT:
+      printf("%s[", string_int_rev(&compilation->ids, expr->element.id));
+      print_expr(expr->element.index);
+      printf("]");
+      break;
+    case CALL:
+      printf("%s(", string_int_rev(&compilation->ids, expr->call.id));
+      for (size_t i = 0; i < expr->call.n_args; i++) {
+        if (i) {
+          printf(", ");
+        }
+        print_expr(expr->call.args[i]);
+      }
+      printf(")");
+      break;
   }
 }
 
@@ -222,13 +318,14 @@ static void print_indent(int indent) {
 void print_stmt(struct stmt *stmt, int indent) {
   switch (stmt->type) {
     case STMT_SEQ:
-      print_stmt(stmt->seq.fst, indent);
-      print_stmt(stmt->seq.snd, indent);
+      for (size_t i = 0; i < stmt->seq.len; i++) {
+        print_stmt(stmt->seq.stmts[i], indent);
+      }
       break;
 
     case STMT_ASSIGN:
       print_indent(indent);
-      printf("%s = ", string_int_rev(&global_ids, stmt->assign.id));
+      printf("%s = ", string_int_rev(&compilation->ids, stmt->assign.id));
       print_expr(stmt->assign.expr);
       printf(";\n");
       break;
@@ -250,6 +347,24 @@ void print_stmt(struct stmt *stmt, int indent) {
       printf("}\n");
       break;
 
+    case STMT_FOR:
+      print_indent(indent);
+      printf("parallel for (%s = ", string_int_rev(&compilation->ids, stmt->for_.var));
+      print_expr(stmt->for_.from);
+      printf(", ");
+      print_expr(stmt->for_.to);
+      printf(")");
+      for (size_t i = 0; i < stmt->for_.n_reductions; i++) {
+        struct reduction *r = &stmt->for_.reductions[i];
+        const char *op = r->op == '+' ? "+" : r->op == '*' ? "*" : r->op == AND ? "&&" : r->op == OR ? "||" : "^";
+        printf("%s%s %s", i ? ", " : " reduce (", op, string_int_rev(&compilation->ids, r->id));
+      }
+      printf("%s {\n", stmt->for_.n_reductions ? ")" : "");
+      print_stmt(stmt->for_.body, indent + 1);
+      print_indent(indent);
+      printf("}\n");
+      break;
+
     case STMT_IF:
       print_indent(indent);
       printf("if (");
@@ -264,6 +379,35 @@ void print_stmt(struct stmt *stmt, int indent) {
       print_indent(indent);
       printf("}\n");
       break;
+
+    case STMT_STORE:
+      print_indent(indent);
+      printf("%s[", string_int_rev(&compilation->ids, stmt->store.id));
+      print_expr(stmt->store.index);
+      printf("] = ");
+      print_expr(stmt->store.expr);
+      printf(";\n");
+      break;
+
+    case STMT_ALLOC:
+      print_indent(indent);
+      printf("%s = %s[", string_int_rev(&compilation->ids, stmt->alloc.id), type_name(stmt->alloc.type));
+      print_expr(stmt->alloc.len);
+      printf("];\n");
+      break;
+
+    case STMT_CALL:
+      print_indent(indent);
+      print_expr(stmt->call.call);
+      printf(";\n");
+      break;
+
+    case STMT_RETURN:
+      print_indent(indent);
+      printf("return ");
+      print_expr(stmt->return_.expr);
+      printf(";\n");
+      break;
     default:
       printf("Default");
       
@@ -271,10 +415,41 @@ void print_stmt(struct stmt *stmt, int indent) {
 }
 
 
+static _Thread_local int next_label = 0;
+
 /**
  * @brief 
- * 
- * @param expr 
+ * It prints the stack machine code of an increment or a decrement (see compile_step in bytecode.c).
+ * @param expr is an increment or a decrement.
+ * @param op is "add" or "sub".
+ * @param post is non-zero if the old value is the result.
+ */
+static void emit_stack_step(struct expr *expr, const char *op, int post) {
+  struct expr *operand = expr->expr;
+
+  if (operand->type != VARIABLE) {
+    emit_stack_machine(operand);
+    if (!post) {
+      printf("load_imm 1\n%s\n", op);
+    }
+    return;
+  }
+
+  const char *name = string_int_rev(&compilation->ids, operand->id);
+  if (post) {
+    printf("load_mem %zu # %s\n", operand->id, name);
+  }
+  printf("load_mem %zu # %s\nload_imm 1\n%s\nstore_mem %zu # %s\n", operand->id, name, op, operand->id, name);
+  if (!post) {
+    printf("load_mem %zu # %s\n", operand->id, name);
+  }
+}
+
+/**
+ * @brief 
+ * It takes an expression and prints the stack machine code that leaves its value on the stack.
+ * bytecode.c compiles to the binary form of the same instructions.
+ * @param expr is an expression.
  */
 void emit_stack_machine(struct expr *expr) {
   switch (expr->type) {
@@ -286,26 +461,33 @@ void emit_stack_machine(struct expr *expr) {
       printf("load_imm %d\n", expr->value);
       break;
     case PRE_INCREMENT_OP: 
-      printf("++");
-      emit_stack_machine(expr->expr);
+      emit_stack_step(expr, "add", 0);
       break;
     case POST_INCREMENT_OP:
-      emit_stack_machine(expr->expr);
-      printf("++");
+      emit_stack_step(expr, "add", 1);
       break;
     case PRE_DECREMENT_OP:
-      printf("--");
-      emit_stack_machine(expr->expr);
+      emit_stack_step(expr, "sub", 0);
       break;
     case POST_DECREMENT_OP:
-      emit_stack_machine(expr->expr);
-      printf("--");
+      emit_stack_step(expr, "sub", 1);
       break;
     case VARIABLE:
-      printf("load_mem %zu # %s\n", expr->id, string_int_rev(&global_ids, expr->id));
+      printf("load_mem %zu # %s\n", expr->id, string_int_rev(&compilation->ids, expr->id));
       break;
     case BIN_OP:
       emit_stack_machine(expr->binop.lhs);
+      if (is_short_circuit(expr)) {
+        int short_label = next_label++;
+        int end_label = next_label++;
+        printf("%s L%d\n", expr->binop.op == AND ? "jump_if_false" : "jump_if_true", short_label);
+        emit_stack_machine(expr->binop.rhs);
+        printf("jump L%d\n", end_label);
+        printf("L%d:\n", short_label);
+        printf(expr->binop.op == AND ? "load_false\n" : "load_true\n");
+        printf("L%d:\n", end_label);
+        break;
+      }
       emit_stack_machine(expr->binop.rhs);
 
       switch (expr->binop.op) {
@@ -323,19 +505,32 @@ void emit_stack_machine(struct expr *expr) {
         case OR:  printf("or\n");  break;
         case XOR:  printf("xor\n");  break;
         case REMAINDER: printf("remainder\n"); break;
-        case RIGHTSHIFT: printf("rightshift\n");
-        case LEFTSHIFT: printf("leftshift\n");
+        case RIGHTSHIFT: printf("rightshift\n"); break;
+        case LEFTSHIFT: printf("leftshift\n"); break;
       }
       break;
     case TERNARY_OP:{
-      
+      int else_label = next_label++;
+      int end_label = next_label++;
+      emit_stack_machine(expr->ternary.lhs);
+      printf("jump_if_false L%d\n", else_label);
+      emit_stack_machine(expr->ternary.mhs);
+      printf("jump L%d\n", end_label);
+      printf("L%d:\n", else_label);
+      emit_stack_machine(expr->ternary.rhs);
+      printf("L%d:\n", end_label);
       break;
     }
+
+    // The parser rejects arrays and functions in the stack machine mode.
+    case ELEMENT:
+    case CALL:
+      abort();
   }
 }
 
 
-static int next_reg = 0;
+static _Thread_local int next_reg = 0;
 
 /**
  * @brief 
@@ -346,6 +541,35 @@ static int gen_reg() {
   return next_reg++;
 }
 
+/**
+ * @brief 
+ * It prints the register machine code of an increment or a decrement.
+ * @param expr is an increment or a decrement.
+ * @param result_reg is the register of its value.
+ * @param op is "add" or "sub".
+ * @param post is non-zero if the old value is the result.
+ */
+static void emit_reg_step(struct expr *expr, int result_reg, const char *op, int post) {
+  struct expr *operand = expr->expr;
+
+  if (operand->type != VARIABLE) {
+    int value = emit_reg_machine(operand);
+    if (post) {
+      printf("r%d = r%d\n", result_reg, value);
+    } else {
+      printf("r%d = %s r%d, 1\n", result_reg, op, value);
+    }
+    return;
+  }
+
+  int old = post ? result_reg : gen_reg();
+  int new = post ? gen_reg() : result_reg;
+  const char *name = string_int_rev(&compilation->ids, operand->id);
+  printf("r%d = load %zu # %s\n", old, operand->id, name);
+  printf("r%d = %s r%d, 1\n", new, op, old);
+  printf("store %zu, r%d # %s\n", operand->id, new, name);
+}
+
 /**
  * @brief 
  * It takes an expression to emit register machine.
@@ -364,7 +588,7 @@ int emit_reg_machine(struct expr *expr) {
       break;
 
     case VARIABLE:
-      printf("r%d = load %zu # %s\n", result_reg, expr->id, string_int_rev(&global_ids, expr->id));
+      printf("r%d = load %zu # %s\n", result_reg, expr->id, string_int_rev(&compilation->ids, expr->id));
       break;
     
     case BIN_OP: {
@@ -393,21 +617,522 @@ int emit_reg_machine(struct expr *expr) {
       break;
     }
   
+    case PRE_INCREMENT_OP:
+      emit_reg_step(expr, result_reg, "add", 0);
+      break;
+    case POST_INCREMENT_OP:
+      emit_reg_step(expr, result_reg, "add", 1);
+      break;
+    case PRE_DECREMENT_OP:
+      emit_reg_step(expr, result_reg, "sub", 0);
+      break;
+    case POST_DECREMENT_OP:
+      emit_reg_step(expr, result_reg, "sub", 1);
+      break;
+
     case TERNARY_OP:{
 
       break;
     }
+
+    // The parser rejects arrays and functions in the register machine mode.
+    case ELEMENT:
+    case CALL:
+      abort();
   }
   return result_reg;
 }
 
+/**
+ * @brief
+ * @param context is a LLVMContextRef.
+ * @param type is INTEGER or BOOLEAN.
+ * @return LLVMTypeRef is the type of the elements of an array in memory, booleans take a byte.
+ */
+static LLVMTypeRef element_mem_type(LLVMContextRef context, enum value_type type) {
+  return type == BOOLEAN ? LLVMInt8TypeInContext(context) : LLVMInt32TypeInContext(context);
+}
+
+// the function being parsed, NULL in main
+static _Thread_local struct function *current_function;
+
+// non-zero when the variables of main are globals of the module (see declare_globals)
+static _Thread_local int globals;
+
+/**
+ * @brief
+ * It makes the variables of main module globals instead of allocas, so that they outlive main
+ * and the modules compiled later can refer to them (see the REPL in repl.c). The globals, and
+ * the functions, are then external and their symbols are prefixed by var. and fn., which
+ * cannot clash with the runtime or the C library.
+ * @param enable is non-zero for globals, zero for allocas (the default).
+ */
+void declare_globals(int enable) {
+  globals = enable;
+}
+
+/**
+ * @brief
+ * It adds a zero-initialized global for a variable of main.
+ * @param module is a LLVMModuleRef.
+ * @param type is the type of the global.
+ * @param name is the name of the variable.
+ * @return LLVMValueRef is the global.
+ */
+static LLVMValueRef add_global(LLVMModuleRef module, LLVMTypeRef type, const char *name) {
+  LLVMValueRef global;
+
+  if (globals) {
+    char *symbol = malloc(strlen(name) + 5);
+    sprintf(symbol, "var.%s", name);
+    global = LLVMAddGlobal(module, type, symbol);
+    free(symbol);
+  } else {
+    global = LLVMAddGlobal(module, type, name);
+    LLVMSetLinkage(global, LLVMInternalLinkage);
+  }
+  LLVMSetInitializer(global, LLVMConstNull(type));
+  return global;
+}
+
+/**
+ * @brief
+ * It declares an integer or a boolean variable: an alloca of main or of the function being
+ * parsed, which mem2reg promotes to registers, or a global with declare_globals.
+ * @param module is a LLVMModuleRef.
+ * @param builder is a LLVMBuilderRef positioned in main or in the function.
+ * @param type is the type of the variable.
+ * @param name is the name of the variable.
+ * @return LLVMValueRef is the storage of the variable, to record in the types of the variables.
+ */
+LLVMValueRef declare_scalar(LLVMModuleRef module, LLVMBuilderRef builder, enum value_type type, const char *name) {
+  LLVMContextRef context = LLVMGetModuleContext(module);
+  LLVMTypeRef t = type == BOOLEAN ? LLVMInt1TypeInContext(context) : LLVMInt32TypeInContext(context);
+
+  if (globals && !current_function) {
+    return add_global(module, t, name);
+  }
+  return LLVMBuildAlloca(builder, t, name);
+}
+
+/**
+ * @brief
+ * It declares an array. A fixed-size array is a zero-initialized global of the module, so it is
+ * contiguous, aligned for the widest vectors and never overflows the stack. A heap array is
+ * a pair of its elements and its length in main, allocated by STMT_ALLOC; it starts empty.
+ * @param module is a LLVMModuleRef.
+ * @param builder is a LLVMBuilderRef positioned in main.
+ * @param type is the type of the elements.
+ * @param len is the number of elements, negative for a heap array.
+ * @param name is the name of the array.
+ * @return LLVMValueRef is the storage of the array, to record in the types of the variables.
+ */
+LLVMValueRef declare_array(LLVMModuleRef module, LLVMBuilderRef builder, enum value_type type, int32_t len, const char *name) {
+  LLVMContextRef context = LLVMGetModuleContext(module);
+  LLVMTypeRef elem = element_mem_type(context, type);
+
+  if (len >= 0) {
+    LLVMValueRef array = add_global(module, LLVMArrayType(elem, len), name);
+    LLVMSetAlignment(array, ARRAY_ALIGNMENT);
+    return array;
+  }
+
+  LLVMTypeRef fields[] = { LLVMPointerType(elem, 0), LLVMInt32TypeInContext(context) };
+  LLVMTypeRef slot_type = LLVMStructTypeInContext(context, fields, 2, 0);
+  if (globals) {
+    return add_global(module, slot_type, name);
+  }
+  LLVMValueRef slot = LLVMBuildAlloca(builder, slot_type, name);
+  LLVMBuildStore(builder, LLVMConstNull(slot_type), slot);
+  return slot;
+}
+
+/**
+ * @brief
+ * @param var is the storage of a declaration.
+ * @return int is non-zero if it is a parameter or a local of the function being parsed.
+ */
+static int is_local(LLVMValueRef var) {
+  return current_function && LLVMIsAAllocaInst(var) &&
+         LLVMGetBasicBlockParent(LLVMGetInstructionParent(var)) == current_function->fn;
+}
+
+/**
+ * @brief
+ * @param var is the storage of a declaration.
+ * @return int is non-zero if it is a variable or a heap array of main, an alloca or, with
+ * declare_globals, a global that is not a fixed-size array.
+ */
+static int is_main_variable(LLVMValueRef var) {
+  if (LLVMIsAAllocaInst(var)) {
+    return !is_local(var);
+  }
+  return LLVMIsAGlobalVariable(var) && LLVMGetTypeKind(LLVMGlobalGetValueType(var)) != LLVMArrayTypeKind;
+}
+
+/**
+ * @brief
+ * It looks up an identifier from the code being parsed. A function sees its parameters and its
+ * locals, the functions and the fixed-size arrays, which are globals, but not the variables of
+ * main, which live in the frame of main.
+ * @param id is an identifier.
+ * @return LLVMValueRef is its storage, NULL if it is not declared or not visible.
+ */
+static LLVMValueRef lookup(size_t id) {
+  LLVMValueRef var = vector_get(&compilation->types, id);
+  if (var && current_function && is_main_variable(var)) {
+    return NULL;
+  }
+  return var;
+}
+
+/**
+ * @brief
+ * @param id is a variable.
+ * @return LLVMTypeRef is the type of its storage: an integer, an array or a heap array.
+ */
+static LLVMTypeRef storage_type(size_t id) {
+  LLVMValueRef var = lookup(id);
+  return var ? LLVMGetElementType(LLVMTypeOf(var)) : NULL;
+}
+
+/**
+ * @brief
+ * @param id is a variable.
+ * @return int is non-zero if it is an integer or a boolean.
+ */
+static int is_scalar(size_t id) {
+  LLVMTypeRef type = storage_type(id);
+  return type && LLVMGetTypeKind(type) == LLVMIntegerTypeKind;
+}
+
+/**
+ * @brief
+ * @param id is an identifier.
+ * @return int is non-zero if it is a function.
+ */
+static int is_function(size_t id) {
+  LLVMValueRef var = lookup(id);
+  return var && LLVMIsAFunction(var);
+}
+
+/**
+ * @brief
+ * @param id is a variable.
+ * @return int is non-zero if it is an array, fixed-size or on the heap.
+ */
+int is_array(size_t id) {
+  LLVMTypeRef type = storage_type(id);
+  return type && (LLVMGetTypeKind(type) == LLVMArrayTypeKind || LLVMGetTypeKind(type) == LLVMStructTypeKind);
+}
+
+/**
+ * @brief
+ * @param id is a variable.
+ * @return int is non-zero if it is a heap array.
+ */
+static int is_heap_array(size_t id) {
+  LLVMTypeRef type = storage_type(id);
+  return type && LLVMGetTypeKind(type) == LLVMStructTypeKind;
+}
+
+/**
+ * @brief
+ * @param id is an array.
+ * @return enum value_type is the type of its elements.
+ */
+static enum value_type element_type(size_t id) {
+  LLVMTypeRef type = storage_type(id);
+  LLVMTypeRef elem = is_heap_array(id) ? LLVMGetElementType(LLVMStructGetTypeAtIndex(type, 0)) : LLVMGetElementType(type);
+  return LLVMGetIntTypeWidth(elem) == 8 ? BOOLEAN : INTEGER;
+}
+
+/**
+ * @brief
+ * @return int is non-zero if the program declares an array, which only the LLVM backend supports.
+ */
+int uses_arrays(void) {
+  size_t n = string_int_count(&compilation->ids);
+
+  for (size_t id = 0; id < n; id++) {
+    if (is_array(id)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief
+ * @return int is non-zero if the program declares a function, which only the LLVM backend supports.
+ */
+int uses_functions(void) {
+  size_t n = string_int_count(&compilation->ids);
+
+  for (size_t id = 0; id < n; id++) {
+    if (is_function(id)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief
+ * @return int is non-zero if the program has a parallel loop, which only the LLVM backend supports.
+ */
+int uses_parallel_loops(void) {
+  return compilation->n_parallel_loops > 0;
+}
+
+/**
+ * @brief
+ * @return int is non-zero while a function is parsed.
+ */
+int in_function(void) {
+  return current_function != NULL;
+}
+
+/**
+ * @brief
+ * It tells if an identifier can be declared. Each name is declared once in main, and a parameter
+ * or a local of a function may hide a declaration of main.
+ * @param id is an identifier.
+ * @return int is non-zero if it is not declared yet where the parser is.
+ */
+int can_declare(size_t id) {
+  LLVMValueRef var = vector_get(&compilation->types, id);
+  return !var || (current_function && !is_local(var));
+}
+
+/**
+ * @brief
+ * It declares an identifier, after can_declare. A declaration of main hidden by a function is
+ * restored by end_function.
+ * @param id is an identifier.
+ * @param storage is its alloca, global or function.
+ */
+void declare_variable(size_t id, LLVMValueRef storage) {
+  struct function *f = current_function;
+
+  if (f) {
+    if (f->n_hidden == f->hidden_capacity) {
+      f->hidden_capacity = f->hidden_capacity ? 2 * f->hidden_capacity : 8;
+      f->hidden = realloc(f->hidden, f->hidden_capacity * sizeof(f->hidden[0]));
+    }
+    f->hidden[f->n_hidden].id = id;
+    f->hidden[f->n_hidden].storage = vector_get(&compilation->types, id);
+    f->n_hidden++;
+  }
+  vector_set(&compilation->types, id, storage);
+}
+
+/**
+ * @brief
+ * It takes the parameters of a function so far and appends the next one.
+ * @param f is a function, NULL before the first parameter.
+ * @param type is the type of the parameter.
+ * @param id is its name.
+ * @return struct function* is the function.
+ */
+struct function *add_param(struct function *f, enum value_type type, size_t id) {
+  if (!f) {
+    f = arena_alloc(&compilation->arena, sizeof(struct function));
+    memset(f, 0, sizeof(*f));
+  }
+  if (f->n_params == f->capacity) {
+    size_t capacity = f->capacity ? 2 * f->capacity : 4;
+    size_t *params = arena_alloc(&compilation->arena, capacity * sizeof(params[0]));
+    enum value_type *param_types = arena_alloc(&compilation->arena, capacity * sizeof(param_types[0]));
+    for (size_t i = 0; i < f->n_params; i++) {
+      params[i] = f->params[i];
+      param_types[i] = f->param_types[i];
+    }
+    f->params = params;
+    f->param_types = param_types;
+    f->capacity = capacity;
+  }
+  f->params[f->n_params] = id;
+  f->param_types[f->n_params] = type;
+  f->n_params++;
+  return f;
+}
+
+/**
+ * @brief
+ * @param context is a LLVMContextRef.
+ * @param type is INTEGER or BOOLEAN.
+ * @return LLVMTypeRef is the type of its values in registers.
+ */
+static LLVMTypeRef scalar_type(LLVMContextRef context, enum value_type type) {
+  return type == BOOLEAN ? LLVMInt1TypeInContext(context) : LLVMInt32TypeInContext(context);
+}
+
+/**
+ * @brief
+ * It starts a function once its header is parsed. The function is an internal LLVM function with
+ * the fast calling convention, each parameter is stored in an alloca of the entry block like the
+ * variables of main, so that mem2reg promotes them to registers, and the builder moves to it
+ * until end_function.
+ * @param f is the function built by add_param, NULL if it has no parameter.
+ * @param type is the type of the result.
+ * @param id is the name of the function.
+ * @param module is a LLVMModuleRef.
+ * @param builder is a LLVMBuilderRef positioned in main.
+ * @return struct function* is the function, NULL if it cannot be declared.
+ */
+struct function *begin_function(struct function *f, enum value_type type, size_t id, LLVMModuleRef module, LLVMBuilderRef builder) {
+  LLVMContextRef context = LLVMGetModuleContext(module);
+  const char *name = string_int_rev(&compilation->ids, id);
+
+  if (current_function) {
+    printf("Function %s cannot be declared in a function\n", name);
+    return NULL;
+  }
+  if (!can_declare(id)) {
+    printf("Multiple declarations for identifier %s\n", name);
+    return NULL;
+  }
+  if (!f) {
+    f = arena_alloc(&compilation->arena, sizeof(struct function));
+    memset(f, 0, sizeof(*f));
+  }
+  for (size_t i = 0; i < f->n_params; i++) {
+    for (size_t j = 0; j < i; j++) {
+      if (f->params[i] == f->params[j]) {
+        printf("Multiple declarations for identifier %s\n", string_int_rev(&compilation->ids, f->params[i]));
+        return NULL;
+      }
+    }
+  }
+
+  LLVMTypeRef *param_types = malloc((f->n_params + 1) * sizeof(param_types[0]));
+  for (size_t i = 0; i < f->n_params; i++) {
+    param_types[i] = scalar_type(context, f->param_types[i]);
+  }
+  // the symbol cannot clash with the runtime or the C library
+  char *symbol = malloc(strlen(name) + 4);
+  sprintf(symbol, "fn.%s", name);
+  f->fn = LLVMAddFunction(module, symbol, LLVMFunctionType(scalar_type(context, type), param_types, f->n_params, 0));
+  if (!globals) {
+    LLVMSetLinkage(f->fn, LLVMInternalLinkage);
+  }
+  LLVMSetFunctionCallConv(f->fn, LLVMFastCallConv);
+  set_host_cpu(f->fn);
+  free(symbol);
+  free(param_types);
+
+  declare_variable(id, f->fn);
+  f->type = type;
+  f->caller = LLVMGetInsertBlock(builder);
+  current_function = f;
+  LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(context, f->fn, "entry"));
+
+  for (size_t i = 0; i < f->n_params; i++) {
+    const char *param_name = string_int_rev(&compilation->ids, f->params[i]);
+    LLVMValueRef param = LLVMGetParam(f->fn, i);
+    LLVMSetValueName(param, param_name);
+    LLVMValueRef slot = LLVMBuildAlloca(builder, scalar_type(context, f->param_types[i]), param_name);
+    LLVMBuildStore(builder, param, slot);
+    declare_variable(f->params[i], slot);
+  }
+  return f;
+}
+
+/**
+ * @brief
+ * It restores the declarations of main hidden by a function and moves the builder back to main.
+ * @param f is the function being parsed.
+ * @param builder is a LLVMBuilderRef.
+ */
+static void leave_function(struct function *f, LLVMBuilderRef builder) {
+  while (f->n_hidden) {
+    f->n_hidden--;
+    vector_set(&compilation->types, f->hidden[f->n_hidden].id, f->hidden[f->n_hidden].storage);
+  }
+  free(f->hidden);
+  f->hidden = NULL;
+  f->hidden_capacity = 0;
+  current_function = NULL;
+  LLVMPositionBuilderAtEnd(builder, f->caller);
+}
+
+/**
+ * @brief
+ * It checks, simplifies and generates the body of a function, in the scope of its parameters and
+ * locals, then restores the declarations of main they hid and moves the builder back to main.
+ * A function that ends without a return returns 0 or false.
+ * @param f is the function started by begin_function.
+ * @param body is its body.
+ * @param module is a LLVMModuleRef.
+ * @param builder is a LLVMBuilderRef positioned in the function.
+ * @return int is non-zero if the body is valid.
+ */
+int end_function(struct function *f, struct stmt *body, LLVMModuleRef module, LLVMBuilderRef builder) {
+  int valid = valid_stmt(body);
+
+  if (valid) {
+    struct stmt *simplified = simplify_stmt(body);
+    codegen_stmt(simplified ? simplified : body, module, builder);
+    if (!LLVMGetBasicBlockTerminator(LLVMGetInsertBlock(builder))) {
+      LLVMBuildRet(builder, LLVMConstNull(LLVMGetReturnType(LLVMGetElementType(LLVMTypeOf(f->fn)))));
+    }
+  }
+  leave_function(f, builder);
+  return valid;
+}
+
+/**
+ * @brief
+ * It leaves the function being parsed, if any, after a syntax error in its body, so that the
+ * declarations of main it hid are visible again.
+ * @param builder is a LLVMBuilderRef.
+ */
+void abandon_function(LLVMBuilderRef builder) {
+  if (current_function) {
+    leave_function(current_function, builder);
+  }
+}
+
+/**
+ * @brief
+ * It rebinds the globals and the functions declared so far to declarations of the same symbols in
+ * a module, so that its code can use the storage defined by other modules. The declarations in the
+ * module are added on demand; without declare, the identifiers whose symbol the module does not
+ * have are forgotten instead, like those declared by an input that failed to compile.
+ * @param module is a LLVMModuleRef.
+ * @param declare is non-zero to add the missing declarations to the module.
+ */
+void import_globals(LLVMModuleRef module, int declare) {
+  size_t n = string_int_count(&compilation->ids);
+
+  for (size_t id = 0; id < n; id++) {
+    LLVMValueRef var = vector_get(&compilation->types, id);
+    if (!var || !LLVMIsAGlobalValue(var) || LLVMGetGlobalParent(var) == module) {
+      continue;
+    }
+
+    size_t len;
+    const char *symbol = LLVMGetValueName2(var, &len);
+    LLVMValueRef decl = LLVMIsAFunction(var) ? LLVMGetNamedFunction(module, symbol) : LLVMGetNamedGlobal(module, symbol);
+    if (!decl && declare && LLVMIsAFunction(var)) {
+      decl = LLVMAddFunction(module, symbol, LLVMGlobalGetValueType(var));
+      LLVMSetFunctionCallConv(decl, LLVMGetFunctionCallConv(var));
+    } else if (!decl && declare) {
+      decl = LLVMAddGlobal(module, LLVMGlobalGetValueType(var), symbol);
+      LLVMSetAlignment(decl, LLVMGetAlignment(var));
+    }
+    vector_set(&compilation->types, id, decl);
+  }
+}
+
 /**
  * @brief 
- * It takes an expression and return the value type of the expression.
+ * It computes the value type of an expression from the cached types of its children.
  * @param expr is an expression.
  * @return enum value_type  
  */
-enum value_type check_types(struct expr *expr) {
+static enum value_type infer_type(struct expr *expr) {
   switch (expr->type) {
     case BOOL_LIT:
       return BOOLEAN;
@@ -419,8 +1144,17 @@ enum value_type check_types(struct expr *expr) {
     case PRE_DECREMENT_OP:
     case POST_DECREMENT_OP: 
       return check_types(expr->expr);
+    case ELEMENT:
+      // an array is only used through its elements
+      if (!is_array(expr->element.id) || check_types(expr->element.index) != INTEGER) {
+        return ERROR;
+      }
+      return element_type(expr->element.id);
     case VARIABLE:{
-      LLVMValueRef ptr = vector_get(&global_types, expr->id);
+      if (!is_scalar(expr->id)) {
+        return ERROR;
+      }
+      LLVMValueRef ptr = vector_get(&compilation->types, expr->id);
       LLVMTypeRef t = LLVMGetElementType(LLVMTypeOf(ptr));
       return LLVMGetIntTypeWidth(t) == 1 ? BOOLEAN : INTEGER;
     }
@@ -474,30 +1208,33 @@ enum value_type check_types(struct expr *expr) {
           default: return ERROR;
       }
     }
-    case TERNARY_OP:{
-
-    enum value_type lhs = check_types(expr->ternary.lhs->binop.lhs);
-    enum value_type rhs = check_types( expr->ternary.lhs->binop.rhs);
-
-    if(lhs == BOOLEAN && rhs == BOOLEAN){
-
-      enum value_type mhs = check_types(expr->ternary.mhs);
-      enum value_type righs = check_types(expr->ternary.rhs);
-
-      if( mhs == BOOLEAN && righs == BOOLEAN ){ return BOOLEAN; } 
-      else if( mhs == INTEGER && righs == INTEGER){ return INTEGER; }
-
-    } else if(lhs == INTEGER && rhs == INTEGER){
-
+    case CALL: {
+      if (!is_function(expr->call.id)) {
+        return ERROR;
+      }
+      LLVMValueRef fn = lookup(expr->call.id);
+      enum value_type type = LLVMGetIntTypeWidth(LLVMGetReturnType(storage_type(expr->call.id))) == 1 ? BOOLEAN : INTEGER;
+      if (LLVMCountParams(fn) != expr->call.n_args) {
+        return ERROR;
+      }
+      for (size_t i = 0; i < expr->call.n_args; i++) {
+        enum value_type param = LLVMGetIntTypeWidth(LLVMTypeOf(LLVMGetParam(fn, i))) == 1 ? BOOLEAN : INTEGER;
+        if (check_types(expr->call.args[i]) != param) {
+          type = ERROR;
+        }
+      }
+      return type;
+    }
+    case TERNARY_OP: {
+      enum value_type cond = check_types(expr->ternary.lhs);
       enum value_type mhs = check_types(expr->ternary.mhs);
-      enum value_type righs = check_types(expr->ternary.rhs);
-
-      if( mhs == BOOLEAN && righs == BOOLEAN ){ return BOOLEAN; } 
-      else if( mhs == INTEGER && righs == INTEGER){ return INTEGER; }
+      enum value_type rhs = check_types(expr->ternary.rhs);
 
-    }else {  return ERROR; }
-
-  }    
+      if (cond == BOOLEAN && mhs == rhs && mhs != ERROR)
+        return mhs;
+      else
+        return ERROR;
+    }
   default:
     return ERROR;
   }
@@ -505,54 +1242,63 @@ enum value_type check_types(struct expr *expr) {
 
 /**
  * @brief 
- * It takes an expression to free it from memory.
- * @param expr  is an expression.
+ * It takes an expression and return the value type of the expression.
+ * The type is computed once and stored in the node, so later calls (and codegen) just read it.
+ * @param expr is an expression.
+ * @return enum value_type  
  */
-void free_expr(struct expr *expr) {
-  switch (expr->type) {
-    case BOOL_LIT:
-      free(expr);
-      break;
-    case LITERAL:
-      free(expr);
-      break;
-    case VARIABLE:
-      free(expr);
-      break;
+enum value_type check_types(struct expr *expr) {
+  if (expr->value_type == UNTYPED) {
+    expr->value_type = infer_type(expr);
+  }
+  return expr->value_type;
+}
 
-    case BIN_OP:
-      free_expr(expr->binop.lhs);
-      free_expr(expr->binop.rhs);
-      free(expr);
-      break;
-    case PRE_INCREMENT_OP:
-    case POST_INCREMENT_OP:
-    case PRE_DECREMENT_OP:
-    case POST_DECREMENT_OP:
-       free_expr(expr->expr);
-      break;
-    case TERNARY_OP:
-      free_expr(expr->ternary.lhs->binop.lhs);
-      free_expr(expr->ternary.lhs->binop.rhs);
-      free_expr(expr->ternary.lhs);
-      free_expr(expr->ternary.mhs);
-      free_expr(expr->ternary.rhs);
-      break;
+/**
+ * @brief 
+ * It appends a statement to the array of a block, doubling it in the arena when it is full.
+ * @param block is a block.
+ * @param stmt is a statement.
+ */
+static void append_stmt(struct stmt *block, struct stmt *stmt) {
+  if (block->seq.len == block->seq.capacity) {
+    size_t capacity = block->seq.capacity ? 2 * block->seq.capacity : 4;
+    struct stmt **stmts = arena_alloc(&compilation->arena, capacity * sizeof(stmts[0]));
+    for (size_t i = 0; i < block->seq.len; i++) {
+      stmts[i] = block->seq.stmts[i];
+    }
+    block->seq.stmts = stmts;
+    block->seq.capacity = capacity;
   }
+  block->seq.stmts[block->seq.len++] = stmt;
 }
 
 /**
  * @brief 
- * TODO:
- * @param fst 
- * @param snd 
- * @return struct stmt* 
+ * It takes a statement and the next one to build a block. The statements of a block are an array
+ * rather than a chain of pairs, so the walkers loop over them instead of recursing once per statement.
+ * @param fst is a block, which is extended, or the first statement.
+ * @param snd is the next statement, the statements of a block are appended one by one.
+ * @return struct stmt* is the block.
  */
 struct stmt* make_seq(struct stmt *fst, struct stmt *snd) {
-  struct stmt* r = malloc(sizeof(struct stmt));
-  r->type = STMT_SEQ;
-  r->seq.fst = fst;
-  r->seq.snd = snd;
+  struct stmt* r = fst;
+
+  if (fst->type != STMT_SEQ) {
+    r = arena_alloc(&compilation->arena, sizeof(struct stmt));
+    r->type = STMT_SEQ;
+    r->seq.stmts = NULL;
+    r->seq.len = 0;
+    r->seq.capacity = 0;
+    append_stmt(r, fst);
+  }
+  if (snd->type == STMT_SEQ) {
+    for (size_t i = 0; i < snd->seq.len; i++) {
+      append_stmt(r, snd->seq.stmts[i]);
+    }
+  } else {
+    append_stmt(r, snd);
+  }
   return r;
 }
 
@@ -564,7 +1310,7 @@ struct stmt* make_seq(struct stmt *fst, struct stmt *snd) {
  * @return struct stmt* 
  */
 struct stmt* make_assign(size_t id, struct expr *e) {
-  struct stmt* r = malloc(sizeof(struct stmt));
+  struct stmt* r = arena_alloc(&compilation->arena, sizeof(struct stmt));
   r->type = STMT_ASSIGN;
   r->assign.id = id;
   r->assign.expr = e;
@@ -576,13 +1322,15 @@ struct stmt* make_assign(size_t id, struct expr *e) {
  * It takes an expression and a statement to create while loop.
  * @param e is an expression.
  * @param body is a statement.
+ * @param loc is the location of the while.
  * @return struct stmt* 
  */
-struct stmt* make_while(struct expr *e, struct stmt *body) {
-  struct stmt* r = malloc(sizeof(struct stmt));
+struct stmt* make_while(struct expr *e, struct stmt *body, struct location loc) {
+  struct stmt* r = arena_alloc(&compilation->arena, sizeof(struct stmt));
   r->type = STMT_WHILE;
   r->while_.cond = e;
   r->while_.body = body;
+  r->while_.loc = loc;
   return r;
 }
 
@@ -592,14 +1340,16 @@ struct stmt* make_while(struct expr *e, struct stmt *body) {
  * @param e is an expression.
  * @param if_body is a statement.
  * @param else_body is a statement.
+ * @param loc is the location of the if.
  * @return struct stmt* 
  */
-struct stmt* make_ifelse(struct expr *e, struct stmt *if_body, struct stmt *else_body) {
-  struct stmt* r = malloc(sizeof(struct stmt));
+struct stmt* make_ifelse(struct expr *e, struct stmt *if_body, struct stmt *else_body, struct location loc) {
+  struct stmt* r = arena_alloc(&compilation->arena, sizeof(struct stmt));
   r->type = STMT_IF;
   r->ifelse.cond = e;
   r->ifelse.if_body = if_body;
   r->ifelse.else_body = else_body;
+  r->ifelse.loc = loc;
   return r;
 }
 
@@ -608,10 +1358,11 @@ struct stmt* make_ifelse(struct expr *e, struct stmt *if_body, struct stmt *else
  *  It takes an expression as a condition part of the if. It also takes a statement to construct body of if condition.
  * @param e is an expresion
  * @param body is an statement to be used body of the if.
+ * @param loc is the location of the if.
  * @return struct stmt* is a statement
  */
-struct stmt* make_if(struct expr *e, struct stmt *body) {
-  return make_ifelse(e, body, NULL);
+struct stmt* make_if(struct expr *e, struct stmt *body, struct location loc) {
+  return make_ifelse(e, body, NULL, loc);
 }
 
 
@@ -622,47 +1373,272 @@ struct stmt* make_if(struct expr *e, struct stmt *body) {
  * @return struct stmt* is a statement.
  */
 struct stmt* make_print(struct expr *e) {
-  struct stmt* r = malloc(sizeof(struct stmt));
+  struct stmt* r = arena_alloc(&compilation->arena, sizeof(struct stmt));
   r->type = STMT_PRINT;
   r->print.expr = e;
   return r;
 }
 
+/**
+ * @brief 
+ * It takes an array, an index and an expression to assign the expression to an element.
+ * @param id is the array.
+ * @param index is an expression.
+ * @param e is an expression.
+ * @return struct stmt* is a statement.
+ */
+struct stmt* make_store(size_t id, struct expr *index, struct expr *e) {
+  struct stmt* r = arena_alloc(&compilation->arena, sizeof(struct stmt));
+  r->type = STMT_STORE;
+  r->store.id = id;
+  r->store.index = index;
+  r->store.expr = e;
+  return r;
+}
+
+/**
+ * @brief 
+ * It takes a heap array and a length to allocate new elements to the array, all zero.
+ * @param id is the array.
+ * @param type is the type of the elements, which must be the one of the declaration.
+ * @param len is an expression.
+ * @return struct stmt* is a statement.
+ */
+struct stmt* make_alloc(size_t id, enum value_type type, struct expr *len) {
+  struct stmt* r = arena_alloc(&compilation->arena, sizeof(struct stmt));
+  r->type = STMT_ALLOC;
+  r->alloc.id = id;
+  r->alloc.type = type;
+  r->alloc.len = len;
+  return r;
+}
+
+/**
+ * @brief 
+ * It takes a call to make a statement of it, for a function called for its prints.
+ * @param call is a call.
+ * @return struct stmt* is a statement.
+ */
+struct stmt* make_call(struct expr *call) {
+  struct stmt* r = arena_alloc(&compilation->arena, sizeof(struct stmt));
+  r->type = STMT_CALL;
+  r->call.call = call;
+  return r;
+}
 
 /**
  * @brief 
- * It takes a statement to clear it from memeory
+ * It takes an expression to return it from the function.
+ * @param e is an expression.
+ * @return struct stmt* is a statement.
+ */
+struct stmt* make_return(struct expr *e) {
+  struct stmt* r = arena_alloc(&compilation->arena, sizeof(struct stmt));
+  r->type = STMT_RETURN;
+  r->return_.expr = e;
+  return r;
+}
+
+/**
+ * @brief
+ * It adds a reduction variable to a parallel loop, which make_for completes.
+ * @param loop is the loop, NULL for the first reduction.
+ * @param op is the operator.
+ * @param id is the variable.
+ * @return struct stmt* is the loop.
+ */
+struct stmt* add_reduction(struct stmt *loop, int op, size_t id) {
+  if (!loop) {
+    loop = arena_alloc(&compilation->arena, sizeof(struct stmt));
+    loop->type = STMT_FOR;
+    loop->for_.reductions = NULL;
+    loop->for_.n_reductions = 0;
+    loop->for_.capacity = 0;
+  }
+  if (loop->for_.n_reductions == loop->for_.capacity) {
+    size_t capacity = loop->for_.capacity ? 2 * loop->for_.capacity : 4;
+    struct reduction *list = arena_alloc(&compilation->arena, capacity * sizeof(list[0]));
+    for (size_t i = 0; i < loop->for_.n_reductions; i++) {
+      list[i] = loop->for_.reductions[i];
+    }
+    loop->for_.reductions = list;
+    loop->for_.capacity = capacity;
+  }
+  loop->for_.reductions[loop->for_.n_reductions++] = (struct reduction) { id, op };
+  return loop;
+}
+
+/**
+ * @brief
+ * It takes a range and a statement to create a parallel loop: the body runs once for each
+ * value of the loop variable from the first to the last of the range, in any order and on
+ * any thread.
+ * @param loop is the loop with its reduction variables, or NULL.
+ * @param var is the loop variable.
+ * @param from is the first value.
+ * @param to is one past the last value.
+ * @param body is a statement.
+ * @param loc is the location of the for.
+ * @return struct stmt* is the loop.
+ */
+struct stmt* make_for(struct stmt *loop, size_t var, struct expr *from, struct expr *to, struct stmt *body, struct location loc) {
+  struct stmt* r = loop;
+
+  if (!r) {
+    r = arena_alloc(&compilation->arena, sizeof(struct stmt));
+    r->type = STMT_FOR;
+    r->for_.reductions = NULL;
+    r->for_.n_reductions = 0;
+    r->for_.capacity = 0;
+  }
+  r->for_.var = var;
+  // no identifier has a dot, so the name is only seen by codegen_for
+  r->for_.end = string_int_get(&compilation->ids, "for.end");
+  r->for_.from = from;
+  r->for_.to = to;
+  r->for_.body = body;
+  r->for_.loc = loc;
+  compilation->n_parallel_loops++;
+  return r;
+}
+
+
+/**
+ * @brief
+ * @param loop is a parallel loop.
+ * @param id is a variable.
+ * @return int is non-zero if it is a reduction variable of the loop.
+ */
+static int is_reduction(struct stmt *loop, size_t id) {
+  for (size_t i = 0; i < loop->for_.n_reductions; i++) {
+    if (loop->for_.reductions[i].id == id) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief
+ * @param id is a scalar.
+ * @return enum value_type is its type.
+ */
+static enum value_type variable_type(size_t id) {
+  return LLVMGetIntTypeWidth(storage_type(id)) == 1 ? BOOLEAN : INTEGER;
+}
+
+/**
+ * @brief
+ * It checks the reduction variables of a parallel loop: scalars, each once, other than the loop
+ * variable, with an operator that is associative and commutative for their type.
+ * @param loop is a parallel loop.
+ * @return int is non-zero if they are valid.
+ */
+static int valid_reductions(struct stmt *loop) {
+  for (size_t i = 0; i < loop->for_.n_reductions; i++) {
+    struct reduction *r = &loop->for_.reductions[i];
+    if (!is_scalar(r->id) || r->id == loop->for_.var) {
+      return 0;
+    }
+    for (size_t j = 0; j < i; j++) {
+      if (loop->for_.reductions[j].id == r->id) {
+        return 0;
+      }
+    }
+    if (r->op == '+' || r->op == '*') {
+      if (variable_type(r->id) != INTEGER) {
+        return 0;
+      }
+    } else if (r->op != AND && r->op != OR && r->op != XOR) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * @brief
+ * It tells if an expression of the body of a parallel loop only changes the reduction variables
+ * of the loop, which are private to each thread. The other variables are shared.
+ * @param expr is an expression.
+ * @param loop is the loop.
+ * @return int is non-zero if it does.
+ */
+static int writes_reductions_expr(struct expr *expr, struct stmt *loop) {
+  switch (expr->type) {
+    case BOOL_LIT:
+    case LITERAL:
+    case VARIABLE:
+      return 1;
+    case BIN_OP:
+      return writes_reductions_expr(expr->binop.lhs, loop) && writes_reductions_expr(expr->binop.rhs, loop);
+    case TERNARY_OP:
+      return
+        writes_reductions_expr(expr->ternary.lhs, loop) &&
+        writes_reductions_expr(expr->ternary.mhs, loop) &&
+        writes_reductions_expr(expr->ternary.rhs, loop);
+    case ELEMENT:
+      return writes_reductions_expr(expr->element.index, loop);
+    case CALL:
+      // a function only changes its own variables and the arrays
+      for (size_t i = 0; i < expr->call.n_args; i++) {
+        if (!writes_reductions_expr(expr->call.args[i], loop)) {
+          return 0;
+        }
+      }
+      return 1;
+    default:
+      if (expr->expr->type == VARIABLE && !is_reduction(loop, expr->expr->id)) {
+        return 0;
+      }
+      return writes_reductions_expr(expr->expr, loop);
+  }
+}
+
+/**
+ * @brief
+ * It tells if a statement of the body of a parallel loop only changes the reduction variables
+ * of the loop and the elements of the arrays. The body can neither allocate an array, which
+ * changes the variable of a heap array, nor return.
  * @param stmt is a statement.
+ * @param loop is the loop.
+ * @return int is non-zero if it does.
  */
-void free_stmt(struct stmt *stmt) {
+static int writes_reductions_stmt(struct stmt *stmt, struct stmt *loop) {
   switch (stmt->type) {
     case STMT_SEQ:
-      free_stmt(stmt->seq.fst);
-      free_stmt(stmt->seq.snd);
-      break;
-
+      for (size_t i = 0; i < stmt->seq.len; i++) {
+        if (!writes_reductions_stmt(stmt->seq.stmts[i], loop)) {
+          return 0;
+        }
+      }
+      return 1;
     case STMT_ASSIGN:
-      free_expr(stmt->assign.expr);
-      break;
-
+      return is_reduction(loop, stmt->assign.id) && writes_reductions_expr(stmt->assign.expr, loop);
+    case STMT_STORE:
+      return writes_reductions_expr(stmt->store.index, loop) && writes_reductions_expr(stmt->store.expr, loop);
     case STMT_PRINT:
-      free_expr(stmt->print.expr);
-      break;
-
-    case STMT_WHILE:
-      free_expr(stmt->while_.cond);
-      free_stmt(stmt->while_.body);
-      break;
-
+      return writes_reductions_expr(stmt->print.expr, loop);
+    case STMT_CALL:
+      return writes_reductions_expr(stmt->call.call, loop);
     case STMT_IF:
-      free_expr(stmt->ifelse.cond);
-      free_stmt(stmt->ifelse.if_body);
-      if (stmt->ifelse.else_body)
-        free_stmt(stmt->ifelse.else_body);
-      break;
+      return
+        writes_reductions_expr(stmt->ifelse.cond, loop) &&
+        writes_reductions_stmt(stmt->ifelse.if_body, loop) &&
+        (!stmt->ifelse.else_body || writes_reductions_stmt(stmt->ifelse.else_body, loop));
+    case STMT_WHILE:
+      return writes_reductions_expr(stmt->while_.cond, loop) && writes_reductions_stmt(stmt->while_.body, loop);
+    case STMT_FOR:
+      // a nested loop changes its reduction variables, its body is checked against it
+      for (size_t i = 0; i < stmt->for_.n_reductions; i++) {
+        if (!is_reduction(loop, stmt->for_.reductions[i].id)) {
+          return 0;
+        }
+      }
+      return writes_reductions_expr(stmt->for_.from, loop) && writes_reductions_expr(stmt->for_.to, loop);
+    default:
+      return 0;
   }
-
-  free(stmt);
 }
 
 /**
@@ -674,19 +1650,52 @@ void free_stmt(struct stmt *stmt) {
 int valid_stmt(struct stmt *stmt) {
   switch (stmt->type) {
     case STMT_SEQ:
-      return valid_stmt(stmt->seq.fst) && valid_stmt(stmt->seq.snd);
+      for (size_t i = 0; i < stmt->seq.len; i++) {
+        if (!valid_stmt(stmt->seq.stmts[i])) {
+          return 0;
+        }
+      }
+      return 1;
 
     case STMT_ASSIGN:
       // should the language/compiler forbid accessing uninitialized variables?
       // maybe also warn about dead assignments?
-      return check_types(stmt->assign.expr) != ERROR;
+      return is_scalar(stmt->assign.id) && check_types(stmt->assign.expr) != ERROR;
+
+    case STMT_STORE:
+      return
+        is_array(stmt->store.id) &&
+        check_types(stmt->store.index) == INTEGER &&
+        check_types(stmt->store.expr) == element_type(stmt->store.id);
+
+    case STMT_ALLOC:
+      return
+        is_heap_array(stmt->alloc.id) &&
+        element_type(stmt->alloc.id) == stmt->alloc.type &&
+        check_types(stmt->alloc.len) == INTEGER;
 
     case STMT_PRINT:
       return check_types(stmt->print.expr) != ERROR;
 
+    case STMT_CALL:
+      return check_types(stmt->call.call) != ERROR;
+
+    case STMT_RETURN:
+      // only in a function, main has no result
+      return current_function && check_types(stmt->return_.expr) == current_function->type;
+
     case STMT_WHILE:
       return check_types(stmt->while_.cond) == BOOLEAN && valid_stmt(stmt->while_.body);
 
+    case STMT_FOR:
+      return
+        is_scalar(stmt->for_.var) && variable_type(stmt->for_.var) == INTEGER &&
+        check_types(stmt->for_.from) == INTEGER &&
+        check_types(stmt->for_.to) == INTEGER &&
+        valid_reductions(stmt) &&
+        valid_stmt(stmt->for_.body) &&
+        writes_reductions_stmt(stmt->for_.body, stmt);
+
     case STMT_IF:
       return
         check_types(stmt->ifelse.cond) == BOOLEAN &&
@@ -699,156 +1708,1621 @@ int valid_stmt(struct stmt *stmt) {
 
 /**
  * @brief 
- * It takes a expression and generete code for it.
+ * It takes an expression and tells if evaluating it changes a variable.
  * @param expr is an expression.
- * @param module is a LLVMModuleRef.
- * @param builder is a LLVMBuilderRef.
- * @return LLVMValueRef
+ * @return int is non-zero if it has no side effects.
  */
-LLVMValueRef codegen_expr(struct expr *expr, LLVMModuleRef module, LLVMBuilderRef builder) {
+static int is_pure(struct expr *expr) {
   switch (expr->type) {
     case BOOL_LIT:
-      return LLVMConstInt(LLVMInt1Type(), expr->value, 0);
-
     case LITERAL:
-      return LLVMConstInt(LLVMInt32Type(), expr->value, 0);
-
     case VARIABLE:
-      return LLVMBuildLoad(builder, vector_get(&global_types, expr->id), "loadtmp");
-
-    case PRE_INCREMENT_OP:{
-          switch (expr->expr->type)
-          {
-          case VARIABLE: {           
-             LLVMValueRef exp = codegen_expr(expr->expr,module,builder);
-             LLVMValueRef result =  LLVMBuildAdd(builder,exp,LLVMConstInt(LLVMInt32Type(), 1, 0), "addtmp"); 
-             LLVMBuildStore(builder, result, vector_get(&global_types,expr->expr->id));
-            return result;
-          }
-          case LITERAL:{
-            LLVMValueRef exp = codegen_expr(expr->expr,module,builder);
-            return LLVMBuildAdd(builder,exp,LLVMConstInt(LLVMInt32Type(), 1, 0), "addtmp");
-          }
-          default:
-            return NULL;
-          }
-    } 
-     case POST_INCREMENT_OP:{
-          switch (expr->expr->type)
-          {
-          case VARIABLE: {           
-             LLVMValueRef exp = codegen_expr(expr->expr,module,builder);
-             LLVMValueRef result =  LLVMBuildAdd(builder,exp,LLVMConstInt(LLVMInt32Type(), 1, 0), "addtmp"); 
-             LLVMBuildStore(builder, result, vector_get(&global_types,expr->expr->id));
-            return exp;
-          }
-          case LITERAL:{
-            LLVMValueRef exp = codegen_expr(expr->expr,module,builder);
-            return exp;
-          }
-          default:
-            return NULL;
-          }
-    } 
-   case PRE_DECREMENT_OP:{
-         switch (expr->expr->type)
-          {
-          case VARIABLE:{
-             LLVMValueRef exp = codegen_expr(expr->expr,module,builder);
-             LLVMValueRef result =  LLVMBuildSub(builder,exp,LLVMConstInt(LLVMInt32Type(), 1, 0), "subtmp"); 
-             LLVMBuildStore(builder, result, vector_get(&global_types,expr->expr->id));
-             return result;
-          }
-          case LITERAL:{
-            LLVMValueRef exp = codegen_expr(expr->expr,module,builder);
-            return LLVMBuildSub(builder,exp,LLVMConstInt(LLVMInt32Type(), 1, 0), "subtmp");
-
-          }
-          default:
-            return NULL;
-          }
-    }
-      case POST_DECREMENT_OP:{
-         switch (expr->expr->type)
-          {
-          case VARIABLE:{
-             LLVMValueRef exp = codegen_expr(expr->expr,module,builder);
-             LLVMValueRef result =  LLVMBuildSub(builder,exp,LLVMConstInt(LLVMInt32Type(), 1, 0), "subtmp"); 
-             LLVMBuildStore(builder, result, vector_get(&global_types,expr->expr->id));
-             return exp;
-          }
-          case LITERAL:{
-            LLVMValueRef exp = codegen_expr(expr->expr,module,builder);
-            return exp;
-
-          }
-          default:
-            return NULL;
-          }
-    }
-    case BIN_OP: {
-      LLVMValueRef lhs = codegen_expr(expr->binop.lhs, module, builder);
-      LLVMValueRef rhs = codegen_expr(expr->binop.rhs, module, builder);
-      switch (expr->binop.op) {
-        
-        case '+': return LLVMBuildAdd(builder, lhs, rhs, "addtmp");
-        case '-': return LLVMBuildSub(builder, lhs, rhs, "subtmp");
-        case '*': return LLVMBuildMul(builder, lhs, rhs, "multmp");
-        case '/': return LLVMBuildSDiv(builder, lhs, rhs, "divtmp");
-                          
-        case EQ:  return LLVMBuildICmp(builder, LLVMIntEQ, lhs, rhs, "eqtmp");
-        case NE:  return LLVMBuildICmp(builder, LLVMIntNE, lhs, rhs, "netmp");
-        case GE:  return LLVMBuildICmp(builder, LLVMIntSGE, lhs, rhs, "getmp");
-        case LE:  return LLVMBuildICmp(builder, LLVMIntSLE, lhs, rhs, "letmp");
-        case '>': return LLVMBuildICmp(builder, LLVMIntSGT, lhs, rhs, "gttmp");
-        case '<': return LLVMBuildICmp(builder, LLVMIntSLT, lhs, rhs, "lttmp");
+      return 1;
+    case BIN_OP:
+      return is_pure(expr->binop.lhs) && is_pure(expr->binop.rhs);
+    case TERNARY_OP:
+      return is_pure(expr->ternary.lhs) && is_pure(expr->ternary.mhs) && is_pure(expr->ternary.rhs);
+    case ELEMENT:
+      // an index out of bounds stops the program, so the access may not be dropped
+      return 0;
+    case CALL:
+      // a function may print, or never return
+      return 0;
+    default:
+      return expr->expr->type != VARIABLE && is_pure(expr->expr);
+  }
+}
 
-        case AND: return LLVMBuildAnd(builder,lhs,rhs,"andtmp");
-        case OR:  return LLVMBuildOr(builder,lhs,rhs,"ortmp");
-        case XOR: return LLVMBuildXor(builder,lhs,rhs,"xortmp");
-        case REMAINDER: return LLVMBuildSRem(builder,lhs,rhs,"modtmp");
+/**
+ * @brief
+ * It takes an expression and estimates the cost of evaluating it when its value may not be needed.
+ * It must then neither change a variable nor trap, so a division is only allowed by a constant
+ * other than 0 and -1.
+ * @param expr is an expression.
+ * @return int is the number of operations it takes, -1 if it cannot be evaluated speculatively.
+ */
+static int speculation_cost(struct expr *expr) {
+  int lhs, mhs, rhs;
 
-        case LEFTSHIFT: return LLVMBuildShl(builder,lhs,rhs,"shifltmp");
-        case RIGHTSHIFT: return LLVMBuildLShr(builder, lhs,rhs,"shiftrtmp");
+  switch (expr->type) {
+    case BOOL_LIT:
+    case LITERAL:
+      return 0;
+    case VARIABLE:
+      return 1;
+    case BIN_OP:
+      if ((expr->binop.op == '/' || expr->binop.op == REMAINDER) &&
+          (expr->binop.rhs->type != LITERAL || expr->binop.rhs->value == 0 || expr->binop.rhs->value == -1)) {
+        return -1;
       }
-
-    }
-
-    case TERNARY_OP:{
-      LLVMValueRef truth = codegen_expr(expr->ternary.lhs,module,builder);
-      LLVMValueRef mhs = codegen_expr(expr->ternary.mhs, module, builder);
-      LLVMValueRef rhs = codegen_expr(expr->ternary.rhs, module, builder);
-      return LLVMBuildSelect(builder,truth,mhs,rhs,"");
-    }
-
+      lhs = speculation_cost(expr->binop.lhs);
+      rhs = speculation_cost(expr->binop.rhs);
+      return lhs < 0 || rhs < 0 ? -1 : 1 + lhs + rhs;
+    case TERNARY_OP:
+      lhs = speculation_cost(expr->ternary.lhs);
+      mhs = speculation_cost(expr->ternary.mhs);
+      rhs = speculation_cost(expr->ternary.rhs);
+      return lhs < 0 || mhs < 0 || rhs < 0 ? -1 : 1 + lhs + mhs + rhs;
+    case ELEMENT:
+    case CALL:
+      return -1;
+    default:
+      return is_pure(expr) ? speculation_cost(expr->expr) + 1 : -1;
   }
-  return NULL;
 }
 
+/**
+ * @brief
+ * It takes an operand that is only needed on one path, the right-hand side of && and || or an arm
+ * of ?:, and tells if it is better to evaluate it anyway and choose the value without branching.
+ * A few operations cost less than a branch that may be mispredicted; anything else is branched over.
+ * @param expr is an expression.
+ * @return int is non-zero if it can be evaluated unconditionally.
+ */
+int should_speculate(struct expr *expr) {
+  int cost = speculation_cost(expr);
+  return cost >= 0 && cost <= SPECULATION_MAX_COST;
+}
 
 /**
- * @brief 
- * It takes a statement to generate code for it.
+ * @brief
+ * @param expr is an expression.
+ * @return int is non-zero if it is a boolean && or || that must be evaluated with a branch.
+ */
+int is_short_circuit(struct expr *expr) {
+  return expr->type == BIN_OP && (expr->binop.op == AND || expr->binop.op == OR) &&
+         expr->value_type == BOOLEAN && !should_speculate(expr->binop.rhs);
+}
+
+/**
+ * @brief 
+ * It takes two expressions and tells if they are the same tree.
+ * @param a is an expression.
+ * @param b is an expression.
+ * @return int is non-zero if they always have the same value, when they are pure.
+ */
+static int same_expr(struct expr *a, struct expr *b) {
+  if (a->type != b->type) {
+    return 0;
+  }
+  switch (a->type) {
+    case BOOL_LIT:
+    case LITERAL:
+      return a->value == b->value;
+    case VARIABLE:
+      return a->id == b->id;
+    case BIN_OP:
+      return a->binop.op == b->binop.op && same_expr(a->binop.lhs, b->binop.lhs) && same_expr(a->binop.rhs, b->binop.rhs);
+    case TERNARY_OP:
+      return same_expr(a->ternary.lhs, b->ternary.lhs) && same_expr(a->ternary.mhs, b->ternary.mhs) &&
+             same_expr(a->ternary.rhs, b->ternary.rhs);
+    default:
+      return 0;
+  }
+}
+
+/**
+ * @brief 
+ * @param expr is an expression.
+ * @param value is a value.
+ * @return int is non-zero if the expression is a literal with that value.
+ */
+static int is_value(struct expr *expr, int value) {
+  return (expr->type == LITERAL || expr->type == BOOL_LIT) && expr->value == value;
+}
+
+/**
+ * @brief 
+ * It turns an expression into a literal of its own type.
+ * @param expr is an expression.
+ * @param value is its value.
+ * @return struct expr* is the expression.
+ */
+static struct expr *make_constant(struct expr *expr, int value) {
+  if (expr->value_type == BOOLEAN) {
+    expr->type = BOOL_LIT;
+    expr->value = value & 1;
+  } else {
+    expr->type = LITERAL;
+    expr->value = value;
+  }
+  return expr;
+}
+
+/**
+ * @brief 
+ * It computes a binary operation on constants like the generated code, which wraps around on overflow.
+ * The operations that are undefined in LLVM (division by zero, overflowing division, shifts by 32 bits
+ * or more) and the remainders and shifts of booleans are not folded.
+ * @param op is a binary operator.
+ * @param type is the type of the operands.
+ * @param a is the left-hand side.
+ * @param b is the right-hand side.
+ * @param result is where the result is stored.
+ * @return int is non-zero if the operation was folded.
+ */
+static int fold_binop(int op, enum value_type type, int32_t a, int32_t b, int32_t *result) {
+  switch (op) {
+    case '+': *result = (int32_t) ((uint32_t) a + (uint32_t) b); return 1;
+    case '-': *result = (int32_t) ((uint32_t) a - (uint32_t) b); return 1;
+    case '*': *result = (int32_t) ((uint32_t) a * (uint32_t) b); return 1;
+    case '/':
+    case REMAINDER:
+      if (type != INTEGER || b == 0 || (a == INT32_MIN && b == -1)) {
+        return 0;
+      }
+      *result = op == '/' ? a / b : a % b;
+      return 1;
+    case LEFTSHIFT:
+    case RIGHTSHIFT:
+      if (type != INTEGER || b < 0 || b >= 32) {
+        return 0;
+      }
+      *result = op == LEFTSHIFT ? (int32_t) ((uint32_t) a << b) : (int32_t) ((uint32_t) a >> b);
+      return 1;
+    case EQ:  *result = a == b; return 1;
+    case NE:  *result = a != b; return 1;
+    case GE:  *result = a >= b; return 1;
+    case LE:  *result = a <= b; return 1;
+    case '>': *result = a > b; return 1;
+    case '<': *result = a < b; return 1;
+    case AND: *result = a & b; return 1;
+    case OR:  *result = a | b; return 1;
+    case XOR: *result = a ^ b; return 1;
+    default: return 0;
+  }
+}
+
+/**
+ * @brief 
+ * It simplifies a binary operation whose operands are already simplified:
+ * constant folding, then identities like x * 1, x + 0 and x ^ x.
+ * An operand is only dropped if it has no side effects.
+ * @param expr is a binary operation.
+ * @return struct expr* is the simplified expression.
+ */
+static struct expr *simplify_binop(struct expr *expr) {
+  struct expr *lhs = expr->binop.lhs;
+  struct expr *rhs = expr->binop.rhs;
+  enum value_type type = lhs->value_type;
+  int all_ones = type == BOOLEAN ? 1 : -1;
+  int32_t result;
+
+  if ((lhs->type == LITERAL || lhs->type == BOOL_LIT) && (rhs->type == LITERAL || rhs->type == BOOL_LIT) &&
+      fold_binop(expr->binop.op, type, lhs->value, rhs->value, &result)) {
+    return make_constant(expr, result);
+  }
+
+  int same = same_expr(lhs, rhs) && is_pure(lhs);
+  switch (expr->binop.op) {
+    case '+':
+      if (is_value(rhs, 0)) return lhs;
+      if (is_value(lhs, 0)) return rhs;
+      break;
+    case '-':
+      if (is_value(rhs, 0)) return lhs;
+      if (same) return make_constant(expr, 0);
+      break;
+    case '*':
+      if (is_value(rhs, 1)) return lhs;
+      if (is_value(lhs, 1)) return rhs;
+      if ((is_value(rhs, 0) && is_pure(lhs)) || (is_value(lhs, 0) && is_pure(rhs))) return make_constant(expr, 0);
+      break;
+    case '/':
+      if (is_value(rhs, 1)) return lhs;
+      break;
+    case LEFTSHIFT:
+    case RIGHTSHIFT:
+      if (type == INTEGER && is_value(rhs, 0)) return lhs;
+      break;
+    case XOR:
+      if (is_value(rhs, 0)) return lhs;
+      if (is_value(lhs, 0)) return rhs;
+      if (same) return make_constant(expr, 0);
+      break;
+    // The right-hand side of a boolean || or && is not evaluated when the left one decides.
+    case OR:
+      if (is_value(rhs, 0)) return lhs;
+      if (is_value(lhs, 0)) return rhs;
+      if ((is_value(rhs, all_ones) && is_pure(lhs)) || (is_value(lhs, all_ones) && (type == BOOLEAN || is_pure(rhs)))) return make_constant(expr, all_ones);
+      if (same) return lhs;
+      break;
+    case AND:
+      if (is_value(rhs, all_ones)) return lhs;
+      if (is_value(lhs, all_ones)) return rhs;
+      if ((is_value(rhs, 0) && is_pure(lhs)) || (is_value(lhs, 0) && (type == BOOLEAN || is_pure(rhs)))) return make_constant(expr, 0);
+      if (same) return lhs;
+      break;
+    case EQ:
+    case GE:
+    case LE:
+      if (same) return make_constant(expr, 1);
+      break;
+    case NE:
+    case '>':
+    case '<':
+      if (same) return make_constant(expr, 0);
+      break;
+  }
+  return expr;
+}
+
+/**
+ * @brief 
+ * It takes a type-checked expression and simplifies it, in place where it can.
+ * @param expr is an expression.
+ * @return struct expr* is an equivalent expression.
+ */
+struct expr *simplify_expr(struct expr *expr) {
+  switch (expr->type) {
+    case BOOL_LIT:
+    case LITERAL:
+    case VARIABLE:
+      return expr;
+
+    case PRE_INCREMENT_OP:
+    case POST_INCREMENT_OP:
+    case PRE_DECREMENT_OP:
+    case POST_DECREMENT_OP:
+      expr->expr = simplify_expr(expr->expr);
+      // Only a variable is updated, the step of a literal is just a value.
+      if (expr->expr->type == LITERAL) {
+        int step = expr->type == PRE_INCREMENT_OP ? 1 : expr->type == PRE_DECREMENT_OP ? -1 : 0;
+        return make_constant(expr, (int32_t) ((uint32_t) expr->expr->value + (uint32_t) step));
+      }
+      return expr;
+
+    case BIN_OP:
+      expr->binop.lhs = simplify_expr(expr->binop.lhs);
+      expr->binop.rhs = simplify_expr(expr->binop.rhs);
+      return simplify_binop(expr);
+
+    case ELEMENT:
+      expr->element.index = simplify_expr(expr->element.index);
+      return expr;
+
+    case CALL:
+      for (size_t i = 0; i < expr->call.n_args; i++) {
+        expr->call.args[i] = simplify_expr(expr->call.args[i]);
+      }
+      return expr;
+
+    case TERNARY_OP: {
+      struct expr *cond = expr->ternary.lhs = simplify_expr(expr->ternary.lhs);
+      struct expr *mhs = expr->ternary.mhs = simplify_expr(expr->ternary.mhs);
+      struct expr *rhs = expr->ternary.rhs = simplify_expr(expr->ternary.rhs);
+      // Only the arm that is chosen is evaluated, unless both are pure (see should_speculate).
+      if (cond->type == BOOL_LIT) {
+        return cond->value ? mhs : rhs;
+      }
+      if (same_expr(mhs, rhs) && is_pure(cond) && is_pure(mhs)) {
+        return mhs;
+      }
+      return expr;
+    }
+  }
+  return expr;
+}
+
+/**
+ * @brief 
+ * It takes a valid statement and simplifies its expressions, and removes the branches that never run.
+ * A statement that does nothing is removed from its block, or NULL for the caller to drop,
+ * and a body that does nothing keeps its original form where a statement is required.
+ * @param stmt is a statement.
+ * @return struct stmt* is an equivalent statement, NULL if it does nothing.
+ */
+struct stmt *simplify_stmt(struct stmt *stmt) {
+  switch (stmt->type) {
+    case STMT_SEQ: {
+      size_t len = 0;
+      for (size_t i = 0; i < stmt->seq.len; i++) {
+        struct stmt *s = simplify_stmt(stmt->seq.stmts[i]);
+        if (s) {
+          stmt->seq.stmts[len++] = s;
+        }
+      }
+      stmt->seq.len = len;
+      if (len <= 1) {
+        return len ? stmt->seq.stmts[0] : NULL;
+      }
+      return stmt;
+    }
+
+    case STMT_ASSIGN:
+      stmt->assign.expr = simplify_expr(stmt->assign.expr);
+      return stmt;
+
+    case STMT_PRINT:
+      stmt->print.expr = simplify_expr(stmt->print.expr);
+      return stmt;
+
+    case STMT_STORE:
+      stmt->store.index = simplify_expr(stmt->store.index);
+      stmt->store.expr = simplify_expr(stmt->store.expr);
+      return stmt;
+
+    case STMT_ALLOC:
+      stmt->alloc.len = simplify_expr(stmt->alloc.len);
+      return stmt;
+
+    case STMT_CALL:
+      stmt->call.call = simplify_expr(stmt->call.call);
+      return stmt;
+
+    case STMT_RETURN:
+      stmt->return_.expr = simplify_expr(stmt->return_.expr);
+      return stmt;
+
+    case STMT_WHILE: {
+      struct expr *cond = stmt->while_.cond = simplify_expr(stmt->while_.cond);
+      if (is_value(cond, 0)) {
+        return NULL;
+      }
+      struct stmt *body = simplify_stmt(stmt->while_.body);
+      if (body) {
+        stmt->while_.body = body;
+      }
+      return stmt;
+    }
+
+    case STMT_FOR: {
+      struct expr *from = stmt->for_.from = simplify_expr(stmt->for_.from);
+      struct expr *to = stmt->for_.to = simplify_expr(stmt->for_.to);
+      if (from->type == LITERAL && to->type == LITERAL && from->value >= to->value) {
+        return NULL;
+      }
+      struct stmt *body = simplify_stmt(stmt->for_.body);
+      if (body) {
+        stmt->for_.body = body;
+      }
+      return stmt;
+    }
+
+    case STMT_IF: {
+      struct expr *cond = stmt->ifelse.cond = simplify_expr(stmt->ifelse.cond);
+      if (cond->type == BOOL_LIT) {
+        struct stmt *taken = cond->value ? stmt->ifelse.if_body : stmt->ifelse.else_body;
+        return taken ? simplify_stmt(taken) : NULL;
+      }
+      struct stmt *if_body = simplify_stmt(stmt->ifelse.if_body);
+      struct stmt *else_body = stmt->ifelse.else_body ? simplify_stmt(stmt->ifelse.else_body) : NULL;
+      if (!if_body && !else_body && is_pure(cond)) {
+        return NULL;
+      }
+      if (if_body) {
+        stmt->ifelse.if_body = if_body;
+      }
+      if (stmt->ifelse.else_body) {
+        stmt->ifelse.else_body = else_body;
+      }
+      return stmt;
+    }
+  }
+  return stmt;
+}
+
+/**
+ * @brief
+ * Access to an array whose index is the induction variable of a counted loop plus a constant.
+ */
+struct loop_access {
+  size_t id;
+  struct expr *index;
+  int32_t offset;
+};
+
+/**
+ * @brief
+ * A loop while (i < n) or while (i <= n) whose body ends with i = i + 1 and changes neither i
+ * nor n before, and allocates no array. Its accesses a[i + c] stay in bounds for every iteration
+ * if they do for the first and the last one, so a single check before the loop covers them all.
+ */
+struct counted_loop {
+  size_t var;                     // i
+  struct expr *bound;             // n, a literal or a variable
+  int inclusive;                  // for <=
+  struct stmt *step;              // i = i + 1
+  struct loop_access *accesses;
+  size_t n_accesses;
+  struct counted_loop *outer;     // the enclosing loop generated without checks
+};
+
+// the loops being generated without bounds checks, innermost first
+static _Thread_local struct counted_loop *unchecked_loops;
+// non-zero while generating the checked copy of a loop, which is not versioned again
+static _Thread_local int in_checked_copy;
+
+/**
+ * @brief
+ * It tells if an access is known to be in bounds, because its index is a constant or
+ * because it was checked before the loop being generated.
+ * @param id is an array.
+ * @param index is the index.
+ * @return int is non-zero if it needs no check.
+ */
+static int in_bounds(size_t id, struct expr *index) {
+  LLVMTypeRef type = storage_type(id);
+
+  if (index->type == LITERAL && !is_heap_array(id)) {
+    return index->value >= 0 && (unsigned) index->value < LLVMGetArrayLength(type);
+  }
+  for (struct counted_loop *loop = unchecked_loops; loop; loop = loop->outer) {
+    for (size_t i = 0; i < loop->n_accesses; i++) {
+      if (loop->accesses[i].index == index) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief
+ * It generates the length of an array.
+ * @param id is an array.
+ * @param module is a LLVMModuleRef.
+ * @param builder is a LLVMBuilderRef.
+ * @return LLVMValueRef is the length, an i32.
+ */
+static LLVMValueRef codegen_length(size_t id, LLVMModuleRef module, LLVMBuilderRef builder) {
+  LLVMContextRef context = LLVMGetModuleContext(module);
+
+  if (!is_heap_array(id)) {
+    return LLVMConstInt(LLVMInt32TypeInContext(context), LLVMGetArrayLength(storage_type(id)), 0);
+  }
+  return LLVMBuildLoad(builder, LLVMBuildStructGEP(builder, vector_get(&compilation->types, id), 1, ""), "lentmp");
+}
+
+/**
+ * @brief
+ * It generates the address of an element, and the check of its index unless it is known to be
+ * in bounds. The check is a single unsigned comparison, which also catches negative indexes.
+ * @param id is an array.
+ * @param index is the index.
+ * @param module is a LLVMModuleRef.
+ * @param builder is a LLVMBuilderRef.
+ * @return LLVMValueRef is the address of the element.
+ */
+static LLVMValueRef codegen_element_ptr(size_t id, struct expr *index, LLVMModuleRef module, LLVMBuilderRef builder) {
+  LLVMContextRef context = LLVMGetModuleContext(module);
+  LLVMValueRef array = vector_get(&compilation->types, id);
+  LLVMValueRef i = codegen_expr(index, module, builder);
+
+  if (!in_bounds(id, index)) {
+    LLVMValueRef func = LLVMGetBasicBlockParent(LLVMGetInsertBlock(builder));
+    LLVMBasicBlockRef fail_bb = LLVMAppendBasicBlockInContext(context, func, "outofbounds");
+    LLVMBasicBlockRef ok_bb = LLVMAppendBasicBlockInContext(context, func, "inbounds");
+    LLVMValueRef len = codegen_length(id, module, builder);
+
+    LLVMBuildCondBr(builder, LLVMBuildICmp(builder, LLVMIntULT, i, len, "boundtmp"), ok_bb, fail_bb);
+    LLVMPositionBuilderAtEnd(builder, fail_bb);
+    LLVMValueRef args[] = { i, len };
+    LLVMBuildCall(builder, LLVMGetNamedFunction(module, "array_bounds_error"), args, 2, "");
+    LLVMBuildUnreachable(builder);
+    LLVMPositionBuilderAtEnd(builder, ok_bb);
+  }
+
+  i = LLVMBuildSExt(builder, i, LLVMInt64TypeInContext(context), "idxtmp");
+  if (is_heap_array(id)) {
+    LLVMValueRef data = LLVMBuildLoad(builder, LLVMBuildStructGEP(builder, array, 0, ""), "datatmp");
+    return LLVMBuildInBoundsGEP(builder, data, &i, 1, "elemtmp");
+  }
+  LLVMValueRef indexes[] = { LLVMConstInt(LLVMInt64TypeInContext(context), 0, 0), i };
+  return LLVMBuildInBoundsGEP(builder, array, indexes, 2, "elemtmp");
+}
+
+// the profile counted by the module (--profile-generate), and the one its branches are weighted
+// with (--profile-use), NULL when there is none
+static _Thread_local struct profile *profile_counters;
+static _Thread_local struct profile *profile_weights;
+
+/**
+ * @brief
+ * It sets the profiles of the code generated next, by this thread.
+ * @param counters is the profile whose counters the ifs and whiles increment, or NULL.
+ * @param weights is the profile read back for the weights of their branches, or NULL.
+ */
+void codegen_profile(struct profile *counters, struct profile *weights) {
+  profile_counters = counters;
+  profile_weights = weights;
+}
+
+/**
+ * @brief
+ * It counts an edge of an if or a while, when the module is instrumented.
+ * @param loc is the location of the statement.
+ * @param edge is 0 for the code run when the condition is true, 1 when it is false.
+ * @param module is a LLVMModuleRef.
+ * @param builder is a LLVMBuilderRef at the start of the code of the edge.
+ */
+static void count_edge(struct location loc, int edge, LLVMModuleRef module, LLVMBuilderRef builder) {
+  if (profile_counters) {
+    profile_increment(profile_counters, loc, edge, module, builder);
+  }
+}
+
+/**
+ * @brief
+ * @param loc is the location of an if or a while.
+ * @return const uint64_t* is the number of times its condition was true and false in the
+ * profile, NULL if there is none.
+ */
+static const uint64_t *branch_counts(struct location loc) {
+  return profile_weights ? profile_lookup(profile_weights, loc) : NULL;
+}
+
+/**
+ * @brief
+ * It generates a branch on a condition. A boolean && or || jumps to its target as soon as
+ * its left-hand side decides, so a condition never materializes its value in a phi.
+ * @param cond is a boolean expression.
+ * @param true_bb is the block run when it is true.
+ * @param false_bb is the block run when it is false.
+ * @param counts are the times the condition was true and false (see branch_counts), or NULL.
+ * A condition with && or || is left unweighted: its counts are of the whole condition, and
+ * how often each operand decided is not counted.
+ * @param module is a LLVMModuleRef.
+ * @param builder is a LLVMBuilderRef.
+ */
+static void codegen_branch(struct expr *cond, LLVMBasicBlockRef true_bb, LLVMBasicBlockRef false_bb,
+                           const uint64_t *counts, LLVMModuleRef module, LLVMBuilderRef builder) {
+  if (is_short_circuit(cond)) {
+    // laid out right before the code that runs when the condition is true
+    LLVMBasicBlockRef rhs_bb = LLVMInsertBasicBlockInContext(LLVMGetModuleContext(module), true_bb, "rhs");
+
+    if (cond->binop.op == AND) {
+      codegen_branch(cond->binop.lhs, rhs_bb, false_bb, NULL, module, builder);
+    } else {
+      codegen_branch(cond->binop.lhs, true_bb, rhs_bb, NULL, module, builder);
+    }
+    LLVMPositionBuilderAtEnd(builder, rhs_bb);
+    codegen_branch(cond->binop.rhs, true_bb, false_bb, NULL, module, builder);
+    return;
+  }
+  LLVMValueRef branch = LLVMBuildCondBr(builder, codegen_expr(cond, module, builder), true_bb, false_bb);
+  if (counts) {
+    profile_set_weights(branch, counts);
+  }
+}
+
+/**
+ * @brief
+ * It generates a boolean && or || that only evaluates its right-hand side when the left one
+ * does not decide, merging the two values with a phi.
+ * @param expr is a boolean && or ||.
+ * @param module is a LLVMModuleRef.
+ * @param builder is a LLVMBuilderRef.
+ * @return LLVMValueRef is its value.
+ */
+static LLVMValueRef codegen_short_circuit(struct expr *expr, LLVMModuleRef module, LLVMBuilderRef builder) {
+  LLVMContextRef context = LLVMGetModuleContext(module);
+  LLVMValueRef func = LLVMGetBasicBlockParent(LLVMGetInsertBlock(builder));
+  LLVMBasicBlockRef rhs_bb = LLVMAppendBasicBlockInContext(context, func, "rhs");
+  LLVMBasicBlockRef cont_bb = LLVMAppendBasicBlockInContext(context, func, "cont");
+  int is_and = expr->binop.op == AND;
+
+  LLVMValueRef lhs = codegen_expr(expr->binop.lhs, module, builder);
+  LLVMBasicBlockRef lhs_end = LLVMGetInsertBlock(builder);
+  LLVMBuildCondBr(builder, lhs, is_and ? rhs_bb : cont_bb, is_and ? cont_bb : rhs_bb);
+
+  LLVMPositionBuilderAtEnd(builder, rhs_bb);
+  LLVMValueRef rhs = codegen_expr(expr->binop.rhs, module, builder);
+  LLVMBasicBlockRef rhs_end = LLVMGetInsertBlock(builder);
+  LLVMBuildBr(builder, cont_bb);
+
+  LLVMPositionBuilderAtEnd(builder, cont_bb);
+  LLVMValueRef phi = LLVMBuildPhi(builder, LLVMInt1TypeInContext(context), is_and ? "andtmp" : "ortmp");
+  LLVMValueRef values[] = { LLVMConstInt(LLVMInt1TypeInContext(context), !is_and, 0), rhs };
+  LLVMBasicBlockRef blocks[] = { lhs_end, rhs_end };
+  LLVMAddIncoming(phi, values, blocks, 2);
+  return phi;
+}
+
+/**
+ * @brief
+ * It generates a ?: that only evaluates the arm that is chosen, merging the two values with a phi.
+ * @param expr is a ?:.
+ * @param module is a LLVMModuleRef.
+ * @param builder is a LLVMBuilderRef.
+ * @return LLVMValueRef is its value.
+ */
+static LLVMValueRef codegen_conditional(struct expr *expr, LLVMModuleRef module, LLVMBuilderRef builder) {
+  LLVMContextRef context = LLVMGetModuleContext(module);
+  LLVMValueRef func = LLVMGetBasicBlockParent(LLVMGetInsertBlock(builder));
+  LLVMBasicBlockRef mhs_bb = LLVMAppendBasicBlockInContext(context, func, "then");
+  LLVMBasicBlockRef rhs_bb = LLVMAppendBasicBlockInContext(context, func, "else");
+  LLVMBasicBlockRef cont_bb = LLVMAppendBasicBlockInContext(context, func, "cont");
+
+  codegen_branch(expr->ternary.lhs, mhs_bb, rhs_bb, NULL, module, builder);
+
+  LLVMPositionBuilderAtEnd(builder, mhs_bb);
+  LLVMValueRef mhs = codegen_expr(expr->ternary.mhs, module, builder);
+  LLVMBasicBlockRef mhs_end = LLVMGetInsertBlock(builder);
+  LLVMBuildBr(builder, cont_bb);
+
+  LLVMPositionBuilderAtEnd(builder, rhs_bb);
+  LLVMValueRef rhs = codegen_expr(expr->ternary.rhs, module, builder);
+  LLVMBasicBlockRef rhs_end = LLVMGetInsertBlock(builder);
+  LLVMBuildBr(builder, cont_bb);
+
+  LLVMPositionBuilderAtEnd(builder, cont_bb);
+  LLVMValueRef phi = LLVMBuildPhi(builder, LLVMTypeOf(mhs), "condtmp");
+  LLVMValueRef values[] = { mhs, rhs };
+  LLVMBasicBlockRef blocks[] = { mhs_end, rhs_end };
+  LLVMAddIncoming(phi, values, blocks, 2);
+  return phi;
+}
+
+/**
+ * @brief 
+ * It takes a expression and generete code for it.
+ * @param expr is an expression.
+ * @param module is a LLVMModuleRef.
+ * @param builder is a LLVMBuilderRef.
+ * @return LLVMValueRef
+ */
+LLVMValueRef codegen_expr(struct expr *expr, LLVMModuleRef module, LLVMBuilderRef builder) {
+  LLVMContextRef context = LLVMGetModuleContext(module);
+
+  switch (expr->type) {
+    case BOOL_LIT:
+      return LLVMConstInt(LLVMInt1TypeInContext(context), expr->value, 0);
+
+    case LITERAL:
+      return LLVMConstInt(LLVMInt32TypeInContext(context), expr->value, 0);
+
+    case VARIABLE:
+      return LLVMBuildLoad(builder, vector_get(&compilation->types, expr->id), "loadtmp");
+
+    case CALL: {
+      LLVMValueRef *args = malloc((expr->call.n_args + 1) * sizeof(args[0]));
+      for (size_t i = 0; i < expr->call.n_args; i++) {
+        args[i] = codegen_expr(expr->call.args[i], module, builder);
+      }
+      LLVMValueRef result = LLVMBuildCall(builder, vector_get(&compilation->types, expr->call.id), args, expr->call.n_args, "calltmp");
+      LLVMSetInstructionCallConv(result, LLVMFastCallConv);
+      free(args);
+      return result;
+    }
+
+    case ELEMENT: {
+      LLVMValueRef ptr = codegen_element_ptr(expr->element.id, expr->element.index, module, builder);
+      LLVMValueRef value = LLVMBuildLoad(builder, ptr, "elemval");
+      return expr->value_type == BOOLEAN ? LLVMBuildTrunc(builder, value, LLVMInt1TypeInContext(context), "booltmp") : value;
+    }
+
+    case PRE_INCREMENT_OP:{
+          switch (expr->expr->type)
+          {
+          case VARIABLE: {           
+             LLVMValueRef exp = codegen_expr(expr->expr,module,builder);
+             LLVMValueRef result =  LLVMBuildAdd(builder,exp,LLVMConstInt(LLVMInt32TypeInContext(context), 1, 0), "addtmp"); 
+             LLVMBuildStore(builder, result, vector_get(&compilation->types,expr->expr->id));
+            return result;
+          }
+          default:{
+            LLVMValueRef exp = codegen_expr(expr->expr,module,builder);
+            return LLVMBuildAdd(builder,exp,LLVMConstInt(LLVMInt32TypeInContext(context), 1, 0), "addtmp");
+          }
+          }
+    } 
+     case POST_INCREMENT_OP:{
+          switch (expr->expr->type)
+          {
+          case VARIABLE: {           
+             LLVMValueRef exp = codegen_expr(expr->expr,module,builder);
+             LLVMValueRef result =  LLVMBuildAdd(builder,exp,LLVMConstInt(LLVMInt32TypeInContext(context), 1, 0), "addtmp"); 
+             LLVMBuildStore(builder, result, vector_get(&compilation->types,expr->expr->id));
+            return exp;
+          }
+          default:{
+            LLVMValueRef exp = codegen_expr(expr->expr,module,builder);
+            return exp;
+          }
+          }
+    } 
+   case PRE_DECREMENT_OP:{
+         switch (expr->expr->type)
+          {
+          case VARIABLE:{
+             LLVMValueRef exp = codegen_expr(expr->expr,module,builder);
+             LLVMValueRef result =  LLVMBuildSub(builder,exp,LLVMConstInt(LLVMInt32TypeInContext(context), 1, 0), "subtmp"); 
+             LLVMBuildStore(builder, result, vector_get(&compilation->types,expr->expr->id));
+             return result;
+          }
+          default:{
+            LLVMValueRef exp = codegen_expr(expr->expr,module,builder);
+            return LLVMBuildSub(builder,exp,LLVMConstInt(LLVMInt32TypeInContext(context), 1, 0), "subtmp");
+
+          }
+          }
+    }
+      case POST_DECREMENT_OP:{
+         switch (expr->expr->type)
+          {
+          case VARIABLE:{
+             LLVMValueRef exp = codegen_expr(expr->expr,module,builder);
+             LLVMValueRef result =  LLVMBuildSub(builder,exp,LLVMConstInt(LLVMInt32TypeInContext(context), 1, 0), "subtmp"); 
+             LLVMBuildStore(builder, result, vector_get(&compilation->types,expr->expr->id));
+             return exp;
+          }
+          default:{
+            LLVMValueRef exp = codegen_expr(expr->expr,module,builder);
+            return exp;
+
+          }
+          }
+    }
+    case BIN_OP: {
+      if (is_short_circuit(expr)) {
+        return codegen_short_circuit(expr, module, builder);
+      }
+      LLVMValueRef lhs = codegen_expr(expr->binop.lhs, module, builder);
+      LLVMValueRef rhs = codegen_expr(expr->binop.rhs, module, builder);
+      switch (expr->binop.op) {
+        
+        case '+': return LLVMBuildAdd(builder, lhs, rhs, "addtmp");
+        case '-': return LLVMBuildSub(builder, lhs, rhs, "subtmp");
+        case '*': return LLVMBuildMul(builder, lhs, rhs, "multmp");
+        case '/': return LLVMBuildSDiv(builder, lhs, rhs, "divtmp");
+                          
+        case EQ:  return LLVMBuildICmp(builder, LLVMIntEQ, lhs, rhs, "eqtmp");
+        case NE:  return LLVMBuildICmp(builder, LLVMIntNE, lhs, rhs, "netmp");
+        case GE:  return LLVMBuildICmp(builder, LLVMIntSGE, lhs, rhs, "getmp");
+        case LE:  return LLVMBuildICmp(builder, LLVMIntSLE, lhs, rhs, "letmp");
+        case '>': return LLVMBuildICmp(builder, LLVMIntSGT, lhs, rhs, "gttmp");
+        case '<': return LLVMBuildICmp(builder, LLVMIntSLT, lhs, rhs, "lttmp");
+
+        case AND: return LLVMBuildAnd(builder,lhs,rhs,"andtmp");
+        case OR:  return LLVMBuildOr(builder,lhs,rhs,"ortmp");
+        case XOR: return LLVMBuildXor(builder,lhs,rhs,"xortmp");
+        case REMAINDER: return LLVMBuildSRem(builder,lhs,rhs,"modtmp");
+
+        case LEFTSHIFT: return LLVMBuildShl(builder,lhs,rhs,"shifltmp");
+        case RIGHTSHIFT: return LLVMBuildLShr(builder, lhs,rhs,"shiftrtmp");
+      }
+      return NULL;
+    }
+
+    case TERNARY_OP:{
+      if (!should_speculate(expr->ternary.mhs) || !should_speculate(expr->ternary.rhs)) {
+        return codegen_conditional(expr, module, builder);
+      }
+      LLVMValueRef truth = codegen_expr(expr->ternary.lhs,module,builder);
+      LLVMValueRef mhs = codegen_expr(expr->ternary.mhs, module, builder);
+      LLVMValueRef rhs = codegen_expr(expr->ternary.rhs, module, builder);
+      return LLVMBuildSelect(builder,truth,mhs,rhs,"");
+    }
+
+  }
+  return NULL;
+}
+
+
+/**
+ * @brief
+ * It takes an index and tells if it is the induction variable of a loop plus a constant.
+ * @param index is an expression.
+ * @param var is the induction variable.
+ * @param offset is where the constant is stored.
+ * @return int is non-zero if it is i, i + c, c + i or i - c.
+ */
+static int induction_offset(struct expr *index, size_t var, int32_t *offset) {
+  if (index->type == VARIABLE) {
+    *offset = 0;
+    return index->id == var;
+  }
+  if (index->type != BIN_OP || (index->binop.op != '+' && index->binop.op != '-')) {
+    return 0;
+  }
+
+  struct expr *lhs = index->binop.lhs, *rhs = index->binop.rhs;
+  if (index->binop.op == '+' && lhs->type == LITERAL) {
+    lhs = index->binop.rhs;
+    rhs = index->binop.lhs;
+  }
+  if (lhs->type != VARIABLE || lhs->id != var || rhs->type != LITERAL ||
+      (index->binop.op == '-' && rhs->value == INT32_MIN)) {
+    return 0;
+  }
+  *offset = index->binop.op == '-' ? -rhs->value : rhs->value;
+  return 1;
+}
+
+/**
+ * @brief
+ * It records an access of a loop if its index is the induction variable plus a constant.
+ * @param loop is a counted loop.
+ * @param id is an array.
+ * @param index is the index.
+ */
+static void add_loop_access(struct counted_loop *loop, size_t id, struct expr *index) {
+  int32_t offset;
+
+  if (induction_offset(index, loop->var, &offset)) {
+    loop->accesses = realloc(loop->accesses, (loop->n_accesses + 1) * sizeof(loop->accesses[0]));
+    loop->accesses[loop->n_accesses++] = (struct loop_access) { id, index, offset };
+  }
+}
+
+/**
+ * @brief
+ * @param loop is a counted loop.
+ * @param id is a variable.
+ * @return int is non-zero if it is the induction variable or the bound of the loop.
+ */
+static int is_loop_var(struct counted_loop *loop, size_t id) {
+  return id == loop->var || (loop->bound->type == VARIABLE && id == loop->bound->id);
+}
+
+/**
+ * @brief
+ * It collects the accesses of an expression of a loop body.
+ * @param expr is an expression.
+ * @param loop is a counted loop.
+ * @return int is zero if the expression changes the induction variable or the bound.
+ */
+static int scan_loop_expr(struct expr *expr, struct counted_loop *loop) {
+  switch (expr->type) {
+    case BOOL_LIT:
+    case LITERAL:
+    case VARIABLE:
+      return 1;
+    case BIN_OP:
+      return scan_loop_expr(expr->binop.lhs, loop) && scan_loop_expr(expr->binop.rhs, loop);
+    case TERNARY_OP:
+      return scan_loop_expr(expr->ternary.lhs, loop) && scan_loop_expr(expr->ternary.mhs, loop) &&
+             scan_loop_expr(expr->ternary.rhs, loop);
+    case ELEMENT:
+      add_loop_access(loop, expr->element.id, expr->element.index);
+      return scan_loop_expr(expr->element.index, loop);
+    case CALL:
+      // a function sees neither the induction variable nor the bound, nor a heap array
+      for (size_t i = 0; i < expr->call.n_args; i++) {
+        if (!scan_loop_expr(expr->call.args[i], loop)) {
+          return 0;
+        }
+      }
+      return 1;
+    default:
+      if (expr->expr->type == VARIABLE && is_loop_var(loop, expr->expr->id)) {
+        return 0;
+      }
+      return scan_loop_expr(expr->expr, loop);
+  }
+}
+
+/**
+ * @brief
+ * It collects the accesses of a statement of a loop body.
+ * @param stmt is a statement.
+ * @param loop is a counted loop.
+ * @return int is zero if the statement changes the induction variable (other than the step)
+ * or the bound, or allocates an array.
+ */
+static int scan_loop_stmt(struct stmt *stmt, struct counted_loop *loop) {
+  switch (stmt->type) {
+    case STMT_SEQ:
+      for (size_t i = 0; i < stmt->seq.len; i++) {
+        if (!scan_loop_stmt(stmt->seq.stmts[i], loop)) {
+          return 0;
+        }
+      }
+      return 1;
+    case STMT_ASSIGN:
+      if (stmt != loop->step && is_loop_var(loop, stmt->assign.id)) {
+        return 0;
+      }
+      return scan_loop_expr(stmt->assign.expr, loop);
+    case STMT_PRINT:
+      return scan_loop_expr(stmt->print.expr, loop);
+    case STMT_IF:
+      return
+        scan_loop_expr(stmt->ifelse.cond, loop) &&
+        scan_loop_stmt(stmt->ifelse.if_body, loop) &&
+        (!stmt->ifelse.else_body || scan_loop_stmt(stmt->ifelse.else_body, loop));
+    case STMT_WHILE:
+      return scan_loop_expr(stmt->while_.cond, loop) && scan_loop_stmt(stmt->while_.body, loop);
+    case STMT_STORE:
+      add_loop_access(loop, stmt->store.id, stmt->store.index);
+      return scan_loop_expr(stmt->store.index, loop) && scan_loop_expr(stmt->store.expr, loop);
+    case STMT_CALL:
+      return scan_loop_expr(stmt->call.call, loop);
+    default:
+      return 0;
+  }
+}
+
+/**
+ * @brief
+ * It tells if a while loop is a counted loop with accesses whose checks can be moved before it.
+ * @param stmt is a while statement.
+ * @param loop is where the loop is described, its accesses must be freed.
+ * @return int is non-zero if it is.
+ */
+static int analyze_counted_loop(struct stmt *stmt, struct counted_loop *loop) {
+  struct expr *cond = stmt->while_.cond;
+  struct stmt *body = stmt->while_.body;
+
+  if (cond->type != BIN_OP || (cond->binop.op != '<' && cond->binop.op != LE) ||
+      cond->binop.lhs->type != VARIABLE || cond->binop.lhs->value_type != INTEGER ||
+      body->type != STMT_SEQ || !body->seq.len) {
+    return 0;
+  }
+  struct expr *bound = cond->binop.rhs;
+  if (bound->type != LITERAL && (bound->type != VARIABLE || bound->id == cond->binop.lhs->id)) {
+    return 0;
+  }
+  struct stmt *step = body->seq.stmts[body->seq.len - 1];
+  struct expr *next = step->type == STMT_ASSIGN ? step->assign.expr : NULL;
+  if (!next || step->assign.id != cond->binop.lhs->id || next->type != BIN_OP || next->binop.op != '+' ||
+      next->binop.lhs->type != VARIABLE || next->binop.lhs->id != step->assign.id || !is_value(next->binop.rhs, 1)) {
+    return 0;
+  }
+
+  loop->var = step->assign.id;
+  loop->bound = bound;
+  loop->inclusive = cond->binop.op == LE;
+  loop->step = step;
+  loop->accesses = NULL;
+  loop->n_accesses = 0;
+  if (!scan_loop_stmt(body, loop) || !loop->n_accesses) {
+    free(loop->accesses);
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * @brief
+ * It generates the check, before a counted loop, that all its accesses are in bounds: for the
+ * first and the last value of the induction variable, in 64 bits so that nothing overflows.
+ * A loop that does not run passes it.
+ * @param loop is a counted loop.
+ * @param module is a LLVMModuleRef.
+ * @param builder is a LLVMBuilderRef.
+ * @return LLVMValueRef is non-zero if the loop can run without checks.
+ */
+static LLVMValueRef codegen_loop_guard(struct counted_loop *loop, LLVMModuleRef module, LLVMBuilderRef builder) {
+  LLVMTypeRef i64 = LLVMInt64TypeInContext(LLVMGetModuleContext(module));
+  LLVMValueRef var = vector_get(&compilation->types, loop->var);
+  LLVMValueRef first = LLVMBuildSExt(builder, LLVMBuildLoad(builder, var, "loadtmp"), i64, "firsttmp");
+  LLVMValueRef last = LLVMBuildSExt(builder, codegen_expr(loop->bound, module, builder), i64, "lasttmp");
+
+  if (!loop->inclusive) {
+    last = LLVMBuildSub(builder, last, LLVMConstInt(i64, 1, 0), "lasttmp");
+  }
+  LLVMValueRef empty = LLVMBuildICmp(builder, LLVMIntSGT, first, last, "emptytmp");
+  // i <= INT32_MAX never ends, the increment wraps around
+  LLVMValueRef ok = LLVMBuildICmp(builder, LLVMIntSLT, last, LLVMConstInt(i64, INT32_MAX, 0), "guardtmp");
+
+  for (size_t i = 0; i < loop->n_accesses; i++) {
+    struct loop_access *access = &loop->accesses[i];
+    LLVMValueRef offset = LLVMConstInt(i64, access->offset, 1);
+    LLVMValueRef len = LLVMBuildSExt(builder, codegen_length(access->id, module, builder), i64, "lentmp");
+    LLVMValueRef low = LLVMBuildICmp(builder, LLVMIntSGE, LLVMBuildAdd(builder, first, offset, ""),
+                                     LLVMConstInt(i64, 0, 0), "guardtmp");
+    LLVMValueRef high = LLVMBuildICmp(builder, LLVMIntSLT, LLVMBuildAdd(builder, last, offset, ""), len, "guardtmp");
+    ok = LLVMBuildAnd(builder, ok, LLVMBuildAnd(builder, low, high, ""), "guardtmp");
+  }
+  return LLVMBuildOr(builder, empty, ok, "guardtmp");
+}
+
+/**
+ * @brief
+ * It generates a while loop.
+ * @param stmt is a while statement.
+ * @param module is a LLVMModuleRef.
+ * @param builder is a LLVMBuilderRef.
+ */
+static void codegen_while(struct stmt *stmt, LLVMModuleRef module, LLVMBuilderRef builder) {
+  LLVMContextRef context = LLVMGetModuleContext(module);
+  LLVMValueRef func = LLVMGetBasicBlockParent(LLVMGetInsertBlock(builder));
+  LLVMBasicBlockRef cond_bb = LLVMAppendBasicBlockInContext(context, func, "cond");
+  LLVMBasicBlockRef body_bb = LLVMAppendBasicBlockInContext(context, func, "body");
+  LLVMBasicBlockRef cont_bb = LLVMAppendBasicBlockInContext(context, func, "cont");
+
+  LLVMBuildBr(builder, cond_bb);
+
+  const uint64_t *counts = branch_counts(stmt->while_.loc);
+  LLVMPositionBuilderAtEnd(builder, cond_bb);
+  codegen_branch(stmt->while_.cond, body_bb, cont_bb, counts, module, builder);
+
+  LLVMPositionBuilderAtEnd(builder, body_bb);
+  count_edge(stmt->while_.loc, 0, module, builder);
+  codegen_stmt(stmt->while_.body, module, builder);
+  LLVMValueRef latch = LLVMBuildBr(builder, cond_bb);
+  if (counts) {
+    profile_set_loop_hints(latch, counts);
+  }
+
+  LLVMPositionBuilderAtEnd(builder, cont_bb);
+  count_edge(stmt->while_.loc, 1, module, builder);
+}
+
+// where the parts of main are outlined (see codegen_outline), NULL to generate main as a whole
+static _Thread_local struct outline *outline;
+// non-zero while the code of a part is generated, the parts are not nested
+static _Thread_local int outlining;
+
+/**
+ * @brief
+ * It makes the code generated next, by this thread, outline the parts of main: each while that is
+ * not in another one, and each run of at least OUTLINE_MIN_STMTS other statements of a block, cut
+ * every OUTLINE_MAX_STMTS, becomes a function of a module of its own, which main calls. The modules can then be
+ * optimized and compiled concurrently, each in its own context (see parallel.c).
+ * @param parts is where the modules are stored, NULL to stop outlining.
+ */
+void codegen_outline(struct outline *parts) {
+  outline = parts;
+}
+
+/**
+ * @brief
+ * It marks the identifiers an expression uses.
+ * @param expr is an expression.
+ * @param used is a flag per identifier.
+ */
+static void mark_expr(struct expr *expr, char *used) {
+  switch (expr->type) {
+    case BOOL_LIT:
+    case LITERAL:
+      break;
+    case VARIABLE:
+      used[expr->id] = 1;
+      break;
+    case BIN_OP:
+      mark_expr(expr->binop.lhs, used);
+      mark_expr(expr->binop.rhs, used);
+      break;
+    case TERNARY_OP:
+      mark_expr(expr->ternary.lhs, used);
+      mark_expr(expr->ternary.mhs, used);
+      mark_expr(expr->ternary.rhs, used);
+      break;
+    case ELEMENT:
+      used[expr->element.id] = 1;
+      mark_expr(expr->element.index, used);
+      break;
+    case CALL:
+      for (size_t i = 0; i < expr->call.n_args; i++) {
+        mark_expr(expr->call.args[i], used);
+      }
+      break;
+    default:
+      mark_expr(expr->expr, used);
+      break;
+  }
+}
+
+/**
+ * @brief
+ * It marks the identifiers a statement uses.
+ * @param stmt is a statement.
+ * @param used is a flag per identifier.
+ */
+static void mark_stmt(struct stmt *stmt, char *used) {
+  switch (stmt->type) {
+    case STMT_SEQ:
+      for (size_t i = 0; i < stmt->seq.len; i++) {
+        mark_stmt(stmt->seq.stmts[i], used);
+      }
+      break;
+    case STMT_ASSIGN:
+      used[stmt->assign.id] = 1;
+      mark_expr(stmt->assign.expr, used);
+      break;
+    case STMT_STORE:
+      used[stmt->store.id] = 1;
+      mark_expr(stmt->store.index, used);
+      mark_expr(stmt->store.expr, used);
+      break;
+    case STMT_ALLOC:
+      used[stmt->alloc.id] = 1;
+      mark_expr(stmt->alloc.len, used);
+      break;
+    case STMT_IF:
+      mark_expr(stmt->ifelse.cond, used);
+      mark_stmt(stmt->ifelse.if_body, used);
+      if (stmt->ifelse.else_body) {
+        mark_stmt(stmt->ifelse.else_body, used);
+      }
+      break;
+    case STMT_WHILE:
+      mark_expr(stmt->while_.cond, used);
+      mark_stmt(stmt->while_.body, used);
+      break;
+    case STMT_FOR:
+      used[stmt->for_.var] = 1;
+      mark_expr(stmt->for_.from, used);
+      mark_expr(stmt->for_.to, used);
+      for (size_t i = 0; i < stmt->for_.n_reductions; i++) {
+        used[stmt->for_.reductions[i].id] = 1;
+      }
+      mark_stmt(stmt->for_.body, used);
+      break;
+    case STMT_PRINT:
+      mark_expr(stmt->print.expr, used);
+      break;
+    case STMT_CALL:
+      mark_expr(stmt->call.call, used);
+      break;
+    case STMT_RETURN:
+      mark_expr(stmt->return_.expr, used);
+      break;
+  }
+}
+
+/**
+ * @brief
+ * It generates statements of main as a function of a new module, and a call to it in main.
+ * The variables and the arrays of main they use are passed by pointer. The function copies the
+ * variables to allocas of its own, which mem2reg promotes to registers, and copies them back when
+ * it returns: nothing else sees them meanwhile, the functions of the program and the runtime do
+ * not. Those are declared in the module.
+ * @param stmts are the statements.
+ * @param n is their number.
+ * @param module is the module of main.
+ * @param builder is a LLVMBuilderRef positioned in main.
+ */
+static void outline_stmts(struct stmt **stmts, size_t n, LLVMModuleRef module, LLVMBuilderRef builder) {
+  LLVMContextRef context = LLVMGetModuleContext(module);
+  size_t n_ids = string_int_count(&compilation->ids);
+  char *used = calloc(n_ids, 1);
+  size_t *ids = malloc(n_ids * sizeof(ids[0]));
+  LLVMValueRef *args = malloc(n_ids * sizeof(args[0]));
+  LLVMTypeRef *param_types = malloc(n_ids * sizeof(param_types[0]));
+  unsigned n_params = 0;
+  char name[32];
+
+  for (size_t i = 0; i < n; i++) {
+    mark_stmt(stmts[i], used);
+  }
+  for (size_t id = 0; id < n_ids; id++) {
+    LLVMValueRef var = vector_get(&compilation->types, id);
+    if (used[id] && var && !LLVMIsAFunction(var)) {
+      ids[n_params] = id;
+      args[n_params] = var;
+      param_types[n_params] = LLVMTypeOf(var);
+      n_params++;
+    }
+  }
+
+  snprintf(name, sizeof(name), "part.%zu", outline->n_modules);
+  LLVMModuleRef part = LLVMModuleCreateWithNameInContext(name, context);
+  LLVMTypeRef fn_type = LLVMFunctionType(LLVMVoidTypeInContext(context), param_types, n_params, 0);
+  LLVMValueRef fn = LLVMAddFunction(part, name, fn_type);
+  set_host_cpu(fn);
+  declare_runtime(part);
+  LLVMBuilderRef part_builder = LLVMCreateBuilderInContext(context);
+  LLVMPositionBuilderAtEnd(part_builder, LLVMAppendBasicBlockInContext(context, fn, "entry"));
+  for (unsigned i = 0; i < n_params; i++) {
+    const char *var_name = string_int_rev(&compilation->ids, ids[i]);
+    LLVMValueRef param = LLVMGetParam(fn, i);
+    LLVMSetValueName(param, var_name);
+    LLVMAddAttributeAtIndex(fn, i + 1, LLVMCreateEnumAttribute(context, LLVMGetEnumAttributeKindForName("noalias", 7), 0));
+    LLVMAddAttributeAtIndex(fn, i + 1, LLVMCreateEnumAttribute(context, LLVMGetEnumAttributeKindForName("nocapture", 9), 0));
+    if (LLVMIsAGlobalVariable(args[i])) {
+      LLVMAddAttributeAtIndex(fn, i + 1, LLVMCreateEnumAttribute(context, LLVMGetEnumAttributeKindForName("align", 5),
+                                                                   LLVMGetAlignment(args[i])));
+      vector_set(&compilation->types, ids[i], param);
+    } else {
+      LLVMValueRef copy = LLVMBuildAlloca(part_builder, LLVMGetElementType(param_types[i]), var_name);
+      LLVMBuildStore(part_builder, LLVMBuildLoad(part_builder, param, ""), copy);
+      vector_set(&compilation->types, ids[i], copy);
+    }
+  }
+  import_globals(part, 1);
+
+  outlining = 1;
+  for (size_t i = 0; i < n; i++) {
+    codegen_stmt(stmts[i], part, part_builder);
+  }
+  outlining = 0;
+  for (unsigned i = 0; i < n_params; i++) {
+    LLVMValueRef copy = vector_get(&compilation->types, ids[i]);
+    if (LLVMIsAAllocaInst(copy)) {
+      LLVMBuildStore(part_builder, LLVMBuildLoad(part_builder, copy, ""), LLVMGetParam(fn, i));
+    }
+  }
+  LLVMBuildRetVoid(part_builder);
+  LLVMDisposeBuilder(part_builder);
+
+  for (unsigned i = 0; i < n_params; i++) {
+    vector_set(&compilation->types, ids[i], args[i]);
+  }
+  import_globals(module, 1);
+  LLVMBuildCall(builder, LLVMAddFunction(module, name, fn_type), args, n_params, "");
+
+  if (outline->n_modules == outline->capacity) {
+    outline->capacity = outline->capacity ? 2 * outline->capacity : 8;
+    outline->modules = realloc(outline->modules, outline->capacity * sizeof(outline->modules[0]));
+  }
+  outline->modules[outline->n_modules++] = part;
+  free(used);
+  free(ids);
+  free(args);
+  free(param_types);
+}
+
+/**
+ * @brief
+ * @return int is non-zero if the statement being generated is in main and may be outlined.
+ */
+static int can_outline(void) {
+  return outline && !outlining && !current_function;
+}
+
+/**
+ * @brief
+ * It adds an alloca to the entry block of the function being generated, so that the loops
+ * around the code do not grow the stack.
+ * @param builder is a LLVMBuilderRef.
+ * @param type is the type of the alloca.
+ * @param name is its name.
+ * @return LLVMValueRef is the alloca.
+ */
+static LLVMValueRef build_entry_alloca(LLVMBuilderRef builder, LLVMTypeRef type, const char *name) {
+  LLVMBasicBlockRef entry = LLVMGetEntryBasicBlock(LLVMGetBasicBlockParent(LLVMGetInsertBlock(builder)));
+  LLVMBuilderRef entry_builder = LLVMCreateBuilderInContext(LLVMGetTypeContext(type));
+  LLVMValueRef first = LLVMGetFirstInstruction(entry);
+
+  if (first) {
+    LLVMPositionBuilderBefore(entry_builder, first);
+  } else {
+    LLVMPositionBuilderAtEnd(entry_builder, entry);
+  }
+  LLVMValueRef alloca = LLVMBuildAlloca(entry_builder, type, name);
+  LLVMDisposeBuilder(entry_builder);
+  return alloca;
+}
+
+/**
+ * @brief
+ * @param type is an integer type.
+ * @param op is the operator of a reduction.
+ * @return LLVMValueRef is its identity.
+ */
+static LLVMValueRef reduction_identity(LLVMTypeRef type, int op) {
+  switch (op) {
+    case '*': return LLVMConstInt(type, 1, 0);
+    case AND: return LLVMConstAllOnes(type);
+    default:  return LLVMConstNull(type);
+  }
+}
+
+/**
+ * @brief
+ * @param op is the operator of a reduction.
+ * @return LLVMOpcode is its instruction.
+ */
+static LLVMOpcode reduction_opcode(int op) {
+  switch (op) {
+    case '+': return LLVMAdd;
+    case '*': return LLVMMul;
+    case AND: return LLVMAnd;
+    case OR:  return LLVMOr;
+    default:  return LLVMXor;
+  }
+}
+
+/**
+ * @brief
+ * It combines the result of a chunk into the accumulator of a reduction, which the other threads
+ * update at the same time. LLVM has no atomic multiplication, a product is a compare and
+ * exchange loop.
+ * @param op is the operator.
+ * @param acc is the accumulator, an i32.
+ * @param value is the result of the chunk, an i32.
+ * @param builder is a LLVMBuilderRef.
+ */
+static void codegen_atomic_reduce(int op, LLVMValueRef acc, LLVMValueRef value, LLVMBuilderRef builder) {
+  if (op != '*') {
+    LLVMAtomicRMWBinOp rmw = op == '+' ? LLVMAtomicRMWBinOpAdd : op == AND ? LLVMAtomicRMWBinOpAnd :
+                             op == OR ? LLVMAtomicRMWBinOpOr : LLVMAtomicRMWBinOpXor;
+    LLVMBuildAtomicRMW(builder, rmw, acc, value, LLVMAtomicOrderingMonotonic, 0);
+    return;
+  }
+
+  LLVMContextRef context = LLVMGetTypeContext(LLVMTypeOf(value));
+  LLVMValueRef func = LLVMGetBasicBlockParent(LLVMGetInsertBlock(builder));
+  LLVMBasicBlockRef entry_bb = LLVMGetInsertBlock(builder);
+  LLVMBasicBlockRef retry_bb = LLVMAppendBasicBlockInContext(context, func, "retry");
+  LLVMBasicBlockRef done_bb = LLVMAppendBasicBlockInContext(context, func, "reduced");
+
+  LLVMValueRef first = LLVMBuildLoad(builder, acc, "acctmp");
+  LLVMSetOrdering(first, LLVMAtomicOrderingMonotonic);
+  LLVMSetAlignment(first, 4);
+  LLVMBuildBr(builder, retry_bb);
+
+  LLVMPositionBuilderAtEnd(builder, retry_bb);
+  LLVMValueRef old = LLVMBuildPhi(builder, LLVMTypeOf(value), "acctmp");
+  LLVMValueRef pair = LLVMBuildAtomicCmpXchg(builder, acc, old, LLVMBuildMul(builder, old, value, "multmp"),
+                                             LLVMAtomicOrderingMonotonic, LLVMAtomicOrderingMonotonic, 0);
+  LLVMValueRef seen = LLVMBuildExtractValue(builder, pair, 0, "acctmp");
+  LLVMBuildCondBr(builder, LLVMBuildExtractValue(builder, pair, 1, "oktmp"), done_bb, retry_bb);
+  LLVMValueRef incoming[] = { first, seen };
+  LLVMBasicBlockRef blocks[] = { entry_bb, retry_bb };
+  LLVMAddIncoming(old, incoming, blocks, 2);
+
+  LLVMPositionBuilderAtEnd(builder, done_bb);
+}
+
+/**
+ * @brief
+ * It generates a parallel loop. The body becomes a function parfor(env, from, to) of a chunk
+ * of the range, which parallel_for in the runtime calls on its threads. In the function, the
+ * chunk is a while loop whose variable is a local of its own and whose end is the hidden
+ * variable of the loop, so that it is a counted loop like the others (see analyze_counted_loop).
+ *
+ * The function sees the globals. The other variables and arrays the body uses, of the function
+ * or the part of main around the loop, are passed by pointer in env and copied to locals, since
+ * the body does not change them. Each reduction variable is a local that starts from the identity
+ * of its operator, and each chunk combines it with an atomic operation into an accumulator of the
+ * caller, which is combined with the variable once the loop is over.
+ * @param stmt is a parallel loop.
+ * @param module is a LLVMModuleRef.
+ * @param builder is a LLVMBuilderRef.
+ */
+static void codegen_for(struct stmt *stmt, LLVMModuleRef module, LLVMBuilderRef builder) {
+  LLVMContextRef context = LLVMGetModuleContext(module);
+  LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+  LLVMTypeRef bytes_type = LLVMPointerType(LLVMInt8TypeInContext(context), 0);
+  struct reduction *reductions = stmt->for_.reductions;
+  size_t n_reductions = stmt->for_.n_reductions;
+  size_t n_ids = string_int_count(&compilation->ids);
+  char *used = calloc(n_ids, 1);
+  size_t *ids = malloc(n_ids * sizeof(ids[0]));
+  LLVMValueRef *storage = malloc(n_ids * sizeof(storage[0]));
+  LLVMTypeRef *fields = malloc((n_ids + n_reductions) * sizeof(fields[0]));
+  LLVMValueRef *outer = malloc(n_reductions * sizeof(outer[0]));
+  LLVMValueRef *accs = malloc(n_reductions * sizeof(accs[0]));
+  unsigned n_captured = 0;
+
+  mark_stmt(stmt->for_.body, used);
+  used[stmt->for_.var] = 0;
+  for (size_t i = 0; i < n_reductions; i++) {
+    used[reductions[i].id] = 0;
+  }
+  for (size_t id = 0; id < n_ids; id++) {
+    LLVMValueRef var = vector_get(&compilation->types, id);
+    if (used[id] && var && !LLVMIsAGlobalValue(var)) {
+      ids[n_captured] = id;
+      storage[n_captured] = var;
+      fields[n_captured] = LLVMTypeOf(var);
+      n_captured++;
+    }
+  }
+  for (size_t i = 0; i < n_reductions; i++) {
+    fields[n_captured + i] = LLVMPointerType(i32, 0);
+  }
+  LLVMTypeRef env_type = LLVMStructTypeInContext(context, fields, n_captured + n_reductions, 0);
+
+  // the body
+  LLVMTypeRef param_types[] = { bytes_type, i32, i32 };
+  LLVMValueRef fn = LLVMAddFunction(module, "parfor", LLVMFunctionType(LLVMVoidTypeInContext(context), param_types, 3, 0));
+  LLVMSetLinkage(fn, LLVMInternalLinkage);
+  set_host_cpu(fn);
+  LLVMBuilderRef body_builder = LLVMCreateBuilderInContext(context);
+  LLVMPositionBuilderAtEnd(body_builder, LLVMAppendBasicBlockInContext(context, fn, "entry"));
+  LLVMValueRef env = LLVMBuildBitCast(body_builder, LLVMGetParam(fn, 0), LLVMPointerType(env_type, 0), "env");
+
+  for (unsigned i = 0; i < n_captured; i++) {
+    const char *name = string_int_rev(&compilation->ids, ids[i]);
+    LLVMValueRef ptr = LLVMBuildLoad(body_builder, LLVMBuildStructGEP(body_builder, env, i, ""), name);
+    LLVMTypeRef type = LLVMGetElementType(fields[i]);
+    if (LLVMGetTypeKind(type) == LLVMArrayTypeKind) {
+      vector_set(&compilation->types, ids[i], ptr);
+    } else {
+      LLVMValueRef copy = LLVMBuildAlloca(body_builder, type, name);
+      LLVMBuildStore(body_builder, LLVMBuildLoad(body_builder, ptr, ""), copy);
+      vector_set(&compilation->types, ids[i], copy);
+    }
+  }
+  LLVMValueRef outer_var = vector_get(&compilation->types, stmt->for_.var);
+  LLVMValueRef var = LLVMBuildAlloca(body_builder, i32, string_int_rev(&compilation->ids, stmt->for_.var));
+  LLVMBuildStore(body_builder, LLVMGetParam(fn, 1), var);
+  vector_set(&compilation->types, stmt->for_.var, var);
+  LLVMValueRef outer_end = vector_get(&compilation->types, stmt->for_.end);
+  LLVMValueRef end = LLVMBuildAlloca(body_builder, i32, "end");
+  LLVMBuildStore(body_builder, LLVMGetParam(fn, 2), end);
+  vector_set(&compilation->types, stmt->for_.end, end);
+  for (size_t i = 0; i < n_reductions; i++) {
+    outer[i] = vector_get(&compilation->types, reductions[i].id);
+    LLVMTypeRef type = LLVMGetElementType(LLVMTypeOf(outer[i]));
+    LLVMValueRef partial = LLVMBuildAlloca(body_builder, type, string_int_rev(&compilation->ids, reductions[i].id));
+    LLVMBuildStore(body_builder, reduction_identity(type, reductions[i].op), partial);
+    vector_set(&compilation->types, reductions[i].id, partial);
+  }
+
+  // while (var < end) { body; var = var + 1; }, typed here since end is only declared now
+  struct expr *cond = binop(variable(stmt->for_.var), '<', variable(stmt->for_.end));
+  struct expr *next = binop(variable(stmt->for_.var), '+', literal(1));
+  cond->value_type = BOOLEAN;
+  cond->binop.lhs->value_type = cond->binop.rhs->value_type = INTEGER;
+  next->value_type = next->binop.lhs->value_type = next->binop.rhs->value_type = INTEGER;
+  struct stmt *block = arena_alloc(&compilation->arena, sizeof(struct stmt));
+  block->type = STMT_SEQ;
+  block->seq.stmts = NULL;
+  block->seq.len = 0;
+  block->seq.capacity = 0;
+  block = make_seq(make_seq(block, stmt->for_.body), make_assign(stmt->for_.var, next));
+  codegen_stmt(make_while(cond, block, stmt->for_.loc), module, body_builder);
+
+  for (size_t i = 0; i < n_reductions; i++) {
+    LLVMValueRef partial = LLVMBuildLoad(body_builder, vector_get(&compilation->types, reductions[i].id), "");
+    LLVMValueRef acc = LLVMBuildLoad(body_builder, LLVMBuildStructGEP(body_builder, env, n_captured + i, ""), "acc");
+    codegen_atomic_reduce(reductions[i].op, acc, LLVMBuildZExt(body_builder, partial, i32, ""), body_builder);
+    vector_set(&compilation->types, reductions[i].id, outer[i]);
+  }
+  LLVMBuildRetVoid(body_builder);
+  LLVMDisposeBuilder(body_builder);
+  vector_set(&compilation->types, stmt->for_.end, outer_end);
+  vector_set(&compilation->types, stmt->for_.var, outer_var);
+  for (unsigned i = 0; i < n_captured; i++) {
+    vector_set(&compilation->types, ids[i], storage[i]);
+  }
+
+  // the call
+  LLVMValueRef frame = build_entry_alloca(builder, env_type, "env");
+  for (unsigned i = 0; i < n_captured; i++) {
+    LLVMBuildStore(builder, storage[i], LLVMBuildStructGEP(builder, frame, i, ""));
+  }
+  for (size_t i = 0; i < n_reductions; i++) {
+    LLVMValueRef acc = build_entry_alloca(builder, i32, "acc");
+    LLVMBuildStore(builder, reduction_identity(i32, reductions[i].op), acc);
+    LLVMBuildStore(builder, acc, LLVMBuildStructGEP(builder, frame, n_captured + i, ""));
+    accs[i] = acc;
+  }
+  LLVMValueRef args[] = {
+    LLVMBuildBitCast(builder, fn, bytes_type, ""),
+    LLVMBuildBitCast(builder, frame, bytes_type, ""),
+    codegen_expr(stmt->for_.from, module, builder),
+    codegen_expr(stmt->for_.to, module, builder),
+  };
+  LLVMBuildCall(builder, LLVMGetNamedFunction(module, "parallel_for"), args, 4, "");
+
+  for (size_t i = 0; i < n_reductions; i++) {
+    LLVMValueRef var = vector_get(&compilation->types, reductions[i].id);
+    LLVMTypeRef type = LLVMGetElementType(LLVMTypeOf(var));
+    LLVMValueRef acc = LLVMBuildTrunc(builder, LLVMBuildLoad(builder, accs[i], "acctmp"), type, "");
+    LLVMValueRef value = LLVMBuildBinOp(builder, reduction_opcode(reductions[i].op),
+                                        LLVMBuildLoad(builder, var, "loadtmp"), acc, "reducetmp");
+    LLVMBuildStore(builder, value, var);
+  }
+
+  free(used);
+  free(ids);
+  free(storage);
+  free(fields);
+  free(outer);
+  free(accs);
+}
+
+/**
+ * @brief
+ * @param stmt is an assignment.
+ * @return int is non-zero if it is the step of a loop generated without checks.
+ */
+static int is_unchecked_step(struct stmt *stmt) {
+  for (struct counted_loop *loop = unchecked_loops; loop; loop = loop->outer) {
+    if (loop->step == stmt) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief 
+ * It takes a statement to generate code for it.
  * @param stmt is a statement.
  * @param module is a LLVMModuleRef.
  * @param builder is a LLVMBuilderRef.
  */
 void codegen_stmt(struct stmt *stmt, LLVMModuleRef module, LLVMBuilderRef builder) {
+  LLVMContextRef context = LLVMGetModuleContext(module);
+
   switch (stmt->type) {
     case STMT_SEQ: {
-      codegen_stmt(stmt->seq.fst, module, builder);
-      codegen_stmt(stmt->seq.snd, module, builder);
+      for (size_t i = 0; i < stmt->seq.len; i++) {
+        // a run of statements long enough to be worth a part of its own
+        size_t run = 0;
+        while (can_outline() && i + run < stmt->seq.len && run < OUTLINE_MAX_STMTS &&
+               stmt->seq.stmts[i + run]->type != STMT_WHILE && stmt->seq.stmts[i + run]->type != STMT_FOR) {
+          run++;
+        }
+        if (run >= OUTLINE_MIN_STMTS) {
+          outline_stmts(stmt->seq.stmts + i, run, module, builder);
+          i += run - 1;
+        } else {
+          codegen_stmt(stmt->seq.stmts[i], module, builder);
+        }
+      }
       break;
     }
 
     case STMT_ASSIGN: {
-      LLVMValueRef expr = codegen_expr(stmt->assign.expr, module, builder);
-      LLVMBuildStore(builder, expr, vector_get(&global_types, stmt->assign.id));
+      LLVMValueRef var = vector_get(&compilation->types, stmt->assign.id);
+      LLVMValueRef expr;
+      if (is_unchecked_step(stmt)) {
+        // i < n before the step of a checked loop, so i + 1 does not overflow
+        expr = LLVMBuildNSWAdd(builder, LLVMBuildLoad(builder, var, "loadtmp"),
+                               LLVMConstInt(LLVMInt32TypeInContext(context), 1, 0), "addtmp");
+      } else {
+        expr = codegen_expr(stmt->assign.expr, module, builder);
+      }
+      LLVMBuildStore(builder, expr, var);
+      break;
+    }
+
+    case STMT_STORE: {
+      LLVMValueRef ptr = codegen_element_ptr(stmt->store.id, stmt->store.index, module, builder);
+      LLVMValueRef expr = codegen_expr(stmt->store.expr, module, builder);
+      if (stmt->store.expr->value_type == BOOLEAN) {
+        expr = LLVMBuildZExt(builder, expr, LLVMInt8TypeInContext(context), "bytetmp");
+      }
+      LLVMBuildStore(builder, expr, ptr);
+      break;
+    }
+
+    case STMT_ALLOC: {
+      LLVMValueRef slot = vector_get(&compilation->types, stmt->alloc.id);
+      LLVMValueRef data_ptr = LLVMBuildStructGEP(builder, slot, 0, "");
+      LLVMTypeRef data_type = LLVMGetElementType(LLVMTypeOf(data_ptr));
+      LLVMTypeRef bytes_type = LLVMPointerType(LLVMInt8TypeInContext(context), 0);
+      LLVMValueRef len = codegen_expr(stmt->alloc.len, module, builder);
+      LLVMValueRef args[] = {
+        LLVMBuildBitCast(builder, LLVMBuildLoad(builder, data_ptr, "datatmp"), bytes_type, ""),
+        len,
+        LLVMConstInt(LLVMInt32TypeInContext(context), stmt->alloc.type == BOOLEAN ? 1 : 4, 0),
+      };
+      LLVMValueRef data = LLVMBuildCall(builder, LLVMGetNamedFunction(module, "array_new"), args, 3, "newtmp");
+      LLVMBuildStore(builder, LLVMBuildBitCast(builder, data, data_type, ""), data_ptr);
+      LLVMBuildStore(builder, len, LLVMBuildStructGEP(builder, slot, 1, ""));
+      break;
+    }
+
+    case STMT_CALL:
+      codegen_expr(stmt->call.call, module, builder);
+      break;
+
+    case STMT_RETURN: {
+      LLVMValueRef func = LLVMGetBasicBlockParent(LLVMGetInsertBlock(builder));
+      LLVMValueRef value = codegen_expr(stmt->return_.expr, module, builder);
+      // the frame of a call whose result is returned as it is can be reused, see set_call_policy
+      if (stmt->return_.expr->type == CALL) {
+        LLVMSetTailCall(value, 1);
+      }
+      LLVMBuildRet(builder, value);
+      // the statements after it never run, they go to a block of their own
+      LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(context, func, "afterreturn"));
       break;
     }
 
     case STMT_PRINT: {
-      enum value_type arg_type = check_types(stmt->print.expr);
+      enum value_type arg_type = stmt->print.expr->value_type;
       LLVMValueRef print_fn = LLVMGetNamedFunction(module, arg_type == BOOLEAN ? "print_i1" : "print_i32");
       LLVMValueRef args[] = { codegen_expr(stmt->print.expr, module, builder) };
       LLVMBuildCall(builder, print_fn, args, 1, "");  // It calles function by LLVMValueref with parameter
@@ -856,39 +3330,66 @@ void codegen_stmt(struct stmt *stmt, LLVMModuleRef module, LLVMBuilderRef builde
     }
 
     case STMT_WHILE: {
+      struct counted_loop loop;
+      if (can_outline()) {
+        outline_stmts(&stmt, 1, module, builder);
+        break;
+      }
+      if (in_checked_copy || !analyze_counted_loop(stmt, &loop)) {
+        codegen_while(stmt, module, builder);
+        break;
+      }
+
+      // Loop versioning: a copy without the checks of the accesses covered by the guard, which
+      // the vectorizer can handle, and the checked copy, which stops at the first bad access.
       LLVMValueRef func = LLVMGetBasicBlockParent(LLVMGetInsertBlock(builder));
-      LLVMBasicBlockRef cond_bb = LLVMAppendBasicBlock(func, "cond");
-      LLVMBasicBlockRef body_bb = LLVMAppendBasicBlock(func, "body");
-      LLVMBasicBlockRef cont_bb = LLVMAppendBasicBlock(func, "cont");
+      LLVMBasicBlockRef unchecked_bb = LLVMAppendBasicBlockInContext(context, func, "unchecked");
+      LLVMBasicBlockRef checked_bb = LLVMAppendBasicBlockInContext(context, func, "checked");
+      LLVMBasicBlockRef cont_bb = LLVMAppendBasicBlockInContext(context, func, "endloop");
 
-      LLVMBuildBr(builder, cond_bb);
+      LLVMBuildCondBr(builder, codegen_loop_guard(&loop, module, builder), unchecked_bb, checked_bb);
 
-      LLVMPositionBuilderAtEnd(builder, cond_bb);
-      LLVMValueRef cond = codegen_expr(stmt->while_.cond, module, builder);
-      LLVMBuildCondBr(builder, cond, body_bb, cont_bb);
+      LLVMPositionBuilderAtEnd(builder, unchecked_bb);
+      loop.outer = unchecked_loops;
+      unchecked_loops = &loop;
+      codegen_while(stmt, module, builder);
+      unchecked_loops = loop.outer;
+      LLVMBuildBr(builder, cont_bb);
 
-      LLVMPositionBuilderAtEnd(builder, body_bb);
-      codegen_stmt(stmt->while_.body, module, builder);
-      LLVMBuildBr(builder, cond_bb);
+      LLVMPositionBuilderAtEnd(builder, checked_bb);
+      in_checked_copy = 1;
+      codegen_while(stmt, module, builder);
+      in_checked_copy = 0;
+      LLVMBuildBr(builder, cont_bb);
 
       LLVMPositionBuilderAtEnd(builder, cont_bb);
+      free(loop.accesses);
       break;
     }
 
+    case STMT_FOR:
+      if (can_outline()) {
+        outline_stmts(&stmt, 1, module, builder);
+      } else {
+        codegen_for(stmt, module, builder);
+      }
+      break;
+
     case STMT_IF: {
       LLVMValueRef func = LLVMGetBasicBlockParent(LLVMGetInsertBlock(builder));
-      LLVMBasicBlockRef body_bb = LLVMAppendBasicBlock(func, "body");
-      LLVMBasicBlockRef else_bb = LLVMAppendBasicBlock(func, "else");
-      LLVMBasicBlockRef cont_bb = LLVMAppendBasicBlock(func, "cont");
+      LLVMBasicBlockRef body_bb = LLVMAppendBasicBlockInContext(context, func, "body");
+      LLVMBasicBlockRef else_bb = LLVMAppendBasicBlockInContext(context, func, "else");
+      LLVMBasicBlockRef cont_bb = LLVMAppendBasicBlockInContext(context, func, "cont");
 
-      LLVMValueRef cond = codegen_expr(stmt->ifelse.cond, module, builder);
-      LLVMBuildCondBr(builder, cond, body_bb, else_bb);
+      codegen_branch(stmt->ifelse.cond, body_bb, else_bb, branch_counts(stmt->ifelse.loc), module, builder);
 
       LLVMPositionBuilderAtEnd(builder, body_bb);
+      count_edge(stmt->ifelse.loc, 0, module, builder);
       codegen_stmt(stmt->ifelse.if_body, module, builder);
       LLVMBuildBr(builder, cont_bb);
 
       LLVMPositionBuilderAtEnd(builder, else_bb);
+      count_edge(stmt->ifelse.loc, 1, module, builder);
       if (stmt->ifelse.else_body) {
         codegen_stmt(stmt->ifelse.else_body, module, builder);
       }
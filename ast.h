@@ -9,6 +9,7 @@
  * 
  */
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <llvm-c/Core.h>
 
@@ -16,7 +17,7 @@
 
 const char *type_name(enum value_type t);
 
-#define CONST(n) LLVMConstInt(LLVMInt32Type(), (n), 0)
+#define CONST(context, n) LLVMConstInt(LLVMInt32TypeInContext(context), (n), 0)
 /**
  * @brief 
  * This is used for description of expression type.
@@ -31,6 +32,8 @@ enum expr_type {
   POST_INCREMENT_OP,
   PRE_DECREMENT_OP,
   POST_DECREMENT_OP,
+  ELEMENT,
+  CALL,
 };
 
 /**
@@ -40,6 +43,7 @@ enum expr_type {
 struct expr {
 
   enum expr_type type;
+  enum value_type value_type; // filled in by check_types
 
   union {
     int value; // for type == LITERAL || type == BOOL_LIT
@@ -54,6 +58,16 @@ struct expr {
       struct expr *mhs; // midle expression  
       struct expr *rhs; // right hand-sie;
     } ternary; // for type = TERNARY_OP
+    struct {
+      size_t id;          // the array
+      struct expr *index;
+    } element; // for type == ELEMENT
+    struct {
+      size_t id;          // the function
+      struct expr **args;
+      size_t n_args;
+      size_t capacity;
+    } call; // for type == CALL
     struct expr *expr;
   };
   
@@ -69,14 +83,22 @@ struct expr* pre_increment(struct expr *e);
 struct expr* post_increment(struct expr *e);
 struct expr* pre_decrement(struct expr *e);
 struct expr* post_decrement(struct expr *e);
+struct expr* element(size_t id, struct expr *index);
+struct expr* call(size_t id, struct expr *args);
+struct expr* add_arg(struct expr *args, struct expr *arg);
 
 void print_expr(struct expr *expr);
 void emit_stack_machine(struct expr *expr);
 int emit_reg_machine(struct expr *expr);
 
 enum value_type check_types(struct expr *expr);
+struct expr *simplify_expr(struct expr *expr);
+
+// the most operations evaluated to avoid a branch, see should_speculate
+#define SPECULATION_MAX_COST 4
 
-void free_expr(struct expr *expr);
+int should_speculate(struct expr *expr);
+int is_short_circuit(struct expr *expr);
 
 /**
  * @brief 
@@ -88,6 +110,21 @@ enum stmt_type {
   STMT_IF,
   STMT_WHILE,
   STMT_PRINT,
+  STMT_STORE,
+  STMT_ALLOC,
+  STMT_CALL,
+  STMT_RETURN,
+  STMT_FOR,
+};
+
+/**
+ * @brief
+ * Reduction variable of a parallel loop. Each chunk of the range combines its values from the
+ * identity of the operator, and the results of the chunks are combined into the variable.
+ */
+struct reduction {
+  size_t id;
+  int op;     // '+' or '*' of integers, AND, OR or XOR of integers or booleans
 };
 
 /**
@@ -104,19 +141,50 @@ struct stmt {
       struct expr *expr;
     } assign; // for type == STMT_ASSIGN
     struct {
-      struct stmt *fst, *snd;
-    } seq; // for type == STMT_SEQ
+      struct stmt **stmts;
+      size_t len;
+      size_t capacity;
+    } seq; // for type == STMT_SEQ, the statements of a block
     struct {
       struct expr *cond;
       struct stmt *if_body, *else_body;
+      struct location loc;  // of the keyword, the key of the statement in a profile
     } ifelse; // for type == STMT_IF
     struct {
       struct expr *cond;
       struct stmt *body;
+      struct location loc;
     } while_; // for type == STMT_WHILE
     struct {
       struct expr *expr;
     } print; // for type == STMT_PRINT
+    struct {
+      size_t id;
+      struct expr *index;
+      struct expr *expr;
+    } store; // for type == STMT_STORE, an assignment to an element
+    struct {
+      size_t id;
+      enum value_type type; // of the elements
+      struct expr *len;
+    } alloc; // for type == STMT_ALLOC, a new heap array
+    struct {
+      struct expr *call;
+    } call; // for type == STMT_CALL, a call whose result is not used
+    struct {
+      struct expr *expr;
+    } return_; // for type == STMT_RETURN
+    struct {
+      size_t var;         // the loop variable, private to the iterations, unchanged after the loop
+      size_t end;         // hidden variable of the end of a chunk, see codegen_for
+      struct expr *from;
+      struct expr *to;    // excluded
+      struct stmt *body;
+      struct reduction *reductions;
+      size_t n_reductions;
+      size_t capacity;
+      struct location loc;
+    } for_; // for type == STMT_FOR, a parallel loop
     struct{
       struct expr *left;
       struct expr *right;
@@ -127,15 +195,85 @@ struct stmt {
 
 struct stmt* make_seq(struct stmt *fst, struct stmt *snd);
 struct stmt* make_assign(size_t id, struct expr *e);
-struct stmt* make_while(struct expr *e, struct stmt *body);
-struct stmt* make_ifelse(struct expr *e, struct stmt *if_body, struct stmt *else_body);
-struct stmt* make_if(struct expr *e, struct stmt *body);
+struct stmt* make_while(struct expr *e, struct stmt *body, struct location loc);
+struct stmt* make_ifelse(struct expr *e, struct stmt *if_body, struct stmt *else_body, struct location loc);
+struct stmt* make_if(struct expr *e, struct stmt *body, struct location loc);
 struct stmt* make_print(struct expr *e);
+struct stmt* make_store(size_t id, struct expr *index, struct expr *e);
+struct stmt* make_alloc(size_t id, enum value_type type, struct expr *len);
+struct stmt* make_call(struct expr *call);
+struct stmt* make_return(struct expr *e);
+struct stmt* add_reduction(struct stmt *loop, int op, size_t id);
+struct stmt* make_for(struct stmt *loop, size_t var, struct expr *from, struct expr *to, struct stmt *body, struct location loc);
 
 
-void free_stmt(struct stmt *stmt);
+void declare_globals(int enable);
+LLVMValueRef declare_scalar(LLVMModuleRef module, LLVMBuilderRef builder, enum value_type type, const char *name);
+LLVMValueRef declare_array(LLVMModuleRef module, LLVMBuilderRef builder, enum value_type type, int32_t len, const char *name);
+int is_array(size_t id);
+int uses_arrays(void);
+int uses_parallel_loops(void);
+
+/**
+ * @brief
+ * Declaration of the program hidden by a parameter or a local of a function.
+ */
+struct binding {
+  size_t id;
+  LLVMValueRef storage;
+};
+
+/**
+ * @brief
+ * A function of the program. The parameters are collected first, begin_function then creates
+ * the LLVM function and their storage, the locals are declared in it like the variables of main,
+ * and end_function generates the body.
+ */
+struct function {
+  enum value_type *param_types;
+  size_t *params;                 // ids of the parameters
+  size_t n_params;
+  size_t capacity;
+  enum value_type type;           // of the result
+  LLVMValueRef fn;
+  LLVMBasicBlockRef caller;       // where the builder was before the function
+  struct binding *hidden;
+  size_t n_hidden;
+  size_t hidden_capacity;
+};
+
+struct function *add_param(struct function *f, enum value_type type, size_t id);
+struct function *begin_function(struct function *f, enum value_type type, size_t id, LLVMModuleRef module, LLVMBuilderRef builder);
+int end_function(struct function *f, struct stmt *body, LLVMModuleRef module, LLVMBuilderRef builder);
+void abandon_function(LLVMBuilderRef builder);
+void import_globals(LLVMModuleRef module, int declare);
+int in_function(void);
+int can_declare(size_t id);
+void declare_variable(size_t id, LLVMValueRef storage);
+int uses_functions(void);
+
 void print_stmt(struct stmt *stmt, int indent);
 int valid_stmt(struct stmt *stmt);
+struct stmt *simplify_stmt(struct stmt *stmt);
+
+struct profile;
+void codegen_profile(struct profile *counters, struct profile *weights);
+
+// the runs of fewer statements of main stay in main, the longer ones are cut in parts of at
+// most OUTLINE_MAX_STMTS, which are compiled concurrently (see codegen_outline)
+#define OUTLINE_MIN_STMTS 32
+#define OUTLINE_MAX_STMTS 256
+
+/**
+ * @brief
+ * Modules of the parts of main outlined by codegen_outline, each defines a function part.<n>.
+ */
+struct outline {
+  LLVMModuleRef *modules;
+  size_t n_modules;
+  size_t capacity;
+};
 
+void codegen_outline(struct outline *parts);
 LLVMValueRef codegen_expr(struct expr *expr, LLVMModuleRef module, LLVMBuilderRef builder);
 void codegen_stmt(struct stmt *stmt, LLVMModuleRef module, LLVMBuilderRef builder);
@@ -0,0 +1,478 @@
+/**
+ * @file backend.c
+ * @brief
+ * Target machine, optimization pipeline and JIT setup for the generated module.
+ * Everything is tuned for the CPU the compiler runs on.
+ */
+
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/Error.h>
+#include <llvm-c/ExecutionEngine.h>
+#include <llvm-c/Linker.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/Orc.h>
+#include <llvm-c/TargetMachine.h>
+#include <llvm-c/Transforms/PassBuilder.h>
+#include "backend.h"
+#include "runtime.h"
+
+// directory of runtime.c, set by the Makefile
+#ifndef RUNTIME_DIR
+#define RUNTIME_DIR "."
+#endif
+
+extern char **environ;
+
+/**
+ * @brief
+ * It maps an optimization level (0-3) to the code generation level of LLVM.
+ * @param opt_level is an optimization level.
+ * @return LLVMCodeGenOptLevel
+ */
+static LLVMCodeGenOptLevel codegen_level(int opt_level) {
+  switch (opt_level) {
+    case 0: return LLVMCodeGenLevelNone;
+    case 1: return LLVMCodeGenLevelLess;
+    case 2: return LLVMCodeGenLevelDefault;
+    default: return LLVMCodeGenLevelAggressive;
+  }
+}
+
+/**
+ * @brief
+ * It creates a target machine for the host, with the name and the features of the host CPU.
+ * @param opt_level is an optimization level.
+ * @param jit is non-zero if the code is run in process, zero for object files (position independent).
+ * @return LLVMTargetMachineRef is NULL if the host is not supported.
+ */
+LLVMTargetMachineRef create_host_machine(int opt_level, int jit) {
+  char *triple = LLVMGetDefaultTargetTriple();
+  char *cpu = LLVMGetHostCPUName();
+  char *features = LLVMGetHostCPUFeatures();
+  char *error = NULL;
+  LLVMTargetRef target;
+  LLVMTargetMachineRef machine = NULL;
+
+  if (LLVMGetTargetFromTriple(triple, &target, &error)) {
+    fprintf(stderr, "%s\n", error);
+    LLVMDisposeMessage(error);
+  } else {
+    machine = LLVMCreateTargetMachine(target, triple, cpu, features, codegen_level(opt_level),
+                                      jit ? LLVMRelocDefault : LLVMRelocPIC,
+                                      jit ? LLVMCodeModelJITDefault : LLVMCodeModelDefault);
+  }
+
+  LLVMDisposeMessage(triple);
+  LLVMDisposeMessage(cpu);
+  LLVMDisposeMessage(features);
+  return machine;
+}
+
+/**
+ * @brief
+ * It sets the triple and the data layout of the module to the ones of the target machine,
+ * so the optimizer knows the real cost of types and instructions.
+ * @param module is a LLVMModuleRef.
+ * @param machine is a target machine.
+ */
+void setup_module_for_host(LLVMModuleRef module, LLVMTargetMachineRef machine) {
+  char *triple = LLVMGetTargetMachineTriple(machine);
+  LLVMTargetDataRef layout = LLVMCreateTargetDataLayout(machine);
+
+  LLVMSetTarget(module, triple);
+  LLVMSetModuleDataLayout(module, layout);
+
+  LLVMDisposeTargetData(layout);
+  LLVMDisposeMessage(triple);
+}
+
+/**
+ * @brief
+ * It marks a function to be compiled for the host CPU. MCJIT always uses a generic CPU,
+ * but the per-function attributes override it.
+ * @param function is a function.
+ */
+void set_host_cpu(LLVMValueRef function) {
+  LLVMContextRef context = LLVMGetTypeContext(LLVMTypeOf(function));
+  char *cpu = LLVMGetHostCPUName();
+  char *features = LLVMGetHostCPUFeatures();
+
+  LLVMAttributeRef cpu_attr = LLVMCreateStringAttribute(context, "target-cpu", 10, cpu, strlen(cpu));
+  LLVMAttributeRef features_attr = LLVMCreateStringAttribute(context, "target-features", 15, features, strlen(features));
+  LLVMAddAttributeAtIndex(function, LLVMAttributeFunctionIndex, cpu_attr);
+  LLVMAddAttributeAtIndex(function, LLVMAttributeFunctionIndex, features_attr);
+
+  LLVMDisposeMessage(cpu);
+  LLVMDisposeMessage(features);
+}
+
+/**
+ * @brief
+ * It declares the entry points of the runtime that the generated code calls.
+ * @param module is a LLVMModuleRef.
+ */
+void declare_runtime(LLVMModuleRef module) {
+  LLVMContextRef context = LLVMGetModuleContext(module);
+  LLVMTypeRef void_type = LLVMVoidTypeInContext(context);
+
+  // print_i32
+  LLVMTypeRef print_i32_args[] = { LLVMInt32TypeInContext(context) };
+  LLVMAddFunction(module, "print_i32",
+  LLVMFunctionType(void_type, print_i32_args, 1, 0));
+
+  // print_i1, the runtime takes a C bool
+  LLVMTypeRef print_i1_args[] = { LLVMInt1TypeInContext(context) };
+  LLVMValueRef print_i1 = LLVMAddFunction(module, "print_i1",
+  LLVMFunctionType(void_type, print_i1_args, 1, 0));
+  LLVMAddAttributeAtIndex(print_i1, 1, LLVMCreateEnumAttribute(context,
+                          LLVMGetEnumAttributeKindForName("zeroext", 7), 0));
+
+  // runtime_flush
+  LLVMAddFunction(module, "runtime_flush",
+  LLVMFunctionType(void_type, NULL, 0, 0));
+
+  // array_new, whose result is aligned and aliases nothing else
+  LLVMTypeRef bytes_type = LLVMPointerType(LLVMInt8TypeInContext(context), 0);
+  LLVMTypeRef array_new_args[] = { bytes_type, LLVMInt32TypeInContext(context), LLVMInt32TypeInContext(context) };
+  LLVMValueRef array_new = LLVMAddFunction(module, "array_new",
+  LLVMFunctionType(bytes_type, array_new_args, 3, 0));
+  LLVMAddAttributeAtIndex(array_new, LLVMAttributeReturnIndex, LLVMCreateEnumAttribute(context,
+                          LLVMGetEnumAttributeKindForName("noalias", 7), 0));
+  LLVMAddAttributeAtIndex(array_new, LLVMAttributeReturnIndex, LLVMCreateEnumAttribute(context,
+                          LLVMGetEnumAttributeKindForName("align", 5), ARRAY_ALIGNMENT));
+
+  // array_bounds_error, which does not return, so the checks are predicted not to fail
+  LLVMTypeRef array_bounds_error_args[] = { LLVMInt32TypeInContext(context), LLVMInt32TypeInContext(context) };
+  LLVMValueRef array_bounds_error = LLVMAddFunction(module, "array_bounds_error",
+  LLVMFunctionType(void_type, array_bounds_error_args, 2, 0));
+  LLVMAddAttributeAtIndex(array_bounds_error, LLVMAttributeFunctionIndex, LLVMCreateEnumAttribute(context,
+                          LLVMGetEnumAttributeKindForName("noreturn", 8), 0));
+  LLVMAddAttributeAtIndex(array_bounds_error, LLVMAttributeFunctionIndex, LLVMCreateEnumAttribute(context,
+                          LLVMGetEnumAttributeKindForName("cold", 4), 0));
+
+  // profile_write
+  LLVMTypeRef profile_write_args[] = { bytes_type, bytes_type, LLVMPointerType(LLVMInt64TypeInContext(context), 0),
+                                       LLVMInt32TypeInContext(context) };
+  LLVMAddFunction(module, "profile_write",
+  LLVMFunctionType(void_type, profile_write_args, 4, 0));
+
+  // parallel_for, whose body is passed as bytes like its environment
+  LLVMTypeRef parallel_for_args[] = { bytes_type, bytes_type, LLVMInt32TypeInContext(context), LLVMInt32TypeInContext(context) };
+  LLVMAddFunction(module, "parallel_for",
+  LLVMFunctionType(void_type, parallel_for_args, 4, 0));
+}
+
+/**
+ * @brief
+ * It adds the main function of the program, which returns an exit status when linked into
+ * an executable, and positions the builder in its entry block.
+ * @param module is a LLVMModuleRef.
+ * @param builder is a LLVMBuilderRef.
+ * @return LLVMValueRef is the function.
+ */
+LLVMValueRef add_main(LLVMModuleRef module, LLVMBuilderRef builder) {
+  LLVMContextRef context = LLVMGetModuleContext(module);
+  LLVMTypeRef main_type = LLVMFunctionType(LLVMInt32TypeInContext(context), NULL, 0, 0);
+  LLVMValueRef main = LLVMAddFunction(module, "main", main_type);
+
+  set_host_cpu(main);
+  LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(context, main, "entry"));
+  return main;
+}
+
+/**
+ * @brief
+ * It ends the main function: the buffered output of the program is written out before returning.
+ * @param module is a LLVMModuleRef.
+ * @param builder is a LLVMBuilderRef positioned at the end of main.
+ */
+void finish_main(LLVMModuleRef module, LLVMBuilderRef builder) {
+  LLVMContextRef context = LLVMGetModuleContext(module);
+
+  LLVMBuildCall(builder, LLVMGetNamedFunction(module, "runtime_flush"), NULL, 0, "");
+  LLVMBuildRet(builder, LLVMConstInt(LLVMInt32TypeInContext(context), 0, 0));
+}
+
+/**
+ * @brief
+ * It links the runtime bitcode into the module. The runtime entry points become internal,
+ * so the optimizer can inline them into main (and drop them) like any other function of the program.
+ * @param module is a LLVMModuleRef.
+ * @param runtime is the runtime module, destroyed by the linking.
+ * @return int is zero on success.
+ */
+int link_runtime(LLVMModuleRef module, LLVMModuleRef runtime) {
+  static const char *entry_points[] = { "print_i32", "print_i1", "runtime_flush" };
+
+  if (LLVMLinkModules2(module, runtime)) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < sizeof(entry_points) / sizeof(entry_points[0]); i++) {
+    LLVMValueRef fn = LLVMGetNamedFunction(module, entry_points[i]);
+    if (fn && !LLVMIsDeclaration(fn)) {
+      LLVMSetLinkage(fn, LLVMInternalLinkage);
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief
+ * It decides which functions of the program are inlined and which calls reuse the frame of their
+ * caller, by optimization level, so that inlining pays for itself in run time without growing
+ * the module, and the compile time, of large programs. The functions of the program are those
+ * with the fast calling convention (see begin_function in ast.c).
+ *   -O0       nothing is inlined and no call is a tail call, the code stays as written.
+ *   -O1       the functions of at most INLINE_SMALL_INSTRUCTIONS and those called once are always
+ *             inlined, the others never, so the inliner has no decision to make.
+ *   -O2, -O3  the inliner of LLVM decides, but the functions of more than INLINE_MAX_INSTRUCTIONS
+ *             called from several places are never copied.
+ * From -O1, a call in a return (see STMT_RETURN) stays a tail call, which the code generator turns
+ * into a jump, and -O2 turns a function calling itself that way into a loop.
+ * @param module is a LLVMModuleRef.
+ * @param opt_level is an optimization level.
+ */
+static void set_call_policy(LLVMModuleRef module, int opt_level) {
+  LLVMContextRef context = LLVMGetModuleContext(module);
+  unsigned always_inline = LLVMGetEnumAttributeKindForName("alwaysinline", 12);
+  unsigned no_inline = LLVMGetEnumAttributeKindForName("noinline", 8);
+
+  for (LLVMValueRef fn = LLVMGetFirstFunction(module); fn; fn = LLVMGetNextFunction(fn)) {
+    if (LLVMIsDeclaration(fn) || LLVMGetFunctionCallConv(fn) != LLVMFastCallConv) {
+      continue;
+    }
+
+    unsigned size = 0, calls = 0;
+    int recursive = 0;
+    for (LLVMBasicBlockRef bb = LLVMGetFirstBasicBlock(fn); bb; bb = LLVMGetNextBasicBlock(bb)) {
+      for (LLVMValueRef inst = LLVMGetFirstInstruction(bb); inst; inst = LLVMGetNextInstruction(inst)) {
+        size++;
+        if (LLVMIsACallInst(inst)) {
+          recursive |= LLVMGetCalledValue(inst) == fn;
+          if (opt_level == 0) {
+            LLVMSetTailCall(inst, 0);
+          }
+        }
+      }
+    }
+    for (LLVMUseRef use = LLVMGetFirstUse(fn); use; use = LLVMGetNextUse(use)) {
+      calls++;
+    }
+
+    unsigned kind = 0;
+    if (opt_level == 0) {
+      kind = no_inline;
+    } else if (opt_level == 1) {
+      kind = !recursive && (size <= INLINE_SMALL_INSTRUCTIONS || calls == 1) ? always_inline : no_inline;
+    } else if (size > INLINE_MAX_INSTRUCTIONS && calls > 1) {
+      kind = no_inline;
+    }
+    if (kind) {
+      LLVMAddAttributeAtIndex(fn, LLVMAttributeFunctionIndex, LLVMCreateEnumAttribute(context, kind, 0));
+    }
+  }
+}
+
+/**
+ * @brief
+ * It runs the module pipeline of the given level: -O0 only promotes the variables and the parameters
+ * to registers, -O1 to -O3 run the default pipelines of LLVM (inliner, instcombine, GVN, LICM,
+ * unrolling, vectorizers...), with the inlining decisions of set_call_policy.
+ * @param module is a LLVMModuleRef.
+ * @param machine is the target machine, used for the cost model of the vectorizers.
+ * @param opt_level is an optimization level.
+ * @return int is zero on success.
+ */
+int optimize_module(LLVMModuleRef module, LLVMTargetMachineRef machine, int opt_level) {
+  static const char *pipelines[] = { "function(mem2reg)", "default<O1>", "default<O2>", "default<O3>" };
+  LLVMPassBuilderOptionsRef options = LLVMCreatePassBuilderOptions();
+
+  set_call_policy(module, opt_level);
+
+  LLVMPassBuilderOptionsSetLoopUnrolling(options, opt_level >= 2);
+  LLVMPassBuilderOptionsSetLoopInterleaving(options, opt_level >= 2);
+  LLVMPassBuilderOptionsSetLoopVectorization(options, opt_level >= 2);
+  LLVMPassBuilderOptionsSetSLPVectorization(options, opt_level >= 2);
+
+  LLVMErrorRef error = LLVMRunPasses(module, pipelines[opt_level], machine, options);
+  LLVMDisposePassBuilderOptions(options);
+
+  if (error) {
+    char *message = LLVMGetErrorMessage(error);
+    fprintf(stderr, "%s\n", message);
+    LLVMDisposeErrorMessage(message);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief
+ * It creates a MCJIT execution engine that generates code at the given optimization level.
+ * @param engine is where the engine is stored.
+ * @param module is a LLVMModuleRef, owned by the engine afterwards.
+ * @param opt_level is an optimization level.
+ * @param error is where the error message is stored.
+ * @return int is zero on success.
+ */
+int create_jit(LLVMExecutionEngineRef *engine, LLVMModuleRef module, int opt_level, char **error) {
+  struct LLVMMCJITCompilerOptions options;
+
+  LLVMInitializeMCJITCompilerOptions(&options, sizeof(options));
+  options.OptLevel = opt_level;
+  return LLVMCreateMCJITCompilerForModule(engine, module, &options, sizeof(options), error);
+}
+
+/**
+ * @brief
+ * It generates machine code for the module and writes it to a native object file.
+ * @param module is a LLVMModuleRef.
+ * @param machine is a target machine created with jit == 0.
+ * @param filename is the name of the object file.
+ * @return int is zero on success.
+ */
+int emit_object(LLVMModuleRef module, LLVMTargetMachineRef machine, const char *filename) {
+  char *error = NULL;
+
+  if (LLVMTargetMachineEmitToFile(machine, module, (char *) filename, LLVMObjectFile, &error)) {
+    fprintf(stderr, "%s\n", error);
+    LLVMDisposeMessage(error);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief
+ * It generates machine code for the module into an in-memory object file.
+ * @param module is a LLVMModuleRef.
+ * @param machine is a target machine created with jit == 0.
+ * @return LLVMMemoryBufferRef is NULL on failure.
+ */
+LLVMMemoryBufferRef emit_object_buffer(LLVMModuleRef module, LLVMTargetMachineRef machine) {
+  char *error = NULL;
+  LLVMMemoryBufferRef object;
+
+  if (LLVMTargetMachineEmitToMemoryBuffer(machine, module, LLVMObjectFile, &error, &object)) {
+    fprintf(stderr, "%s\n", error);
+    LLVMDisposeMessage(error);
+    return NULL;
+  }
+  return object;
+}
+
+/**
+ * @brief
+ * It prints and consumes an error of the ORC API.
+ * @param error is an error, or NULL.
+ * @return int is non-zero if there was an error.
+ */
+int report_error(LLVMErrorRef error) {
+  if (!error) {
+    return 0;
+  }
+  char *message = LLVMGetErrorMessage(error);
+  fprintf(stderr, "%s\n", message);
+  LLVMDisposeErrorMessage(message);
+  return 1;
+}
+
+/**
+ * @brief
+ * It loads object files into a LLJIT session and runs their main. Undefined symbols
+ * (the runtime, if it is not in the objects, and libc) are resolved in the compiler process.
+ * @param objects are the object files, owned by the JIT afterwards.
+ * @param n is their number.
+ * @return int is zero on success.
+ */
+int run_objects(LLVMMemoryBufferRef *objects, size_t n) {
+  LLVMOrcLLJITRef jit = NULL;
+  LLVMOrcDefinitionGeneratorRef process_symbols;
+  LLVMOrcExecutorAddress main_address;
+  size_t added = 0;
+
+  int failed = report_error(LLVMOrcCreateLLJIT(&jit, NULL));
+  if (!failed) {
+    LLVMOrcJITDylibRef dylib = LLVMOrcLLJITGetMainJITDylib(jit);
+    failed =
+      report_error(LLVMOrcCreateDynamicLibrarySearchGeneratorForProcess(&process_symbols, LLVMOrcLLJITGetGlobalPrefix(jit), NULL, NULL));
+    if (!failed) {
+      LLVMOrcJITDylibAddGenerator(dylib, process_symbols);
+      for (; added < n && !failed; added++) {
+        failed = report_error(LLVMOrcLLJITAddObjectFile(jit, dylib, objects[added]));
+      }
+      failed = failed || report_error(LLVMOrcLLJITLookup(jit, &main_address, "main"));
+    }
+  }
+  for (size_t i = added; i < n; i++) {
+    LLVMDisposeMemoryBuffer(objects[i]);
+  }
+
+  if (!failed) {
+    int (*main_fn)(void) = (int (*)(void)) main_address;
+    fprintf(stderr, "Running\n");
+    main_fn();
+    fprintf(stderr, "Done\n");
+  }
+
+  if (jit) {
+    report_error(LLVMOrcDisposeLLJIT(jit));
+  }
+  return failed;
+}
+
+/**
+ * @brief
+ * It loads an object file into a LLJIT session and runs its main (see run_objects).
+ * @param object is the object file, owned by the JIT afterwards.
+ * @return int is zero on success.
+ */
+int run_object(LLVMMemoryBufferRef object) {
+  return run_objects(&object, 1);
+}
+
+/**
+ * @brief
+ * It links an object file into an executable with the system C compiler ($CC, cc by default),
+ * run without a shell. If the runtime was not linked into the object, runtime.c is compiled in
+ * as well, from the directory the compiler was built in.
+ * @param object is the object file.
+ * @param output is the name of the executable.
+ * @param external_runtime is non-zero if the object only declares the runtime.
+ * @return int is zero on success.
+ */
+int link_executable(const char *object, const char *output, int external_runtime) {
+  const char *cc = getenv("CC");
+  char *argv[8];
+  int argc = 0;
+  pid_t pid;
+  int status;
+
+  argv[argc++] = (char *) (cc && *cc ? cc : "cc");
+  argv[argc++] = "-O2";
+  argv[argc++] = "-o";
+  argv[argc++] = (char *) output;
+  argv[argc++] = (char *) object;
+  if (external_runtime) {
+    argv[argc++] = RUNTIME_DIR "/runtime.c";
+  }
+  argv[argc++] = "-lpthread";
+  argv[argc] = NULL;
+
+  int error = posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ);
+  if (error) {
+    fprintf(stderr, "Link failed: %s: %s\n", argv[0], strerror(error));
+    return 1;
+  }
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+    fprintf(stderr, "Link failed: %s\n", argv[0]);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,31 @@
+/**
+ * @file backend.h
+ * @brief
+ * Target machine, optimization pipeline and JIT setup for the generated module.
+ */
+
+#include <llvm-c/Core.h>
+#include <llvm-c/Error.h>
+#include <llvm-c/ExecutionEngine.h>
+#include <llvm-c/TargetMachine.h>
+
+// the functions of the program of at most this many instructions are inlined at -O1
+#define INLINE_SMALL_INSTRUCTIONS 32
+// at -O2 and -O3, the functions of more instructions called from several places stay calls
+#define INLINE_MAX_INSTRUCTIONS 400
+
+LLVMTargetMachineRef create_host_machine(int opt_level, int jit);
+void setup_module_for_host(LLVMModuleRef module, LLVMTargetMachineRef machine);
+void set_host_cpu(LLVMValueRef function);
+void declare_runtime(LLVMModuleRef module);
+LLVMValueRef add_main(LLVMModuleRef module, LLVMBuilderRef builder);
+void finish_main(LLVMModuleRef module, LLVMBuilderRef builder);
+int link_runtime(LLVMModuleRef module, LLVMModuleRef runtime);
+int optimize_module(LLVMModuleRef module, LLVMTargetMachineRef machine, int opt_level);
+int create_jit(LLVMExecutionEngineRef *engine, LLVMModuleRef module, int opt_level, char **error);
+int emit_object(LLVMModuleRef module, LLVMTargetMachineRef machine, const char *filename);
+LLVMMemoryBufferRef emit_object_buffer(LLVMModuleRef module, LLVMTargetMachineRef machine);
+int report_error(LLVMErrorRef error);
+int run_objects(LLVMMemoryBufferRef *objects, size_t n);
+int run_object(LLVMMemoryBufferRef object);
+int link_executable(const char *object, const char *output, int external_runtime);
@@ -0,0 +1,291 @@
+/**
+ * @file batch.c
+ * @brief
+ * Batch compilation of a list of programs to object files.
+ *
+ * Each worker thread has its own LLVM context and target machine, and compiles one program
+ * at a time in its own compilation with the reentrant parser and scanner, so the workers
+ * share nothing but the list of programs. The list is dealt in contiguous ranges, one per
+ * worker. A worker takes its programs from the front of its range; once the range is empty,
+ * it steals the back half of the range of another worker, so a few long programs do not
+ * leave the other cores idle. No program is ever added, so a worker that finds every range
+ * empty is done.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/IRReader.h>
+#include "ast.h"
+#include "backend.h"
+#include "batch.h"
+#include "lexer.h"
+#include "stats.h"
+#include "utils.h"
+
+/**
+ * @brief
+ * Programs left to a worker: files[head] to files[tail - 1].
+ */
+struct batch_range {
+  pthread_mutex_t lock;
+  size_t head;
+  size_t tail;
+};
+
+struct batch {
+  const char **files;
+  struct batch_range *ranges;
+  int n_workers;
+  int opt_level;
+  int external_runtime;
+  atomic_size_t n_failed;
+  atomic_size_t n_stolen;
+};
+
+struct batch_worker {
+  struct batch *batch;
+  int id;
+  pthread_t thread;
+};
+
+/**
+ * @brief
+ * It gives the next program of a worker, stealing from the other workers if it has none left.
+ * @param batch is a batch.
+ * @param id is the worker.
+ * @param file is where the index of the program is stored.
+ * @return int is zero when there is nothing left to compile.
+ */
+static int next_file(struct batch *batch, int id, size_t *file) {
+  struct batch_range *own = &batch->ranges[id];
+
+  pthread_mutex_lock(&own->lock);
+  int found = own->head < own->tail;
+  if (found) {
+    *file = own->head++;
+  }
+  pthread_mutex_unlock(&own->lock);
+  if (found) {
+    return 1;
+  }
+
+  for (int i = 1; i < batch->n_workers; i++) {
+    struct batch_range *victim = &batch->ranges[(id + i) % batch->n_workers];
+    size_t head = 0, tail = 0;
+
+    pthread_mutex_lock(&victim->lock);
+    if (victim->head < victim->tail) {
+      tail = victim->tail;
+      head = tail - (tail - victim->head + 1) / 2;
+      victim->tail = head;
+    }
+    pthread_mutex_unlock(&victim->lock);
+
+    if (head < tail) {
+      pthread_mutex_lock(&own->lock);
+      own->head = head + 1;
+      own->tail = tail;
+      pthread_mutex_unlock(&own->lock);
+      atomic_fetch_add(&batch->n_stolen, tail - head);
+      *file = head;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief
+ * It names the object file of a program: its extension is replaced by .o.
+ * @param path is the file of the program.
+ * @param object is where the name is stored.
+ * @param size is the size of object.
+ */
+static void object_name(const char *path, char *object, size_t size) {
+  const char *slash = strrchr(path, '/');
+  const char *dot = strrchr(slash ? slash : path, '.');
+  int len = dot ? (int) (dot - path) : (int) strlen(path);
+
+  snprintf(object, size, "%.*s.o", len, path);
+}
+
+/**
+ * @brief
+ * It compiles a program to an object file, in the compilation and the LLVM context of the caller.
+ * @param path is the file of the program.
+ * @param context is the LLVM context of the worker.
+ * @param machine is the target machine of the worker.
+ * @param runtime is the runtime module to link into the program, NULL to only declare it.
+ * @param opt_level is an optimization level.
+ * @return int is zero on success.
+ */
+static int compile_file(const char *path, LLVMContextRef context, LLVMTargetMachineRef machine,
+                        LLVMModuleRef runtime, int opt_level) {
+  struct compilation c;
+  struct lexer lexer;
+  char object[4096];
+  char *error = NULL;
+
+  if (lexer_open(&lexer, path)) {
+    return 1;
+  }
+  compilation_init(&c);
+  compilation = &c;
+
+  LLVMModuleRef module = LLVMModuleCreateWithNameInContext(path, context);
+  LLVMBuilderRef builder = LLVMCreateBuilderInContext(context);
+  setup_module_for_host(module, machine);
+  declare_runtime(module);
+  add_main(module, builder);
+
+  struct stats_timer t = stats_start();
+  int failed = yyparse(&lexer, module, builder) || !c.root;
+  stats_stop(&t, STATS_PARSE);
+  stats_count(STATS_AST_NODES, arena_count(&c.arena));
+  lexer_close(&lexer);
+
+  if (!failed) {
+    t = stats_start();
+    codegen_stmt(c.root, module, builder);
+    finish_main(module, builder);
+    stats_stop(&t, STATS_CODEGEN);
+    stats_count_module(module, STATS_IR_INSTRUCTIONS, STATS_IR_BLOCKS);
+    object_name(path, object, sizeof(object));
+
+    t = stats_start();
+    failed = runtime && link_runtime(module, LLVMCloneModule(runtime));
+    stats_stop(&t, STATS_LINK_RUNTIME);
+
+    t = stats_start();
+    failed = failed || LLVMVerifyModule(module, LLVMPrintMessageAction, &error);
+    stats_stop(&t, STATS_VERIFY);
+    LLVMDisposeMessage(error);
+
+    t = stats_start();
+    failed = failed || optimize_module(module, machine, opt_level);
+    stats_stop(&t, STATS_OPTIMIZE);
+    stats_count_module(module, STATS_OPT_IR_INSTRUCTIONS, STATS_OPT_IR_BLOCKS);
+
+    t = stats_start();
+    failed = failed || emit_object(module, machine, object);
+    stats_stop(&t, STATS_MACHINE_CODE);
+    stats_count_file(STATS_MACHINE_CODE_BYTES, object);
+  }
+
+  LLVMDisposeBuilder(builder);
+  LLVMDisposeModule(module);
+  compilation_fini(&c);
+  compilation = NULL;
+  return failed;
+}
+
+/**
+ * @brief
+ * Worker thread: it compiles programs until there are none left.
+ * @param arg is the worker.
+ * @return void* is NULL.
+ */
+static void *worker_thread(void *arg) {
+  struct batch_worker *worker = arg;
+  struct batch *batch = worker->batch;
+  LLVMContextRef context = LLVMContextCreate();
+  LLVMTargetMachineRef machine = create_host_machine(batch->opt_level, 0);
+  LLVMModuleRef runtime = NULL;
+  LLVMMemoryBufferRef buffer;
+  char *error = NULL;
+  size_t file;
+
+  // The runtime is parsed once per worker and cloned into each program.
+  if (machine && !batch->external_runtime) {
+    if (LLVMCreateMemoryBufferWithContentsOfFile("runtime.bc", &buffer, &error) ||
+        LLVMParseIRInContext(context, buffer, &runtime, &error)) {
+      fprintf(stderr, "%s\n", error);
+      LLVMDisposeMessage(error);
+      LLVMDisposeTargetMachine(machine);
+      machine = NULL;
+    } else {
+      setup_module_for_host(runtime, machine);
+    }
+  }
+
+  while (next_file(batch, worker->id, &file)) {
+    if (!machine || compile_file(batch->files[file], context, machine, runtime, batch->opt_level)) {
+      fprintf(stderr, "%s: compilation failed\n", batch->files[file]);
+      atomic_fetch_add(&batch->n_failed, 1);
+    }
+  }
+
+  if (runtime) {
+    LLVMDisposeModule(runtime);
+  }
+  if (machine) {
+    LLVMDisposeTargetMachine(machine);
+  }
+  LLVMContextDispose(context);
+  return NULL;
+}
+
+/**
+ * @brief
+ * It compiles each program to an object file named after it (see object_name).
+ * @param files is the list of programs.
+ * @param n_files is their number.
+ * @param jobs is the number of threads, 0 for one per core.
+ * @param opt_level is an optimization level.
+ * @param external_runtime is non-zero to only declare the runtime instead of linking runtime.bc.
+ * @return int is zero if every program was compiled.
+ */
+int batch_compile(const char **files, size_t n_files, int jobs, int opt_level, int external_runtime) {
+  struct batch batch = { 0 };
+  struct timespec start, end;
+
+  if (jobs <= 0) {
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if ((size_t) jobs > n_files) {
+    jobs = n_files;
+  }
+
+  batch.files = files;
+  batch.n_workers = jobs;
+  batch.opt_level = opt_level;
+  batch.external_runtime = external_runtime;
+  batch.ranges = calloc(jobs, sizeof(batch.ranges[0]));
+  for (int i = 0; i < jobs; i++) {
+    pthread_mutex_init(&batch.ranges[i].lock, NULL);
+    batch.ranges[i].head = n_files * i / jobs;
+    batch.ranges[i].tail = n_files * (i + 1) / jobs;
+  }
+
+  struct batch_worker *workers = calloc(jobs, sizeof(workers[0]));
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < jobs; i++) {
+    workers[i].batch = &batch;
+    workers[i].id = i;
+    pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+  }
+  for (int i = 0; i < jobs; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  size_t n_failed = atomic_load(&batch.n_failed);
+  fprintf(stderr, "Compiled %zu of %zu programs on %d threads in %.3f s (%zu stolen)\n",
+          n_files - n_failed, n_files, jobs,
+          (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9,
+          atomic_load(&batch.n_stolen));
+
+  for (int i = 0; i < jobs; i++) {
+    pthread_mutex_destroy(&batch.ranges[i].lock);
+  }
+  free(workers);
+  free(batch.ranges);
+  return n_failed != 0;
+}
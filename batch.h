@@ -0,0 +1,9 @@
+/**
+ * @file batch.h
+ * @brief
+ * Batch compilation: many programs compiled ahead of time in one process, on a pool of threads.
+ */
+
+#include <stddef.h>
+
+int batch_compile(const char **files, size_t n_files, int jobs, int opt_level, int external_runtime);
@@ -0,0 +1,246 @@
+/**
+ * @file ast_walk.c
+ * @brief
+ * Benchmark of the pointer AST against the flat AST: it generates a large random program,
+ * copies it to the flat AST and times the same passes over both.
+ *
+ * usage: ast_walk [statements] [repetitions]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <llvm-c/Core.h>
+#include "../ast.h"
+#include "../flat.h"
+#include "../utils.h"
+
+#define N_VARS 16
+
+static size_t int_vars[N_VARS], bool_vars[N_VARS];
+
+/**
+ * @brief
+ * @return double is a monotonic time in seconds.
+ */
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static struct expr *gen_bool(int depth);
+
+/**
+ * @brief
+ * It generates a random integer expression.
+ * @param depth is the maximum depth.
+ */
+static struct expr *gen_int(int depth) {
+  static const int ops[] = { '+', '-', '*', '/', REMAINDER, AND, OR, XOR, LEFTSHIFT, RIGHTSHIFT };
+
+  switch (depth > 0 ? rand() % 6 : rand() % 2) {
+    case 0: return literal(rand() % 1000);
+    case 1: return variable(int_vars[rand() % N_VARS]);
+    case 2: return post_increment(variable(int_vars[rand() % N_VARS]));
+    case 3: return ternary(gen_bool(depth - 1), gen_int(depth - 1), gen_int(depth - 1));
+    default: return binop(gen_int(depth - 1), ops[rand() % 10], gen_int(depth - 1));
+  }
+}
+
+/**
+ * @brief
+ * It generates a random boolean expression.
+ * @param depth is the maximum depth.
+ */
+static struct expr *gen_bool(int depth) {
+  static const int cmps[] = { EQ, NE, GE, LE, '<', '>' };
+  static const int ops[] = { AND, OR, XOR, EQ, NE };
+
+  switch (depth > 0 ? rand() % 4 : rand() % 2) {
+    case 0: return bool_lit(rand() % 2);
+    case 1: return variable(bool_vars[rand() % N_VARS]);
+    case 2: return binop(gen_int(depth - 1), cmps[rand() % 6], gen_int(depth - 1));
+    default: return binop(gen_bool(depth - 1), ops[rand() % 5], gen_bool(depth - 1));
+  }
+}
+
+/**
+ * @brief
+ * It generates a random sequence of statements.
+ * @param n is the number of statements.
+ * @param depth is the maximum nesting of if and while.
+ */
+static struct stmt *gen_stmts(size_t n, int depth) {
+  // the generated statements have no source, the locations only key the profiles
+  const struct location no_location = {0, 0};
+  struct stmt *seq = NULL;
+
+  while (n > 0) {
+    struct stmt *s;
+    size_t body = depth > 0 ? 1 + rand() % 8 : 0;
+    switch (body && body < n ? rand() % 5 : rand() % 3) {
+      case 0: s = make_assign(int_vars[rand() % N_VARS], gen_int(4)); n--; break;
+      case 1: s = make_assign(bool_vars[rand() % N_VARS], gen_bool(4)); n--; break;
+      case 2: s = make_print(gen_int(4)); n--; break;
+      case 3: s = make_ifelse(gen_bool(3), gen_stmts(body, depth - 1), rand() % 2 ? gen_stmts(1, depth - 1) : NULL, no_location); n -= body; break;
+      default: s = make_while(gen_bool(3), gen_stmts(body, depth - 1), no_location); n -= body; break;
+    }
+    seq = seq ? make_seq(seq, s) : s;
+  }
+  return seq;
+}
+
+/**
+ * @brief
+ * Walks of the pointer AST, the counterparts of the flat passes.
+ */
+static int64_t tree_sum_literals(struct expr *expr) {
+  switch (expr->type) {
+    case LITERAL: return expr->value;
+    case BOOL_LIT:
+    case VARIABLE: return 0;
+    case BIN_OP: return tree_sum_literals(expr->binop.lhs) + tree_sum_literals(expr->binop.rhs);
+    case TERNARY_OP:
+      return tree_sum_literals(expr->ternary.lhs) + tree_sum_literals(expr->ternary.mhs) + tree_sum_literals(expr->ternary.rhs);
+    default: return tree_sum_literals(expr->expr);
+  }
+}
+
+static int64_t tree_sum_stmt(struct stmt *stmt) {
+  switch (stmt->type) {
+    case STMT_SEQ: {
+      int64_t sum = 0;
+      for (size_t i = 0; i < stmt->seq.len; i++) {
+        sum += tree_sum_stmt(stmt->seq.stmts[i]);
+      }
+      return sum;
+    }
+    case STMT_ASSIGN: return tree_sum_literals(stmt->assign.expr);
+    case STMT_PRINT: return tree_sum_literals(stmt->print.expr);
+    case STMT_WHILE: return tree_sum_literals(stmt->while_.cond) + tree_sum_stmt(stmt->while_.body);
+    default:
+      return tree_sum_literals(stmt->ifelse.cond) + tree_sum_stmt(stmt->ifelse.if_body) +
+             (stmt->ifelse.else_body ? tree_sum_stmt(stmt->ifelse.else_body) : 0);
+  }
+}
+
+static void reset_expr(struct expr *expr) {
+  expr->value_type = UNTYPED;
+  switch (expr->type) {
+    case BOOL_LIT:
+    case LITERAL:
+    case VARIABLE: break;
+    case BIN_OP: reset_expr(expr->binop.lhs); reset_expr(expr->binop.rhs); break;
+    case TERNARY_OP: reset_expr(expr->ternary.lhs); reset_expr(expr->ternary.mhs); reset_expr(expr->ternary.rhs); break;
+    default: reset_expr(expr->expr);
+  }
+}
+
+static void reset_stmt(struct stmt *stmt) {
+  switch (stmt->type) {
+    case STMT_SEQ:
+      for (size_t i = 0; i < stmt->seq.len; i++) {
+        reset_stmt(stmt->seq.stmts[i]);
+      }
+      break;
+    case STMT_ASSIGN: reset_expr(stmt->assign.expr); break;
+    case STMT_PRINT: reset_expr(stmt->print.expr); break;
+    case STMT_WHILE: reset_expr(stmt->while_.cond); reset_stmt(stmt->while_.body); break;
+    default:
+      reset_expr(stmt->ifelse.cond);
+      reset_stmt(stmt->ifelse.if_body);
+      if (stmt->ifelse.else_body) {
+        reset_stmt(stmt->ifelse.else_body);
+      }
+  }
+}
+
+/**
+ * @brief
+ * It prints a line of the results table.
+ */
+static void report(const char *pass, double tree, double flat, size_t nodes) {
+  printf("%-12s %10.2f %10.2f %8.2fx\n", pass, tree * 1e9 / nodes, flat * 1e9 / nodes, tree / flat);
+}
+
+int main(int argc, char **argv) {
+  size_t n_stmts = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+  int reps = argc > 2 ? atoi(argv[2]) : 10;
+  char name[16];
+  struct compilation c;
+
+  compilation_init(&c);
+  compilation = &c;
+
+  // The variables are allocas like the ones of the parser, check_types reads their types.
+  LLVMModuleRef module = LLVMModuleCreateWithName("bench");
+  LLVMBuilderRef builder = LLVMCreateBuilder();
+  LLVMValueRef main = LLVMAddFunction(module, "main", LLVMFunctionType(LLVMInt32Type(), NULL, 0, 0));
+  LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlock(main, "entry"));
+  for (int i = 0; i < N_VARS; i++) {
+    snprintf(name, sizeof(name), "x%d", i);
+    int_vars[i] = string_int_get(&compilation->ids, name);
+    vector_set(&compilation->types, int_vars[i], LLVMBuildAlloca(builder, LLVMInt32Type(), name));
+    snprintf(name, sizeof(name), "b%d", i);
+    bool_vars[i] = string_int_get(&compilation->ids, name);
+    vector_set(&compilation->types, bool_vars[i], LLVMBuildAlloca(builder, LLVMInt1Type(), name));
+  }
+
+  srand(42);
+  struct stmt *program = gen_stmts(n_stmts, 3);
+  struct flat_ast flat;
+  flat_init(&flat);
+  double start = now();
+  flat_from_tree(&flat, program);
+  double convert = now() - start;
+
+  size_t nodes = flat.exprs.len + flat.stmts.len;
+  size_t flat_bytes = flat.exprs.len * (1 + 1 + 4 * 5) + flat.stmts.len * (1 + 4 * 4) + flat.stmts.n_children * 4;
+  printf("%zu statements, %zu expressions\n", flat.stmts.len, flat.exprs.len);
+  printf("pointer AST: %zu bytes, flat AST: %zu bytes, conversion %.2f ms\n",
+         arena_bytes(&compilation->arena), flat_bytes, convert * 1e3);
+
+  double best_tree_sum = 1e9, best_flat_sum = 1e9, best_tree_check = 1e9, best_flat_check = 1e9;
+  int64_t tree_sum = 0, flat_sum = 0;
+  int tree_valid = 0, flat_ok = 0;
+
+  for (int r = 0; r < reps; r++) {
+    start = now();
+    tree_sum = tree_sum_stmt(program);
+    double t = now() - start;
+    best_tree_sum = t < best_tree_sum ? t : best_tree_sum;
+
+    start = now();
+    flat_sum = flat_sum_literals(&flat);
+    t = now() - start;
+    best_flat_sum = t < best_flat_sum ? t : best_flat_sum;
+
+    reset_stmt(program);
+    start = now();
+    tree_valid = valid_stmt(program);
+    t = now() - start;
+    best_tree_check = t < best_tree_check ? t : best_tree_check;
+
+    start = now();
+    flat_check_types(&flat);
+    flat_ok = flat_valid(&flat);
+    t = now() - start;
+    best_flat_check = t < best_flat_check ? t : best_flat_check;
+  }
+
+  if (tree_sum != flat_sum || tree_valid != flat_ok) {
+    fprintf(stderr, "mismatch: sum %lld/%lld, valid %d/%d\n", (long long) tree_sum, (long long) flat_sum, tree_valid, flat_ok);
+    return 1;
+  }
+
+  printf("%-12s %10s %10s %9s\n", "pass", "tree ns", "flat ns", "speedup");
+  report("walk", best_tree_sum, best_flat_sum, nodes);
+  report("check_types", best_tree_check, best_flat_check, nodes);
+
+  flat_fini(&flat);
+  arena_fini(&compilation->arena);
+  LLVMDisposeBuilder(builder);
+  LLVMDisposeModule(module);
+  return 0;
+}
@@ -0,0 +1,147 @@
+/**
+ * @file gen.c
+ * @brief
+ * Generator of synthetic programs for the benchmark suite (see suite.sh). The same shape,
+ * size and seed always give the same program. Every variable is assigned before it is read
+ * and no division is generated, so the programs behave the same in every execution mode.
+ *
+ * usage: gen vars|deep|seq|loops|print size [seed]
+ *   vars   size variables, each computed from the previous ones
+ *   deep   flat expressions of size operators, which the parser nests to the right
+ *   seq    size statements in a row, assignments and ifs
+ *   loops  three nested loops running about size iterations of the innermost body
+ *   print  a loop printing size values
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned long long state;
+
+/**
+ * @brief
+ * @return unsigned is a pseudo-random number (xorshift), reproducible across C libraries.
+ */
+static unsigned next(void) {
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state >> 32;
+}
+
+/**
+ * @brief
+ * It prints an integer operator that cannot trap.
+ */
+static void print_op(void) {
+  static const char *ops[] = { "+", "-", "*", "^", "+", "-" };
+  printf(" %s ", ops[next() % 6]);
+}
+
+/**
+ * @brief
+ * It declares n integer variables v0 to vn-1 and sets them.
+ * @param n is the number of variables.
+ */
+static void declare_vars(long n) {
+  for (long i = 0; i < n; i++) {
+    printf("int v%ld;\n", i);
+  }
+  printf("int i; int j; int k; int s;\n{\n");
+  for (long i = 0; i < n; i++) {
+    printf("v%ld = %u;\n", i, next() % 1000);
+  }
+  printf("s = 0;\n");
+}
+
+static void gen_vars(long n) {
+  declare_vars(n);
+  for (long i = 1; i < n; i++) {
+    printf("v%ld = v%ld", i, i - 1);
+    print_op();
+    printf("v%lu;\n", (unsigned long) (next() % i));
+  }
+  printf("print v%ld;\n}\n", n - 1);
+}
+
+static void gen_deep(long n) {
+  declare_vars(16);
+  for (int stmt = 0; stmt < 4; stmt++) {
+    printf("s = s");
+    for (long i = 0; i < n; i++) {
+      print_op();
+      if (next() % 2) {
+        printf("v%u", next() % 16);
+      } else {
+        printf("%u", next() % 100);
+      }
+    }
+    printf(";\nprint s;\n");
+  }
+  printf("}\n");
+}
+
+static void gen_seq(long n) {
+  declare_vars(16);
+  for (long i = 0; i < n; i++) {
+    unsigned a = next() % 16, b = next() % 16, c = next() % 16;
+    if (next() % 4) {
+      printf("v%u = v%u", a, b);
+      print_op();
+      printf("v%u;\n", c);
+    } else {
+      printf("if (v%u > v%u) v%u = v%u - %u; else v%u = v%u + 1;\n", b, c, a, a, next() % 10, a, a);
+    }
+  }
+  printf("print v0;\nprint v15;\n}\n");
+}
+
+static void gen_loops(long n) {
+  long k = 1;
+  while ((k + 1) * (k + 1) * (k + 1) <= n) {
+    k++;
+  }
+  declare_vars(4);
+  printf("i = 0;\nwhile (i < %ld) {\n", k);
+  printf("  j = 0;\n  while (j < %ld) {\n", k);
+  printf("    k = 0;\n    while (k < %ld) {\n", k);
+  printf("      s = s + (i ^ j) * k - v0;\n");
+  printf("      if (s > 1000000) s = s - 1000000;\n");
+  printf("      k = k + 1;\n    }\n");
+  printf("    j = j + 1;\n  }\n");
+  printf("  i = i + 1;\n}\nprint s;\n}\n");
+}
+
+static void gen_print(long n) {
+  declare_vars(2);
+  printf("i = 0;\nwhile (i < %ld) {\n  print i * v0 + v1;\n  print i > v1;\n  i = i + 1;\n}\n}\n", (n + 1) / 2);
+}
+
+int main(int argc, char **argv) {
+  static const struct {
+    const char *name;
+    void (*gen)(long n);
+  } shapes[] = {
+    { "vars", gen_vars },
+    { "deep", gen_deep },
+    { "seq", gen_seq },
+    { "loops", gen_loops },
+    { "print", gen_print },
+  };
+
+  if (argc < 3 || atol(argv[2]) < 1) {
+    fprintf(stderr, "usage: %s vars|deep|seq|loops|print size [seed]\n", argv[0]);
+    return 1;
+  }
+  state = argc > 3 ? strtoull(argv[3], NULL, 10) * 2654435761u + 1 : 88172645463325252ull;
+
+  for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+    if (!strcmp(argv[1], shapes[i].name)) {
+      shapes[i].gen(atol(argv[2]));
+      return 0;
+    }
+  }
+  fprintf(stderr, "unknown shape %s\n", argv[1]);
+  return 1;
+}
@@ -0,0 +1,167 @@
+/**
+ * @file intern.c
+ * @brief
+ * Benchmark of the identifier interner: it generates random identifiers and a stream of
+ * occurrences of them, as the scanner sees them, and interns the stream with the table of utils.c
+ * and with the previous table (FNV-1a, linear probing, modulo, strdup of each key) copied below.
+ * The previous table rehashed itself on every lookup once half full, since it grew to 2 * count;
+ * the copy doubles its capacity instead, so that the comparison is of hashing and probing.
+ *
+ * usage: intern [identifiers] [lookups]
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../utils.h"
+
+/**
+ * @brief
+ * @return double is a monotonic time in seconds.
+ */
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief
+ * The previous interner, kept as the baseline.
+ */
+struct old_string_int {
+  size_t count;
+  size_t capacity;
+  struct old_kv {
+    char *key;
+    int id;
+  } *data;
+};
+
+static size_t old_hash(const char *s) {
+  size_t r = 0xcbf29ce484222325;
+  while (*s) {
+    r *= 0x100000001b3;
+    r ^= *s;
+    s++;
+  }
+
+  return r;
+}
+
+static void old_init(struct old_string_int *v) {
+  v->count = 0;
+  v->capacity = 16;
+  v->data = calloc(v->capacity, sizeof(v->data[0]));
+}
+
+static void old_fini(struct old_string_int *v) {
+  for (size_t i = 0; i < v->capacity; i++) {
+    free(v->data[i].key);
+  }
+  free(v->data);
+}
+
+static void old_resize(struct old_string_int *v, size_t n) {
+  struct old_kv *newdata = calloc(n, sizeof(v->data[0]));
+
+  for (size_t i = 0; i < v->capacity; i++) {
+    char *key = v->data[i].key;
+    if (key) {
+      size_t idx = old_hash(key);
+      while (newdata[idx % n].key) {
+        idx++;
+      }
+      newdata[idx % n] = v->data[i];
+    }
+  }
+  free(v->data);
+  v->data = newdata;
+  v->capacity = n;
+}
+
+static size_t old_get(struct old_string_int *v, const char *key) {
+  size_t idx;
+
+  if (2 * v->count >= v->capacity) {
+    old_resize(v, 2 * v->capacity);
+  }
+
+  for (idx = old_hash(key) % v->capacity; v->data[idx].key; idx = (idx + 1) % v->capacity) {
+    if (!strcmp(v->data[idx].key, key)) {
+      return v->data[idx].id;
+    }
+  }
+
+  v->data[idx].id = v->count;
+  v->data[idx].key = strdup(key);
+  return v->count++;
+}
+
+int main(int argc, char **argv) {
+  static const char alnum[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+  size_t n_ids = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000;
+  size_t n_lookups = argc > 2 ? strtoul(argv[2], NULL, 10) : 10000000;
+
+  // The identifiers, NUL terminated so that both tables can read them.
+  char (*names)[17] = malloc(n_ids * sizeof(names[0]));
+  size_t *lens = malloc(n_ids * sizeof(lens[0]));
+  srand(1);
+  for (size_t i = 0; i < n_ids; i++) {
+    lens[i] = 1 + rand() % 16;
+    names[i][0] = alnum[rand() % 52];
+    for (size_t j = 1; j < lens[i]; j++) {
+      names[i][j] = alnum[rand() % 62];
+    }
+    names[i][lens[i]] = 0;
+  }
+
+  // Most occurrences are of a few identifiers, as in real programs.
+  uint32_t *stream = malloc(n_lookups * sizeof(stream[0]));
+  for (size_t i = 0; i < n_lookups; i++) {
+    size_t r = rand() % n_ids;
+    stream[i] = rand() % 4 ? r % (n_ids < 64 ? n_ids : 64) : r;
+  }
+
+  struct old_string_int old;
+  struct string_int table;
+  size_t old_sum = 0, new_sum = 0;
+
+  double start = now();
+  old_init(&old);
+  for (size_t i = 0; i < n_lookups; i++) {
+    old_sum += old_get(&old, names[stream[i]]);
+  }
+  double old_time = now() - start;
+
+  start = now();
+  string_int_init(&table);
+  for (size_t i = 0; i < n_lookups; i++) {
+    new_sum += string_int_get_len(&table, names[stream[i]], lens[stream[i]]);
+  }
+  double new_time = now() - start;
+
+  for (size_t id = 0; id < string_int_count(&table); id++) {
+    if (old_get(&old, string_int_rev(&table, id)) != id) {
+      fprintf(stderr, "the tables disagree on %s\n", string_int_rev(&table, id));
+      return 1;
+    }
+  }
+
+  printf("%zu identifiers, %zu lookups (%zu distinct)\n", n_ids, n_lookups, old.count);
+  printf("old  %8.3f s  %6.1f ns/lookup\n", old_time, old_time * 1e9 / n_lookups);
+  printf("new  %8.3f s  %6.1f ns/lookup  %.2fx\n", new_time, new_time * 1e9 / n_lookups, old_time / new_time);
+  if (old_sum != new_sum) {
+    fprintf(stderr, "the tables gave different ids\n");
+    return 1;
+  }
+
+  old_fini(&old);
+  string_int_fini(&table);
+  free(stream);
+  free(lens);
+  free(names);
+  return 0;
+}
@@ -0,0 +1,129 @@
+#!/bin/sh
+# Benchmark suite of the compiler: it generates programs of several shapes with bench/gen,
+# runs each of them in each execution mode with --stats-json and records
+#   compile_ms  time of every phase but run (lex, parse, ..., optimize, machine code)
+#   run_ms      time of the run phase
+#   wall_ms     end-to-end time of the process
+#   rss_kb      peak resident memory of the process
+# keeping the best of REPEAT runs. The results are compared with the baseline, and any
+# metric worse than the baseline by more than THRESHOLD percent is reported as a regression.
+#
+# usage: bench/suite.sh [--update-baseline]   (run from the directory of the compiler)
+#
+# environment:
+#   COMPILER   compiler to measure (./compiler)
+#   GEN        program generator (bench/gen)
+#   SCALE      multiplier of the sizes of the programs (1)
+#   REPEAT     runs of each program and mode (3)
+#   THRESHOLD  tolerated slowdown in percent (10)
+#   MIN_MS     differences of times below it are noise and never regressions (2)
+#   BASELINE   baseline file (bench/baseline.tsv)
+#   RESULTS    results file (bench/results.tsv)
+
+set -e
+
+COMPILER=${COMPILER:-./compiler}
+GEN=${GEN:-bench/gen}
+SCALE=${SCALE:-1}
+REPEAT=${REPEAT:-3}
+THRESHOLD=${THRESHOLD:-10}
+MIN_MS=${MIN_MS:-2}
+BASELINE=${BASELINE:-bench/baseline.tsv}
+RESULTS=${RESULTS:-bench/results.tsv}
+
+# name, shape, size
+PROGRAMS="
+vars   vars  2000
+deep   deep  2000
+seq    seq   20000
+loops  loops 1000000
+print  print 20000
+"
+
+# name, options
+MODES="
+jit-O0  -m jit -O0
+jit-O2  -m jit -O2
+stack   -m stack
+reg     -m reg
+tiered  -m tiered
+"
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# It prints the compile and run times (ns) and the peak memory (KiB) of a --stats-json report.
+parse_stats() {
+  sed -e 's/"\([a-z ]*\)": {"ns": \([0-9]*\)/\n\1=\2\n/g' -e 's/"peak_rss_kb": \([0-9]*\)/\nrss=\1\n/' "$1" |
+    awk -F= '/=/ { if ($1 == "run") run = $2; else if ($1 == "rss") rss = $2; else compile += $2 }
+             END { printf "%.0f %.0f %.0f\n", compile, run, rss }'
+}
+
+# It prints the time in nanoseconds.
+now_ns() {
+  date +%s%N
+}
+
+printf 'program\tmode\tcompile_ms\trun_ms\twall_ms\trss_kb\n' > "$RESULTS"
+
+echo "$PROGRAMS" | while read -r name shape size; do
+  [ -n "$name" ] || continue
+  "$GEN" "$shape" $((size * SCALE)) > "$TMP/$name.code"
+  echo "$MODES" | while read -r mode options; do
+    [ -n "$mode" ] || continue
+    best=""
+    i=0
+    while [ $i -lt "$REPEAT" ]; do
+      start=$(now_ns)
+      if ! $COMPILER $options --stats-json "$TMP/stats.json" "$TMP/$name.code" > "$TMP/out" 2> "$TMP/err"; then
+        echo "$name $mode: failed" >&2
+        cat "$TMP/err" >&2
+        exit 1
+      fi
+      end=$(now_ns)
+      run=$(parse_stats "$TMP/stats.json")
+      run="$run $((end - start))"
+      best=$(echo "$best
+$run" | awk 'NF == 4 { for (i = 1; i <= 4; i++) if (!(i in b) || $i < b[i]) b[i] = $i }
+             END { printf "%.0f %.0f %.0f %.0f\n", b[1], b[2], b[3], b[4] }')
+      i=$((i + 1))
+    done
+    echo "$best" | awk -v name="$name" -v mode="$mode" \
+      '{ printf "%s\t%s\t%.3f\t%.3f\t%.3f\t%d\n", name, mode, $1 / 1e6, $2 / 1e6, $4 / 1e6, $3 }' >> "$RESULTS"
+  done
+done
+
+column -t "$RESULTS" 2>/dev/null || cat "$RESULTS"
+
+if [ "$1" = "--update-baseline" ]; then
+  cp "$RESULTS" "$BASELINE"
+  echo "baseline stored in $BASELINE"
+  exit 0
+fi
+
+if [ ! -f "$BASELINE" ]; then
+  echo "no baseline in $BASELINE, run with --update-baseline to store one"
+  exit 0
+fi
+
+# A metric regresses when it is worse than the baseline by more than THRESHOLD percent and,
+# for the times, by more than MIN_MS.
+awk -F'\t' -v threshold="$THRESHOLD" -v min_ms="$MIN_MS" '
+  FNR == 1 { for (i = 3; i <= NF; i++) metric[i] = $i; next }
+  NR == FNR { base[$1 "\t" $2, 3] = $3; base[$1 "\t" $2, 4] = $4; base[$1 "\t" $2, 5] = $5;
+              base[$1 "\t" $2, 6] = $6; seen[$1 "\t" $2] = 1; next }
+  !(($1 "\t" $2) in seen) { next }
+  {
+    for (i = 3; i <= 6; i++) {
+      old = base[$1 "\t" $2, i]
+      if ($i > old * (1 + threshold / 100) && (i == 6 || $i - old > min_ms)) {
+        printf "REGRESSION %s %s %s: %s -> %s (+%.1f%%)\n", $1, $2, metric[i], old, $i,
+               (old > 0 ? 100 * ($i - old) / old : 100)
+        n++
+      }
+    }
+  }
+  END {
+    if (n) { printf "%d regressions beyond %s%%\n", n, threshold; exit 1 }
+    printf "no regression beyond %s%%\n", threshold
+  }' "$BASELINE" "$RESULTS"
@@ -0,0 +1,567 @@
+/**
+ * @file bytecode.c
+ * @brief
+ * Compiler from the AST to the binary stack machine code, and its interpreter.
+ * The interpreter dispatches with computed goto, so every instruction jumps directly to the next handler.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "ast.h"
+#include "bytecode.h"
+#include "runtime.h"
+#include "utils.h"
+
+/**
+ * @brief
+ * Static information about an instruction.
+ */
+struct opcode_info {
+  const char *mnemonic;
+  int operands;
+  int effect;
+};
+
+#define OPCODE_INFO(name, mnemonic, operands, effect) { mnemonic, operands, effect },
+static const struct opcode_info info[OP_COUNT] = {
+  OPCODES(OPCODE_INFO)
+};
+#undef OPCODE_INFO
+
+/**
+ * @brief
+ * It appends an instruction to the code, without looking for superinstructions.
+ * @param bc is a bytecode.
+ * @param op is an opcode.
+ * @param a is the first operand, if any.
+ * @param b is the second operand, if any.
+ */
+static void append(struct bytecode *bc, enum opcode op, int32_t a, int32_t b) {
+  if (bc->len + 3 > bc->capacity) {
+    bc->capacity = bc->capacity ? 2 * bc->capacity : 256;
+    bc->code = realloc(bc->code, bc->capacity * sizeof(bc->code[0]));
+  }
+
+  bc->recent[2] = bc->recent[1];
+  bc->recent[1] = bc->recent[0];
+  bc->recent[0] = bc->len;
+  if (bc->n_recent < 3) {
+    bc->n_recent++;
+  }
+
+  bc->code[bc->len++] = op;
+  if (info[op].operands > 0) {
+    bc->code[bc->len++] = a;
+  }
+  if (info[op].operands > 1) {
+    bc->code[bc->len++] = b;
+  }
+}
+
+/**
+ * @brief
+ * @param bc is a bytecode.
+ * @param i is 0 for the last instruction, 1 for the one before...
+ * @return int is the opcode of a recent instruction, -1 if it may be a jump target.
+ */
+static int recent_op(struct bytecode *bc, size_t i) {
+  return i < bc->n_recent ? bc->code[bc->recent[i]] : -1;
+}
+
+/**
+ * @brief
+ * @param bc is a bytecode.
+ * @param i is 0 for the last instruction, 1 for the one before...
+ * @return int32_t is the first operand of a recent instruction.
+ */
+static int32_t recent_operand(struct bytecode *bc, size_t i) {
+  return bc->code[bc->recent[i] + 1];
+}
+
+/**
+ * @brief
+ * It removes the last instruction, to replace it with a superinstruction.
+ * @param bc is a bytecode.
+ */
+static void drop_recent(struct bytecode *bc) {
+  bc->len = bc->recent[0];
+  bc->recent[0] = bc->recent[1];
+  bc->recent[1] = bc->recent[2];
+  bc->n_recent--;
+}
+
+/**
+ * @brief
+ * @param op is a comparison.
+ * @return int is the conditional jump taken when the comparison is true, -1 if op is not a comparison.
+ */
+static int compare_jump(int op) {
+  switch (op) {
+    case OP_EQ: return OP_JEQ;
+    case OP_NE: return OP_JNE;
+    case OP_LT: return OP_JLT;
+    case OP_LE: return OP_JLE;
+    case OP_GT: return OP_JGT;
+    case OP_GE: return OP_JGE;
+    default: return -1;
+  }
+}
+
+/**
+ * @brief
+ * @param op is a conditional jump on a comparison.
+ * @return enum opcode is the jump on the opposite comparison.
+ */
+static enum opcode negate_jump(enum opcode op) {
+  switch (op) {
+    case OP_JEQ: return OP_JNE;
+    case OP_JNE: return OP_JEQ;
+    case OP_JLT: return OP_JGE;
+    case OP_JLE: return OP_JGT;
+    case OP_JGT: return OP_JLE;
+    default: return OP_JLT;
+  }
+}
+
+/**
+ * @brief
+ * It emits an instruction, merging it with the previous ones into a superinstruction when possible.
+ * @param bc is a bytecode.
+ * @param op is an opcode.
+ * @param a is the first operand, if any.
+ */
+static void emit(struct bytecode *bc, enum opcode op, int32_t a) {
+  int32_t b = 0;
+
+  // The stack depth is the one of the plain sequence, which is never smaller than the merged one.
+  bc->depth += info[op].effect;
+  if (bc->depth > bc->max_depth) {
+    bc->max_depth = bc->depth;
+  }
+
+  switch (op) {
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+      if (recent_op(bc, 0) == OP_PUSH) {
+        a = recent_operand(bc, 0);
+        drop_recent(bc);
+        op = op == OP_ADD ? OP_ADD_IMM : op == OP_SUB ? OP_SUB_IMM : OP_MUL_IMM;
+      }
+      break;
+
+    case OP_STORE:
+      if (recent_op(bc, 0) == OP_PUSH) {
+        b = recent_operand(bc, 0);
+        drop_recent(bc);
+        op = OP_STORE_IMM;
+      } else if ((recent_op(bc, 0) == OP_ADD_IMM || recent_op(bc, 0) == OP_SUB_IMM) &&
+                 recent_op(bc, 1) == OP_LOAD && recent_operand(bc, 1) == a) {
+        b = recent_op(bc, 0) == OP_ADD_IMM ? recent_operand(bc, 0) : (int32_t) (0u - (uint32_t) recent_operand(bc, 0));
+        drop_recent(bc);
+        drop_recent(bc);
+        op = OP_INCR;
+      }
+      break;
+
+    case OP_PRINT_I32:
+      if (recent_op(bc, 0) == OP_LOAD) {
+        a = recent_operand(bc, 0);
+        drop_recent(bc);
+        op = OP_PRINT_VAR;
+      }
+      break;
+
+    case OP_JZ:
+    case OP_JNZ: {
+      int jump = compare_jump(recent_op(bc, 0));
+      if (jump >= 0) {
+        drop_recent(bc);
+        op = op == OP_JNZ ? (enum opcode) jump : negate_jump(jump);
+        if (recent_op(bc, 0) == OP_PUSH) {
+          b = a;
+          a = recent_operand(bc, 0);
+          drop_recent(bc);
+          op += OP_JEQ_IMM - OP_JEQ;
+        }
+      }
+      break;
+    }
+
+    default:
+      break;
+  }
+
+  append(bc, op, a, b);
+}
+
+/**
+ * @brief
+ * It marks the current position as a jump target: no superinstruction may span it.
+ * @param bc is a bytecode.
+ * @return size_t is the position.
+ */
+static size_t label(struct bytecode *bc) {
+  bc->n_recent = 0;
+  return bc->len;
+}
+
+/**
+ * @brief
+ * It emits a jump.
+ * @param bc is a bytecode.
+ * @param op is JUMP, JZ or JNZ, it may become a jump on a comparison.
+ * @param target is the target, if known.
+ * @return size_t is the position of the target in the code, to patch it.
+ */
+static size_t emit_jump(struct bytecode *bc, enum opcode op, size_t target) {
+  emit(bc, op, target);
+  return bc->len - 1;
+}
+
+static void compile_expr(struct bytecode *bc, struct expr *expr);
+
+/**
+ * @brief
+ * It compiles an increment or a decrement. On a variable the new value is stored back;
+ * like in codegen_expr, on any other expression only the value is computed.
+ * @param bc is a bytecode.
+ * @param expr is an increment or a decrement.
+ * @param delta is 1 or -1.
+ * @param post is non-zero if the old value is the result.
+ */
+static void compile_step(struct bytecode *bc, struct expr *expr, int delta, int post) {
+  struct expr *operand = expr->expr;
+  int boolean = expr->value_type == BOOLEAN;
+
+  if (operand->type != VARIABLE) {
+    compile_expr(bc, operand);
+    if (!post) {
+      emit(bc, OP_PUSH, delta);
+      emit(bc, OP_ADD, 0);
+      if (boolean) {
+        emit(bc, OP_PUSH, 1);
+        emit(bc, OP_AND, 0);
+      }
+    }
+    return;
+  }
+
+  if (post) {
+    emit(bc, OP_LOAD, operand->id);
+  }
+  emit(bc, OP_LOAD, operand->id);
+  emit(bc, OP_PUSH, delta);
+  emit(bc, OP_ADD, 0);
+  if (boolean) {
+    // i1 arithmetic wraps around
+    emit(bc, OP_PUSH, 1);
+    emit(bc, OP_AND, 0);
+  }
+  emit(bc, OP_STORE, operand->id);
+  if (!post) {
+    emit(bc, OP_LOAD, operand->id);
+  }
+}
+
+/**
+ * @brief
+ * It compiles an expression, leaving its value on the stack.
+ * @param bc is a bytecode.
+ * @param expr is an expression.
+ */
+static void compile_expr(struct bytecode *bc, struct expr *expr) {
+  switch (expr->type) {
+    case BOOL_LIT:
+    case LITERAL:
+      emit(bc, OP_PUSH, expr->value);
+      break;
+
+    case VARIABLE:
+      emit(bc, OP_LOAD, expr->id);
+      break;
+
+    case PRE_INCREMENT_OP:  compile_step(bc, expr, 1, 0);  break;
+    case POST_INCREMENT_OP: compile_step(bc, expr, 1, 1);  break;
+    case PRE_DECREMENT_OP:  compile_step(bc, expr, -1, 0); break;
+    case POST_DECREMENT_OP: compile_step(bc, expr, -1, 1); break;
+
+    case BIN_OP:
+      compile_expr(bc, expr->binop.lhs);
+      if (is_short_circuit(expr)) {
+        // a && b is a ? b : false, a || b is a ? true : b
+        size_t to_short = emit_jump(bc, expr->binop.op == AND ? OP_JZ : OP_JNZ, 0);
+        compile_expr(bc, expr->binop.rhs);
+        size_t to_end = emit_jump(bc, OP_JUMP, 0);
+        bc->depth--; // only one of the two values is pushed
+        bc->code[to_short] = label(bc);
+        emit(bc, OP_PUSH, expr->binop.op == OR);
+        bc->code[to_end] = label(bc);
+        break;
+      }
+      compile_expr(bc, expr->binop.rhs);
+      switch (expr->binop.op) {
+        case '+': emit(bc, OP_ADD, 0); break;
+        case '-': emit(bc, OP_SUB, 0); break;
+        case '*': emit(bc, OP_MUL, 0); break;
+        case '/': emit(bc, OP_DIV, 0); break;
+        case REMAINDER: emit(bc, OP_REM, 0); break;
+        case EQ:  emit(bc, OP_EQ, 0); break;
+        case NE:  emit(bc, OP_NE, 0); break;
+        case GE:  emit(bc, OP_GE, 0); break;
+        case LE:  emit(bc, OP_LE, 0); break;
+        case '>': emit(bc, OP_GT, 0); break;
+        case '<': emit(bc, OP_LT, 0); break;
+        case AND: emit(bc, OP_AND, 0); break;
+        case OR:  emit(bc, OP_OR, 0); break;
+        case XOR: emit(bc, OP_XOR, 0); break;
+        case LEFTSHIFT:  emit(bc, OP_SHL, 0); break;
+        case RIGHTSHIFT: emit(bc, OP_SHR, 0); break;
+      }
+      break;
+
+    case TERNARY_OP: {
+      compile_expr(bc, expr->ternary.lhs);
+      size_t to_else = emit_jump(bc, OP_JZ, 0);
+      compile_expr(bc, expr->ternary.mhs);
+      size_t to_end = emit_jump(bc, OP_JUMP, 0);
+      bc->depth--; // only one of the two values is pushed
+      bc->code[to_else] = label(bc);
+      compile_expr(bc, expr->ternary.rhs);
+      bc->code[to_end] = label(bc);
+      break;
+    }
+
+    // The parser rejects arrays and functions in the VM modes.
+    case ELEMENT:
+    case CALL:
+      abort();
+  }
+}
+
+/**
+ * @brief
+ * It records a while loop.
+ * @param bc is a bytecode.
+ * @param stmt is a while statement.
+ * @return int32_t is the number of the loop.
+ */
+static int32_t add_loop(struct bytecode *bc, struct stmt *stmt) {
+  if (bc->n_loops == bc->loops_capacity) {
+    bc->loops_capacity = bc->loops_capacity ? 2 * bc->loops_capacity : 8;
+    bc->loops = realloc(bc->loops, bc->loops_capacity * sizeof(bc->loops[0]));
+  }
+  bc->loops[bc->n_loops] = stmt;
+  return bc->n_loops++;
+}
+
+/**
+ * @brief
+ * It compiles a statement.
+ * @param bc is a bytecode.
+ * @param stmt is a statement.
+ */
+static void compile_stmt(struct bytecode *bc, struct stmt *stmt) {
+  switch (stmt->type) {
+    case STMT_SEQ:
+      for (size_t i = 0; i < stmt->seq.len; i++) {
+        compile_stmt(bc, stmt->seq.stmts[i]);
+      }
+      break;
+
+    case STMT_ASSIGN:
+      compile_expr(bc, stmt->assign.expr);
+      emit(bc, OP_STORE, stmt->assign.id);
+      break;
+
+    case STMT_PRINT:
+      compile_expr(bc, stmt->print.expr);
+      emit(bc, stmt->print.expr->value_type == BOOLEAN ? OP_PRINT_I1 : OP_PRINT_I32, 0);
+      break;
+
+    case STMT_IF: {
+      compile_expr(bc, stmt->ifelse.cond);
+      size_t to_else = emit_jump(bc, OP_JZ, 0);
+      compile_stmt(bc, stmt->ifelse.if_body);
+      if (stmt->ifelse.else_body) {
+        size_t to_end = emit_jump(bc, OP_JUMP, 0);
+        bc->code[to_else] = label(bc);
+        compile_stmt(bc, stmt->ifelse.else_body);
+        bc->code[to_end] = label(bc);
+      } else {
+        bc->code[to_else] = label(bc);
+      }
+      break;
+    }
+
+    case STMT_WHILE: {
+      // The condition is at the bottom, so that an iteration runs a single jump.
+      size_t to_cond = emit_jump(bc, OP_JUMP, 0);
+      size_t body = label(bc);
+      compile_stmt(bc, stmt->while_.body);
+      bc->code[to_cond] = label(bc);
+      size_t loop = bc->len;
+      if (bc->count_loops) {
+        append(bc, OP_LOOP, add_loop(bc, stmt), 0);
+      }
+      compile_expr(bc, stmt->while_.cond);
+      emit_jump(bc, OP_JNZ, body);
+      if (bc->count_loops) {
+        bc->code[loop + 2] = label(bc);
+      }
+      break;
+    }
+
+    // The parser rejects arrays, functions and parallel loops in the VM modes.
+    case STMT_STORE:
+    case STMT_ALLOC:
+    case STMT_CALL:
+    case STMT_RETURN:
+    case STMT_FOR:
+      abort();
+  }
+}
+
+/**
+ * @brief
+ * It compiles a whole program.
+ * @param bc is where the code is stored.
+ * @param stmt is the program.
+ * @param mem_size is the number of variables.
+ * @param count_loops is non-zero to emit a LOOP instruction in each while loop.
+ */
+void bytecode_compile(struct bytecode *bc, struct stmt *stmt, size_t mem_size, int count_loops) {
+  bc->code = NULL;
+  bc->len = 0;
+  bc->capacity = 0;
+  bc->max_depth = 0;
+  bc->mem_size = mem_size;
+  bc->depth = 0;
+  bc->n_recent = 0;
+  bc->loops = NULL;
+  bc->n_loops = 0;
+  bc->loops_capacity = 0;
+  bc->count_loops = count_loops;
+  bc->on_loop = NULL;
+  bc->ctx = NULL;
+
+  compile_stmt(bc, stmt);
+  emit(bc, OP_HALT, 0);
+}
+
+/**
+ * @brief
+ * It frees the code.
+ * @param bc is a bytecode.
+ */
+void bytecode_fini(struct bytecode *bc) {
+  free(bc->code);
+  free(bc->loops);
+}
+
+/**
+ * @brief
+ * It prints the code in the text format of emit_stack_machine.
+ * @param bc is a bytecode.
+ */
+void bytecode_dump(struct bytecode *bc) {
+  for (size_t pc = 0; pc < bc->len; pc += 1 + info[bc->code[pc]].operands) {
+    enum opcode op = bc->code[pc];
+    printf("%5zu: %s", pc, info[op].mnemonic);
+    for (int i = 1; i <= info[op].operands; i++) {
+      printf(" %d", bc->code[pc + i]);
+    }
+    if (op == OP_LOAD || op == OP_STORE || op == OP_STORE_IMM || op == OP_INCR || op == OP_PRINT_VAR) {
+      printf(" # %s", string_int_rev(&compilation->ids, bc->code[pc + 1]));
+    }
+    printf("\n");
+  }
+}
+
+/**
+ * @brief
+ * It runs a program until HALT.
+ * Arithmetic wraps around like the i32 operations of the generated code.
+ * @param bc is a bytecode.
+ * @param mem is the memory of the program, one slot per variable.
+ * @return uint64_t is the number of instructions executed.
+ */
+uint64_t bytecode_run(struct bytecode *bc, int32_t *mem) {
+#define OPCODE_LABEL(name, mnemonic, operands, effect) &&do_##name,
+  static const void *labels[OP_COUNT] = {
+    OPCODES(OPCODE_LABEL)
+  };
+#undef OPCODE_LABEL
+
+  int32_t *stack = malloc((bc->max_depth + 1) * sizeof(int32_t));
+  int32_t *sp = stack; // first free slot
+  const int32_t *code = bc->code;
+  const int32_t *pc = code;
+  uint64_t dispatches = 0;
+
+#define NEXT() do { dispatches++; goto *labels[*pc]; } while (0)
+#define WRAP(a, op, b) ((int32_t) ((uint32_t) (a) op (uint32_t) (b)))
+#define BINARY(name, expr) do_##name: { int32_t b = *--sp; int32_t a = sp[-1]; sp[-1] = (expr); pc += 1; NEXT(); }
+#define JUMP_IF(name, cmp) do_##name: { int32_t b = *--sp; int32_t a = *--sp; pc = (a cmp b) ? code + pc[1] : pc + 2; NEXT(); }
+#define JUMP_IF_IMM(name, cmp) do_##name: { int32_t a = *--sp; pc = (a cmp pc[1]) ? code + pc[2] : pc + 3; NEXT(); }
+
+  NEXT();
+
+  do_PUSH: *sp++ = pc[1]; pc += 2; NEXT();
+  do_LOAD: *sp++ = mem[pc[1]]; pc += 2; NEXT();
+  do_STORE: mem[pc[1]] = *--sp; pc += 2; NEXT();
+
+  BINARY(ADD, WRAP(a, +, b))
+  BINARY(SUB, WRAP(a, -, b))
+  BINARY(MUL, WRAP(a, *, b))
+  BINARY(DIV, a / b)
+  BINARY(REM, a % b)
+  BINARY(AND, a & b)
+  BINARY(OR, a | b)
+  BINARY(XOR, a ^ b)
+  BINARY(SHL, WRAP(a, <<, b & 31))
+  BINARY(SHR, (int32_t) ((uint32_t) a >> (b & 31)))
+  BINARY(EQ, a == b)
+  BINARY(NE, a != b)
+  BINARY(LT, a < b)
+  BINARY(LE, a <= b)
+  BINARY(GT, a > b)
+  BINARY(GE, a >= b)
+
+  do_JUMP: pc = code + pc[1]; NEXT();
+  do_JZ: pc = *--sp ? pc + 2 : code + pc[1]; NEXT();
+  do_JNZ: pc = *--sp ? code + pc[1] : pc + 2; NEXT();
+  do_LOOP: pc = bc->on_loop && bc->on_loop(bc->ctx, pc[1], mem) ? code + pc[2] : pc + 3; NEXT();
+  do_PRINT_I32: print_i32(*--sp); pc += 1; NEXT();
+  do_PRINT_I1: print_i1(*--sp & 1); pc += 1; NEXT();
+
+  do_ADD_IMM: sp[-1] = WRAP(sp[-1], +, pc[1]); pc += 2; NEXT();
+  do_SUB_IMM: sp[-1] = WRAP(sp[-1], -, pc[1]); pc += 2; NEXT();
+  do_MUL_IMM: sp[-1] = WRAP(sp[-1], *, pc[1]); pc += 2; NEXT();
+  do_STORE_IMM: mem[pc[1]] = pc[2]; pc += 3; NEXT();
+  do_INCR: mem[pc[1]] = WRAP(mem[pc[1]], +, pc[2]); pc += 3; NEXT();
+  do_PRINT_VAR: print_i32(mem[pc[1]]); pc += 2; NEXT();
+
+  JUMP_IF(JEQ, ==)
+  JUMP_IF(JNE, !=)
+  JUMP_IF(JLT, <)
+  JUMP_IF(JLE, <=)
+  JUMP_IF(JGT, >)
+  JUMP_IF(JGE, >=)
+  JUMP_IF_IMM(JEQ_IMM, ==)
+  JUMP_IF_IMM(JNE_IMM, !=)
+  JUMP_IF_IMM(JLT_IMM, <)
+  JUMP_IF_IMM(JLE_IMM, <=)
+  JUMP_IF_IMM(JGT_IMM, >)
+  JUMP_IF_IMM(JGE_IMM, >=)
+
+  do_HALT:
+  free(stack);
+  return dispatches;
+
+#undef NEXT
+#undef WRAP
+#undef BINARY
+#undef JUMP_IF
+#undef JUMP_IF_IMM
+}
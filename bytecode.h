@@ -0,0 +1,101 @@
+/**
+ * @file bytecode.h
+ * @brief
+ * Binary encoding of the stack machine of emit_stack_machine, and its interpreter.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief
+ * Instructions of the stack machine: name, mnemonic, number of operands and stack effect.
+ * The operands follow the opcode in the code array. The instructions after HALT are
+ * superinstructions that the compiler builds out of common sequences.
+ */
+#define OPCODES(X)                                                               \
+  X(PUSH,       "load_imm",       1, +1) /* k:     push k                     */ \
+  X(LOAD,       "load_mem",       1, +1) /* id:    push mem[id]               */ \
+  X(STORE,      "store_mem",      1, -1) /* id:    mem[id] = pop              */ \
+  X(ADD,        "add",            0, -1)                                         \
+  X(SUB,        "sub",            0, -1)                                         \
+  X(MUL,        "mul",            0, -1)                                         \
+  X(DIV,        "div",            0, -1)                                         \
+  X(REM,        "remainder",      0, -1)                                         \
+  X(AND,        "and",            0, -1)                                         \
+  X(OR,         "or",             0, -1)                                         \
+  X(XOR,        "xor",            0, -1)                                         \
+  X(SHL,        "leftshift",      0, -1)                                         \
+  X(SHR,        "rightshift",     0, -1)                                         \
+  X(EQ,         "eq",             0, -1)                                         \
+  X(NE,         "ne",             0, -1)                                         \
+  X(LT,         "lt",             0, -1)                                         \
+  X(LE,         "le",             0, -1)                                         \
+  X(GT,         "gt",             0, -1)                                         \
+  X(GE,         "ge",             0, -1)                                         \
+  X(JUMP,       "jump",           1,  0) /* t:     pc = t                     */ \
+  X(JZ,         "jump_if_false",  1, -1) /* t:     if (!pop) pc = t           */ \
+  X(JNZ,        "jump_if_true",   1, -1) /* t:     if (pop) pc = t            */ \
+  X(LOOP,       "loop",           2,  0) /* n t:   while n, t is its exit     */ \
+  X(PRINT_I32,  "print_i32",      0, -1)                                         \
+  X(PRINT_I1,   "print_i1",       0, -1)                                         \
+  X(HALT,       "halt",           0,  0)                                         \
+  X(ADD_IMM,    "add_imm",        1,  0) /* k:     top += k                   */ \
+  X(SUB_IMM,    "sub_imm",        1,  0) /* k:     top -= k                   */ \
+  X(MUL_IMM,    "mul_imm",        1,  0) /* k:     top *= k                   */ \
+  X(STORE_IMM,  "store_imm",      2,  0) /* id k:  mem[id] = k                */ \
+  X(INCR,       "incr",           2,  0) /* id k:  mem[id] += k               */ \
+  X(PRINT_VAR,  "print_mem",      1,  0) /* id:    print_i32(mem[id])         */ \
+  X(JEQ,        "jump_if_eq",     1, -2) /* t:     compare two, jump if true  */ \
+  X(JNE,        "jump_if_ne",     1, -2)                                         \
+  X(JLT,        "jump_if_lt",     1, -2)                                         \
+  X(JLE,        "jump_if_le",     1, -2)                                         \
+  X(JGT,        "jump_if_gt",     1, -2)                                         \
+  X(JGE,        "jump_if_ge",     1, -2)                                         \
+  X(JEQ_IMM,    "jump_if_eq_imm", 2, -1) /* k t:   compare top with k         */ \
+  X(JNE_IMM,    "jump_if_ne_imm", 2, -1)                                         \
+  X(JLT_IMM,    "jump_if_lt_imm", 2, -1)                                         \
+  X(JLE_IMM,    "jump_if_le_imm", 2, -1)                                         \
+  X(JGT_IMM,    "jump_if_gt_imm", 2, -1)                                         \
+  X(JGE_IMM,    "jump_if_ge_imm", 2, -1)
+
+#define OPCODE_ENUM(name, mnemonic, operands, effect) OP_##name,
+enum opcode {
+  OPCODES(OPCODE_ENUM)
+  OP_COUNT
+};
+#undef OPCODE_ENUM
+
+/**
+ * @brief
+ * A compiled program: the code, the size of the stack it needs and the size of its memory.
+ */
+struct bytecode {
+  int32_t *code;
+  size_t len;
+  size_t capacity;
+  size_t max_depth;
+  size_t mem_size;
+
+  // while loops, with a LOOP instruction before their condition when they are counted
+  struct stmt **loops;
+  size_t n_loops;
+  size_t loops_capacity;
+  int count_loops;
+
+  // called by LOOP, it returns non-zero if it ran the rest of the loop itself
+  int (*on_loop)(void *ctx, int32_t loop, int32_t *mem);
+  void *ctx;
+
+  // state of the compiler
+  size_t depth;
+  size_t recent[3]; // start of the last instructions emitted since the last jump target, most recent first
+  size_t n_recent;
+};
+
+struct stmt;
+
+void bytecode_compile(struct bytecode *bc, struct stmt *stmt, size_t mem_size, int count_loops);
+void bytecode_fini(struct bytecode *bc);
+void bytecode_dump(struct bytecode *bc);
+uint64_t bytecode_run(struct bytecode *bc, int32_t *mem);
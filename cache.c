@@ -0,0 +1,428 @@
+/**
+ * @file cache.c
+ * @brief
+ * On-disk cache of the machine code generated for a program.
+ *
+ * Object files are stored as <key>.o in $COMPILER_CACHE_DIR (by default $XDG_CACHE_HOME/compiler,
+ * or ~/.cache/compiler). The key is a hash of the source text, the options that change the code,
+ * the host CPU and the build of the compiler (its GNU build id, or a hash of its executable),
+ * so the objects of another build are never reused. The source is stored next to the object,
+ * as <key>.src, and compared on lookup, so two programs whose keys collide are told apart.
+ * When the cache grows over $COMPILER_CACHE_SIZE bytes (64 MiB by default), the least recently
+ * used objects are removed.
+ */
+
+#include <dirent.h>
+#include <link.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/TargetMachine.h>
+#include <llvm/Config/llvm-config.h>
+#include "cache.h"
+
+#define COMPILER_VERSION "0.1 LLVM " LLVM_VERSION_STRING
+#define DEFAULT_CACHE_SIZE (64 * 1024 * 1024)
+
+static char cache_dir[4096];
+static int hit = -1; // -1 if the cache has not been used by this run
+
+/**
+ * @brief
+ * FNV-1a over a buffer, continuing from a previous hash.
+ * @param h is the previous hash.
+ * @param data is a buffer.
+ * @param len is the length of the buffer.
+ * @return uint64_t
+ */
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len) {
+  const unsigned char *p = data;
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 0x100000001b3;
+  }
+  return h;
+}
+
+/**
+ * @brief
+ * It hashes the GNU build id of the compiler, when the linker gave it one.
+ * @param info is an object loaded in the process, the executable comes first.
+ * @param size is the size of info.
+ * @param data is where the hash is stored, left at zero without a build id.
+ * @return int is non-zero to stop after the executable.
+ */
+static int hash_build_id(struct dl_phdr_info *info, size_t size, void *data) {
+  (void) size;
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+    if (phdr->p_type != PT_NOTE) {
+      continue;
+    }
+    const char *note = (const char *) (info->dlpi_addr + phdr->p_vaddr);
+    const char *end = note + phdr->p_memsz;
+    while (note + sizeof(ElfW(Nhdr)) <= end) {
+      const ElfW(Nhdr) *nhdr = (const ElfW(Nhdr) *) note;
+      const char *name = note + sizeof(*nhdr);
+      const char *desc = name + ((nhdr->n_namesz + 3) & ~3u);
+      if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 && !memcmp(name, "GNU", 4)) {
+        *(uint64_t *) data = hash_bytes(0xcbf29ce484222325, desc, nhdr->n_descsz);
+        return 1;
+      }
+      note = desc + ((nhdr->n_descsz + 3) & ~3u);
+    }
+  }
+  return 1;
+}
+
+/**
+ * @brief
+ * It identifies the build of the compiler: its build id, or else the bytes of its executable.
+ * @return uint64_t is a hash of it.
+ */
+static uint64_t compiler_build(void) {
+  static uint64_t build;
+
+  if (!build) {
+    dl_iterate_phdr(hash_build_id, &build);
+  }
+  if (!build) {
+    FILE *f = fopen("/proc/self/exe", "rb");
+    build = 0xcbf29ce484222325;
+    if (f) {
+      char buffer[65536];
+      size_t n;
+      while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        build = hash_bytes(build, buffer, n);
+      }
+      fclose(f);
+    }
+  }
+  return build;
+}
+
+/**
+ * @brief
+ * It finds the cache directory and creates it (with its parents) if needed.
+ * @return const char* is NULL if there is no usable directory.
+ */
+static const char *get_cache_dir(void) {
+  if (!cache_dir[0]) {
+    const char *dir = getenv("COMPILER_CACHE_DIR");
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    if (dir && *dir) {
+      snprintf(cache_dir, sizeof(cache_dir), "%s", dir);
+    } else if (xdg && *xdg) {
+      snprintf(cache_dir, sizeof(cache_dir), "%s/compiler", xdg);
+    } else if (home && *home) {
+      snprintf(cache_dir, sizeof(cache_dir), "%s/.cache/compiler", home);
+    } else {
+      return NULL;
+    }
+
+    for (char *p = cache_dir + 1; *p; p++) {
+      if (*p == '/') {
+        *p = 0;
+        mkdir(cache_dir, 0755);
+        *p = '/';
+      }
+    }
+    mkdir(cache_dir, 0755);
+  }
+  return cache_dir;
+}
+
+/**
+ * @brief
+ * It adds one hit or one miss to the counters kept in the "stats" file of the cache.
+ * @param dir is the cache directory.
+ * @param is_hit is non-zero for a hit.
+ */
+static void count(const char *dir, int is_hit) {
+  char path[4096 + 16];
+  unsigned long hits = 0, misses = 0;
+  FILE *f;
+
+  snprintf(path, sizeof(path), "%s/stats", dir);
+  if ((f = fopen(path, "r"))) {
+    if (fscanf(f, "%lu %lu", &hits, &misses) != 2) {
+      hits = misses = 0;
+    }
+    fclose(f);
+  }
+  if (is_hit) {
+    hits++;
+  } else {
+    misses++;
+  }
+  if ((f = fopen(path, "w"))) {
+    fprintf(f, "%lu %lu\n", hits, misses);
+    fclose(f);
+  }
+  hit = is_hit;
+}
+
+/**
+ * @brief
+ * It computes the cache key of a program.
+ * @param source is the source text.
+ * @param len is the length of the source text.
+ * @param opt_level is the optimization level.
+ * @param external_runtime is non-zero if the runtime is not linked into the program.
+ * @return uint64_t
+ */
+uint64_t cache_key(const char *source, size_t len, int opt_level, int external_runtime) {
+  uint64_t h = 0xcbf29ce484222325;
+  char *cpu = LLVMGetHostCPUName();
+  char *features = LLVMGetHostCPUFeatures();
+
+  uint64_t build = compiler_build();
+
+  h = hash_bytes(h, COMPILER_VERSION, sizeof(COMPILER_VERSION));
+  h = hash_bytes(h, &build, sizeof(build));
+  h = hash_bytes(h, cpu, strlen(cpu) + 1);
+  h = hash_bytes(h, features, strlen(features) + 1);
+  h = hash_bytes(h, &opt_level, sizeof(opt_level));
+  h = hash_bytes(h, &external_runtime, sizeof(external_runtime));
+  h = hash_bytes(h, source, len);
+
+  // The runtime is part of the object when it is linked in.
+  if (!external_runtime) {
+    FILE *f = fopen("runtime.bc", "rb");
+    if (f) {
+      char buffer[4096];
+      size_t n;
+      while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        h = hash_bytes(h, buffer, n);
+      }
+      fclose(f);
+    }
+  }
+
+  LLVMDisposeMessage(cpu);
+  LLVMDisposeMessage(features);
+  return h;
+}
+
+/**
+ * @brief
+ * It compares the source stored with an object to the program, byte for byte.
+ * @param path is the source stored with an object.
+ * @param source is the source text of the program.
+ * @param len is its length.
+ * @return int is non-zero if they are the same.
+ */
+static int same_source(const char *path, const char *source, size_t len) {
+  FILE *f = fopen(path, "rb");
+  char buffer[4096];
+  size_t n, offset = 0;
+  int same = f != NULL;
+
+  while (same && (n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    same = offset + n <= len && !memcmp(buffer, source + offset, n);
+    offset += n;
+  }
+  if (f) {
+    fclose(f);
+  }
+  return same && offset == len;
+}
+
+/**
+ * @brief
+ * It looks for the object of a program in the cache.
+ * @param key is the cache key of the program.
+ * @param source is the source text of the program.
+ * @param len is its length.
+ * @return LLVMMemoryBufferRef is the object file, NULL on a miss.
+ */
+LLVMMemoryBufferRef cache_lookup(uint64_t key, const char *source, size_t len) {
+  const char *dir = get_cache_dir();
+  char path[4096 + 32], source_path[4096 + 32];
+  char *error = NULL;
+  LLVMMemoryBufferRef buffer;
+
+  if (!dir) {
+    return NULL;
+  }
+
+  snprintf(path, sizeof(path), "%s/%016llx.o", dir, (unsigned long long) key);
+  snprintf(source_path, sizeof(source_path), "%s/%016llx.src", dir, (unsigned long long) key);
+  if (!same_source(source_path, source, len)) {
+    count(dir, 0);
+    return NULL;
+  }
+  if (LLVMCreateMemoryBufferWithContentsOfFile(path, &buffer, &error)) {
+    LLVMDisposeMessage(error);
+    count(dir, 0);
+    return NULL;
+  }
+
+  // Refresh the modification time, it is the age used by the eviction.
+  utime(path, NULL);
+  count(dir, 1);
+  return buffer;
+}
+
+/**
+ * @brief
+ * Entry of the cache directory, used by the eviction.
+ */
+struct cache_entry {
+  char name[32];
+  off_t size;
+  time_t mtime;
+};
+
+/**
+ * @brief
+ * It orders entries from the least to the most recently used.
+ */
+static int by_age(const void *a, const void *b) {
+  const struct cache_entry *x = a, *y = b;
+  return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+/**
+ * @brief
+ * It removes the least recently used objects until the cache fits in its size limit.
+ * @param dir is the cache directory.
+ */
+static void evict(const char *dir) {
+  const char *limit_env = getenv("COMPILER_CACHE_SIZE");
+  off_t limit = limit_env && *limit_env ? strtoll(limit_env, NULL, 10) : DEFAULT_CACHE_SIZE;
+  struct cache_entry *entries = NULL;
+  size_t count = 0, capacity = 0;
+  off_t total = 0;
+  struct dirent *d;
+  DIR *dp = opendir(dir);
+
+  if (!dp) {
+    return;
+  }
+
+  while ((d = readdir(dp))) {
+    char path[4096 + 300];
+    struct stat st;
+    size_t len = strlen(d->d_name);
+
+    if (len < 3 || len >= sizeof(entries[0].name) || strcmp(d->d_name + len - 2, ".o")) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir, d->d_name);
+    if (stat(path, &st)) {
+      continue;
+    }
+    if (count == capacity) {
+      capacity = capacity ? 2 * capacity : 64;
+      entries = realloc(entries, capacity * sizeof(entries[0]));
+    }
+    strcpy(entries[count].name, d->d_name);
+    entries[count].size = st.st_size;
+    entries[count].mtime = st.st_mtime;
+    // the source stored with the object
+    strcpy(path + strlen(path) - 2, ".src");
+    if (!stat(path, &st)) {
+      entries[count].size += st.st_size;
+    }
+    total += entries[count].size;
+    count++;
+  }
+  closedir(dp);
+
+  qsort(entries, count, sizeof(entries[0]), by_age);
+  for (size_t i = 0; i < count && total > limit; i++) {
+    char path[4096 + 64];
+    snprintf(path, sizeof(path), "%s/%.*s.src", dir, (int) strlen(entries[i].name) - 2, entries[i].name);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+    if (!unlink(path)) {
+      total -= entries[i].size;
+    }
+  }
+  free(entries);
+}
+
+/**
+ * @brief
+ * It writes a file of the cache to a temporary file and renames it, so concurrent runs never
+ * see half of it.
+ * @param path is the file.
+ * @param data is its content.
+ * @param size is its size.
+ * @return int is zero on success.
+ */
+static int write_file(const char *path, const void *data, size_t size) {
+  char tmp[4096 + 64];
+  FILE *f;
+
+  snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long) getpid());
+  if (!(f = fopen(tmp, "wb"))) {
+    return 1;
+  }
+  int ok = fwrite(data, 1, size, f) == size;
+  ok = !fclose(f) && ok;
+  if (!ok || rename(tmp, path)) {
+    unlink(tmp);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief
+ * It stores the object of a program and its source in the cache, then trims the cache to its
+ * size limit.
+ * @param key is the cache key of the program.
+ * @param source is the source text of the program.
+ * @param len is its length.
+ * @param object is the object file.
+ */
+void cache_store(uint64_t key, const char *source, size_t len, LLVMMemoryBufferRef object) {
+  const char *dir = get_cache_dir();
+  char path[4096 + 32];
+
+  if (!dir) {
+    return;
+  }
+
+  snprintf(path, sizeof(path), "%s/%016llx.src", dir, (unsigned long long) key);
+  if (write_file(path, source, len)) {
+    return;
+  }
+  snprintf(path, sizeof(path), "%s/%016llx.o", dir, (unsigned long long) key);
+  if (write_file(path, LLVMGetBufferStart(object), LLVMGetBufferSize(object))) {
+    return;
+  }
+
+  evict(dir);
+}
+
+/**
+ * @brief
+ * It prints the outcome of this run and the counters of the cache.
+ */
+void cache_report(void) {
+  const char *dir = get_cache_dir();
+  char path[4096 + 16];
+  unsigned long hits = 0, misses = 0;
+  FILE *f;
+
+  if (!dir || hit < 0) {
+    return;
+  }
+  snprintf(path, sizeof(path), "%s/stats", dir);
+  if ((f = fopen(path, "r"))) {
+    if (fscanf(f, "%lu %lu", &hits, &misses) != 2) {
+      hits = misses = 0;
+    }
+    fclose(f);
+  }
+  fprintf(stderr, "Cache %s (%lu hits, %lu misses) in %s\n", hit ? "hit" : "miss", hits, misses, dir);
+}
@@ -0,0 +1,13 @@
+/**
+ * @file cache.h
+ * @brief
+ * On-disk cache of the machine code generated for a program.
+ */
+
+#include <stdint.h>
+#include <llvm-c/Core.h>
+
+uint64_t cache_key(const char *source, size_t len, int opt_level, int external_runtime);
+LLVMMemoryBufferRef cache_lookup(uint64_t key, const char *source, size_t len);
+void cache_store(uint64_t key, const char *source, size_t len, LLVMMemoryBufferRef object);
+void cache_report(void);
@@ -0,0 +1,453 @@
+/**
+ * @file flat.c
+ * @brief
+ * Conversion of the pointer AST to the flat AST, and the passes over the flat AST.
+ * The passes mirror check_types, valid_stmt and print_stmt of ast.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "ast.h"
+#include "flat.h"
+#include "utils.h"
+
+/**
+ * @brief
+ * It grows a column.
+ * @param column is the array.
+ * @param size is the size of an element.
+ * @param capacity is the new number of elements.
+ * @return void* is the grown array.
+ */
+static void *grow(void *column, size_t size, size_t capacity) {
+  return realloc(column, capacity * size);
+}
+
+/**
+ * @brief
+ * It initializes an empty flat AST.
+ * @param ast is a flat AST.
+ */
+void flat_init(struct flat_ast *ast) {
+  struct flat_exprs exprs = { 0 };
+  struct flat_stmts stmts = { 0 };
+  ast->exprs = exprs;
+  ast->stmts = stmts;
+  ast->root = FLAT_NONE;
+}
+
+/**
+ * @brief
+ * It frees the columns.
+ * @param ast is a flat AST.
+ */
+void flat_fini(struct flat_ast *ast) {
+  struct flat_exprs *e = &ast->exprs;
+  struct flat_stmts *s = &ast->stmts;
+
+  free(e->kind);
+  free(e->value_type);
+  free(e->op);
+  free(e->value);
+  free(e->lhs);
+  free(e->mhs);
+  free(e->rhs);
+  free(s->kind);
+  free(s->expr);
+  free(s->fst);
+  free(s->snd);
+  free(s->id);
+  free(s->children);
+  flat_init(ast);
+}
+
+/**
+ * @brief
+ * It appends an expression node.
+ * @return uint32_t is its index.
+ */
+static uint32_t push_expr(struct flat_ast *ast, int kind, int value_type, int op, int32_t value,
+                          uint32_t lhs, uint32_t mhs, uint32_t rhs) {
+  struct flat_exprs *e = &ast->exprs;
+
+  if (e->len == e->capacity) {
+    e->capacity = e->capacity ? 2 * e->capacity : 1024;
+    e->kind = grow(e->kind, sizeof(e->kind[0]), e->capacity);
+    e->value_type = grow(e->value_type, sizeof(e->value_type[0]), e->capacity);
+    e->op = grow(e->op, sizeof(e->op[0]), e->capacity);
+    e->value = grow(e->value, sizeof(e->value[0]), e->capacity);
+    e->lhs = grow(e->lhs, sizeof(e->lhs[0]), e->capacity);
+    e->mhs = grow(e->mhs, sizeof(e->mhs[0]), e->capacity);
+    e->rhs = grow(e->rhs, sizeof(e->rhs[0]), e->capacity);
+  }
+  e->kind[e->len] = kind;
+  e->value_type[e->len] = value_type;
+  e->op[e->len] = op;
+  e->value[e->len] = value;
+  e->lhs[e->len] = lhs;
+  e->mhs[e->len] = mhs;
+  e->rhs[e->len] = rhs;
+  return e->len++;
+}
+
+/**
+ * @brief
+ * It appends a statement node.
+ * @return uint32_t is its index.
+ */
+static uint32_t push_stmt(struct flat_ast *ast, int kind, uint32_t expr, uint32_t fst, uint32_t snd, uint32_t id) {
+  struct flat_stmts *s = &ast->stmts;
+
+  if (s->len == s->capacity) {
+    s->capacity = s->capacity ? 2 * s->capacity : 256;
+    s->kind = grow(s->kind, sizeof(s->kind[0]), s->capacity);
+    s->expr = grow(s->expr, sizeof(s->expr[0]), s->capacity);
+    s->fst = grow(s->fst, sizeof(s->fst[0]), s->capacity);
+    s->snd = grow(s->snd, sizeof(s->snd[0]), s->capacity);
+    s->id = grow(s->id, sizeof(s->id[0]), s->capacity);
+  }
+  s->kind[s->len] = kind;
+  s->expr[s->len] = expr;
+  s->fst[s->len] = fst;
+  s->snd[s->len] = snd;
+  s->id[s->len] = id;
+  return s->len++;
+}
+
+/**
+ * @brief
+ * It copies an expression of the pointer AST, children first.
+ * @param ast is a flat AST.
+ * @param expr is an expression.
+ * @return uint32_t is the index of its copy.
+ */
+uint32_t flat_add_expr(struct flat_ast *ast, struct expr *expr) {
+  switch (expr->type) {
+    case BOOL_LIT:
+    case LITERAL:
+      return push_expr(ast, expr->type, UNTYPED, 0, expr->value, FLAT_NONE, FLAT_NONE, FLAT_NONE);
+
+    case VARIABLE:
+      return push_expr(ast, expr->type, UNTYPED, 0, expr->id, FLAT_NONE, FLAT_NONE, FLAT_NONE);
+
+    case BIN_OP: {
+      uint32_t lhs = flat_add_expr(ast, expr->binop.lhs);
+      uint32_t rhs = flat_add_expr(ast, expr->binop.rhs);
+      return push_expr(ast, BIN_OP, UNTYPED, expr->binop.op, 0, lhs, FLAT_NONE, rhs);
+    }
+
+    case TERNARY_OP: {
+      uint32_t lhs = flat_add_expr(ast, expr->ternary.lhs);
+      uint32_t mhs = flat_add_expr(ast, expr->ternary.mhs);
+      uint32_t rhs = flat_add_expr(ast, expr->ternary.rhs);
+      return push_expr(ast, TERNARY_OP, UNTYPED, 0, 0, lhs, mhs, rhs);
+    }
+
+    case PRE_INCREMENT_OP:
+    case POST_INCREMENT_OP:
+    case PRE_DECREMENT_OP:
+    case POST_DECREMENT_OP: {
+      uint32_t operand = flat_add_expr(ast, expr->expr);
+      return push_expr(ast, expr->type, UNTYPED, 0, 0, operand, FLAT_NONE, FLAT_NONE);
+    }
+
+    // The flat AST only covers the programs of the benchmark, without arrays or functions.
+    case ELEMENT:
+    case CALL:
+      fprintf(stderr, "The flat AST does not support arrays and functions\n");
+      abort();
+  }
+  abort();
+}
+
+/**
+ * @brief
+ * It copies a statement of the pointer AST, children first.
+ * @param ast is a flat AST.
+ * @param stmt is a statement.
+ * @return uint32_t is the index of its copy.
+ */
+uint32_t flat_add_stmt(struct flat_ast *ast, struct stmt *stmt) {
+  switch (stmt->type) {
+    case STMT_SEQ: {
+      // The nested blocks add their own children, so the range is only appended at the end.
+      struct flat_stmts *s = &ast->stmts;
+      uint32_t *children = malloc((stmt->seq.len + 1) * sizeof(children[0]));
+      for (size_t i = 0; i < stmt->seq.len; i++) {
+        children[i] = flat_add_stmt(ast, stmt->seq.stmts[i]);
+      }
+      if (s->n_children + stmt->seq.len > s->children_capacity) {
+        s->children_capacity = 2 * (s->n_children + stmt->seq.len);
+        s->children = grow(s->children, sizeof(s->children[0]), s->children_capacity);
+      }
+      uint32_t first = s->n_children;
+      for (size_t i = 0; i < stmt->seq.len; i++) {
+        s->children[s->n_children++] = children[i];
+      }
+      free(children);
+      return push_stmt(ast, STMT_SEQ, FLAT_NONE, first, stmt->seq.len, 0);
+    }
+
+    case STMT_ASSIGN: {
+      uint32_t expr = flat_add_expr(ast, stmt->assign.expr);
+      return push_stmt(ast, STMT_ASSIGN, expr, FLAT_NONE, FLAT_NONE, stmt->assign.id);
+    }
+
+    case STMT_PRINT: {
+      uint32_t expr = flat_add_expr(ast, stmt->print.expr);
+      return push_stmt(ast, STMT_PRINT, expr, FLAT_NONE, FLAT_NONE, 0);
+    }
+
+    case STMT_WHILE: {
+      uint32_t cond = flat_add_expr(ast, stmt->while_.cond);
+      uint32_t body = flat_add_stmt(ast, stmt->while_.body);
+      return push_stmt(ast, STMT_WHILE, cond, body, FLAT_NONE, 0);
+    }
+
+    case STMT_IF: {
+      uint32_t cond = flat_add_expr(ast, stmt->ifelse.cond);
+      uint32_t if_body = flat_add_stmt(ast, stmt->ifelse.if_body);
+      uint32_t else_body = stmt->ifelse.else_body ? flat_add_stmt(ast, stmt->ifelse.else_body) : FLAT_NONE;
+      return push_stmt(ast, STMT_IF, cond, if_body, else_body, 0);
+    }
+
+    case STMT_STORE:
+    case STMT_ALLOC:
+    case STMT_CALL:
+    case STMT_RETURN:
+    case STMT_FOR:
+      fprintf(stderr, "The flat AST does not support arrays, functions and parallel loops\n");
+      abort();
+  }
+  abort();
+}
+
+/**
+ * @brief
+ * It copies a whole program.
+ * @param ast is an empty flat AST.
+ * @param root is the program.
+ */
+void flat_from_tree(struct flat_ast *ast, struct stmt *root) {
+  ast->root = flat_add_stmt(ast, root);
+}
+
+/**
+ * @brief
+ * It computes the type of every expression with the rules of check_types, in a single loop
+ * since the operands come first.
+ * @param ast is a flat AST.
+ * @return size_t is the number of ill-typed expressions.
+ */
+size_t flat_check_types(struct flat_ast *ast) {
+  struct flat_exprs *e = &ast->exprs;
+  size_t n_vars = string_int_count(&compilation->ids);
+  int8_t *var_types = malloc(n_vars + 1);
+  size_t errors = 0;
+
+  for (size_t i = 0; i < n_vars; i++) {
+    LLVMValueRef ptr = vector_get(&compilation->types, i);
+    var_types[i] = LLVMGetIntTypeWidth(LLVMGetElementType(LLVMTypeOf(ptr))) == 1 ? BOOLEAN : INTEGER;
+  }
+
+  int8_t *t = e->value_type;
+  for (size_t i = 0; i < e->len; i++) {
+    int8_t type = ERROR;
+
+    switch (e->kind[i]) {
+      case BOOL_LIT: type = BOOLEAN; break;
+      case LITERAL: type = INTEGER; break;
+      case VARIABLE: type = var_types[e->value[i]]; break;
+
+      case BIN_OP: {
+        int8_t lhs = t[e->lhs[i]];
+        int8_t rhs = t[e->rhs[i]];
+        switch (e->op[i]) {
+          case '+':
+          case '-':
+          case '*':
+          case '/':
+            type = lhs == INTEGER && rhs == INTEGER ? INTEGER : ERROR;
+            break;
+          case EQ:
+          case NE:
+            type = lhs == rhs && lhs != ERROR ? BOOLEAN : ERROR;
+            break;
+          case GE:
+          case LE:
+          case '>':
+          case '<':
+            type = lhs == INTEGER && rhs == INTEGER ? BOOLEAN : ERROR;
+            break;
+          case AND:
+          case OR:
+          case XOR:
+          case REMAINDER:
+          case RIGHTSHIFT:
+          case LEFTSHIFT:
+            type = lhs == rhs && (lhs == BOOLEAN || lhs == INTEGER) ? lhs : ERROR;
+            break;
+        }
+        break;
+      }
+
+      case TERNARY_OP: {
+        int8_t mhs = t[e->mhs[i]];
+        type = t[e->lhs[i]] == BOOLEAN && mhs == t[e->rhs[i]] && mhs != ERROR ? mhs : ERROR;
+        break;
+      }
+
+      default:
+        type = t[e->lhs[i]];
+    }
+
+    t[i] = type;
+    errors += type == ERROR;
+  }
+
+  free(var_types);
+  return errors;
+}
+
+/**
+ * @brief
+ * It checks the statements like valid_stmt, once flat_check_types has run.
+ * Validity is the conjunction of the checks of every statement, so it is a loop too.
+ * @param ast is a flat AST.
+ * @return int is non-zero if the program is valid.
+ */
+int flat_valid(struct flat_ast *ast) {
+  struct flat_stmts *s = &ast->stmts;
+  int8_t *t = ast->exprs.value_type;
+
+  for (size_t i = 0; i < s->len; i++) {
+    switch (s->kind[i]) {
+      case STMT_ASSIGN:
+      case STMT_PRINT:
+        if (t[s->expr[i]] == ERROR) {
+          return 0;
+        }
+        break;
+      case STMT_IF:
+      case STMT_WHILE:
+        if (t[s->expr[i]] != BOOLEAN) {
+          return 0;
+        }
+        break;
+    }
+  }
+  return 1;
+}
+
+/**
+ * @brief
+ * It adds up the integer literals: a walk that touches every expression, to compare with the pointer AST.
+ * @param ast is a flat AST.
+ * @return int64_t is the sum.
+ */
+int64_t flat_sum_literals(struct flat_ast *ast) {
+  struct flat_exprs *e = &ast->exprs;
+  int64_t sum = 0;
+
+  for (size_t i = 0; i < e->len; i++) {
+    sum += e->kind[i] == LITERAL ? e->value[i] : 0;
+  }
+  return sum;
+}
+
+/**
+ * @brief
+ * It prints an expression like print_expr.
+ * @param ast is a flat AST.
+ * @param expr is the index of an expression.
+ */
+void flat_print_expr(struct flat_ast *ast, uint32_t expr) {
+  struct flat_exprs *e = &ast->exprs;
+
+  switch (e->kind[expr]) {
+    case BOOL_LIT:
+      printf("%s", e->value[expr] ? "true" : "false");
+      break;
+
+    case LITERAL:
+      printf("%d", e->value[expr]);
+      break;
+
+    case VARIABLE:
+      printf("%s", string_int_rev(&compilation->ids, e->value[expr]));
+      break;
+
+    case BIN_OP:
+      printf("(");
+      flat_print_expr(ast, e->lhs[expr]);
+      switch (e->op[expr]) {
+        case EQ: printf(" == "); break;
+        case NE: printf(" != "); break;
+        case GE: printf(" >= "); break;
+        case LE: printf(" <= "); break;
+        case AND: printf(" && "); break;
+        case OR: printf(" || "); break;
+        case XOR: printf(" ^ "); break;
+        case REMAINDER: printf(" %% "); break;
+        case RIGHTSHIFT: printf(" >> "); break;
+        case LEFTSHIFT: printf(" << "); break;
+        default: printf(" %c ", e->op[expr]); break;
+      }
+      flat_print_expr(ast, e->rhs[expr]);
+      printf(")");
+      break;
+
+    case TERNARY_OP:
+      flat_print_expr(ast, e->lhs[expr]);
+      printf(" ? ");
+      flat_print_expr(ast, e->mhs[expr]);
+      printf(" : ");
+      flat_print_expr(ast, e->rhs[expr]);
+      break;
+
+    default:
+      flat_print_expr(ast, e->lhs[expr]);
+  }
+}
+
+/**
+ * @brief
+ * It prints a statement like print_stmt.
+ * @param ast is a flat AST.
+ * @param stmt is the index of a statement.
+ * @param indent is the indentation level.
+ */
+void flat_print_stmt(struct flat_ast *ast, uint32_t stmt, int indent) {
+  struct flat_stmts *s = &ast->stmts;
+
+  switch (s->kind[stmt]) {
+    case STMT_SEQ:
+      for (uint32_t i = 0; i < s->snd[stmt]; i++) {
+        flat_print_stmt(ast, s->children[s->fst[stmt] + i], indent);
+      }
+      return;
+
+    case STMT_WHILE:
+    case STMT_IF:
+      printf("%*s%s (", 2 * indent, "", s->kind[stmt] == STMT_IF ? "if" : "while");
+      flat_print_expr(ast, s->expr[stmt]);
+      printf(") {\n");
+      flat_print_stmt(ast, s->fst[stmt], indent + 1);
+      if (s->kind[stmt] == STMT_IF && s->snd[stmt] != FLAT_NONE) {
+        printf("%*s} else {\n", 2 * indent, "");
+        flat_print_stmt(ast, s->snd[stmt], indent + 1);
+      }
+      printf("%*s}\n", 2 * indent, "");
+      return;
+
+    case STMT_ASSIGN:
+      printf("%*s%s = ", 2 * indent, "", string_int_rev(&compilation->ids, s->id[stmt]));
+      break;
+
+    case STMT_PRINT:
+      printf("%*sprint ", 2 * indent, "");
+      break;
+  }
+  flat_print_expr(ast, s->expr[stmt]);
+  printf(";\n");
+}
@@ -0,0 +1,66 @@
+/**
+ * @file flat.h
+ * @brief
+ * Flat storage of the AST: the nodes live in contiguous arrays, one per field (struct of arrays),
+ * and refer to their children by 32-bit index. Children are stored before their parents,
+ * so the bottom-up passes are a single loop over the arrays.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FLAT_NONE UINT32_MAX  // missing child (if without else)
+
+/**
+ * @brief
+ * Expressions, one column per field.
+ */
+struct flat_exprs {
+  uint8_t *kind;        // enum expr_type
+  int8_t *value_type;   // enum value_type, filled in by flat_check_types
+  int32_t *op;          // operator of BIN_OP
+  int32_t *value;       // value of LITERAL and BOOL_LIT, id of VARIABLE
+  uint32_t *lhs;        // left-hand side of BIN_OP, operand of the unary ops, condition of TERNARY_OP
+  uint32_t *mhs;        // first arm of TERNARY_OP
+  uint32_t *rhs;        // right-hand side of BIN_OP, second arm of TERNARY_OP
+  size_t len;
+  size_t capacity;
+};
+
+/**
+ * @brief
+ * Statements, one column per field.
+ */
+struct flat_stmts {
+  uint8_t *kind;        // enum stmt_type
+  uint32_t *expr;       // expression of ASSIGN and PRINT, condition of IF and WHILE
+  uint32_t *fst;        // first statement of SEQ in children, body of WHILE and IF
+  uint32_t *snd;        // number of statements of SEQ, else of IF
+  uint32_t *id;         // variable of ASSIGN
+  size_t len;
+  size_t capacity;
+
+  uint32_t *children;   // the statements of the blocks, each block is a contiguous range
+  size_t n_children;
+  size_t children_capacity;
+};
+
+struct flat_ast {
+  struct flat_exprs exprs;
+  struct flat_stmts stmts;
+  uint32_t root;
+};
+
+struct expr;
+struct stmt;
+
+void flat_init(struct flat_ast *ast);
+void flat_fini(struct flat_ast *ast);
+uint32_t flat_add_expr(struct flat_ast *ast, struct expr *expr);
+uint32_t flat_add_stmt(struct flat_ast *ast, struct stmt *stmt);
+void flat_from_tree(struct flat_ast *ast, struct stmt *root);
+size_t flat_check_types(struct flat_ast *ast);
+int flat_valid(struct flat_ast *ast);
+int64_t flat_sum_literals(struct flat_ast *ast);
+void flat_print_expr(struct flat_ast *ast, uint32_t expr);
+void flat_print_stmt(struct flat_ast *ast, uint32_t stmt, int indent);
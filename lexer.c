@@ -0,0 +1,346 @@
+/**
+ * @file lexer.c
+ * @brief
+ * Zero-copy scanner over a memory-mapped program.
+ *
+ * The tokens are those of scanner.l, with the same longest match rules: identifiers are
+ * scanned in full and then looked up among the keywords with a perfect hash, integers are
+ * parsed while they are scanned, and whitespace is skipped 16 bytes at a time with SSE2.
+ * Identifiers are interned straight from the mapping, which is never written to.
+ *
+ * yylex, called by the parser with the lexer of its program, goes to this scanner when
+ * the program is mapped and to the reentrant flex scanner (flex_yylex, see scanner.l)
+ * otherwise. Neither keeps any global state, so threads can scan programs concurrently.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <llvm-c/Core.h>
+#include "y.tab.h"
+#include "lexer.h"
+#include "stats.h"
+#include "utils.h"
+
+void yyerror(struct lexer *lexer, LLVMModuleRef module, LLVMBuilderRef builder, const char* s);
+int flex_yylex(YYSTYPE *lval, void *scanner);
+
+// reentrant interface of the flex scanner, generated in scanner.c
+int yylex_init_extra(struct lexer *extra, void **scanner);
+void yyset_in(FILE *in, void *scanner);
+int yylex_destroy(void *scanner);
+
+/**
+ * @brief
+ * Keywords by perfect hash, see keyword.
+ */
+static const struct {
+  const char *name;
+  size_t len;
+  int token;
+} keywords[16] = {
+  [0] = { "bool", 4, BOOL_TYPE },
+  [1] = { "false", 5, FALSE },
+  [2] = { "return", 6, RETURN },
+  [3] = { "while", 5, WHILE },
+  [4] = { "print", 5, PRINT },
+  [6] = { "int", 3, INT_TYPE },
+  [8] = { "if", 2, IF },
+  [9] = { "reduce", 6, REDUCE },
+  [12] = { "parallel", 8, PARALLEL },
+  [13] = { "true", 4, TRUE },
+  [14] = { "for", 3, FOR },
+  [15] = { "else", 4, ELSE },
+};
+
+/**
+ * @brief
+ * It memory-maps a program to scan it.
+ * @param lexer is where the scanner is stored.
+ * @param path is the file of the program.
+ * @return int is 0 on success, 1 if the file cannot be read.
+ */
+int lexer_open(struct lexer *lexer, const char *path) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+
+  memset(lexer, 0, sizeof(*lexer));
+  lexer->path = path;
+  lexer->line = 1;
+
+  if (fd < 0 || fstat(fd, &st)) {
+    perror(path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 1;
+  }
+
+  lexer->len = st.st_size;
+  if (lexer->len == 0) {
+    // mmap cannot map nothing, any non-NULL pointer does
+    lexer->source = "";
+  } else {
+    void *p = mmap(NULL, lexer->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      perror(path);
+      close(fd);
+      return 1;
+    }
+    madvise(p, lexer->len, MADV_SEQUENTIAL);
+    lexer->source = p;
+  }
+  close(fd);
+  return 0;
+}
+
+/**
+ * @brief
+ * It makes a flex scanner read a program from a stream.
+ * @param lexer is where the scanner is stored.
+ * @param in is the stream of the program.
+ */
+void lexer_open_stream(struct lexer *lexer, FILE *in) {
+  memset(lexer, 0, sizeof(*lexer));
+  lexer->line = 1;
+  yylex_init_extra(lexer, &lexer->flex);
+  yyset_in(in, lexer->flex);
+}
+
+/**
+ * @brief
+ * It unmaps the program, or frees the flex scanner.
+ * @param lexer is a lexer.
+ */
+void lexer_close(struct lexer *lexer) {
+  if (lexer->flex) {
+    yylex_destroy(lexer->flex);
+  } else if (lexer->source && lexer->len) {
+    munmap((void *) lexer->source, lexer->len);
+  }
+  lexer->flex = NULL;
+  lexer->source = NULL;
+  lexer->len = 0;
+}
+
+/**
+ * @brief
+ * It skips whitespace, 16 bytes at a time while they are in the mapping.
+ * @param source is the program.
+ * @param len is its length.
+ * @param i is an offset in the program.
+ * @return size_t is the offset of the first byte that is not whitespace.
+ */
+static size_t skip_whitespace(const char *source, size_t len, size_t i) {
+#ifdef __SSE2__
+  while (i + 16 <= len) {
+    __m128i c = _mm_loadu_si128((const __m128i *) (source + i));
+    __m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')),
+                                           _mm_cmpeq_epi8(c, _mm_set1_epi8('\n'))),
+                              _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('\t')),
+                                           _mm_cmpeq_epi8(c, _mm_set1_epi8('\r'))));
+    unsigned mask = ~_mm_movemask_epi8(ws) & 0xffff;
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+    i += 16;
+  }
+#endif
+  while (i < len && (source[i] == ' ' || source[i] == '\n' || source[i] == '\t' || source[i] == '\r')) {
+    i++;
+  }
+  return i;
+}
+
+/**
+ * @brief
+ * @param c is a byte.
+ * @return int is non-zero if the byte is a letter.
+ */
+static int is_alpha(char c) {
+  return (unsigned char) ((c | 0x20) - 'a') < 26;
+}
+
+/**
+ * @brief
+ * @param c is a byte.
+ * @return int is non-zero if the byte is a digit.
+ */
+static int is_digit(char c) {
+  return (unsigned char) (c - '0') < 10;
+}
+
+/**
+ * @brief
+ * It looks up a word among the keywords. The hash of the first letter, counted twice, and the
+ * last one has no collision between them, so a single comparison decides.
+ * @param s is a word.
+ * @param len is its length.
+ * @return int is the token of the keyword, 0 if the word is not one.
+ */
+static int keyword(const char *s, size_t len) {
+  unsigned h = (2 * (unsigned char) s[0] + (unsigned char) s[len - 1]) & 15;
+
+  if (keywords[h].len == len && !memcmp(keywords[h].name, s, len)) {
+    return keywords[h].token;
+  }
+  return 0;
+}
+
+/**
+ * @brief
+ * It scans the next token of the mapped program.
+ * @param lexer is a lexer opened with lexer_open.
+ * @param lval is where the value of the token is stored.
+ * @return int is the token, 0 at the end of the program.
+ */
+int lexer_lex(struct lexer *lexer, YYSTYPE *lval) {
+  const char *source = lexer->source;
+  size_t source_len = lexer->len;
+
+  for (;;) {
+    size_t i = skip_whitespace(source, source_len, lexer->pos);
+    if (i == source_len) {
+      lexer->pos = i;
+      lexer->token.offset = i;
+      lexer->token.len = 0;
+      return 0;
+    }
+
+    const char *s = source + i;
+    char c = *s;
+    char d = i + 1 < source_len ? s[1] : 0;
+    size_t len = 1;
+    int token;
+
+    if (is_alpha(c)) {
+      while (i + len < source_len && (is_alpha(s[len]) || is_digit(s[len]))) {
+        len++;
+      }
+      token = keyword(s, len);
+      if (!token) {
+        lval->id = string_int_get_len(&compilation->ids, s, len);
+        token = ID;
+      }
+    } else if (is_digit(c)) {
+      // unsigned arithmetic wraps like atoi does in practice on overflow
+      uint32_t value = c - '0';
+      while (i + len < source_len && is_digit(s[len])) {
+        value = value * 10 + (s[len++] - '0');
+      }
+      lval->value = (int32_t) value;
+      token = VAL;
+    } else if (c == '+' && d == '+') {
+      // \++ in scanner.l, the longest match takes every plus
+      while (i + len < source_len && s[len] == '+') {
+        len++;
+      }
+      token = PLUSPLUS;
+    } else {
+      len = 2;
+      switch (c << 8 | d) {
+        case '>' << 8 | '=': token = GE; break;
+        case '<' << 8 | '=': token = LE; break;
+        case '=' << 8 | '=': token = EQ; break;
+        case '!' << 8 | '=': token = NE; break;
+        case '>' << 8 | '>': token = RIGHTSHIFT; break;
+        case '<' << 8 | '<': token = LEFTSHIFT; break;
+        case '&' << 8 | '&': token = AND; break;
+        case '|' << 8 | '|': token = OR; break;
+        case '-' << 8 | '-': token = MINUSMINUS; break;
+        default:
+          len = 1;
+          switch (c) {
+            case '-': case '*': case '/': case '+': case '>': case '<': case '=':
+            case ';': case '{': case '}': case '(': case ')': case '[': case ']': case ',':
+              token = c;
+              break;
+            case '?': token = QUESTION_MARK; break;
+            case ':': token = COLON; break;
+            case '^': token = XOR; break;
+            case '%': token = REMAINDER; break;
+            default:
+              yyerror(lexer, NULL, NULL, "Unexpected character");
+              lexer->pos = i + 1;
+              continue;
+          }
+      }
+    }
+
+    lexer->pos = i + len;
+    lexer->token.offset = i;
+    lexer->token.len = len;
+    if (token == IF || token == WHILE || token == FOR) {
+      lval->loc = lexer_location(lexer);
+    }
+    return token;
+  }
+}
+
+/**
+ * @brief
+ * It counts the lines of a piece of the program.
+ * @param lexer is a lexer.
+ * @param text is the piece, after the lines counted so far.
+ * @param len is its length.
+ * @param offset is its offset in the program.
+ */
+void lexer_count_lines(struct lexer *lexer, const char *text, size_t len, size_t offset) {
+  const char *end = text + len;
+
+  for (const char *p = text; (p = memchr(p, '\n', end - p)); p++) {
+    lexer->line++;
+    lexer->line_start = offset + (p - text) + 1;
+  }
+}
+
+/**
+ * @brief
+ * It gives the location of the last token. The flex scanner counts the lines of the whitespace
+ * it skips; the lines of the mapping are only counted here, up to the token, so the scanner
+ * does not pay for them when no location is asked for.
+ * @param lexer is a lexer.
+ * @return struct location is the line and the column of the token, from 1.
+ */
+struct location lexer_location(struct lexer *lexer) {
+  struct location loc;
+
+  if (!lexer->flex) {
+    lexer_count_lines(lexer, lexer->source + lexer->counted, lexer->token.offset - lexer->counted, lexer->counted);
+    lexer->counted = lexer->token.offset;
+  }
+  loc.line = lexer->line;
+  loc.column = (int) (lexer->token.offset - lexer->line_start) + 1;
+  return loc;
+}
+
+/**
+ * @brief
+ * Scanner called by the parser.
+ * @param lval is where the value of the token is stored.
+ * @param lexer is the lexer of the program being parsed.
+ * @return int is the next token, 0 at the end of the program.
+ */
+int yylex(YYSTYPE *lval, struct lexer *lexer) {
+  if (lexer->start) {
+    int token = lexer->start;
+    lexer->start = 0;
+    return token;
+  }
+  if (!stats_enabled) {
+    return lexer->flex ? flex_yylex(lval, lexer->flex) : lexer_lex(lexer, lval);
+  }
+
+  struct stats_timer t = stats_start();
+  int token = lexer->flex ? flex_yylex(lval, lexer->flex) : lexer_lex(lexer, lval);
+  stats_stop(&t, STATS_LEX);
+  stats_count(STATS_TOKENS, token != 0);
+  return token;
+}
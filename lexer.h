@@ -0,0 +1,43 @@
+/**
+ * @file lexer.h
+ * @brief
+ * Zero-copy scanner: the program is memory-mapped and its tokens are slices of the mapping,
+ * so large generated sources are never copied into a flex buffer. It recognizes the same
+ * tokens as scanner.l, which still reads the programs given on the standard input.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+
+/**
+ * @brief
+ * Slice of the source of a token.
+ */
+struct lexer_token {
+  size_t offset;
+  size_t len;
+};
+
+/**
+ * @brief
+ * State of the scanner of one program, passed to yylex by the parser.
+ */
+struct lexer {
+  const char *path;         // name of the program in the messages, NULL for stdin
+  const char *source;       // the mapping, NULL when the flex scanner is used
+  size_t len;
+  size_t pos;
+  struct lexer_token token; // the last token
+  void *flex;               // reentrant flex scanner of the stream
+  int line;                 // line of line_start, from 1
+  size_t line_start;        // offset of the last line start counted
+  size_t counted;           // offset up to which the lines of the mapping are counted
+  int start;                // token returned before the program, 0 for none (see REPL)
+};
+
+int lexer_open(struct lexer *lexer, const char *path);
+void lexer_open_stream(struct lexer *lexer, FILE *in);
+void lexer_close(struct lexer *lexer);
+int lexer_lex(struct lexer *lexer, YYSTYPE *lval);
+void lexer_count_lines(struct lexer *lexer, const char *text, size_t len, size_t offset);
+struct location lexer_location(struct lexer *lexer);
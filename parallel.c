@@ -0,0 +1,142 @@
+/**
+ * @file parallel.c
+ * @brief
+ * Parallel code generation of a program whose main was outlined (see codegen_outline in ast.c).
+ *
+ * An LLVM context, and the modules in it, can only be used by one thread at a time, so main and
+ * each part are written to bitcode and every worker parses the modules it takes in a context
+ * of its own, optimizes them and generates an object file with its own target machine. The
+ * modules are taken from a shared counter, the largest first, so that the last ones to finish
+ * are small. The objects are then linked in memory by the LLJIT that runs the program.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/BitReader.h>
+#include <llvm-c/BitWriter.h>
+#include <llvm-c/Core.h>
+#include "ast.h"
+#include "backend.h"
+#include "parallel.h"
+
+struct parallel {
+  LLVMMemoryBufferRef *bitcode;   // of each module, the largest first
+  LLVMMemoryBufferRef *objects;   // generated from each of them
+  size_t n;
+  int opt_level;
+  atomic_size_t next;             // first module not taken yet
+  atomic_int failed;
+};
+
+/**
+ * @brief
+ * Worker thread: it compiles modules until there are none left.
+ * @param arg is the work.
+ * @return void* is NULL.
+ */
+static void *worker_thread(void *arg) {
+  struct parallel *p = arg;
+  LLVMContextRef context = LLVMContextCreate();
+  LLVMTargetMachineRef machine = create_host_machine(p->opt_level, 0);
+  size_t i;
+
+  while ((i = atomic_fetch_add(&p->next, 1)) < p->n) {
+    LLVMModuleRef module;
+    if (!machine || LLVMParseBitcodeInContext2(context, p->bitcode[i], &module)) {
+      atomic_store(&p->failed, 1);
+      continue;
+    }
+    setup_module_for_host(module, machine);
+    if (optimize_module(module, machine, p->opt_level) ||
+        !(p->objects[i] = emit_object_buffer(module, machine))) {
+      atomic_store(&p->failed, 1);
+    }
+    LLVMDisposeModule(module);
+  }
+
+  if (machine) {
+    LLVMDisposeTargetMachine(machine);
+  }
+  LLVMContextDispose(context);
+  return NULL;
+}
+
+/**
+ * @brief
+ * It orders bitcode buffers by decreasing size.
+ */
+static int larger_first(const void *a, const void *b) {
+  size_t size_a = LLVMGetBufferSize(*(LLVMMemoryBufferRef *) a);
+  size_t size_b = LLVMGetBufferSize(*(LLVMMemoryBufferRef *) b);
+  return size_a < size_b ? 1 : size_a > size_b ? -1 : 0;
+}
+
+/**
+ * @brief
+ * It optimizes and compiles main and its parts to object files, concurrently. The functions of
+ * the program become external, the parts call them across objects. The modules are consumed.
+ * @param module is the module of main, finished and verified.
+ * @param parts are the modules of its parts.
+ * @param opt_level is an optimization level.
+ * @param jobs is the number of threads, 0 for one per core.
+ * @param n_objects is where the number of objects is stored.
+ * @return LLVMMemoryBufferRef* are the objects, NULL if one of them cannot be compiled.
+ */
+LLVMMemoryBufferRef *compile_parallel(LLVMModuleRef module, struct outline *parts, int opt_level, int jobs, size_t *n_objects) {
+  struct parallel p = { 0 };
+  char *error = NULL;
+
+  for (LLVMValueRef fn = LLVMGetFirstFunction(module); fn; fn = LLVMGetNextFunction(fn)) {
+    if (!LLVMIsDeclaration(fn) && LLVMGetFunctionCallConv(fn) == LLVMFastCallConv) {
+      LLVMSetLinkage(fn, LLVMExternalLinkage);
+    }
+  }
+
+  p.n = parts->n_modules + 1;
+  p.opt_level = opt_level;
+  p.bitcode = malloc(p.n * sizeof(p.bitcode[0]));
+  p.objects = calloc(p.n, sizeof(p.objects[0]));
+  p.bitcode[0] = LLVMWriteBitcodeToMemoryBuffer(module);
+  LLVMDisposeModule(module);
+  for (size_t i = 0; i < parts->n_modules; i++) {
+    LLVMVerifyModule(parts->modules[i], LLVMAbortProcessAction, &error);
+    p.bitcode[i + 1] = LLVMWriteBitcodeToMemoryBuffer(parts->modules[i]);
+    LLVMDisposeModule(parts->modules[i]);
+  }
+  qsort(p.bitcode, p.n, sizeof(p.bitcode[0]), larger_first);
+
+  if (jobs <= 0) {
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if ((size_t) jobs > p.n) {
+    jobs = p.n;
+  }
+  pthread_t *threads = malloc(jobs * sizeof(threads[0]));
+  for (int i = 0; i < jobs; i++) {
+    pthread_create(&threads[i], NULL, worker_thread, &p);
+  }
+  for (int i = 0; i < jobs; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+
+  for (size_t i = 0; i < p.n; i++) {
+    LLVMDisposeMemoryBuffer(p.bitcode[i]);
+  }
+  free(p.bitcode);
+  if (atomic_load(&p.failed)) {
+    for (size_t i = 0; i < p.n; i++) {
+      if (p.objects[i]) {
+        LLVMDisposeMemoryBuffer(p.objects[i]);
+      }
+    }
+    free(p.objects);
+    return NULL;
+  }
+  *n_objects = p.n;
+  return p.objects;
+}
@@ -0,0 +1,12 @@
+/**
+ * @file parallel.h
+ * @brief
+ * Parallel code generation: main and its outlined parts optimized and compiled on a pool of threads.
+ */
+
+#include <stddef.h>
+#include <llvm-c/Core.h>
+
+struct outline;
+
+LLVMMemoryBufferRef *compile_parallel(LLVMModuleRef module, struct outline *parts, int opt_level, int jobs, size_t *n_objects);
@@ -1,20 +1,52 @@
 %{
   #include <stdio.h>
   #include <stdlib.h>
+  #include <string.h>
+  #include <unistd.h>
 
   #include <llvm-c/Analysis.h>
   #include <llvm-c/Core.h>
   #include <llvm-c/ExecutionEngine.h>
   #include <llvm-c/IRReader.h>
-  #include <llvm-c/Transforms/Scalar.h>
-  #include <llvm-c/Transforms/Utils.h>
   #include "ast.h"
+  #include "backend.h"
+  #include "batch.h"
+  #include "bytecode.h"
+  #include "cache.h"
+  #include "parallel.h"
+  #include "regvm.h"
+  #include "repl.h"
+  #include "runtime.h"
+  #include "stats.h"
+  #include "tier.h"
   #include "utils.h"
-
-  int yylex(void);
-  void yyerror(LLVMModuleRef module, LLVMBuilderRef builder, const char* s);
 %}
 
+%code requires {
+  struct lexer;
+
+  /**
+   * @brief
+   * Location of a token in the program, from line 1 and column 1.
+   */
+  struct location {
+    int line;
+    int column;
+  };
+}
+
+%code {
+  #include "lexer.h"
+  #include "profile.h"
+
+  int yylex(YYSTYPE *lval, struct lexer *lexer);
+  void yyerror(struct lexer *lexer, LLVMModuleRef module, LLVMBuilderRef builder, const char* s);
+  static struct stmt *check_program(struct stmt *stmt);
+}
+
+%define api.pure full
+%lex-param {struct lexer *lexer}
+%parse-param {struct lexer *lexer}
 %parse-param {LLVMModuleRef module}
 %parse-param {LLVMBuilderRef builder}
 
@@ -30,6 +62,8 @@
     BOOLEAN = 2,
   } type;
   struct stmt *stmt;
+  struct function *function;
+  struct location loc;
 }
 
 %token GE LE EQ NE
@@ -37,7 +71,10 @@
 %token PLUSPLUS
 %token MINUSMINUS
 %token EXCLAMATION
-%token IF ELSE WHILE PRINT 
+%token <loc> IF WHILE FOR
+%token PARALLEL REDUCE
+%token ELSE PRINT RETURN
+%token REPL
 %token BOOL_TYPE INT_TYPE 
 %token AND OR XOR REMAINDER
 %token <id> ID
@@ -46,8 +83,13 @@
 %token <value> VAL
 %type  <op>    op
 %type  <expr>  expr
+%type  <expr>  args
+%type  <function> params
+%type  <function> param_list
 %type  <stmt>  stmt
 %type  <stmt>  stmts
+%type  <stmt>  entries
+%type  <stmt>  reductions
 %type  <type>  type
 
 
@@ -61,33 +103,84 @@
 
 %%
 program: decls stmt {
-                      if (valid_stmt($2)) {
-                        codegen_stmt($2, module, builder);
-                      } else {
-                        fprintf(stderr, "INVALID PROGRAM\n");
-                        exit(1);
+                      compilation->root = check_program($2);
+                      if (!compilation->root) {
+                        YYABORT;
                       }
                       // printf("{\n");
                       // print_stmt($2, 1);
                       // printf("}\n");
-                      free_stmt($2);
                     }
+      | REPL entries { compilation->root = $2; }
+
+// an input of the REPL, declarations and statements in any order, each checked where it is
+entries: entries decl                       {  $$ = $1;                       }
+      | entries stmt                        {
+                                               struct stmt *stmt = check_program($2);
+                                               if (!stmt) {
+                                                 YYABORT;
+                                               }
+                                               $$ = $1 ? make_seq($1, stmt) : stmt;
+                                             }
+      |                                     {  $$ = NULL;                     }
 
 type: BOOL_TYPE   { $$ = BOOLEAN; }
       | INT_TYPE  { $$ = INTEGER; }
 
 decls: decls decl | ;
 decl: type ID ';'     {
-                        if (vector_get(&global_types, $2)) {
-                          printf("Multiple declarations for identifier %s\n", string_int_rev(&global_ids, $2));
-                          exit(0);
+                        if (!can_declare($2)) {
+                          printf("Multiple declarations for identifier %s\n", string_int_rev(&compilation->ids, $2));
+                          YYABORT;
+                        } else {
+                          declare_variable($2, declare_scalar(module, builder, $1, string_int_rev(&compilation->ids, $2)));
+                        }
+                      }
+      | type ID '[' VAL ']' ';' {
+                        if (!can_declare($2)) {
+                          printf("Multiple declarations for identifier %s\n", string_int_rev(&compilation->ids, $2));
+                          YYABORT;
+                        } else if (in_function()) {
+                          printf("Array %s cannot be declared in a function\n", string_int_rev(&compilation->ids, $2));
+                          YYABORT;
+                        } else if ($4 <= 0) {
+                          printf("Array %s must have at least one element\n", string_int_rev(&compilation->ids, $2));
+                          YYABORT;
+                        } else {
+                          declare_variable($2, declare_array(module, builder, $1, $4, string_int_rev(&compilation->ids, $2)));
+                        }
+                      }
+      | type ID '[' ']' ';' {
+                        if (!can_declare($2)) {
+                          printf("Multiple declarations for identifier %s\n", string_int_rev(&compilation->ids, $2));
+                          YYABORT;
+                        } else if (in_function()) {
+                          printf("Array %s cannot be declared in a function\n", string_int_rev(&compilation->ids, $2));
+                          YYABORT;
                         } else {
-                          LLVMTypeRef t = $1 == BOOLEAN ? LLVMInt1Type() : LLVMInt32Type();
-                          LLVMValueRef p = LLVMBuildAlloca(builder, t, string_int_rev(&global_ids, $2));
-                          vector_set(&global_types, $2, p);
+                          declare_variable($2, declare_array(module, builder, $1, -1, string_int_rev(&compilation->ids, $2)));
+                        }
+                      }
+      | type ID '(' params ')' {
+                        // the body is generated in the function as soon as it is parsed
+                        $<function>$ = begin_function($4, $1, $2, module, builder);
+                        if (!$<function>$) {
+                          YYABORT;
+                        }
+                      }
+        '{' decls stmts '}' {
+                        if (!end_function($<function>6, $9, module, builder)) {
+                          fprintf(stderr, "INVALID PROGRAM\n");
+                          YYABORT;
                         }
                       }
 
+params: param_list                          {  $$ = $1;                       }
+      |                                     {  $$ = NULL;                     }
+
+param_list: param_list ',' type ID          {  $$ = add_param($1, $3, $4);    }
+      | type ID                             {  $$ = add_param(NULL, $1, $2);  }
+
 stmts: stmts stmt                           {  $$ = make_seq($1, $2);         }
       | stmt                                {  $$ = $1;                       };
 
@@ -95,9 +188,20 @@ stmt: '{' stmts '}'                         {  $$ = $2;                       }
       | '(' stmt ')'                        {  $$ = $2;                       }
       | PRINT expr ';'                      {  $$ = make_print($2);           }    
       | ID '=' expr ';'                     {  $$ = make_assign($1, $3);      }
-      | IF '(' expr ')' stmt %prec IF_ALONE {  $$ = make_if($3, $5);          }
-      | IF '(' expr ')' stmt ELSE stmt      {  $$ = make_ifelse($3, $5, $7);  }
-      | WHILE '(' expr ')' stmt             {  $$ = make_while($3, $5);       }
+      | ID '[' expr ']' '=' expr ';'        {  $$ = make_store($1, $3, $6);   }
+      | ID '=' type '[' expr ']' ';'        {  $$ = make_alloc($1, $3, $5);   }
+      | ID '(' ')' ';'                      {  $$ = make_call(call($1, NULL)); }
+      | ID '(' args ')' ';'                 {  $$ = make_call(call($1, $3));  }
+      | RETURN expr ';'                     {  $$ = make_return($2);          }
+      | IF '(' expr ')' stmt %prec IF_ALONE {  $$ = make_if($3, $5, $1);      }
+      | IF '(' expr ')' stmt ELSE stmt      {  $$ = make_ifelse($3, $5, $7, $1); }
+      | WHILE '(' expr ')' stmt             {  $$ = make_while($3, $5, $1);   }
+      | PARALLEL FOR '(' ID '=' expr ',' expr ')' stmt {
+                                               $$ = make_for(NULL, $4, $6, $8, $10, $2);
+                                             }
+      | PARALLEL FOR '(' ID '=' expr ',' expr ')' REDUCE '(' reductions ')' stmt {
+                                               $$ = make_for($12, $4, $6, $8, $14, $2);
+                                             }
      
       
 
@@ -105,6 +209,9 @@ expr: VAL                                   {  $$ = literal($1);              }
       | FALSE                               {  $$ = bool_lit(0);              }
       | TRUE                                {  $$ = bool_lit(1);              }
       | ID                                  {  $$ = variable($1);             }
+      | ID '[' expr ']'                     {  $$ = element($1, $3);          }
+      | ID '(' ')'                          {  $$ = call($1, NULL);           }
+      | ID '(' args ')'                     {  $$ = call($1, $3);             }
       | '(' expr ')'                        {  $$ = $2;                       }
       | expr op expr                        {  $$ = binop($1, $2, $3);        }
       | expr QUESTION_MARK expr COLON expr  {  $$ = ternary($1,$3,$5);        }
@@ -113,6 +220,13 @@ expr: VAL                                   {  $$ = literal($1);              }
       | MINUSMINUS expr                     {  $$ = pre_decrement($2);        }
       | expr MINUSMINUS                     {  $$ = post_decrement($1);       }
 
+// the reduction variables of a parallel loop, each with its operator
+reductions: op ID                           {  $$ = add_reduction(NULL, $1, $2); }
+      | reductions ',' op ID                {  $$ = add_reduction($1, $3, $4); }
+
+args: expr                                  {  $$ = add_arg(NULL, $1);        }
+      | args ',' expr                       {  $$ = add_arg($1, $3);          }
+
 op: REMAINDER                               {  $$ = REMAINDER;                }
     | '+'                                   {  $$ = '+';                      }
     | '-'                                   {  $$ = '-';                      }
@@ -134,11 +248,190 @@ op: REMAINDER                               {  $$ = REMAINDER;                }
   ; 
 %%
 
-void yyerror(LLVMModuleRef module, LLVMBuilderRef builder, const char* s) {
-    fprintf(stderr, "%s\n", s);
+/**
+ * @brief
+ * It checks the types of a program, or of a statement of the REPL, and simplifies it.
+ * @param stmt is the statement.
+ * @return struct stmt* is the simplified statement, NULL if it is invalid.
+ */
+static struct stmt *check_program(struct stmt *stmt) {
+    struct stats_timer t = stats_start();
+    int valid = valid_stmt(stmt);
+    stats_stop(&t, STATS_CHECK);
+    if (!valid) {
+      fprintf(stderr, "INVALID PROGRAM\n");
+      return NULL;
+    }
+    // a program that does nothing stays as it is, it has no empty statement
+    t = stats_start();
+    struct stmt *simplified = simplify_stmt(stmt);
+    stats_stop(&t, STATS_SIMPLIFY);
+    return simplified ? simplified : stmt;
+}
+
+void yyerror(struct lexer *lexer, LLVMModuleRef module, LLVMBuilderRef builder, const char* s) {
+    if (lexer && lexer->path) {
+      fprintf(stderr, "%s: %s\n", lexer->path, s);
+    } else {
+      fprintf(stderr, "%s\n", s);
+    }
+}
+
+enum mode {
+  MODE_JIT,
+  MODE_STACK,
+  MODE_REG,
+  MODE_TIERED,
+};
+
+/**
+ * @brief 
+ * It compiles the program to the stack machine and interprets it, without LLVM.
+ * @param dump is non-zero to print the code before running it.
+ */
+static void run_stack_machine(int dump) {
+    struct bytecode bc;
+
+    struct stats_timer t = stats_start();
+    bytecode_compile(&bc, compilation->root, string_int_count(&compilation->ids), 0);
+    stats_stop(&t, STATS_BYTECODE);
+    if (dump) {
+      bytecode_dump(&bc);
+      fflush(stdout);
+    }
+
+    int32_t *mem = calloc(bc.mem_size + 1, sizeof(int32_t));
+    fprintf(stderr, "Running\n");
+    t = stats_start();
+    uint64_t dispatches = bytecode_run(&bc, mem);
+    runtime_flush();
+    stats_stop(&t, STATS_RUN);
+    stats_count(STATS_INTERPRETED, dispatches);
+    fprintf(stderr, "Done (%llu instructions)\n", (unsigned long long) dispatches);
+
+    free(mem);
+    bytecode_fini(&bc);
+}
+
+/**
+ * @brief 
+ * It compiles the program to the register machine, allocates its registers and interprets it.
+ * @param dump is non-zero to print the code before running it.
+ */
+static void run_register_machine(int dump) {
+    struct regvm vm;
+
+    struct stats_timer t = stats_start();
+    regvm_compile(&vm, compilation->root, string_int_count(&compilation->ids));
+    stats_stop(&t, STATS_BYTECODE);
+    if (dump) {
+      regvm_dump(&vm);
+      fflush(stdout);
+    }
+
+    int32_t *mem = calloc(vm.mem_size + 1, sizeof(int32_t));
+    fprintf(stderr, "Running\n");
+    t = stats_start();
+    uint64_t dispatches = regvm_run(&vm, mem);
+    runtime_flush();
+    stats_stop(&t, STATS_RUN);
+    stats_count(STATS_INTERPRETED, dispatches);
+    fprintf(stderr, "Done (%llu instructions)\n", (unsigned long long) dispatches);
+
+    free(mem);
+    regvm_fini(&vm);
+}
+
+/**
+ * @brief 
+ * It interprets the stack machine code and compiles the hot loops in the background.
+ * @param dump is non-zero to print the code before running it.
+ * @param opt_level is the optimization level of the compiled loops.
+ * @param threshold is the number of iterations of a loop before it is compiled.
+ */
+static void run_tiered(int dump, int opt_level, uint32_t threshold) {
+    struct bytecode bc;
+
+    struct stats_timer t = stats_start();
+    bytecode_compile(&bc, compilation->root, string_int_count(&compilation->ids), 1);
+    stats_stop(&t, STATS_BYTECODE);
+    if (dump) {
+      bytecode_dump(&bc);
+      fflush(stdout);
+    }
+
+    int32_t *mem = calloc(bc.mem_size + 1, sizeof(int32_t));
+    fprintf(stderr, "Running\n");
+    t = stats_start();
+    uint64_t dispatches = tier_run(&bc, mem, opt_level, threshold);
+    runtime_flush();
+    stats_stop(&t, STATS_RUN);
+    stats_count(STATS_INTERPRETED, dispatches);
+    fprintf(stderr, "Done (%llu instructions)\n", (unsigned long long) dispatches);
+
+    free(mem);
+    bytecode_fini(&bc);
+}
+
+static const char *stats_json;  // file of the JSON report, "-" for stdout
+
+/**
+ * @brief 
+ * It prints the report of --stats and --stats-json when the compiler exits.
+ */
+static void report_stats(void) {
+    if (stats_json) {
+      FILE *f = strcmp(stats_json, "-") ? fopen(stats_json, "w") : stdout;
+      if (f) {
+        stats_report_json(f);
+        if (f != stdout) {
+          fclose(f);
+        }
+      } else {
+        perror(stats_json);
+      }
+    } else {
+      stats_report(stderr);
+    }
 }
 
-int main(void)
+/**
+ * @brief 
+ * It prints the command line options of the compiler.
+ * @param name is the name of the executable.
+ */
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-m jit|stack|reg|tiered] [-O0|-O1|-O2|-O3] [--external-runtime] [-c object | -o executable | --cache]\n", name);
+    fprintf(stderr, "       %*s [--profile-generate profile | --profile-use profile] [file | < program]\n", (int) strlen(name), "");
+    fprintf(stderr, "       %s --batch [-j threads] [-O0|-O1|-O2|-O3] [--external-runtime] files...\n", name);
+    fprintf(stderr, "       %s --repl [-O0|-O1|-O2|-O3] [file | < inputs]\n", name);
+    fprintf(stderr, "  -m jit              compile with LLVM and run the machine code (default)\n");
+    fprintf(stderr, "  -m stack            interpret the stack machine code, --dump-bytecode prints it\n");
+    fprintf(stderr, "  -m reg              interpret the register machine code, --dump-bytecode prints it\n");
+    fprintf(stderr, "  -m tiered           interpret the stack machine code and compile the loops that run\n");
+    fprintf(stderr, "                      --tier-threshold iterations (default %d) in the background\n", TIER_THRESHOLD);
+    fprintf(stderr, "  --external-runtime  do not link runtime.bc, call the runtime of the compiler instead\n");
+    fprintf(stderr, "  -c object           compile ahead of time to a native object file instead of running\n");
+    fprintf(stderr, "  -o executable       compile ahead of time and link an executable instead of running\n");
+    fprintf(stderr, "  --cache             reuse the machine code of a previous run of the same program\n");
+    fprintf(stderr, "  -j threads          outline the loops and the long runs of statements of main, and\n");
+    fprintf(stderr, "                      optimize and compile them on threads (0: one per core)\n");
+    fprintf(stderr, "  --profile-generate profile\n");
+    fprintf(stderr, "                      count the branches of each if and while, and write them to profile\n");
+    fprintf(stderr, "                      when the program returns (jit mode, disables --cache)\n");
+    fprintf(stderr, "  --profile-use profile\n");
+    fprintf(stderr, "                      optimize the branches and loops for the counts of profile\n");
+    fprintf(stderr, "  file                memory-map the program and scan it in place instead of reading stdin\n");
+    fprintf(stderr, "  --stats             print the time and the counters of each phase on exit\n");
+    fprintf(stderr, "  --stats-json file   write them as JSON to file (- for stdout)\n");
+    fprintf(stderr, "  --batch             compile each file to an object file next to it, on -j threads\n");
+    fprintf(stderr, "                      (default: one per core)\n");
+    fprintf(stderr, "  --repl              run each declaration or statement as soon as it is read, the\n");
+    fprintf(stderr, "                      variables keep their values from one to the next\n");
+    fprintf(stderr, "                      (an if runs once the next line is read, unless it starts an else)\n");
+}
+
+int main(int argc, char **argv)
 {
     LLVMModuleRef module = LLVMModuleCreateWithName("exe");
     LLVMBuilderRef builder = LLVMCreateBuilder();
@@ -147,73 +440,370 @@ int main(void)
     char *error;
     LLVMMemoryBufferRef buffer;
     LLVMExecutionEngineRef engine;
+    LLVMTargetMachineRef machine = NULL;
+    int opt_level = 0;
+    int external_runtime = 0;
+    const char *object_file = NULL;
+    const char *executable = NULL;
+    int use_cache = 0;
+    uint64_t key = 0;
+    char *cache_source = NULL;
+    size_t cache_len = 0;
+    enum mode mode = MODE_JIT;
+    int dump_bytecode = 0;
+    uint32_t threshold = TIER_THRESHOLD;
+    const char **files = calloc(argc, sizeof(files[0]));
+    size_t n_files = 0;
+    int batch = 0;
+    int jobs = 0;
+    int repl = 0;
+    int parallel = 0;
+    struct outline parts = { 0 };
+    const char *profile_generate = NULL;
+    const char *profile_use = NULL;
+    struct profile counters, weights;
+    struct compilation main_compilation;
+    struct lexer lexer;
+
+    for (int i = 1; i < argc; i++) {
+      if (argv[i][0] == '-' && argv[i][1] == 'O' && argv[i][2] >= '0' && argv[i][2] <= '3' && !argv[i][3]) {
+        opt_level = argv[i][2] - '0';
+      } else if (!strcmp(argv[i], "--external-runtime")) {
+        external_runtime = 1;
+      } else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+        object_file = argv[++i];
+      } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+        executable = argv[++i];
+      } else if (!strcmp(argv[i], "--cache")) {
+        use_cache = 1;
+      } else if (!strcmp(argv[i], "-m") && i + 1 < argc && !strcmp(argv[i + 1], "jit")) {
+        mode = MODE_JIT;
+        i++;
+      } else if (!strcmp(argv[i], "-m") && i + 1 < argc && !strcmp(argv[i + 1], "stack")) {
+        mode = MODE_STACK;
+        i++;
+      } else if (!strcmp(argv[i], "-m") && i + 1 < argc && !strcmp(argv[i + 1], "reg")) {
+        mode = MODE_REG;
+        i++;
+      } else if (!strcmp(argv[i], "-m") && i + 1 < argc && !strcmp(argv[i + 1], "tiered")) {
+        mode = MODE_TIERED;
+        i++;
+      } else if (!strcmp(argv[i], "--tier-threshold") && i + 1 < argc) {
+        threshold = strtoul(argv[++i], NULL, 10);
+      } else if (!strcmp(argv[i], "--dump-bytecode")) {
+        dump_bytecode = 1;
+      } else if (!strcmp(argv[i], "--stats")) {
+        stats_enable();
+      } else if (!strcmp(argv[i], "--stats-json") && i + 1 < argc) {
+        stats_json = argv[++i];
+        stats_enable();
+      } else if (!strcmp(argv[i], "--batch")) {
+        batch = 1;
+      } else if (!strcmp(argv[i], "--repl")) {
+        repl = 1;
+      } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+        jobs = atoi(argv[++i]);
+        parallel = 1;
+      } else if (!strcmp(argv[i], "--profile-generate") && i + 1 < argc) {
+        profile_generate = argv[++i];
+      } else if (!strcmp(argv[i], "--profile-use") && i + 1 < argc) {
+        profile_use = argv[++i];
+      } else if (argv[i][0] != '-') {
+        files[n_files++] = argv[i];
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    }
+    if (batch ? n_files == 0 || mode != MODE_JIT : n_files > 1) {
+      usage(argv[0]);
+      return 1;
+    }
+    if ((profile_generate || profile_use) && (batch || mode != MODE_JIT)) {
+      usage(argv[0]);
+      return 1;
+    }
+    if (repl && (batch || mode != MODE_JIT || object_file || executable || use_cache || profile_generate || profile_use)) {
+      usage(argv[0]);
+      return 1;
+    }
+    // the parts of main only run in process, and count nothing
+    parallel = parallel && !batch;
+    if (parallel && (repl || mode != MODE_JIT || object_file || executable || use_cache || profile_generate)) {
+      usage(argv[0]);
+      return 1;
+    }
+    // The machine code depends on the profile, which is not part of the key of the cache.
+    if (profile_generate || profile_use) {
+      use_cache = 0;
+    }
+
+    if (stats_enabled) {
+      atexit(report_stats);
+    }
 
-    vector_init(&global_types);
-    string_int_init(&global_ids);
+    if (batch) {
+      LLVMInitializeNativeTarget();
+      LLVMInitializeNativeAsmPrinter();
+      return batch_compile(files, n_files, jobs, opt_level, external_runtime);
+    }
 
-    LLVMInitializeNativeTarget();
-    LLVMInitializeNativeAsmPrinter();
-    LLVMInitializeNativeAsmParser();
-    LLVMLinkInMCJIT();
+    if (repl) {
+      FILE *in = n_files ? fopen(files[0], "r") : stdin;
+      if (!in) {
+        perror(files[0]);
+        return 1;
+      }
+      LLVMInitializeNativeTarget();
+      LLVMInitializeNativeAsmPrinter();
+      return repl_run(in, opt_level);
+    }
 
-    // Create execution engine.
-    if (LLVMCreateExecutionEngineForModule(&engine, module, &error)) {
-      fprintf(stderr, "%s\n", error);
-      return 1;
-    } else if (LLVMCreateMemoryBufferWithContentsOfFile("runtime.bc", &buffer, &error)) {
-      fprintf(stderr, "%s\n", error);
-      return 1;
-    } else if (LLVMParseIRInContext(LLVMGetGlobalContext(), buffer, &runtime, &error)) {
-      fprintf(stderr, "%s\n", error);
+    compilation_init(&main_compilation);
+    compilation = &main_compilation;
+
+    if (n_files && lexer_open(&lexer, files[0])) {
       return 1;
     }
 
-    // Setup optimizations.
-    LLVMPassManagerRef pass_manager = LLVMCreateFunctionPassManagerForModule(module);
-    LLVMAddPromoteMemoryToRegisterPass(pass_manager);
-    LLVMInitializeFunctionPassManager(pass_manager);
+    // The interpreters only need LLVM for the declarations, which build allocas in main.
+    if (mode == MODE_JIT || mode == MODE_TIERED) {
+      LLVMInitializeNativeTarget();
+      LLVMInitializeNativeAsmPrinter();
+      LLVMInitializeNativeAsmParser();
+      LLVMLinkInMCJIT();
+    }
+
+    // A cached object skips parsing, codegen and code generation altogether.
+    if (mode == MODE_JIT && use_cache && !object_file && !executable) {
+      size_t len = n_files ? lexer.len : 0;
+      char *source = n_files ? NULL : read_file(stdin, &len);
+      key = cache_key(n_files ? lexer.source : source, len, opt_level, external_runtime);
+
+      LLVMMemoryBufferRef object = cache_lookup(key, n_files ? lexer.source : source, len);
+      if (object) {
+        cache_report();
+        free(source);
+        stats_count(STATS_MACHINE_CODE_BYTES, LLVMGetBufferSize(object));
+        struct stats_timer t = stats_start();
+        int failed = run_object(object);
+        stats_stop(&t, STATS_RUN);
+        return failed;
+      }
+      if (source) {
+        lexer_open_stream(&lexer, fmemopen(source, len, "r"));
+      }
+      // Keep the source for the cache, the lexer unmaps its file after parsing.
+      cache_source = source ? source : memcpy(malloc(len + 1), lexer.source, len);
+      cache_len = len;
+    } else {
+      use_cache = 0;
+    }
+    if (!n_files && !use_cache) {
+      lexer_open_stream(&lexer, stdin);
+    }
+
+    // Target the host CPU, so that the optimizer and the code generator use all of its features.
+    if (mode == MODE_JIT) {
+      machine = create_host_machine(opt_level, !object_file && !executable && !use_cache);
+      if (!machine) {
+        return 1;
+      }
+      setup_module_for_host(module, machine);
+    }
 
-    // print_i32
-    LLVMTypeRef print_i32_args[] = { LLVMInt32Type() };
-    LLVMAddFunction(module, "print_i32",
-    LLVMFunctionType(LLVMVoidType(), print_i32_args, 1, 0));
+    profile_init(&counters);
+    profile_init(&weights);
+    if (profile_use && profile_read(&weights, profile_use)) {
+      return 1;
+    }
+    codegen_profile(profile_generate ? &counters : NULL, profile_use ? &weights : NULL);
 
-    // print_i1
-    LLVMTypeRef print_i1_args[] = { LLVMInt1Type() };
-    LLVMAddFunction(module, "print_i1",
-    LLVMFunctionType(LLVMVoidType(), print_i1_args, 1, 0));
+    declare_runtime(module);
+    LLVMValueRef main = add_main(module, builder);
 
-    // create "main" function
-    LLVMTypeRef main_type = LLVMFunctionType(LLVMVoidType(), NULL, 0, 0);
-    LLVMValueRef main = LLVMAddFunction(module, "main", main_type);
-    LLVMBasicBlockRef main_bb = LLVMAppendBasicBlock(main, "entry");
-    LLVMPositionBuilderAtEnd(builder, main_bb);
+    struct stats_timer t = stats_start();
+    if (yyparse(&lexer, module, builder) || !compilation->root) {
+      return 1;
+    }
+    stats_stop(&t, STATS_PARSE);
+    stats_count(STATS_AST_NODES, arena_count(&compilation->arena));
+    lexer_close(&lexer);
+
+    if (mode == MODE_STACK || mode == MODE_REG || mode == MODE_TIERED) {
+      if (uses_arrays() || uses_functions() || uses_parallel_loops()) {
+        fprintf(stderr, "Arrays, functions and parallel loops are only supported by the jit mode\n");
+        return 1;
+      }
+      if (mode == MODE_STACK) {
+        run_stack_machine(dump_bytecode);
+      } else if (mode == MODE_REG) {
+        run_register_machine(dump_bytecode);
+      } else {
+        run_tiered(dump_bytecode, opt_level, threshold);
+      }
+      arena_fini(&compilation->arena);
+      LLVMDisposeBuilder(builder);
+      LLVMDisposeModule(module);
+      return 0;
+    }
 
-    yyparse(module, builder);
+    t = stats_start();
+    codegen_outline(parallel ? &parts : NULL);
+    codegen_stmt(compilation->root, module, builder);
+    codegen_outline(NULL);
+    arena_fini(&compilation->arena);
+    if (profile_generate) {
+      profile_finish(&counters, profile_generate, module, builder);
+    }
+    finish_main(module, builder);
+    stats_stop(&t, STATS_CODEGEN);
+    stats_count_module(module, STATS_IR_INSTRUCTIONS, STATS_IR_BLOCKS);
+
+    if (parallel) {
+      // The runtime of the compiler is shared by the objects, like with --external-runtime.
+      size_t n_objects;
+      t = stats_start();
+      LLVMDumpModule(module);
+      stats_stop(&t, STATS_DUMP);
+      t = stats_start();
+      LLVMVerifyModule(module, LLVMAbortProcessAction, &error);
+      stats_stop(&t, STATS_VERIFY);
+      fprintf(stderr, "Generating code for %zu parts\n", parts.n_modules + 1);
+      t = stats_start();
+      LLVMMemoryBufferRef *objects = compile_parallel(module, &parts, opt_level, jobs, &n_objects);
+      stats_stop(&t, STATS_MACHINE_CODE);
+      free(parts.modules);
+      if (!objects) {
+        return 1;
+      }
+      t = stats_start();
+      int failed = run_objects(objects, n_objects);
+      stats_stop(&t, STATS_RUN);
+      free(objects);
+      compilation_fini(&main_compilation);
+      profile_fini(&counters);
+      profile_fini(&weights);
+      LLVMDisposeBuilder(builder);
+      LLVMDisposeTargetMachine(machine);
+      return failed;
+    }
 
-    LLVMBuildRet(builder, 0);
+    // Link the runtime into the program, so that prints can be inlined and specialized.
+    t = stats_start();
+    if (!external_runtime) {
+      if (LLVMCreateMemoryBufferWithContentsOfFile("runtime.bc", &buffer, &error)) {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+      } else if (LLVMParseIRInContext(LLVMGetGlobalContext(), buffer, &runtime, &error)) {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+      } else if (link_runtime(module, runtime)) {
+        fprintf(stderr, "Cannot link runtime.bc\n");
+        return 1;
+      }
+    }
+    stats_stop(&t, STATS_LINK_RUNTIME);
 
     // Dump entire module.
+    t = stats_start();
     LLVMDumpModule(module);
+    stats_stop(&t, STATS_DUMP);
 
+    t = stats_start();
     LLVMVerifyModule(module, LLVMAbortProcessAction, &error);
+    stats_stop(&t, STATS_VERIFY);
 
-    LLVMRunFunctionPassManager(pass_manager, main);
+    t = stats_start();
+    if (optimize_module(module, machine, opt_level)) {
+      return 1;
+    }
+    stats_stop(&t, STATS_OPTIMIZE);
+    stats_count_module(module, STATS_OPT_IR_INSTRUCTIONS, STATS_OPT_IR_BLOCKS);
 
     // Dump entire module.
+    t = stats_start();
     LLVMDumpModule(module);
+    stats_stop(&t, STATS_DUMP);
+
+    if (object_file || executable) {
+      // Ahead of time: write the object file and link it, nothing is run. Without -c the
+      // object is a temporary file, removed once linked.
+      char temp[] = "/tmp/compiler-XXXXXX";
+      const char *object = object_file;
+      if (!object) {
+        int fd = mkstemp(temp);
+        if (fd < 0) {
+          perror(temp);
+          return 1;
+        }
+        close(fd);
+        object = temp;
+      }
+      fprintf(stderr, "Generating code\n");
+      t = stats_start();
+      int failed = emit_object(module, machine, object);
+      stats_stop(&t, STATS_MACHINE_CODE);
+      if (!failed) {
+        stats_count_file(STATS_MACHINE_CODE_BYTES, object);
+      }
+      if (!failed && executable) {
+        t = stats_start();
+        failed = link_executable(object, executable, external_runtime);
+        stats_stop(&t, STATS_LINK);
+      }
+      if (!object_file) {
+        remove(temp);
+      }
+      if (failed) {
+        return 1;
+      }
+      LLVMDisposeModule(module);
+    } else if (use_cache) {
+      // Generate a relocatable object, keep it for the next runs and run it.
+      fprintf(stderr, "Generating code\n");
+      t = stats_start();
+      LLVMMemoryBufferRef object = emit_object_buffer(module, machine);
+      if (!object) {
+        return 1;
+      }
+      stats_stop(&t, STATS_MACHINE_CODE);
+      stats_count(STATS_MACHINE_CODE_BYTES, LLVMGetBufferSize(object));
+      cache_store(key, cache_source, cache_len, object);
+      free(cache_source);
+      cache_report();
+      LLVMDisposeModule(module);
+      t = stats_start();
+      int failed = run_object(object);
+      stats_stop(&t, STATS_RUN);
+      if (failed) {
+        return 1;
+      }
+    } else {
+      // Create execution engine.
+      t = stats_start();
+      if (create_jit(&engine, module, opt_level, &error)) {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+      }
+
+      fprintf(stderr, "Generating code\n");
+      int (*main_fn)(void) = (int (*)(void)) LLVMGetPointerToGlobal(engine, main);
+      stats_stop(&t, STATS_MACHINE_CODE);
+      fprintf(stderr, "Running\n");
+      t = stats_start();
+      main_fn();
+      stats_stop(&t, STATS_RUN);
+      fprintf(stderr, "Done\n");
+      LLVMDisposeExecutionEngine(engine);
+    }
 
-    fprintf(stderr, "Generating code\n");
-    void (*main_fn)() = (void (*)()) LLVMGetPointerToGlobal(engine, main);
-    fprintf(stderr, "Running\n");
-    main_fn();
-    fprintf(stderr, "Done\n");
-
-    vector_fini(&global_types);
-    string_int_fini(&global_ids);
+    compilation_fini(&main_compilation);
+    profile_fini(&counters);
+    profile_fini(&weights);
 
     LLVMDisposeBuilder(builder);
-    LLVMDisposeModule(module);
+    LLVMDisposeTargetMachine(machine);
 
     return 0;
 }
@@ -0,0 +1,239 @@
+/**
+ * @file profile.c
+ * @brief
+ * Profile-guided optimization: the counters of an instrumented program, and the profile
+ * they produce turned back into branch weights and loop hints (see profile.h).
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/DebugInfo.h>
+#include "y.tab.h"
+#include "utils.h"
+#include "profile.h"
+
+/**
+ * @brief
+ * It makes an empty profile.
+ * @param p is a profile.
+ */
+void profile_init(struct profile *p) {
+  string_int_init(&p->locations);
+  p->counts = NULL;
+  p->n_counts = 0;
+  p->counters = NULL;
+}
+
+/**
+ * @brief
+ * It frees a profile.
+ * @param p is a profile.
+ */
+void profile_fini(struct profile *p) {
+  string_int_fini(&p->locations);
+  free(p->counts);
+  p->counts = NULL;
+  p->n_counts = 0;
+}
+
+/**
+ * @brief
+ * @param p is a profile.
+ * @param loc is the location of an if or a while.
+ * @return size_t is the id of the location, new ones are added.
+ */
+static size_t location_id(struct profile *p, struct location loc) {
+  char key[32];
+  int len = snprintf(key, sizeof(key), "%d:%d", loc.line, loc.column);
+  return string_int_get_len(&p->locations, key, len);
+}
+
+/**
+ * @brief
+ * It reads a profile written by an instrumented program.
+ * @param p is an empty profile.
+ * @param path is the profile file.
+ * @return int is zero on success.
+ */
+int profile_read(struct profile *p, const char *path) {
+  FILE *f = fopen(path, "r");
+  char line[256], key[64];
+  uint64_t taken, not_taken;
+
+  if (!f) {
+    perror(path);
+    return 1;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    if (line[0] == '#' || line[0] == '\n') {
+      continue;
+    }
+    if (sscanf(line, "%63s %" SCNu64 " %" SCNu64, key, &taken, &not_taken) != 3) {
+      fprintf(stderr, "%s: malformed line: %s", path, line);
+      fclose(f);
+      return 1;
+    }
+    size_t id = string_int_get(&p->locations, key);
+    if (2 * id + 2 > p->n_counts) {
+      p->counts = realloc(p->counts, (2 * id + 2) * sizeof(p->counts[0]));
+      memset(p->counts + p->n_counts, 0, (2 * id + 2 - p->n_counts) * sizeof(p->counts[0]));
+      p->n_counts = 2 * id + 2;
+    }
+    // the runs of a program can be concatenated into one profile
+    p->counts[2 * id] += taken;
+    p->counts[2 * id + 1] += not_taken;
+  }
+  fclose(f);
+  return 0;
+}
+
+/**
+ * @brief
+ * @param p is a profile read by profile_read.
+ * @param loc is the location of an if or a while.
+ * @return const uint64_t* is the number of times its condition was true, then false, NULL if
+ * the statement never ran or is not in the profile.
+ */
+const uint64_t *profile_lookup(struct profile *p, struct location loc) {
+  size_t id = location_id(p, loc);
+
+  if (2 * id + 2 > p->n_counts || (!p->counts[2 * id] && !p->counts[2 * id + 1])) {
+    return NULL;
+  }
+  return p->counts + 2 * id;
+}
+
+/**
+ * @brief
+ * It counts an edge of a branch where the builder is, at the start of its destination.
+ * The counters are 64-bit. They are added to atomically in programs with parallel loops, whose
+ * bodies run on several threads, and with a plain load and store otherwise.
+ * @param p is the profile of an instrumented module.
+ * @param loc is the location of an if or a while.
+ * @param edge is 0 when the condition is true, 1 when it is false.
+ * @param module is a LLVMModuleRef.
+ * @param builder is a LLVMBuilderRef.
+ */
+void profile_increment(struct profile *p, struct location loc, int edge, LLVMModuleRef module, LLVMBuilderRef builder) {
+  LLVMContextRef context = LLVMGetModuleContext(module);
+  LLVMTypeRef i64 = LLVMInt64TypeInContext(context);
+
+  // the number of counters is only known at the end, see profile_finish
+  if (!p->counters) {
+    p->counters = LLVMAddGlobal(module, i64, "profile.counters");
+    LLVMSetLinkage(p->counters, LLVMInternalLinkage);
+    LLVMSetInitializer(p->counters, LLVMConstNull(i64));
+  }
+  LLVMValueRef index = LLVMConstInt(i64, 2 * location_id(p, loc) + edge, 0);
+  LLVMValueRef counter = LLVMBuildGEP(builder, p->counters, &index, 1, "counter");
+  if (compilation->n_parallel_loops) {
+    LLVMBuildAtomicRMW(builder, LLVMAtomicRMWBinOpAdd, counter, LLVMConstInt(i64, 1, 0), LLVMAtomicOrderingMonotonic, 0);
+    return;
+  }
+  LLVMValueRef count = LLVMBuildLoad(builder, counter, "count");
+  LLVMBuildStore(builder, LLVMBuildAdd(builder, count, LLVMConstInt(i64, 1, 0), "count"), counter);
+}
+
+/**
+ * @brief
+ * It sizes the counters of an instrumented module, and makes main write them to the profile
+ * when it returns. A program stopped by an error writes nothing.
+ * @param p is the profile of an instrumented module.
+ * @param path is the profile file.
+ * @param module is a LLVMModuleRef.
+ * @param builder is a LLVMBuilderRef at the end of main.
+ */
+void profile_finish(struct profile *p, const char *path, LLVMModuleRef module, LLVMBuilderRef builder) {
+  LLVMContextRef context = LLVMGetModuleContext(module);
+  LLVMTypeRef i64 = LLVMInt64TypeInContext(context);
+  size_t n = string_int_count(&p->locations);
+
+  LLVMTypeRef counts_type = LLVMArrayType(i64, 2 * n);
+  LLVMValueRef counts = LLVMAddGlobal(module, counts_type, "profile.counts");
+  LLVMSetLinkage(counts, LLVMInternalLinkage);
+  LLVMSetInitializer(counts, LLVMConstNull(counts_type));
+  LLVMValueRef first = LLVMConstBitCast(counts, LLVMPointerType(i64, 0));
+  if (p->counters) {
+    LLVMReplaceAllUsesWith(p->counters, first);
+    LLVMDeleteGlobal(p->counters);
+    p->counters = NULL;
+  }
+
+  size_t len = 0;
+  for (size_t id = 0; id < n; id++) {
+    len += strlen(string_int_rev(&p->locations, id)) + 1;
+  }
+  char *keys = malloc(len + 1), *end = keys;
+  for (size_t id = 0; id < n; id++) {
+    end += sprintf(end, "%s\n", string_int_rev(&p->locations, id));
+  }
+  *end = 0;
+
+  LLVMValueRef args[] = {
+    LLVMBuildGlobalStringPtr(builder, path, "profile.path"),
+    LLVMBuildGlobalStringPtr(builder, keys, "profile.keys"),
+    first,
+    LLVMConstInt(LLVMInt32TypeInContext(context), n, 0),
+  };
+  LLVMBuildCall(builder, LLVMGetNamedFunction(module, "profile_write"), args, 4, "");
+  free(keys);
+}
+
+/**
+ * @brief
+ * It attaches the counts of a branch as its weights.
+ * @param branch is a conditional branch to the code of the true condition, then of the false one.
+ * @param counts are the counts of profile_lookup.
+ */
+void profile_set_weights(LLVMValueRef branch, const uint64_t *counts) {
+  LLVMContextRef context = LLVMGetTypeContext(LLVMTypeOf(branch));
+  LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+  uint64_t max = counts[0] > counts[1] ? counts[0] : counts[1];
+  // the weights are 32-bit, the counts are scaled down together; a weight is never 0, an
+  // edge that was not taken in the runs of the profile may be in others
+  uint64_t scale = max / (UINT32_MAX - 1) + 1;
+
+  LLVMMetadataRef ops[] = {
+    LLVMMDStringInContext2(context, "branch_weights", 14),
+    LLVMValueAsMetadata(LLVMConstInt(i32, counts[0] / scale + 1, 0)),
+    LLVMValueAsMetadata(LLVMConstInt(i32, counts[1] / scale + 1, 0)),
+  };
+  LLVMSetMetadata(branch, LLVMGetMDKindIDInContext(context, "prof", 4),
+                  LLVMMetadataAsValue(context, LLVMMDNodeInContext2(context, ops, 3)));
+}
+
+/**
+ * @brief
+ * It gives a loop the hints of its trip count. The weights of its condition already tell the
+ * loop passes how many iterations it runs on average; a loop that runs fewer than
+ * PROFILE_SHORT_LOOP is also neither unrolled nor vectorized, which would only grow the code.
+ * @param latch is the branch back to the condition of a while.
+ * @param counts are the counts of the condition, see profile_lookup.
+ */
+void profile_set_loop_hints(LLVMValueRef latch, const uint64_t *counts) {
+  LLVMContextRef context = LLVMGetTypeContext(LLVMTypeOf(latch));
+  uint64_t entries = counts[1] ? counts[1] : 1;
+
+  if (counts[0] / entries >= PROFILE_SHORT_LOOP) {
+    return;
+  }
+
+  LLVMMetadataRef unroll[] = { LLVMMDStringInContext2(context, "llvm.loop.unroll.disable", 24) };
+  LLVMMetadataRef width[] = {
+    LLVMMDStringInContext2(context, "llvm.loop.vectorize.width", 25),
+    LLVMValueAsMetadata(LLVMConstInt(LLVMInt32TypeInContext(context), 1, 0)),
+  };
+  // a loop identifier refers to itself
+  LLVMMetadataRef self = LLVMTemporaryMDNode(context, NULL, 0);
+  LLVMMetadataRef ops[] = {
+    self,
+    LLVMMDNodeInContext2(context, unroll, 1),
+    LLVMMDNodeInContext2(context, width, 2),
+  };
+  LLVMMetadataRef loop = LLVMMDNodeInContext2(context, ops, 3);
+  LLVMMetadataReplaceAllUsesWith(self, loop);
+  LLVMSetMetadata(latch, LLVMGetMDKindIDInContext(context, "llvm.loop", 9), LLVMMetadataAsValue(context, loop));
+}
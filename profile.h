@@ -0,0 +1,39 @@
+/**
+ * @file profile.h
+ * @brief
+ * Profile-guided optimization. An instrumented program (--profile-generate) counts how many
+ * times the condition of each if and while was true and false, and writes the counts at exit,
+ * one line per statement keyed by the location of its keyword:
+ *
+ *   line:column true false
+ *
+ * A later compilation (--profile-use) reads them back and turns them into branch weights,
+ * which guide the block layout, the inliner and the loop passes, and into loop hints.
+ */
+
+#include <stdint.h>
+#include <llvm-c/Core.h>
+
+// a loop that runs fewer iterations each time it is entered is neither unrolled nor vectorized
+#define PROFILE_SHORT_LOOP 4
+
+/**
+ * @brief
+ * Counts of the branches of a program, two per location: the condition was true, false.
+ * The locations are interned in locations, whose ids index the counts.
+ */
+struct profile {
+  struct string_int locations;  // "line:column" of each if and while
+  uint64_t *counts;
+  size_t n_counts;              // counts read from the profile file
+  LLVMValueRef counters;        // the counters of an instrumented module
+};
+
+void profile_init(struct profile *p);
+void profile_fini(struct profile *p);
+int profile_read(struct profile *p, const char *path);
+const uint64_t *profile_lookup(struct profile *p, struct location loc);
+void profile_increment(struct profile *p, struct location loc, int edge, LLVMModuleRef module, LLVMBuilderRef builder);
+void profile_finish(struct profile *p, const char *path, LLVMModuleRef module, LLVMBuilderRef builder);
+void profile_set_weights(LLVMValueRef branch, const uint64_t *counts);
+void profile_set_loop_hints(LLVMValueRef latch, const uint64_t *counts);
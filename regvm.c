@@ -0,0 +1,619 @@
+/**
+ * @file regvm.c
+ * @brief
+ * Register machine: compiler from the AST to three-address code over virtual registers,
+ * linear-scan register allocation onto the REGVM_REGISTERS registers, and interpreter.
+ *
+ * Virtual registers hold the temporaries of one statement, variables stay in memory.
+ * A temporary is never live across a loop back edge, so its live interval is simply
+ * the range between its first definition and its last use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "ast.h"
+#include "regvm.h"
+#include "runtime.h"
+#include "utils.h"
+
+#define ALLOCATABLE (REGVM_REGISTERS - REGVM_SCRATCH)
+
+/**
+ * @brief
+ * Code generation state: the program and the next free virtual register.
+ */
+struct regvm_gen {
+  struct regvm *vm;
+  int next_vreg;
+};
+
+/**
+ * @brief
+ * It appends an instruction.
+ * @param vm is a register machine program.
+ * @param inst is the instruction.
+ * @return size_t is its index, to patch jump targets.
+ */
+static size_t append(struct regvm *vm, struct regvm_inst inst) {
+  if (vm->len == vm->capacity) {
+    vm->capacity = vm->capacity ? 2 * vm->capacity : 256;
+    vm->code = realloc(vm->code, vm->capacity * sizeof(vm->code[0]));
+  }
+  vm->code[vm->len] = inst;
+  return vm->len++;
+}
+
+/**
+ * @brief
+ * It emits an instruction.
+ * @return size_t is its index.
+ */
+static size_t emit(struct regvm_gen *g, int op, int dst, int a, int b, int32_t imm, int32_t target) {
+  struct regvm_inst inst = { op, dst, a, b, imm, target };
+  return append(g->vm, inst);
+}
+
+/**
+ * @brief
+ * @return int is a new virtual register.
+ */
+static int new_vreg(struct regvm_gen *g) {
+  return g->next_vreg++;
+}
+
+/**
+ * @brief
+ * @param op is a binary operator of the AST.
+ * @return int is the register form of the operation.
+ */
+static int binop_opcode(int op) {
+  switch (op) {
+    case '+': return R_ADD;
+    case '-': return R_SUB;
+    case '*': return R_MUL;
+    case '/': return R_DIV;
+    case REMAINDER: return R_REM;
+    case AND: return R_AND;
+    case OR: return R_OR;
+    case XOR: return R_XOR;
+    case LEFTSHIFT: return R_SHL;
+    case RIGHTSHIFT: return R_SHR;
+    case EQ: return R_EQ;
+    case NE: return R_NE;
+    case '<': return R_LT;
+    case LE: return R_LE;
+    case '>': return R_GT;
+    default: return R_GE;
+  }
+}
+
+/**
+ * @brief
+ * @param op is a binary operator of the AST.
+ * @param negate is non-zero to jump when the comparison is false.
+ * @return int is the register form of the conditional jump, -1 if op is not a comparison.
+ */
+static int jump_opcode(int op, int negate) {
+  switch (op) {
+    case EQ:  return negate ? R_JNE : R_JEQ;
+    case NE:  return negate ? R_JEQ : R_JNE;
+    case '<': return negate ? R_JGE : R_JLT;
+    case LE:  return negate ? R_JGT : R_JLE;
+    case '>': return negate ? R_JLE : R_JGT;
+    case GE:  return negate ? R_JLT : R_JGE;
+    default:  return -1;
+  }
+}
+
+/**
+ * @brief
+ * @param expr is an expression.
+ * @return int is non-zero if it is a constant that fits an immediate operand.
+ */
+static int is_constant(struct expr *expr) {
+  return expr->type == LITERAL || expr->type == BOOL_LIT;
+}
+
+static int gen_expr(struct regvm_gen *g, struct expr *expr);
+
+/**
+ * @brief
+ * It generates an increment or a decrement, like compile_step in bytecode.c.
+ * @return int is the register of the result.
+ */
+static int gen_step(struct regvm_gen *g, struct expr *expr, int delta, int post) {
+  struct expr *operand = expr->expr;
+  int boolean = expr->value_type == BOOLEAN;
+  int old = gen_expr(g, operand);
+  int result = old;
+
+  if (operand->type == VARIABLE || !post) {
+    result = new_vreg(g);
+    emit(g, R_ADDI, result, old, 0, delta, 0);
+    if (boolean) {
+      // i1 arithmetic wraps around
+      emit(g, R_ANDI, result, result, 0, 1, 0);
+    }
+  }
+  if (operand->type == VARIABLE) {
+    emit(g, R_STORE, 0, result, 0, operand->id, 0);
+  }
+  return post ? old : result;
+}
+
+/**
+ * @brief
+ * It generates an expression.
+ * @return int is the virtual register that holds its value.
+ */
+static int gen_expr(struct regvm_gen *g, struct expr *expr) {
+  int d;
+
+  switch (expr->type) {
+    case BOOL_LIT:
+    case LITERAL:
+      d = new_vreg(g);
+      emit(g, R_LOADI, d, 0, 0, expr->value, 0);
+      return d;
+
+    case VARIABLE:
+      d = new_vreg(g);
+      emit(g, R_LOAD, d, 0, 0, expr->id, 0);
+      return d;
+
+    case PRE_INCREMENT_OP:  return gen_step(g, expr, 1, 0);
+    case POST_INCREMENT_OP: return gen_step(g, expr, 1, 1);
+    case PRE_DECREMENT_OP:  return gen_step(g, expr, -1, 0);
+    case POST_DECREMENT_OP: return gen_step(g, expr, -1, 1);
+
+    case BIN_OP: {
+      int op = binop_opcode(expr->binop.op);
+      int a = gen_expr(g, expr->binop.lhs);
+      if (is_short_circuit(expr)) {
+        // a && b is a ? b : false, a || b is a ? true : b
+        d = new_vreg(g);
+        emit(g, R_LOADI, d, 0, 0, expr->binop.op == OR, 0);
+        size_t to_end = emit(g, expr->binop.op == AND ? R_JZ : R_JNZ, 0, a, 0, 0, 0);
+        int b = gen_expr(g, expr->binop.rhs);
+        emit(g, R_MOV, d, b, 0, 0, 0);
+        g->vm->code[to_end].target = g->vm->len;
+        return d;
+      }
+      if (is_constant(expr->binop.rhs)) {
+        d = new_vreg(g);
+        emit(g, op + 1, d, a, 0, expr->binop.rhs->value, 0);
+      } else {
+        int b = gen_expr(g, expr->binop.rhs);
+        d = new_vreg(g);
+        emit(g, op, d, a, b, 0, 0);
+      }
+      return d;
+    }
+
+    case TERNARY_OP: {
+      int cond = gen_expr(g, expr->ternary.lhs);
+      d = new_vreg(g);
+      size_t to_else = emit(g, R_JZ, 0, cond, 0, 0, 0);
+      int mhs = gen_expr(g, expr->ternary.mhs);
+      emit(g, R_MOV, d, mhs, 0, 0, 0);
+      size_t to_end = emit(g, R_JUMP, 0, 0, 0, 0, 0);
+      g->vm->code[to_else].target = g->vm->len;
+      int rhs = gen_expr(g, expr->ternary.rhs);
+      emit(g, R_MOV, d, rhs, 0, 0, 0);
+      g->vm->code[to_end].target = g->vm->len;
+      return d;
+    }
+
+    // The parser rejects arrays and functions in the VM modes.
+    case ELEMENT:
+    case CALL:
+      abort();
+  }
+  return 0;
+}
+
+/**
+ * @brief
+ * It generates a jump taken when the condition is true (or false), comparing directly if it can.
+ * @param cond is a boolean expression.
+ * @param negate is non-zero to jump when the condition is false.
+ * @param target is the target, if known.
+ * @return size_t is the index of the jump, to patch its target.
+ */
+static size_t gen_branch(struct regvm_gen *g, struct expr *cond, int negate, int32_t target) {
+  int jump = cond->type == BIN_OP ? jump_opcode(cond->binop.op, negate) : -1;
+
+  if (jump < 0) {
+    int c = gen_expr(g, cond);
+    return emit(g, negate ? R_JZ : R_JNZ, 0, c, 0, 0, target);
+  }
+
+  int a = gen_expr(g, cond->binop.lhs);
+  if (is_constant(cond->binop.rhs)) {
+    return emit(g, jump + 1, 0, a, 0, cond->binop.rhs->value, target);
+  }
+  int b = gen_expr(g, cond->binop.rhs);
+  return emit(g, jump, 0, a, b, 0, target);
+}
+
+/**
+ * @brief
+ * It generates a statement.
+ */
+static void gen_stmt(struct regvm_gen *g, struct stmt *stmt) {
+  switch (stmt->type) {
+    case STMT_SEQ:
+      for (size_t i = 0; i < stmt->seq.len; i++) {
+        gen_stmt(g, stmt->seq.stmts[i]);
+      }
+      break;
+
+    case STMT_ASSIGN: {
+      struct expr *e = stmt->assign.expr;
+      if (is_constant(e)) {
+        emit(g, R_STOREI, 0, 0, 0, stmt->assign.id, e->value);
+      } else if (e->type == BIN_OP && (e->binop.op == '+' || e->binop.op == '-') &&
+                 e->binop.lhs->type == VARIABLE && e->binop.lhs->id == stmt->assign.id &&
+                 e->binop.rhs->type == LITERAL) {
+        int32_t k = e->binop.rhs->value;
+        emit(g, R_INCR, 0, 0, 0, stmt->assign.id, e->binop.op == '+' ? k : (int32_t) (0u - (uint32_t) k));
+      } else {
+        int v = gen_expr(g, e);
+        emit(g, R_STORE, 0, v, 0, stmt->assign.id, 0);
+      }
+      break;
+    }
+
+    case STMT_PRINT: {
+      int v = gen_expr(g, stmt->print.expr);
+      emit(g, stmt->print.expr->value_type == BOOLEAN ? R_PRINT_I1 : R_PRINT_I32, 0, v, 0, 0, 0);
+      break;
+    }
+
+    case STMT_IF: {
+      size_t to_else = gen_branch(g, stmt->ifelse.cond, 1, 0);
+      gen_stmt(g, stmt->ifelse.if_body);
+      if (stmt->ifelse.else_body) {
+        size_t to_end = emit(g, R_JUMP, 0, 0, 0, 0, 0);
+        g->vm->code[to_else].target = g->vm->len;
+        gen_stmt(g, stmt->ifelse.else_body);
+        g->vm->code[to_end].target = g->vm->len;
+      } else {
+        g->vm->code[to_else].target = g->vm->len;
+      }
+      break;
+    }
+
+    case STMT_WHILE: {
+      // The condition is at the bottom, so that an iteration runs a single jump.
+      size_t to_cond = emit(g, R_JUMP, 0, 0, 0, 0, 0);
+      int32_t body = g->vm->len;
+      gen_stmt(g, stmt->while_.body);
+      g->vm->code[to_cond].target = g->vm->len;
+      gen_branch(g, stmt->while_.cond, 0, body);
+      break;
+    }
+
+    // The parser rejects arrays, functions and parallel loops in the VM modes.
+    case STMT_STORE:
+    case STMT_ALLOC:
+    case STMT_CALL:
+    case STMT_RETURN:
+    case STMT_FOR:
+      abort();
+  }
+}
+
+/**
+ * @brief
+ * Register uses of an instruction.
+ */
+static int reads_a(int op) {
+  return op == R_STORE || op == R_MOV || (op >= R_ADD && op <= R_GEI) ||
+         op == R_JZ || op == R_JNZ || (op >= R_JEQ && op <= R_JGEI) ||
+         op == R_PRINT_I32 || op == R_PRINT_I1;
+}
+
+static int reads_b(int op) {
+  return (op >= R_ADD && op <= R_GEI && (op - R_ADD) % 2 == 0) ||
+         (op >= R_JEQ && op <= R_JGEI && (op - R_JEQ) % 2 == 0);
+}
+
+static int writes_dst(int op) {
+  return op == R_LOADI || op == R_LOAD || op == R_MOV || (op >= R_ADD && op <= R_GEI);
+}
+
+static int is_jump(int op) {
+  return op == R_JUMP || op == R_JZ || op == R_JNZ || (op >= R_JEQ && op <= R_JGEI);
+}
+
+/**
+ * @brief
+ * Live interval of a virtual register.
+ */
+struct interval {
+  int vreg;
+  int start, end;
+};
+
+static int by_start(const void *x, const void *y) {
+  const struct interval *a = x, *b = y;
+  return a->start - b->start;
+}
+
+/**
+ * @brief
+ * Linear scan (Poletto and Sarkar): intervals are visited by increasing start, the active
+ * ones are kept sorted by end. When no register is free, the interval that ends last is spilled.
+ * @param code is the code over virtual registers.
+ * @param len is the number of instructions.
+ * @param n_vregs is the number of virtual registers.
+ * @param reg is where the register of each virtual register is stored, -1 if it is spilled.
+ */
+static void linear_scan(struct regvm_inst *code, size_t len, int n_vregs, int *reg) {
+  struct interval *intervals = malloc((n_vregs + 1) * sizeof(intervals[0]));
+  struct interval *active[ALLOCATABLE];
+  int n_active = 0;
+  int free_regs[ALLOCATABLE];
+  int n_free = ALLOCATABLE;
+
+  for (int v = 0; v < n_vregs; v++) {
+    intervals[v].vreg = v;
+    intervals[v].start = -1;
+    intervals[v].end = -1;
+  }
+  for (size_t i = 0; i < len; i++) {
+    int op = code[i].op;
+    int regs[3] = { writes_dst(op) ? code[i].dst : -1, reads_a(op) ? code[i].a : -1, reads_b(op) ? code[i].b : -1 };
+    for (int k = 0; k < 3; k++) {
+      if (regs[k] >= 0) {
+        struct interval *it = &intervals[regs[k]];
+        if (it->start < 0) {
+          it->start = i;
+        }
+        it->end = i;
+      }
+    }
+  }
+  qsort(intervals, n_vregs, sizeof(intervals[0]), by_start);
+
+  for (int r = 0; r < ALLOCATABLE; r++) {
+    free_regs[r] = ALLOCATABLE - 1 - r;
+  }
+
+  for (int v = 0; v < n_vregs; v++) {
+    struct interval *it = &intervals[v];
+    if (it->start < 0) {
+      reg[it->vreg] = -1;
+      continue;
+    }
+
+    // Expire the intervals that ended before this one starts.
+    int kept = 0;
+    for (int k = 0; k < n_active; k++) {
+      if (active[k]->end < it->start) {
+        free_regs[n_free++] = reg[active[k]->vreg];
+      } else {
+        active[kept++] = active[k];
+      }
+    }
+    n_active = kept;
+
+    if (n_free == 0) {
+      struct interval *last = active[n_active - 1];
+      if (last->end > it->end) {
+        reg[it->vreg] = reg[last->vreg];
+        reg[last->vreg] = -1;
+        n_active--;
+      } else {
+        reg[it->vreg] = -1;
+        continue;
+      }
+    } else {
+      reg[it->vreg] = free_regs[--n_free];
+    }
+
+    // Insert in the active list, sorted by end.
+    int k = n_active++;
+    while (k > 0 && active[k - 1]->end > it->end) {
+      active[k] = active[k - 1];
+      k--;
+    }
+    active[k] = it;
+  }
+
+  free(intervals);
+}
+
+/**
+ * @brief
+ * It compiles a whole program and allocates its registers.
+ * Spilled virtual registers get a memory slot after the variables; the rewritten code
+ * reloads them in the scratch registers before each use and stores them after each definition.
+ * @param vm is where the program is stored.
+ * @param stmt is the program.
+ * @param n_vars is the number of variables.
+ */
+void regvm_compile(struct regvm *vm, struct stmt *stmt, size_t n_vars) {
+  struct regvm virt = { NULL, 0, 0, n_vars, 0, 0 };
+  struct regvm_gen g = { &virt, 0 };
+
+  gen_stmt(&g, stmt);
+  emit(&g, R_HALT, 0, 0, 0, 0, 0);
+
+  int *reg = malloc((g.next_vreg + 1) * sizeof(int));
+  int32_t *slot = malloc((g.next_vreg + 1) * sizeof(int32_t));
+  size_t *position = malloc((virt.len + 1) * sizeof(size_t));
+  linear_scan(virt.code, virt.len, g.next_vreg, reg);
+
+  vm->code = NULL;
+  vm->len = 0;
+  vm->capacity = 0;
+  vm->mem_size = n_vars;
+  vm->n_vregs = g.next_vreg;
+  vm->n_spilled = 0;
+  for (int v = 0; v < g.next_vreg; v++) {
+    if (reg[v] < 0) {
+      slot[v] = vm->mem_size++;
+      vm->n_spilled++;
+    }
+  }
+
+  for (size_t i = 0; i < virt.len; i++) {
+    struct regvm_inst inst = virt.code[i];
+    int op = inst.op;
+    position[i] = vm->len;
+
+    if (reads_a(op)) {
+      if (reg[inst.a] < 0) {
+        struct regvm_inst load = { R_LOAD, ALLOCATABLE, 0, 0, slot[inst.a], 0 };
+        append(vm, load);
+        inst.a = ALLOCATABLE;
+      } else {
+        inst.a = reg[inst.a];
+      }
+    }
+    if (reads_b(op)) {
+      if (reg[inst.b] < 0) {
+        struct regvm_inst load = { R_LOAD, ALLOCATABLE + 1, 0, 0, slot[inst.b], 0 };
+        append(vm, load);
+        inst.b = ALLOCATABLE + 1;
+      } else {
+        inst.b = reg[inst.b];
+      }
+    }
+    if (writes_dst(op)) {
+      int spilled = reg[inst.dst] < 0;
+      int32_t dst_slot = spilled ? slot[inst.dst] : 0;
+      inst.dst = spilled ? ALLOCATABLE : reg[inst.dst];
+      append(vm, inst);
+      if (spilled) {
+        struct regvm_inst store = { R_STORE, 0, ALLOCATABLE, 0, dst_slot, 0 };
+        append(vm, store);
+      }
+    } else {
+      append(vm, inst);
+    }
+  }
+  position[virt.len] = vm->len;
+
+  for (size_t i = 0; i < vm->len; i++) {
+    if (is_jump(vm->code[i].op)) {
+      vm->code[i].target = position[vm->code[i].target];
+    }
+  }
+
+  free(position);
+  free(slot);
+  free(reg);
+  free(virt.code);
+}
+
+/**
+ * @brief
+ * It frees the code.
+ */
+void regvm_fini(struct regvm *vm) {
+  free(vm->code);
+}
+
+/**
+ * @brief
+ * It prints the code in the text format of emit_reg_machine.
+ */
+void regvm_dump(struct regvm *vm) {
+#define BINOP_NAME(name, mnemonic, expr) [R_##name] = mnemonic, [R_##name##I] = mnemonic,
+  static const char *binops[R_COUNT] = { REGVM_BINOPS(BINOP_NAME) };
+#undef BINOP_NAME
+#define JUMP_NAME(name, cmp) [R_##name] = #cmp, [R_##name##I] = #cmp,
+  static const char *jumps[R_COUNT] = { REGVM_JUMPS(JUMP_NAME) };
+#undef JUMP_NAME
+
+  for (size_t i = 0; i < vm->len; i++) {
+    struct regvm_inst *in = &vm->code[i];
+    printf("%5zu: ", i);
+    switch (in->op) {
+      case R_LOADI: printf("r%d = %d\n", in->dst, in->imm); break;
+      case R_LOAD: printf("r%d = load %d # %s\n", in->dst, in->imm, (size_t) in->imm < string_int_count(&compilation->ids) ? string_int_rev(&compilation->ids, in->imm) : "spill"); break;
+      case R_STORE: printf("store %d, r%d # %s\n", in->imm, in->a, (size_t) in->imm < string_int_count(&compilation->ids) ? string_int_rev(&compilation->ids, in->imm) : "spill"); break;
+      case R_STOREI: printf("store %d, %d # %s\n", in->imm, in->target, string_int_rev(&compilation->ids, in->imm)); break;
+      case R_INCR: printf("incr %d, %d # %s\n", in->imm, in->target, string_int_rev(&compilation->ids, in->imm)); break;
+      case R_MOV: printf("r%d = r%d\n", in->dst, in->a); break;
+      case R_JUMP: printf("jump %d\n", in->target); break;
+      case R_JZ: printf("if !r%d jump %d\n", in->a, in->target); break;
+      case R_JNZ: printf("if r%d jump %d\n", in->a, in->target); break;
+      case R_PRINT_I32: printf("print_i32 r%d\n", in->a); break;
+      case R_PRINT_I1: printf("print_i1 r%d\n", in->a); break;
+      case R_HALT: printf("halt\n"); break;
+      default:
+        if (jumps[in->op] && (in->op - R_JEQ) % 2 == 0) {
+          printf("if r%d %s r%d jump %d\n", in->a, jumps[in->op], in->b, in->target);
+        } else if (jumps[in->op]) {
+          printf("if r%d %s %d jump %d\n", in->a, jumps[in->op], in->imm, in->target);
+        } else if ((in->op - R_ADD) % 2 == 0) {
+          printf("r%d = %s r%d, r%d\n", in->dst, binops[in->op], in->a, in->b);
+        } else {
+          printf("r%d = %s r%d, %d\n", in->dst, binops[in->op], in->a, in->imm);
+        }
+    }
+  }
+  printf("# %d virtual registers, %d spilled, %d registers\n", vm->n_vregs, vm->n_spilled, REGVM_REGISTERS);
+}
+
+/**
+ * @brief
+ * It runs a program until HALT, dispatching with computed goto.
+ * @param vm is a register machine program.
+ * @param mem is the memory of the program: the variables, then the spill slots.
+ * @return uint64_t is the number of instructions executed.
+ */
+uint64_t regvm_run(struct regvm *vm, int32_t *mem) {
+#define BINOP_LABELS(name, mnemonic, expr) [R_##name] = &&do_##name, [R_##name##I] = &&do_##name##I,
+#define JUMP_LABELS(name, cmp) [R_##name] = &&do_##name, [R_##name##I] = &&do_##name##I,
+  static const void *labels[R_COUNT] = {
+    [R_LOADI] = &&do_LOADI, [R_LOAD] = &&do_LOAD, [R_STORE] = &&do_STORE, [R_STOREI] = &&do_STOREI,
+    [R_INCR] = &&do_INCR, [R_MOV] = &&do_MOV,
+    REGVM_BINOPS(BINOP_LABELS)
+    [R_JUMP] = &&do_JUMP, [R_JZ] = &&do_JZ, [R_JNZ] = &&do_JNZ,
+    REGVM_JUMPS(JUMP_LABELS)
+    [R_PRINT_I32] = &&do_PRINT_I32, [R_PRINT_I1] = &&do_PRINT_I1, [R_HALT] = &&do_HALT,
+  };
+#undef BINOP_LABELS
+#undef JUMP_LABELS
+
+  int32_t r[REGVM_REGISTERS] = { 0 };
+  const struct regvm_inst *code = vm->code;
+  const struct regvm_inst *pc = code;
+  uint64_t dispatches = 0;
+
+#define NEXT() do { dispatches++; goto *labels[pc->op]; } while (0)
+#define BINOP_HANDLERS(name, mnemonic, expr)                                                        \
+  do_##name: { int32_t a = r[pc->a], b = r[pc->b]; r[pc->dst] = (expr); pc++; NEXT(); }            \
+  do_##name##I: { int32_t a = r[pc->a], b = pc->imm; r[pc->dst] = (expr); pc++; NEXT(); }
+#define JUMP_HANDLERS(name, cmp)                                                                    \
+  do_##name: pc = r[pc->a] cmp r[pc->b] ? code + pc->target : pc + 1; NEXT();                      \
+  do_##name##I: pc = r[pc->a] cmp pc->imm ? code + pc->target : pc + 1; NEXT();
+
+  NEXT();
+
+  do_LOADI: r[pc->dst] = pc->imm; pc++; NEXT();
+  do_LOAD: r[pc->dst] = mem[pc->imm]; pc++; NEXT();
+  do_STORE: mem[pc->imm] = r[pc->a]; pc++; NEXT();
+  do_STOREI: mem[pc->imm] = pc->target; pc++; NEXT();
+  do_INCR: mem[pc->imm] = (int32_t) ((uint32_t) mem[pc->imm] + (uint32_t) pc->target); pc++; NEXT();
+  do_MOV: r[pc->dst] = r[pc->a]; pc++; NEXT();
+  REGVM_BINOPS(BINOP_HANDLERS)
+  do_JUMP: pc = code + pc->target; NEXT();
+  do_JZ: pc = r[pc->a] ? pc + 1 : code + pc->target; NEXT();
+  do_JNZ: pc = r[pc->a] ? code + pc->target : pc + 1; NEXT();
+  REGVM_JUMPS(JUMP_HANDLERS)
+  do_PRINT_I32: print_i32(r[pc->a]); pc++; NEXT();
+  do_PRINT_I1: print_i1(r[pc->a] & 1); pc++; NEXT();
+
+  do_HALT:
+  return dispatches;
+
+#undef NEXT
+#undef BINOP_HANDLERS
+#undef JUMP_HANDLERS
+}
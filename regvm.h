@@ -0,0 +1,102 @@
+/**
+ * @file regvm.h
+ * @brief
+ * Register machine of emit_reg_machine: three-address code for whole programs,
+ * linear-scan allocation of its virtual registers and an interpreter.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define REGVM_REGISTERS 16   // size of the register file
+#define REGVM_SCRATCH 2      // the last registers are kept to reload spilled values
+
+/**
+ * @brief
+ * Binary operations: name, mnemonic and C expression over a and b.
+ * Each one exists in a register form (d = a op b) and in an immediate form (d = a op imm).
+ */
+#define REGVM_BINOPS(X)                                          \
+  X(ADD, "add",        (int32_t) ((uint32_t) a + (uint32_t) b))  \
+  X(SUB, "sub",        (int32_t) ((uint32_t) a - (uint32_t) b))  \
+  X(MUL, "mul",        (int32_t) ((uint32_t) a * (uint32_t) b))  \
+  X(DIV, "div",        a / b)                                    \
+  X(REM, "remainder",  a % b)                                    \
+  X(AND, "and",        a & b)                                    \
+  X(OR,  "or",         a | b)                                    \
+  X(XOR, "xor",        a ^ b)                                    \
+  X(SHL, "leftshift",  (int32_t) ((uint32_t) a << (b & 31)))     \
+  X(SHR, "rightshift", (int32_t) ((uint32_t) a >> (b & 31)))     \
+  X(EQ,  "eq",         a == b)                                   \
+  X(NE,  "ne",         a != b)                                   \
+  X(LT,  "lt",         a < b)                                    \
+  X(LE,  "le",         a <= b)                                   \
+  X(GT,  "gt",         a > b)                                    \
+  X(GE,  "ge",         a >= b)
+
+/**
+ * @brief
+ * Conditional jumps on a comparison: name and C operator.
+ * Each one exists in a register form (if a op b goto) and an immediate form (if a op imm goto).
+ */
+#define REGVM_JUMPS(X) \
+  X(JEQ, ==)           \
+  X(JNE, !=)           \
+  X(JLT, <)            \
+  X(JLE, <=)           \
+  X(JGT, >)            \
+  X(JGE, >=)
+
+#define REGVM_ENUM_BINOP(name, mnemonic, expr) R_##name, R_##name##I,
+#define REGVM_ENUM_JUMP(name, cmp) R_##name, R_##name##I,
+enum regvm_opcode {
+  R_LOADI,     // d = imm
+  R_LOAD,      // d = mem[imm]
+  R_STORE,     // mem[imm] = a
+  R_STOREI,    // mem[imm] = target (used as a second immediate)
+  R_INCR,      // mem[imm] += target
+  R_MOV,       // d = a
+  REGVM_BINOPS(REGVM_ENUM_BINOP)
+  R_JUMP,      // goto target
+  R_JZ,        // if (!a) goto target
+  R_JNZ,       // if (a) goto target
+  REGVM_JUMPS(REGVM_ENUM_JUMP)
+  R_PRINT_I32, // print_i32(a)
+  R_PRINT_I1,  // print_i1(a)
+  R_HALT,
+  R_COUNT
+};
+#undef REGVM_ENUM_BINOP
+#undef REGVM_ENUM_JUMP
+
+/**
+ * @brief
+ * A three-address instruction. Before allocation dst, a and b are virtual registers,
+ * afterwards they are registers of the register file.
+ */
+struct regvm_inst {
+  int32_t op;
+  int32_t dst, a, b;
+  int32_t imm;     // immediate or memory slot
+  int32_t target;  // jump target (index of an instruction)
+};
+
+/**
+ * @brief
+ * A compiled program.
+ */
+struct regvm {
+  struct regvm_inst *code;
+  size_t len;
+  size_t capacity;
+  size_t mem_size;     // variables and spill slots
+  int n_vregs;         // virtual registers before allocation
+  int n_spilled;       // virtual registers that did not get a register
+};
+
+struct stmt;
+
+void regvm_compile(struct regvm *vm, struct stmt *stmt, size_t n_vars);
+void regvm_fini(struct regvm *vm);
+void regvm_dump(struct regvm *vm);
+uint64_t regvm_run(struct regvm *vm, int32_t *mem);
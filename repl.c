@@ -0,0 +1,293 @@
+/**
+ * @file repl.c
+ * @brief
+ * Interactive session (--repl). The inputs are read one at a time, a declaration or a statement
+ * with its braces balanced, and each is parsed in the compilation of the session, compiled to a
+ * small module of its own whose function runs its statements, added to a LLJIT and run at once.
+ * Only an if waits for the next line, since an else there belongs to it.
+ *
+ * The variables of the session are globals (see declare_globals in ast.c), so they outlive the
+ * input that declares them. The module of an input defines the globals and the functions it
+ * declares and only declares those of the previous inputs (see import_globals), which the JIT
+ * resolves to their definitions. Between inputs, the identifiers are bound to the declarations
+ * of a module of the session that is never compiled, since the modules given to the JIT are.
+ * The runtime is the one of the compiler, like with --external-runtime.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/Orc.h>
+#include "ast.h"
+#include "backend.h"
+#include "lexer.h"
+#include "repl.h"
+#include "stats.h"
+#include "utils.h"
+
+struct repl {
+  LLVMOrcLLJITRef jit;
+  LLVMOrcThreadSafeContextRef tsc;  // context of every module of the session
+  LLVMContextRef context;
+  LLVMModuleRef globals;            // declarations of the globals and the functions defined so far
+  LLVMTargetMachineRef machine;     // of the optimizer, the JIT has its own
+  int opt_level;
+  unsigned n_inputs;
+};
+
+/**
+ * @brief
+ * It starts a session: a LLJIT generating code for the host CPU at the given level, which
+ * resolves the runtime and the C library in the compiler process.
+ * @param r is where the session is stored.
+ * @param opt_level is an optimization level.
+ * @return int is zero on success.
+ */
+static int repl_init(struct repl *r, int opt_level) {
+  LLVMOrcDefinitionGeneratorRef process_symbols;
+
+  memset(r, 0, sizeof(*r));
+  r->opt_level = opt_level;
+  r->machine = create_host_machine(opt_level, 1);
+  if (!r->machine) {
+    return 1;
+  }
+  LLVMTargetMachineRef jit_machine = create_host_machine(opt_level, 1);
+
+  LLVMOrcLLJITBuilderRef builder = LLVMOrcCreateLLJITBuilder();
+  LLVMOrcLLJITBuilderSetJITTargetMachineBuilder(builder, LLVMOrcJITTargetMachineBuilderCreateFromTargetMachine(jit_machine));
+  if (report_error(LLVMOrcCreateLLJIT(&r->jit, builder)) ||
+      report_error(LLVMOrcCreateDynamicLibrarySearchGeneratorForProcess(&process_symbols, LLVMOrcLLJITGetGlobalPrefix(r->jit), NULL, NULL))) {
+    return 1;
+  }
+  LLVMOrcJITDylibAddGenerator(LLVMOrcLLJITGetMainJITDylib(r->jit), process_symbols);
+
+  r->tsc = LLVMOrcCreateNewThreadSafeContext();
+  r->context = LLVMOrcThreadSafeContextGetContext(r->tsc);
+  r->globals = LLVMModuleCreateWithNameInContext("repl.globals", r->context);
+  return 0;
+}
+
+/**
+ * @brief
+ * It ends a session.
+ * @param r is a session.
+ */
+static void repl_fini(struct repl *r) {
+  if (r->globals) {
+    LLVMDisposeModule(r->globals);
+  }
+  if (r->jit) {
+    report_error(LLVMOrcDisposeLLJIT(r->jit));
+  }
+  if (r->tsc) {
+    LLVMOrcDisposeThreadSafeContext(r->tsc);
+  }
+  if (r->machine) {
+    LLVMDisposeTargetMachine(r->machine);
+  }
+}
+
+/**
+ * @brief
+ * It compiles an input in a module of its own and runs it. The declarations of an input that
+ * fails to compile are forgotten, those of the previous inputs stay. The AST of the input is
+ * released from the arena either way.
+ * @param r is a session.
+ * @param source is the input.
+ * @param len is its length.
+ * @return int is zero on success.
+ */
+static int repl_eval(struct repl *r, char *source, size_t len) {
+  char name[32];
+  struct lexer lexer;
+  char *error = NULL;
+  LLVMOrcExecutorAddress address;
+
+  snprintf(name, sizeof(name), "repl.%u", r->n_inputs++);
+  LLVMModuleRef module = LLVMModuleCreateWithNameInContext(name, r->context);
+  LLVMBuilderRef builder = LLVMCreateBuilderInContext(r->context);
+  setup_module_for_host(module, r->machine);
+  declare_runtime(module);
+  LLVMValueRef fn = LLVMAddFunction(module, name, LLVMFunctionType(LLVMInt32TypeInContext(r->context), NULL, 0, 0));
+  set_host_cpu(fn);
+  LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(r->context, fn, "entry"));
+  import_globals(module, 1);
+
+  FILE *in = fmemopen(source, len, "r");
+  lexer_open_stream(&lexer, in);
+  lexer.start = REPL;
+  compilation->root = NULL;
+  struct stats_timer t = stats_start();
+  int failed = yyparse(&lexer, module, builder);
+  stats_stop(&t, STATS_PARSE);
+  lexer_close(&lexer);
+  fclose(in);
+
+  if (failed) {
+    abandon_function(builder);
+    import_globals(r->globals, 0);
+    LLVMDisposeBuilder(builder);
+    LLVMDisposeModule(module);
+    arena_fini(&compilation->arena);
+    return 1;
+  }
+
+  t = stats_start();
+  if (compilation->root) {
+    codegen_stmt(compilation->root, module, builder);
+  }
+  finish_main(module, builder);
+  LLVMDisposeBuilder(builder);
+  stats_stop(&t, STATS_CODEGEN);
+  // the AST of an input is not needed once it is generated, only the globals and functions stay
+  compilation->root = NULL;
+  arena_fini(&compilation->arena);
+
+  t = stats_start();
+  LLVMVerifyModule(module, LLVMAbortProcessAction, &error);
+  stats_stop(&t, STATS_VERIFY);
+  // the optimizer may drop the declarations of the module, which the JIT owns from now on
+  import_globals(r->globals, 1);
+
+  t = stats_start();
+  if (optimize_module(module, r->machine, r->opt_level)) {
+    LLVMDisposeModule(module);
+    return 1;
+  }
+  stats_stop(&t, STATS_OPTIMIZE);
+
+  t = stats_start();
+  LLVMOrcThreadSafeModuleRef tsm = LLVMOrcCreateNewThreadSafeModule(module, r->tsc);
+  if (report_error(LLVMOrcLLJITAddLLVMIRModule(r->jit, LLVMOrcLLJITGetMainJITDylib(r->jit), tsm)) ||
+      report_error(LLVMOrcLLJITLookup(r->jit, &address, name))) {
+    return 1;
+  }
+  stats_stop(&t, STATS_MACHINE_CODE);
+
+  t = stats_start();
+  ((int (*)(void)) address)();
+  stats_stop(&t, STATS_RUN);
+  return 0;
+}
+
+/**
+ * @brief
+ * @param input is the text read so far.
+ * @param len is its length.
+ * @return int is non-zero if it ends a declaration or a statement: its braces and parentheses are
+ * balanced and it ends with a semicolon or a closing brace.
+ */
+static int is_complete(const char *input, size_t len) {
+  int depth = 0;
+  char last = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    if (input[i] == '{' || input[i] == '(') {
+      depth++;
+    } else if (input[i] == '}' || input[i] == ')') {
+      depth--;
+    }
+    if (input[i] != ' ' && input[i] != '\t' && input[i] != '\r' && input[i] != '\n') {
+      last = input[i];
+    }
+  }
+  return depth <= 0 && (last == ';' || last == '}');
+}
+
+/**
+ * @brief
+ * @param text is the text read so far, or a line.
+ * @param len is its length.
+ * @param word is a keyword.
+ * @return int is non-zero if the text starts with the keyword, after blanks.
+ */
+static int starts_with(const char *text, size_t len, const char *word) {
+  size_t i = 0, n = strlen(word);
+
+  while (i < len && (text[i] == ' ' || text[i] == '\t' || text[i] == '\r' || text[i] == '\n')) {
+    i++;
+  }
+  if (len - i < n || memcmp(text + i, word, n)) {
+    return 0;
+  }
+  return i + n == len || !(text[i + n] == '_' || (text[i + n] >= 'a' && text[i + n] <= 'z') ||
+                           (text[i + n] >= 'A' && text[i + n] <= 'Z') || (text[i + n] >= '0' && text[i + n] <= '9'));
+}
+
+/**
+ * @brief
+ * It runs a session on the inputs of a stream until its end, with a prompt on a terminal.
+ * @param in is the stream of the inputs.
+ * @param opt_level is an optimization level.
+ * @return int is zero if every input was compiled and run.
+ */
+int repl_run(FILE *in, int opt_level) {
+  struct compilation c;
+  struct repl r;
+  int interactive = isatty(fileno(in));
+  int failed = 0, held = 0;
+  char *line = NULL, *input = NULL;
+  size_t line_capacity = 0, len = 0, capacity = 0;
+  ssize_t n;
+
+  if (repl_init(&r, opt_level)) {
+    repl_fini(&r);
+    return 1;
+  }
+  compilation_init(&c);
+  compilation = &c;
+  declare_globals(1);
+
+  for (;;) {
+    if (interactive) {
+      fputs(len ? ". " : "> ", stderr);
+    }
+    n = getline(&line, &line_capacity, in);
+    // A complete if waits for the next line, which may start its else.
+    if (held && (n <= 0 || !starts_with(line, n, "else"))) {
+      failed |= repl_eval(&r, input, len);
+      len = 0;
+    }
+    held = 0;
+    if (n > 0) {
+      // one more byte keeps the input NUL-terminated for strspn
+      if (len + n + 1 > capacity) {
+        capacity = 2 * (len + n + 1);
+        input = realloc(input, capacity);
+      }
+      memcpy(input + len, line, n);
+      len += n;
+      input[len] = '\0';
+      // blank lines are not inputs
+      if (strspn(input, " \t\r\n") == len) {
+        len = 0;
+      }
+    }
+    if (len && (n <= 0 || is_complete(input, len))) {
+      if (n > 0 && starts_with(input, len, "if")) {
+        held = 1;
+      } else {
+        failed |= repl_eval(&r, input, len);
+        len = 0;
+      }
+    }
+    if (n <= 0) {
+      break;
+    }
+  }
+  if (interactive) {
+    fputc('\n', stderr);
+  }
+
+  free(line);
+  free(input);
+  declare_globals(0);
+  compilation_fini(&c);
+  compilation = NULL;
+  repl_fini(&r);
+  return failed;
+}
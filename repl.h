@@ -0,0 +1,9 @@
+/**
+ * @file repl.h
+ * @brief
+ * Interactive session: each input is compiled to its own module and run at once on a LLJIT.
+ */
+
+#include <stdio.h>
+
+int repl_run(FILE *in, int opt_level);
@@ -1,46 +1,521 @@
 /**
  * @file runtime.c
  * @author Selman ALPDÜNDAR (s.alpdundar@studenti.unipi.it)
- * @brief 
+ * @brief
  * @version 0.1
  * @date 2019-05-16
- * 
+ *
  * @copyright Copyright (c) 2019
- * 
+ *
  */
 
-#include "stdint.h"
-#include "stdio.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "runtime.h"
+
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+
+/**
+ * @brief
+ * The output of the program is collected in a buffer and written with a single write(2)
+ * when the buffer is full or when the program ends (runtime_flush).
+ * If RUNTIME_ASYNC_OUTPUT is set in the environment, full buffers are handed to a writer thread
+ * and the program goes on filling the other buffer.
+ */
+static char output_buffers[2][OUTPUT_BUFFER_SIZE];
+static char *output = output_buffers[0];
+static size_t output_len = 0;
+
+static int async_state = -1; // -1 until the environment is read, then 0 or 1
+static pthread_t writer;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static char *pending = NULL;
+static size_t pending_len = 0;
+
+// non-zero while the threads of a parallel loop run, the prints then take output_lock
+static int in_parallel_loop = 0;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char digit_pairs[201] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+/**
+ * @brief
+ * It takes the output, if other threads may print at the same time.
+ */
+static void lock_output(void) {
+  if (in_parallel_loop) {
+    pthread_mutex_lock(&output_lock);
+  }
+}
+
+/**
+ * @brief
+ * It releases the output taken by lock_output.
+ */
+static void unlock_output(void) {
+  if (in_parallel_loop) {
+    pthread_mutex_unlock(&output_lock);
+  }
+}
+
+/**
+ * @brief
+ * It writes the whole buffer to the standard output, retrying on partial writes.
+ * @param data is the buffer.
+ * @param len is the number of bytes.
+ */
+static void write_all(const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(1, data, len);
+    if (n <= 0) {
+      return;
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+/**
+ * @brief
+ * The writer thread. It waits for a pending buffer, writes it and signals that it is free again.
+ * @param arg is unused.
+ * @return void*
+ */
+static void *writer_main(void *arg) {
+  (void) arg;
+  pthread_mutex_lock(&writer_lock);
+  for (;;) {
+    while (!pending) {
+      pthread_cond_wait(&writer_cond, &writer_lock);
+    }
+    char *data = pending;
+    size_t len = pending_len;
+    pthread_mutex_unlock(&writer_lock);
+
+    write_all(data, len);
+
+    pthread_mutex_lock(&writer_lock);
+    pending = NULL;
+    pthread_cond_broadcast(&writer_cond);
+  }
+  return NULL;
+}
+
+/**
+ * @brief
+ * It reads RUNTIME_ASYNC_OUTPUT once and starts the writer thread if it is asked for.
+ */
+static void init_output(void) {
+  const char *env = getenv("RUNTIME_ASYNC_OUTPUT");
+  async_state = env && *env && *env != '0' && pthread_create(&writer, NULL, writer_main, NULL) == 0;
+  if (async_state) {
+    pthread_detach(writer);
+  }
+}
+
+/**
+ * @brief
+ * It waits until the writer thread is done with the previous buffer.
+ */
+static void wait_writer(void) {
+  pthread_mutex_lock(&writer_lock);
+  while (pending) {
+    pthread_cond_wait(&writer_cond, &writer_lock);
+  }
+  pthread_mutex_unlock(&writer_lock);
+}
+
+/**
+ * @brief
+ * It hands the current buffer over: to the writer thread, or to write(2) directly.
+ * In async mode the program continues in the other buffer.
+ */
+static void drain_output(void) {
+  if (async_state < 0) {
+    init_output();
+  }
+
+  if (async_state) {
+    wait_writer();
+    pthread_mutex_lock(&writer_lock);
+    pending = output;
+    pending_len = output_len;
+    pthread_cond_signal(&writer_cond);
+    pthread_mutex_unlock(&writer_lock);
+    output = output == output_buffers[0] ? output_buffers[1] : output_buffers[0];
+  } else {
+    write_all(output, output_len);
+  }
+  output_len = 0;
+}
+
+/**
+ * @brief
+ * It writes out everything printed so far. The generated main calls it before returning.
+ */
+void runtime_flush(void) {
+  if (output_len > 0) {
+    drain_output();
+  }
+  if (async_state > 0) {
+    wait_writer();
+  }
+}
+
+/**
+ * @brief
+ * It converts a number to decimal, two digits at a time, writing backward from end.
+ * @param x is a number.
+ * @param end is one past the last character to write.
+ * @return char* is the first character written.
+ */
+static char *format_i32(int32_t x, char *end) {
+  uint32_t u = x < 0 ? 0u - (uint32_t) x : (uint32_t) x;
+
+  while (u >= 100) {
+    uint32_t pair = (u % 100) * 2;
+    u /= 100;
+    *--end = digit_pairs[pair + 1];
+    *--end = digit_pairs[pair];
+  }
+  if (u >= 10) {
+    *--end = digit_pairs[u * 2 + 1];
+    *--end = digit_pairs[u * 2];
+  } else {
+    *--end = '0' + u;
+  }
+  if (x < 0) {
+    *--end = '-';
+  }
+  return end;
+}
 
 /**
- * @brief 
+ * @brief
  * It called by llvm to print a literal
  * @param x is a literal
  */
 void print_i32(int32_t x) {
-  printf("%d\n", x);
+  char tmp[12];
+  char *end = tmp + sizeof(tmp);
+
+  *--end = '\n';
+  char *start = format_i32(x, end);
+  size_t len = tmp + sizeof(tmp) - start;
+
+  lock_output();
+  if (output_len + len > OUTPUT_BUFFER_SIZE) {
+    drain_output();
+  }
+  memcpy(output + output_len, start, len);
+  output_len += len;
+  unlock_output();
 }
 
 
 
 /**
- * @brief 
+ * @brief
  * It called by llvm to print a boolean literal
  * @param x is a bool literal
  */
-void print_i1(int x) {
+void print_i1(bool x) {
+  lock_output();
+  if (output_len + 6 > OUTPUT_BUFFER_SIZE) {
+    drain_output();
+  }
   if (x) {
-    printf("true\n");
+    memcpy(output + output_len, "true\n", 5);
+    output_len += 5;
   } else {
-    printf("false\n");
+    memcpy(output + output_len, "false\n", 6);
+    output_len += 6;
+  }
+  unlock_output();
+}
+
+/**
+ * @brief
+ * It called by llvm to allocate the elements of a heap array, all zero and aligned for vectors.
+ * The previous elements are freed.
+ * @param old is the previous elements, or NULL.
+ * @param len is the number of elements.
+ * @param elem_size is the size of an element.
+ * @return void* is the elements.
+ */
+void *array_new(void *old, int32_t len, int32_t elem_size) {
+  void *data = NULL;
+
+  free(old);
+  if (len < 0) {
+    runtime_flush();
+    fprintf(stderr, "array of negative length %d\n", len);
+    exit(1);
+  }
+  size_t size = (size_t) len * elem_size;
+  if (posix_memalign(&data, ARRAY_ALIGNMENT, size ? size : 1)) {
+    runtime_flush();
+    fprintf(stderr, "out of memory for an array of %d elements\n", len);
+    exit(1);
+  }
+  memset(data, 0, size);
+  return data;
+}
+
+/**
+ * @brief
+ * It called by llvm when an index is out of the bounds of an array. It stops the program,
+ * after the output printed so far.
+ * @param index is the index.
+ * @param len is the length of the array.
+ */
+void array_bounds_error(int32_t index, int32_t len) {
+  // the other threads of a parallel loop wait for the output until the program exits
+  lock_output();
+  runtime_flush();
+  fprintf(stderr, "index %d out of the bounds of an array of %d elements\n", index, len);
+  exit(1);
+}
+
+/**
+ * @brief
+ * It called by llvm when an instrumented program returns, to write its profile: one line per
+ * if or while with its location and the number of times its condition was true and false.
+ * @param path is the profile file.
+ * @param keys are the locations, each ended by a newline.
+ * @param counts are the counters, two per location.
+ * @param n is the number of locations.
+ */
+void profile_write(const char *path, const char *keys, const uint64_t *counts, int32_t n) {
+  FILE *f = fopen(path, "w");
+
+  if (!f) {
+    perror(path);
+    return;
+  }
+  fprintf(f, "# line:column true false\n");
+  for (int32_t i = 0; i < n; i++) {
+    const char *end = strchr(keys, '\n');
+    fprintf(f, "%.*s %llu %llu\n", (int) (end - keys), keys,
+            (unsigned long long) counts[2 * i], (unsigned long long) counts[2 * i + 1]);
+    keys = end + 1;
+  }
+  fclose(f);
+}
+
+// chunks of the range of a parallel loop per thread: enough for the threads that finish
+// early to steal from the others, few enough that a chunk is worth its call
+#define PARALLEL_CHUNKS_PER_THREAD 8
+
+/**
+ * @brief
+ * Iterations of a parallel loop left to a thread: head to tail - 1, a cache line each.
+ */
+struct pool_range {
+  _Alignas(64) pthread_mutex_t lock;
+  int64_t head;
+  int64_t tail;
+};
+
+/**
+ * @brief
+ * The threads of the parallel loops, started by the first one. The caller of parallel_for is
+ * thread 0, the others wait for a loop to be posted. The range of a loop is dealt in contiguous
+ * ranges, one per thread. A thread runs its range a chunk at a time from the front; once it is
+ * empty, it steals the back half of the range of another thread, like the workers of batch.c.
+ * No iteration is ever added, so a thread that finds every range empty is done.
+ */
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t start;       // a loop is posted
+  pthread_cond_t done;        // the last thread is done with it
+  int n_threads;              // with the caller, 0 until the pool is started
+  unsigned loop;              // number of loops posted
+  int n_running;              // threads other than the caller still on the loop
+  void (*body)(void *, int32_t, int32_t);
+  void *env;
+  int64_t chunk;
+  struct pool_range *ranges;
+} pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .start = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER };
+
+/**
+ * @brief
+ * It gives the next chunk of a thread, stealing from the other threads if it has none left.
+ * @param id is the thread.
+ * @param from is where the first iteration is stored.
+ * @param to is where the end of the chunk is stored.
+ * @return int is zero when the loop has nothing left.
+ */
+static int next_chunk(int id, int64_t *from, int64_t *to) {
+  struct pool_range *own = &pool.ranges[id];
+
+  pthread_mutex_lock(&own->lock);
+  int found = own->head < own->tail;
+  if (found) {
+    *from = own->head;
+    *to = own->tail - own->head > pool.chunk ? own->head + pool.chunk : own->tail;
+    own->head = *to;
+  }
+  pthread_mutex_unlock(&own->lock);
+  if (found) {
+    return 1;
+  }
+
+  for (int i = 1; i < pool.n_threads; i++) {
+    struct pool_range *victim = &pool.ranges[(id + i) % pool.n_threads];
+    int64_t head = 0, tail = 0;
+
+    pthread_mutex_lock(&victim->lock);
+    if (victim->head < victim->tail) {
+      tail = victim->tail;
+      head = tail - (tail - victim->head + 1) / 2;
+      victim->tail = head;
+    }
+    pthread_mutex_unlock(&victim->lock);
+
+    if (head < tail) {
+      *from = head;
+      *to = tail - head > pool.chunk ? head + pool.chunk : tail;
+      pthread_mutex_lock(&own->lock);
+      own->head = *to;
+      own->tail = tail;
+      pthread_mutex_unlock(&own->lock);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief
+ * It runs chunks of the posted loop until there are none left.
+ * @param id is the thread.
+ */
+static void run_chunks(int id) {
+  int64_t from, to;
+
+  while (next_chunk(id, &from, &to)) {
+    pool.body(pool.env, (int32_t) from, (int32_t) to);
   }
 }
 
+/**
+ * @brief
+ * A thread of the pool. It waits for a loop, runs its part and tells when it is done.
+ * @param arg is the number of the thread.
+ * @return void*
+ */
+static void *pool_main(void *arg) {
+  int id = (int) (intptr_t) arg;
+  unsigned seen = 0;
+
+  pthread_mutex_lock(&pool.lock);
+  for (;;) {
+    while (pool.loop == seen) {
+      pthread_cond_wait(&pool.start, &pool.lock);
+    }
+    seen = pool.loop;
+    pthread_mutex_unlock(&pool.lock);
+
+    run_chunks(id);
 
+    pthread_mutex_lock(&pool.lock);
+    if (--pool.n_running == 0) {
+      pthread_cond_signal(&pool.done);
+    }
+  }
+  return NULL;
+}
 
+/**
+ * @brief
+ * It starts the pool: RUNTIME_THREADS threads if it is set in the environment, one per core
+ * otherwise, the caller included. The threads live until the program exits.
+ */
+static void init_pool(void) {
+  const char *env = getenv("RUNTIME_THREADS");
+  long n = env && *env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
 
+  if (n < 1) {
+    n = 1;
+  }
+  pool.ranges = aligned_alloc(_Alignof(struct pool_range), n * sizeof(pool.ranges[0]));
+  pool.n_threads = 1;
+  pthread_mutex_init(&pool.ranges[0].lock, NULL);
+  for (long i = 1; i < n; i++) {
+    pthread_t thread;
+    pthread_mutex_init(&pool.ranges[i].lock, NULL);
+    if (pthread_create(&thread, NULL, pool_main, (void *) (intptr_t) i) != 0) {
+      break;
+    }
+    pthread_detach(thread);
+    pool.n_threads++;
+  }
+}
 
+/**
+ * @brief
+ * It called by llvm to run a parallel loop: the body is called on chunks of the range, on the
+ * threads of the pool, and parallel_for returns once the whole range is done. A loop in the
+ * body of another runs on the thread that reaches it.
+ * @param body is the body of the loop, called with the environment and a chunk of the range.
+ * @param env is the environment of the body.
+ * @param from is the first iteration.
+ * @param to is one past the last iteration.
+ */
+void parallel_for(void (*body)(void *, int32_t, int32_t), void *env, int32_t from, int32_t to) {
+  if (from >= to) {
+    return;
+  }
+  if (!pool.n_threads) {
+    init_pool();
+  }
+  int64_t n = (int64_t) to - from;
+  if (pool.n_threads == 1 || in_parallel_loop || n == 1) {
+    body(env, from, to);
+    return;
+  }
 
+  pool.body = body;
+  pool.env = env;
+  pool.chunk = n / (pool.n_threads * PARALLEL_CHUNKS_PER_THREAD);
+  if (pool.chunk < 1) {
+    pool.chunk = 1;
+  }
+  for (int i = 0; i < pool.n_threads; i++) {
+    pool.ranges[i].head = from + n * i / pool.n_threads;
+    pool.ranges[i].tail = from + n * (i + 1) / pool.n_threads;
+  }
 
+  pthread_mutex_lock(&pool.lock);
+  in_parallel_loop = 1;
+  pool.n_running = pool.n_threads - 1;
+  pool.loop++;
+  pthread_cond_broadcast(&pool.start);
+  pthread_mutex_unlock(&pool.lock);
 
+  run_chunks(0);
 
+  pthread_mutex_lock(&pool.lock);
+  while (pool.n_running > 0) {
+    pthread_cond_wait(&pool.done, &pool.lock);
+  }
+  in_parallel_loop = 0;
+  pthread_mutex_unlock(&pool.lock);
+}
@@ -0,0 +1,19 @@
+/**
+ * @file runtime.h
+ * @brief
+ * Functions of the runtime called by the generated code and by the interpreters.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// alignment of the elements of the arrays, a cache line and the widest vectors
+#define ARRAY_ALIGNMENT 64
+
+void print_i32(int32_t x);
+void print_i1(bool x);
+void runtime_flush(void);
+void *array_new(void *old, int32_t len, int32_t elem_size);
+void array_bounds_error(int32_t index, int32_t len);
+void profile_write(const char *path, const char *keys, const uint64_t *counts, int32_t n);
+void parallel_for(void (*body)(void *, int32_t, int32_t), void *env, int32_t from, int32_t to);
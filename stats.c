@@ -0,0 +1,197 @@
+/**
+ * @file stats.c
+ * @brief
+ * Phase timers and counters of the compiler.
+ *
+ * The totals are atomic, so the workers of a batch add to the same report; their times are
+ * then CPU times summed over the threads. Timers read CLOCK_MONOTONIC, whose resolution is
+ * a nanosecond on Linux.
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <llvm-c/Core.h>
+#include "stats.h"
+
+int stats_enabled;
+
+static const char *phase_names[] = {
+#define X(phase, name) name,
+  STATS_PHASES(X)
+#undef X
+};
+
+static const char *counter_names[] = {
+#define X(counter, name) name,
+  STATS_COUNTERS(X)
+#undef X
+};
+
+static atomic_uint_fast64_t phase_ns[STATS_N_PHASES];
+static atomic_uint_fast64_t phase_calls[STATS_N_PHASES];
+static atomic_uint_fast64_t counters[STATS_N_COUNTERS];
+
+// time of the phases stopped by this thread, to subtract nested phases from their parent
+static _Thread_local uint64_t timed;
+
+/**
+ * @brief
+ * @return uint64_t is a monotonic time in nanoseconds.
+ */
+static uint64_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief
+ * It turns the timers and counters on.
+ */
+void stats_enable(void) {
+  stats_enabled = 1;
+}
+
+/**
+ * @brief
+ * It starts timing a phase.
+ * @return struct stats_timer is the timer to stop at the end of the phase.
+ */
+struct stats_timer stats_start(void) {
+  struct stats_timer t = { 0, 0 };
+
+  if (stats_enabled) {
+    t.nested = timed;
+    t.start = now();
+  }
+  return t;
+}
+
+/**
+ * @brief
+ * It stops a timer and adds its time, without the nested phases, to a phase.
+ * @param t is a timer from stats_start.
+ * @param phase is the phase it timed.
+ */
+void stats_stop(struct stats_timer *t, enum stats_phase phase) {
+  if (!stats_enabled) {
+    return;
+  }
+  uint64_t self = now() - t->start - (timed - t->nested);
+  timed += self;
+  atomic_fetch_add_explicit(&phase_ns[phase], self, memory_order_relaxed);
+  atomic_fetch_add_explicit(&phase_calls[phase], 1, memory_order_relaxed);
+}
+
+/**
+ * @brief
+ * It adds to a counter.
+ * @param counter is a counter.
+ * @param n is the amount.
+ */
+void stats_count(enum stats_counter counter, uint64_t n) {
+  if (stats_enabled) {
+    atomic_fetch_add_explicit(&counters[counter], n, memory_order_relaxed);
+  }
+}
+
+/**
+ * @brief
+ * It adds the size of a file to a counter.
+ * @param counter is a counter.
+ * @param path is the file.
+ */
+void stats_count_file(enum stats_counter counter, const char *path) {
+  struct stat st;
+
+  if (stats_enabled && !stat(path, &st)) {
+    stats_count(counter, st.st_size);
+  }
+}
+
+/**
+ * @brief
+ * It counts the instructions and the basic blocks of the functions defined in a module.
+ * @param module is a LLVMModuleRef.
+ * @param instructions is the counter of the instructions.
+ * @param blocks is the counter of the basic blocks.
+ */
+void stats_count_module(LLVMModuleRef module, enum stats_counter instructions, enum stats_counter blocks) {
+  uint64_t n_instructions = 0, n_blocks = 0;
+
+  if (!stats_enabled) {
+    return;
+  }
+  for (LLVMValueRef fn = LLVMGetFirstFunction(module); fn; fn = LLVMGetNextFunction(fn)) {
+    for (LLVMBasicBlockRef bb = LLVMGetFirstBasicBlock(fn); bb; bb = LLVMGetNextBasicBlock(bb)) {
+      n_blocks++;
+      for (LLVMValueRef i = LLVMGetFirstInstruction(bb); i; i = LLVMGetNextInstruction(i)) {
+        n_instructions++;
+      }
+    }
+  }
+  stats_count(instructions, n_instructions);
+  stats_count(blocks, n_blocks);
+}
+
+/**
+ * @brief
+ * @return long is the peak resident set size of the process so far, in KiB.
+ */
+static long peak_rss_kb(void) {
+  struct rusage usage;
+
+  return getrusage(RUSAGE_SELF, &usage) ? 0 : usage.ru_maxrss;
+}
+
+/**
+ * @brief
+ * It prints the phases that ran and the counters that were used, as a table.
+ * @param f is the stream of the report.
+ */
+void stats_report(FILE *f) {
+  uint64_t total = 0;
+
+  for (int i = 0; i < STATS_N_PHASES; i++) {
+    total += phase_ns[i];
+  }
+
+  fprintf(f, "%-28s %12s %7s %8s\n", "phase", "time (ms)", "%", "calls");
+  for (int i = 0; i < STATS_N_PHASES; i++) {
+    if (phase_calls[i]) {
+      fprintf(f, "%-28s %12.3f %6.1f%% %8llu\n", phase_names[i], phase_ns[i] / 1e6,
+              total ? 100.0 * phase_ns[i] / total : 0.0, (unsigned long long) phase_calls[i]);
+    }
+  }
+  fprintf(f, "%-28s %12.3f\n", "total", total / 1e6);
+
+  fprintf(f, "%-28s %12s\n", "counter", "value");
+  for (int i = 0; i < STATS_N_COUNTERS; i++) {
+    if (counters[i]) {
+      fprintf(f, "%-28s %12llu\n", counter_names[i], (unsigned long long) counters[i]);
+    }
+  }
+  fprintf(f, "%-28s %12ld\n", "peak memory (KiB)", peak_rss_kb());
+}
+
+/**
+ * @brief
+ * It prints every phase and counter as a JSON object, the times in nanoseconds, and the peak
+ * memory of the process.
+ * @param f is the stream of the report.
+ */
+void stats_report_json(FILE *f) {
+  fprintf(f, "{\"phases\": {");
+  for (int i = 0; i < STATS_N_PHASES; i++) {
+    fprintf(f, "%s\"%s\": {\"ns\": %llu, \"calls\": %llu}", i ? ", " : "", phase_names[i],
+            (unsigned long long) phase_ns[i], (unsigned long long) phase_calls[i]);
+  }
+  fprintf(f, "}, \"counters\": {");
+  for (int i = 0; i < STATS_N_COUNTERS; i++) {
+    fprintf(f, "%s\"%s\": %llu", i ? ", " : "", counter_names[i], (unsigned long long) counters[i]);
+  }
+  fprintf(f, "}, \"peak_rss_kb\": %ld}\n", peak_rss_kb());
+}
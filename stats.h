@@ -0,0 +1,73 @@
+/**
+ * @file stats.h
+ * @brief
+ * Instrumentation of the compiler: the time spent in each phase and counters of what each
+ * phase produced, reported with --stats (table) or --stats-json (JSON). When it is disabled,
+ * a timer costs a load and a branch.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <llvm-c/Core.h>
+
+// phase, name in the reports
+#define STATS_PHASES(X)                 \
+  X(LEX,          "lex")                \
+  X(PARSE,        "parse")              \
+  X(CHECK,        "check")              \
+  X(SIMPLIFY,     "simplify")           \
+  X(CODEGEN,      "codegen")            \
+  X(LINK_RUNTIME, "link runtime")       \
+  X(VERIFY,       "verify")             \
+  X(OPTIMIZE,     "optimize")           \
+  X(DUMP,         "dump")               \
+  X(MACHINE_CODE, "machine code")       \
+  X(LINK,         "link executable")    \
+  X(BYTECODE,     "bytecode")           \
+  X(RUN,          "run")
+
+// counter, name in the reports
+#define STATS_COUNTERS(X)                                 \
+  X(TOKENS,                 "tokens")                     \
+  X(AST_NODES,              "ast nodes")                  \
+  X(IR_INSTRUCTIONS,        "ir instructions")            \
+  X(IR_BLOCKS,              "ir basic blocks")            \
+  X(OPT_IR_INSTRUCTIONS,    "optimized ir instructions")  \
+  X(OPT_IR_BLOCKS,          "optimized ir basic blocks")  \
+  X(MACHINE_CODE_BYTES,     "machine code bytes")         \
+  X(INTERPRETED,            "interpreted instructions")
+
+enum stats_phase {
+#define X(phase, name) STATS_##phase,
+  STATS_PHASES(X)
+#undef X
+  STATS_N_PHASES
+};
+
+enum stats_counter {
+#define X(counter, name) STATS_##counter,
+  STATS_COUNTERS(X)
+#undef X
+  STATS_N_COUNTERS
+};
+
+/**
+ * @brief
+ * A phase being timed. The phases timed while it runs are not counted in its time,
+ * so the times of nested phases (lex in parse) add up to the wall time.
+ */
+struct stats_timer {
+  uint64_t start;
+  uint64_t nested;
+};
+
+extern int stats_enabled;
+
+void stats_enable(void);
+struct stats_timer stats_start(void);
+void stats_stop(struct stats_timer *t, enum stats_phase phase);
+void stats_count(enum stats_counter counter, uint64_t n);
+void stats_count_file(enum stats_counter counter, const char *path);
+void stats_count_module(LLVMModuleRef module, enum stats_counter instructions, enum stats_counter blocks);
+void stats_report(FILE *f);
+void stats_report_json(FILE *f);
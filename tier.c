@@ -0,0 +1,296 @@
+/**
+ * @file tier.c
+ * @brief
+ * Tiered execution of a bytecode compiled with its LOOP instructions.
+ *
+ * Each LOOP counts the iterations of its while loop. When a loop reaches the threshold,
+ * it is queued for the compiler thread, which generates a function running the whole
+ * while statement with codegen_stmt. The variables are the only state at the condition
+ * of a loop (the stack is empty between statements), so the function loads them from
+ * the memory of the interpreter, runs the loop and stores them back; the next LOOP
+ * executed calls it and continues after the loop.
+ *
+ * The compiler thread generates the loops in an LLVM context of its own, so it shares
+ * nothing of LLVM with the main thread but the allocas of main, whose types it only reads.
+ * It is the only one using the compilation of the interpreter, whose allocas it replaces
+ * while generating a loop, until tier_run returns.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/ExecutionEngine.h>
+#include "ast.h"
+#include "backend.h"
+#include "bytecode.h"
+#include "tier.h"
+#include "utils.h"
+
+typedef void (*loop_fn)(int32_t *mem);
+
+/**
+ * @brief
+ * State of a while loop.
+ */
+struct tier_loop {
+  struct stmt *stmt;
+  uint32_t count;           // iterations counted by the interpreter
+  int entered;              // times the interpreter called the compiled loop
+  _Atomic(loop_fn) code;    // compiled loop, set by the compiler thread
+};
+
+/**
+ * @brief
+ * State of the tiered execution.
+ */
+struct tier {
+  struct tier_loop *loops;
+  size_t n_loops;
+  int opt_level;
+  uint32_t threshold;
+  struct compilation *compilation;  // of the program being run
+
+  pthread_t thread;
+  int started;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int32_t *queue;           // loops to compile, one slot per loop since each one is queued once
+  size_t queue_head, queue_tail;
+  int stop;
+
+  LLVMContextRef context;   // of the compiled loops, owned by the compiler thread
+  LLVMExecutionEngineRef *engines;
+  size_t n_engines;
+  size_t n_compiled;
+};
+
+/**
+ * @brief
+ * It generates the function of a while loop: void loopN(i32 *mem).
+ * @param stmt is a while statement.
+ * @param module is the module of the function.
+ * @param name is the name of the function.
+ */
+static void codegen_loop(struct stmt *stmt, LLVMModuleRef module, const char *name) {
+  LLVMContextRef context = LLVMGetModuleContext(module);
+  LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+  size_t n_vars = string_int_count(&compilation->ids);
+  LLVMValueRef *allocas = malloc((n_vars + 1) * sizeof(LLVMValueRef));
+  LLVMBuilderRef builder = LLVMCreateBuilderInContext(context);
+
+  LLVMTypeRef params[] = { LLVMPointerType(i32, 0) };
+  LLVMValueRef fn = LLVMAddFunction(module, name, LLVMFunctionType(LLVMVoidTypeInContext(context), params, 1, 0));
+  LLVMValueRef mem = LLVMGetParam(fn, 0);
+  set_host_cpu(fn);
+  LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(context, fn, "entry"));
+
+  // Copy the variables of the interpreter into fresh allocas, which mem2reg promotes.
+  // The allocas of main are in the context of the main thread, only the width of their type is read.
+  for (size_t i = 0; i < n_vars; i++) {
+    LLVMValueRef var = vector_get(&compilation->types, i);
+    LLVMTypeRef type = LLVMIntTypeInContext(context, LLVMGetIntTypeWidth(LLVMGetAllocatedType(var)));
+    LLVMValueRef index[] = { CONST(context, i) };
+    LLVMValueRef value = LLVMBuildLoad(builder, LLVMBuildGEP(builder, mem, index, 1, ""), "");
+    if (type != i32) {
+      value = LLVMBuildTrunc(builder, value, type, "");
+    }
+    allocas[i] = var;
+    var = LLVMBuildAlloca(builder, type, string_int_rev(&compilation->ids, i));
+    LLVMBuildStore(builder, value, var);
+    vector_set(&compilation->types, i, var);
+  }
+
+  codegen_stmt(stmt, module, builder);
+
+  // Copy them back, and restore the allocas of main.
+  for (size_t i = 0; i < n_vars; i++) {
+    LLVMValueRef var = vector_get(&compilation->types, i);
+    LLVMValueRef index[] = { CONST(context, i) };
+    LLVMValueRef value = LLVMBuildLoad(builder, var, "");
+    if (LLVMGetAllocatedType(var) != i32) {
+      value = LLVMBuildZExt(builder, value, i32, "");
+    }
+    LLVMBuildStore(builder, value, LLVMBuildGEP(builder, mem, index, 1, ""));
+    vector_set(&compilation->types, i, allocas[i]);
+  }
+  LLVMBuildRetVoid(builder);
+
+  LLVMDisposeBuilder(builder);
+  free(allocas);
+}
+
+/**
+ * @brief
+ * It compiles a loop and publishes its code.
+ * @param tier is the tiered execution.
+ * @param machine is the target machine of the host.
+ * @param n is the number of the loop.
+ */
+static void compile_loop(struct tier *tier, LLVMTargetMachineRef machine, int32_t n) {
+  char name[32];
+  char *error = NULL;
+  LLVMExecutionEngineRef engine;
+
+  snprintf(name, sizeof(name), "loop%d", n);
+  LLVMModuleRef module = LLVMModuleCreateWithNameInContext(name, tier->context);
+  setup_module_for_host(module, machine);
+  declare_runtime(module);
+  codegen_loop(tier->loops[n].stmt, module, name);
+
+  if (LLVMVerifyModule(module, LLVMPrintMessageAction, &error) ||
+      optimize_module(module, machine, tier->opt_level)) {
+    LLVMDisposeMessage(error);
+    LLVMDisposeModule(module);
+    return;
+  }
+  LLVMDisposeMessage(error);
+
+  if (create_jit(&engine, module, tier->opt_level, &error)) {
+    fprintf(stderr, "%s\n", error);
+    LLVMDisposeMessage(error);
+    return;
+  }
+
+  loop_fn code = (loop_fn) LLVMGetFunctionAddress(engine, name);
+  tier->engines[tier->n_engines++] = engine;
+  tier->n_compiled++;
+  atomic_store_explicit(&tier->loops[n].code, code, memory_order_release);
+}
+
+/**
+ * @brief
+ * Compiler thread: it compiles the queued loops in order until it is stopped.
+ * @param arg is the tiered execution.
+ * @return void* is NULL.
+ */
+static void *compiler_thread(void *arg) {
+  struct tier *tier = arg;
+  LLVMTargetMachineRef machine = create_host_machine(tier->opt_level, 1);
+
+  compilation = tier->compilation;
+  tier->context = LLVMContextCreate();
+
+  for (;;) {
+    pthread_mutex_lock(&tier->lock);
+    while (tier->queue_head == tier->queue_tail && !tier->stop) {
+      pthread_cond_wait(&tier->wake, &tier->lock);
+    }
+    if (tier->stop) {
+      pthread_mutex_unlock(&tier->lock);
+      break;
+    }
+    int32_t n = tier->queue[tier->queue_head++];
+    pthread_mutex_unlock(&tier->lock);
+
+    if (machine) {
+      compile_loop(tier, machine, n);
+    }
+  }
+
+  if (machine) {
+    LLVMDisposeTargetMachine(machine);
+  }
+  return NULL;
+}
+
+/**
+ * @brief
+ * It queues a loop for the compiler thread, starting the thread on the first one.
+ * @param tier is the tiered execution.
+ * @param n is the number of the loop.
+ */
+static void request_compile(struct tier *tier, int32_t n) {
+  pthread_mutex_lock(&tier->lock);
+  tier->queue[tier->queue_tail++] = n;
+  pthread_cond_signal(&tier->wake);
+  pthread_mutex_unlock(&tier->lock);
+
+  if (!tier->started) {
+    tier->started = !pthread_create(&tier->thread, NULL, compiler_thread, tier);
+  }
+}
+
+/**
+ * @brief
+ * Callback of the LOOP instruction: it counts an iteration, and enters the compiled loop once it is ready.
+ * @param ctx is the tiered execution.
+ * @param n is the number of the loop.
+ * @param mem is the memory of the interpreter.
+ * @return int is non-zero if the compiled loop ran to the end.
+ */
+static int on_loop(void *ctx, int32_t n, int32_t *mem) {
+  struct tier *tier = ctx;
+  struct tier_loop *loop = &tier->loops[n];
+  loop_fn code = atomic_load_explicit(&loop->code, memory_order_acquire);
+
+  if (code) {
+    if (!loop->entered++) {
+      fprintf(stderr, "Entering compiled loop %d after %u iterations\n", n, loop->count);
+    }
+    code(mem);
+    return 1;
+  }
+
+  if (loop->count < tier->threshold && ++loop->count == tier->threshold) {
+    request_compile(tier, n);
+  }
+  return 0;
+}
+
+/**
+ * @brief
+ * It runs a program in the interpreter, compiling its hot loops in the background.
+ * @param bc is a bytecode compiled with its LOOP instructions.
+ * @param mem is the memory of the program, one slot per variable.
+ * @param opt_level is the optimization level of the compiled loops.
+ * @param threshold is the number of iterations of a loop before it is compiled.
+ * @return uint64_t is the number of instructions interpreted.
+ */
+uint64_t tier_run(struct bytecode *bc, int32_t *mem, int opt_level, uint32_t threshold) {
+  struct tier tier = { 0 };
+
+  tier.n_loops = bc->n_loops;
+  tier.loops = calloc(bc->n_loops + 1, sizeof(tier.loops[0]));
+  tier.queue = calloc(bc->n_loops + 1, sizeof(tier.queue[0]));
+  tier.engines = calloc(bc->n_loops + 1, sizeof(tier.engines[0]));
+  tier.opt_level = opt_level;
+  tier.threshold = threshold;
+  tier.compilation = compilation;
+  pthread_mutex_init(&tier.lock, NULL);
+  pthread_cond_init(&tier.wake, NULL);
+  for (size_t i = 0; i < bc->n_loops; i++) {
+    tier.loops[i].stmt = bc->loops[i];
+  }
+
+  bc->on_loop = on_loop;
+  bc->ctx = &tier;
+  uint64_t dispatches = bytecode_run(bc, mem);
+  bc->on_loop = NULL;
+
+  // The loops still queued are not worth compiling anymore.
+  if (tier.started) {
+    pthread_mutex_lock(&tier.lock);
+    tier.stop = 1;
+    pthread_cond_signal(&tier.wake);
+    pthread_mutex_unlock(&tier.lock);
+    pthread_join(tier.thread, NULL);
+  }
+  fprintf(stderr, "Tiers: %zu of %zu loops compiled\n", tier.n_compiled, tier.n_loops);
+
+  for (size_t i = 0; i < tier.n_engines; i++) {
+    LLVMDisposeExecutionEngine(tier.engines[i]);
+  }
+  // the engines own the modules of the context
+  if (tier.context) {
+    LLVMContextDispose(tier.context);
+  }
+  pthread_mutex_destroy(&tier.lock);
+  pthread_cond_destroy(&tier.wake);
+  free(tier.engines);
+  free(tier.queue);
+  free(tier.loops);
+  return dispatches;
+}
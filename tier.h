@@ -0,0 +1,15 @@
+/**
+ * @file tier.h
+ * @brief
+ * Tiered execution: the bytecode interpreter starts right away, and the while loops that
+ * get hot are compiled with LLVM in a background thread, then entered with the current
+ * values of the variables (on-stack replacement).
+ */
+
+#include <stdint.h>
+
+#define TIER_THRESHOLD 1000  // iterations of a loop before it is compiled
+
+struct bytecode;
+
+uint64_t tier_run(struct bytecode *bc, int32_t *mem, int opt_level, uint32_t threshold);
@@ -9,34 +9,15 @@
  * 
  */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
-
-/**
- * @brief 
- * 
- * @param s 
- * @return size_t 
- */
-static size_t hash(const char *s) {
-  size_t r = 0xcbf29ce484222325;
-  while (*s) {
-    r *= 0x100000001b3;
-    r ^= *s;
-    s++;
-  }
-
-  return r;
-}
-
-/**
- * @brief 
- * It is vector that can take any kind of data.
- */
-struct vector {
-  size_t capacity;
-  void **data;
-};
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "utils.h"
 
 
 /**
@@ -60,9 +41,12 @@ void vector_grow(struct vector *v, size_t n) {
   if (n < v->capacity) {
     return;
   }
+  if (n < 2 * v->capacity) {
+    n = 2 * v->capacity;
+  }
   v->data = realloc(v->data, n * sizeof(v->data[0]));
   for (size_t i = v->capacity; i < n; i++) {
-    v->data[0] = NULL;
+    v->data[i] = NULL;
   }
   v->capacity = n;
 }
@@ -104,120 +88,405 @@ void vector_set(struct vector *v, size_t idx, void *x) {
 
 /**
  * @brief 
- * String initilization. 
+ * It reads a whole file in memory.
+ * @param f is a file.
+ * @param len is where the length is stored.
+ * @return char* is the content (NUL terminated), to be freed by the caller.
+ */
+char *read_file(FILE *f, size_t *len) {
+  size_t capacity = 1 << 16;
+  char *data = malloc(capacity);
+  size_t n;
+
+  *len = 0;
+  while ((n = fread(data + *len, 1, capacity - *len - 1, f)) > 0) {
+    *len += n;
+    if (capacity - *len - 1 == 0) {
+      capacity *= 2;
+      data = realloc(data, capacity);
+    }
+  }
+  data[*len] = 0;
+  return data;
+}
+
+/**
+ * @brief 
+ * A chunk of arena memory. Chunks are linked so that the whole arena can be released at once.
  */
-struct string_int {
-  struct vector rev;
-  size_t count;
-  size_t capacity;
-  struct kv {
-    char *key;
-    int id;
-  } *data;
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t size;
+  size_t used;
+  max_align_t data[];
 };
 
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN (sizeof(max_align_t))
 
+/**
+ * @brief 
+ * It initiates an empty arena. The first chunk is allocated on the first request.
+ * @param a is an arena.
+ */
+void arena_init(struct arena *a) {
+  a->head = NULL;
+  a->count = 0;
+  a->bytes = 0;
+  a->reserved = 0;
+}
 
 /**
  * @brief 
- * 
- * @param v 
+ * It takes n bytes from the current chunk. If the chunk is full, a new one is linked in front of it.
+ * Requests bigger than a chunk get a chunk of their own.
+ * @param a is an arena.
+ * @param n is the size of the object.
+ * @param align is the alignment of the object, a power of two up to ARENA_ALIGN.
+ * @return void* is a pointer with that alignment.
  */
-void string_int_init(struct string_int *v) {
-  vector_init(&v->rev);
-  v->count = 0;
-  v->capacity = 16;
-  v->data = calloc(v->capacity, sizeof(v->data[0]));
+static void *arena_alloc_aligned(struct arena *a, size_t n, size_t align) {
+  struct arena_chunk *c = a->head;
+
+  if (c) {
+    c->used = (c->used + align - 1) & ~(align - 1);
+  }
+  if (c == NULL || c->size < c->used + n) {
+    size_t size = n > ARENA_CHUNK_SIZE ? n : ARENA_CHUNK_SIZE;
+    c = malloc(sizeof(struct arena_chunk) + size);
+    c->next = a->head;
+    c->size = size;
+    c->used = 0;
+    a->head = c;
+    a->reserved += size;
+  }
+
+  void *r = (char *) c->data + c->used;
+  c->used += n;
+  a->count++;
+  a->bytes += n;
+  return r;
 }
 
 /**
  * @brief 
- * 
- * @param v 
+ * It takes n bytes from the arena, rounded up to keep the next object aligned.
+ * @param a is an arena.
+ * @param n is the size of the object.
+ * @return void* is a pointer aligned for any type.
  */
-void string_int_fini(struct string_int *v) {
-  vector_fini(&v->rev);
-  for (size_t i = 0; i < v->capacity; i++) {
-    free(v->data[i].key);
+void *arena_alloc(struct arena *a, size_t n) {
+  return arena_alloc_aligned(a, (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1), ARENA_ALIGN);
+}
+
+/**
+ * @brief 
+ * It releases every chunk of the arena, so all the objects allocated from it.
+ * @param a is an arena.
+ */
+void arena_fini(struct arena *a) {
+  struct arena_chunk *c = a->head;
+  while (c) {
+    struct arena_chunk *next = c->next;
+    free(c);
+    c = next;
   }
+  arena_init(a);
+}
 
-  free(v->data);
+/**
+ * @brief 
+ * @param a is an arena.
+ * @return size_t is the number of objects allocated from the arena.
+ */
+size_t arena_count(struct arena *a) {
+  return a->count;
 }
 
 /**
  * @brief 
- * 
- * @param v 
- * @param n 
+ * @param a is an arena.
+ * @return size_t is the number of bytes handed out, including alignment padding.
  */
-void string_int_resize(struct string_int *v, size_t n) {
-  struct kv *newdata = calloc(n, sizeof(v->data[0]));
+size_t arena_bytes(struct arena *a) {
+  return a->bytes;
+}
+
+/**
+ * @brief 
+ * @param a is an arena.
+ * @return size_t is the number of bytes requested from malloc for the chunks.
+ */
+size_t arena_reserved(struct arena *a) {
+  return a->reserved;
+}
+
+/**
+ * @brief 
+ * Interned string: the key lives in the arena of the table, its hash is computed once.
+ */
+struct string_int_entry {
+  const char *key;
+  uint64_t hash;
+  size_t len;
+};
+
+#define STRING_INT_GROUP 16
+#define STRING_INT_EMPTY 0x80
+
+/**
+ * @brief 
+ * It hashes a string 8 bytes at a time. The last bytes are read with overlapping loads
+ * rather than one by one, since identifiers are short.
+ * @param s is a string.
+ * @param len is its length.
+ * @return uint64_t is the hash.
+ */
+static uint64_t hash(const char *s, size_t len) {
+  uint64_t h = 0x9e3779b97f4a7c15ull ^ len;
+  uint64_t w;
+  uint32_t lo, hi;
+
+  if (len > 8) {
+    for (size_t i = 0; i < len - 8; i += 8) {
+      memcpy(&w, s + i, 8);
+      h = (h ^ w) * 0xbf58476d1ce4e5b9ull;
+      h ^= h >> 31;
+    }
+    memcpy(&w, s + len - 8, 8);
+  } else if (len >= 4) {
+    memcpy(&lo, s, 4);
+    memcpy(&hi, s + len - 4, 4);
+    w = (uint64_t) hi << 32 | lo;
+  } else if (len > 0) {
+    w = (uint64_t) (uint8_t) s[0] << 16 | (uint64_t) (uint8_t) s[len / 2] << 8 | (uint8_t) s[len - 1];
+  } else {
+    w = 0;
+  }
+
+  h = (h ^ w) * 0x94d049bb133111ebull;
+  h ^= h >> 29;
+  h *= 0xbf58476d1ce4e5b9ull;
+  return h ^ (h >> 32);
+}
+
+/**
+ * @brief 
+ * @param ctrl is the first metadata byte of a group.
+ * @param byte is a metadata byte.
+ * @return unsigned is the mask of the slots of the group with that byte.
+ */
+static unsigned match_group(const uint8_t *ctrl, uint8_t byte) {
+#ifdef __SSE2__
+  __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(byte)));
+#else
+  unsigned mask = 0;
+  for (int i = 0; i < STRING_INT_GROUP; i++) {
+    mask |= (unsigned) (ctrl[i] == byte) << i;
+  }
+  return mask;
+#endif
+}
+
+/**
+ * @brief 
+ * It finds the slot of a string, or the slot where it goes. Groups are probed in triangular order,
+ * which visits every group since their number is a power of two. Nothing is ever removed,
+ * so the first group with an empty slot ends the search.
+ * @param v is a string_int.
+ * @param key is a string, NULL to look for an empty slot only.
+ * @param len is its length.
+ * @param h is its hash.
+ * @param found is where it is stored whether the string is in the table.
+ * @return size_t is the slot.
+ */
+static size_t find_slot(struct string_int *v, const char *key, size_t len, uint64_t h, int *found) {
+  size_t mask = v->capacity - 1;
+  size_t pos = (h >> 7) & mask & ~(size_t) (STRING_INT_GROUP - 1);
+  uint8_t tag = h & 0x7f;
+
+  for (size_t step = STRING_INT_GROUP;; pos = (pos + step) & mask, step += STRING_INT_GROUP) {
+    const uint8_t *ctrl = v->ctrl + pos;
 
-  for (size_t i = 0; i < v->capacity; i++) {
-    char *key = v->data[i].key;
     if (key) {
-      size_t idx = hash(key);
-      while (newdata[idx % n].key) {
-        idx++;
+      for (unsigned m = match_group(ctrl, tag); m; m &= m - 1) {
+        size_t slot = pos + __builtin_ctz(m);
+        struct string_int_entry *e = &v->entries[v->slots[slot]];
+        if (e->hash == h && e->len == len && !memcmp(e->key, key, len)) {
+          *found = 1;
+          return slot;
+        }
       }
-      newdata[idx % n].key = v->data[i].key;
-      newdata[idx % n].id = v->data[i].id;
+    }
+
+    unsigned empty = match_group(ctrl, STRING_INT_EMPTY);
+    if (empty) {
+      *found = 0;
+      return pos + __builtin_ctz(empty);
     }
   }
-  free(v->data);
-  v->data = newdata;
-  v->capacity = n;
 }
 
 /**
  * @brief 
- * 
- * @param v 
- * @param key 
- * @return size_t 
+ * It initiates an empty table.
+ * @param v is a string_int.
  */
-size_t string_int_get(struct string_int *v, const char *key) {
-  size_t idx;
+void string_int_init(struct string_int *v) {
+  v->capacity = STRING_INT_GROUP;
+  v->count = 0;
+  v->ctrl = malloc(v->capacity);
+  memset(v->ctrl, STRING_INT_EMPTY, v->capacity);
+  v->slots = malloc(v->capacity * sizeof(v->slots[0]));
+  v->entries_capacity = 16;
+  v->entries = malloc(v->entries_capacity * sizeof(v->entries[0]));
+  arena_init(&v->keys);
+}
+
+/**
+ * @brief 
+ * It frees the table and its strings.
+ * @param v is a string_int.
+ */
+void string_int_fini(struct string_int *v) {
+  free(v->ctrl);
+  free(v->slots);
+  free(v->entries);
+  arena_fini(&v->keys);
+}
+
+/**
+ * @brief 
+ * It grows the table to at least n slots, rounded up to a power of two. The cached hashes
+ * place the strings again without reading their keys. The table never shrinks.
+ * @param v is a string_int.
+ * @param n is a number of slots.
+ */
+void string_int_resize(struct string_int *v, size_t n) {
+  size_t capacity = v->capacity;
+  int found;
+
+  while (capacity < n) {
+    capacity *= 2;
+  }
+  if (capacity == v->capacity) {
+    return;
+  }
 
-  if (2 * v->count >= v->capacity) {
-    string_int_resize(v, 2 * v->count);
+  free(v->ctrl);
+  free(v->slots);
+  v->capacity = capacity;
+  v->ctrl = malloc(capacity);
+  memset(v->ctrl, STRING_INT_EMPTY, capacity);
+  v->slots = malloc(capacity * sizeof(v->slots[0]));
+
+  for (size_t id = 0; id < v->count; id++) {
+    uint64_t h = v->entries[id].hash;
+    size_t slot = find_slot(v, NULL, 0, h, &found);
+    v->ctrl[slot] = h & 0x7f;
+    v->slots[slot] = id;
   }
+}
 
-  for (idx = hash(key) % v->capacity; v->data[idx].key; idx = (idx + 1) % v->capacity) {
-    if (!strcmp(v->data[idx].key, key)) {
-      return v->data[idx].id;
-    }
+/**
+ * @brief 
+ * It gives the id of a string, adding it if it is new.
+ * @param v is a string_int.
+ * @param key is a string, which does not need to be NUL terminated.
+ * @param len is its length.
+ * @return size_t is its id.
+ */
+size_t string_int_get_len(struct string_int *v, const char *key, size_t len) {
+  uint64_t h = hash(key, len);
+  int found;
+  size_t slot = find_slot(v, key, len, h, &found);
+
+  if (found) {
+    return v->slots[slot];
   }
 
-  size_t id = v->count++;
-  char *k = strdup(key);
+  // The load factor stays below 7/8.
+  if (8 * (v->count + 1) > 7 * v->capacity) {
+    string_int_resize(v, 2 * v->capacity);
+    slot = find_slot(v, NULL, 0, h, &found);
+  }
+
+  if (v->count == v->entries_capacity) {
+    v->entries_capacity *= 2;
+    v->entries = realloc(v->entries, v->entries_capacity * sizeof(v->entries[0]));
+  }
 
-  v->data[idx].id = id;
-  v->data[idx].key = k;
-  vector_set(&v->rev, id, k);
+  char *k = arena_alloc_aligned(&v->keys, len + 1, 1);
+  memcpy(k, key, len);
+  k[len] = 0;
 
+  size_t id = v->count++;
+  v->entries[id].key = k;
+  v->entries[id].hash = h;
+  v->entries[id].len = len;
+  v->ctrl[slot] = h & 0x7f;
+  v->slots[slot] = id;
   return id;
 }
 
 /**
  * @brief 
- * 
- * @param v 
- * @param id 
- * @return const char* 
+ * It gives the id of a NUL terminated string, adding it if it is new.
+ * @param v is a string_int.
+ * @param key is a string.
+ * @return size_t is its id.
+ */
+size_t string_int_get(struct string_int *v, const char *key) {
+  return string_int_get_len(v, key, strlen(key));
+}
+
+/**
+ * @brief 
+ * @param v is a string_int.
+ * @param id is an id.
+ * @return const char* is the string with that id, NULL if there is none.
  */
 const char *string_int_rev(struct string_int *v, size_t id) {
-  return vector_get(&v->rev, id);
+  return id < v->count ? v->entries[id].key : NULL;
 }
 
 /**
  * @brief 
- * 
+ * @param v is a string_int.
+ * @return size_t is the number of strings, the ids go from 0 to count - 1.
  */
-struct string_int global_ids;
+size_t string_int_count(struct string_int *v) {
+  return v->count;
+}
 
 /**
  * @brief 
- * 
+ * Compilation of the calling thread.
+ */
+_Thread_local struct compilation *compilation;
+
+/**
+ * @brief 
+ * It initiates an empty compilation.
+ * @param c is a compilation.
  */
-struct vector global_types;
+void compilation_init(struct compilation *c) {
+  string_int_init(&c->ids);
+  vector_init(&c->types);
+  arena_init(&c->arena);
+  c->root = NULL;
+  c->n_parallel_loops = 0;
+}
+
+/**
+ * @brief 
+ * It frees the tables of a compilation and its AST.
+ * @param c is a compilation.
+ */
+void compilation_fini(struct compilation *c) {
+  string_int_fini(&c->ids);
+  vector_fini(&c->types);
+  arena_fini(&c->arena);
+  c->root = NULL;
+}
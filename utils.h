@@ -2,19 +2,84 @@
  * @file
  */
 
-struct vector;
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief
+ * It is vector that can take any kind of data.
+ */
+struct vector {
+  size_t capacity;
+  void **data;
+};
+
 void vector_init(struct vector *v);
 void vector_grow(struct vector *v, size_t n);
 void vector_fini(struct vector *v);
 void *vector_get(struct vector *v, size_t idx);
 void vector_set(struct vector *v, size_t idx, void *x);
 
-struct string_int;
+/**
+ * @brief
+ * Bump allocator. Objects are never freed one by one, the arena is released with arena_fini.
+ */
+struct arena {
+  struct arena_chunk *head;
+  size_t count;
+  size_t bytes;
+  size_t reserved;
+};
+
+/**
+ * @brief
+ * Table from strings to consecutive ids, in the style of a Swiss table: a metadata byte per slot
+ * (STRING_INT_EMPTY, or the low 7 bits of the hash) is probed a group of 16 slots at a time,
+ * and only the slots whose byte matches compare their key. The capacity is a power of two.
+ */
+struct string_int {
+  uint8_t *ctrl;                            // metadata byte of each slot
+  uint32_t *slots;                          // id of the string in each slot
+  size_t capacity;
+  size_t count;
+  struct string_int_entry *entries;         // by id
+  size_t entries_capacity;
+  struct arena keys;
+};
+
 void string_int_init(struct string_int *v);
 void string_int_fini(struct string_int *v);
 void string_int_resize(struct string_int *v, size_t n);
 size_t string_int_get(struct string_int *v, const char *key);
+size_t string_int_get_len(struct string_int *v, const char *key, size_t len);
 const char *string_int_rev(struct string_int *v, size_t id);
+size_t string_int_count(struct string_int *v);
+
+char *read_file(FILE *f, size_t *len);
+
+void arena_init(struct arena *a);
+void *arena_alloc(struct arena *a, size_t n);
+void arena_fini(struct arena *a);
+size_t arena_count(struct arena *a);
+size_t arena_bytes(struct arena *a);
+size_t arena_reserved(struct arena *a);
+
+/**
+ * @brief
+ * State of the compilation of one program. Each thread works on one compilation at a time,
+ * the one pointed to by compilation, so that the parser actions and the passes find it
+ * without taking it as a parameter.
+ */
+struct compilation {
+  struct string_int ids;    // identifiers of the program
+  struct vector types;      // alloca of each variable, by id
+  struct arena arena;       // AST nodes
+  struct stmt *root;        // the program, once parsed
+  size_t n_parallel_loops;  // parsed so far, only the LLVM backend supports them
+};
+
+void compilation_init(struct compilation *c);
+void compilation_fini(struct compilation *c);
 
-extern struct string_int global_ids;
-extern struct vector global_types;
+extern _Thread_local struct compilation *compilation;